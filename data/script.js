@@ -69,40 +69,67 @@
   setInterval(updateStatus, 10000);
 */
 
+// Sends the state we want rather than a toggle, so a retried request is harmless
 function toggleRelay(id) {
-  fetch('/toggle?id=' + id);
-  // Optionally trigger delayed status update
-  setTimeout(updateStatus, 1000); 
+  const button = document.getElementById('relay' + id);
+  const turnOn = !(button && button.classList.contains('green'));
+  const body = {
+    requestId: Date.now().toString(36) + Math.random().toString(36).slice(2, 8),
+    ops: [{ relay: id, op: turnOn ? 'on' : 'off' }]
+  };
+  fetch('/api/relays', { method: 'POST', body: JSON.stringify(body) })
+    .then(() => updateStatus());
 }
 
+let statusVersion = 0;
+
 function updateStatus() {
   fetch('/api/status')
     .then(response => response.json())
+    .then(showStatus);
+}
+
+// Long-polls for the next status version, so the page follows changes made
+// from buttons, LoRa or another browser without polling on a timer
+function watchStatus() {
+  fetch('/api/status?since=' + statusVersion + '&wait=25')
+    .then(response => {
+      if (response.status === 304) return null;
+      if (!response.ok) throw new Error(response.status);
+      return response.json();
+    })
     .then(data => {
-      for (var i = 0; i < data.states.length; i++) {
-        var button = document.getElementById('relay' + i);
-        if (!button) continue;
-        button.classList.remove('green', 'red', 'active', 'has-dot');
-        button.style.removeProperty('--dot-color');
-
-        if (data.states[i]) {
-          button.classList.add('green', 'active');
-        } else {
-          button.classList.add('red', 'active');
-        }
+      if (data) showStatus(data);
+      watchStatus();
+    })
+    .catch(() => setTimeout(watchStatus, 5000));
+}
 
-        let label = data.labels && data.labels[i] ? data.labels[i] : button.innerText;
-        button.innerText = label;
+function showStatus(data) {
+  statusVersion = data.version;
+  for (var i = 0; i < data.states.length; i++) {
+    var button = document.getElementById('relay' + i);
+    if (!button) continue;
+    button.classList.remove('green', 'red', 'active', 'has-dot');
+    button.style.removeProperty('--dot-color');
 
-        if (data.reset[i] && data.ips[i]) {
-          button.classList.add('has-dot');
-          button.style.setProperty('--dot-color', data.states[i] ? 'yellow' : 'grey');
-        } else if (data.ips[i]) {
-          button.classList.add('has-dot');
-          button.style.setProperty('--dot-color', data.states[i] ? 'blue' : 'grey');
-        }
-      }
-    });
+    if (data.states[i]) {
+      button.classList.add('green', 'active');
+    } else {
+      button.classList.add('red', 'active');
+    }
+
+    let label = data.labels && data.labels[i] ? data.labels[i] : button.innerText;
+    button.innerText = label;
+
+    if (data.reset[i] && data.ips[i]) {
+      button.classList.add('has-dot');
+      button.style.setProperty('--dot-color', data.states[i] ? 'yellow' : 'grey');
+    } else if (data.ips[i]) {
+      button.classList.add('has-dot');
+      button.style.setProperty('--dot-color', data.states[i] ? 'blue' : 'grey');
+    }
+  }
 }
 
   // Bit of a dogs dinner, but basically. This is called and redirects after 3 seconds.
@@ -115,7 +142,7 @@ function updateStatus() {
 
 // Will run as soon as the script is loaded by the browser
 //setInterval(updateStatus, 2000);
-updateStatus(); // fetches status immediately on page load
+watchStatus(); // fetches status straight away, then waits for changes
 
 
 document.addEventListener('DOMContentLoaded', function () {
@@ -130,7 +157,7 @@ document.addEventListener('DOMContentLoaded', function () {
 
 function triggerUpload() {
 
-  if (confirm("If you upload a config.json that is not formatted correctly, the ESP32 will probably not work properly or connect to the wifi and you will have to reflash it. Want to continue? ")) {
+  if (confirm("The uploaded config.json is checked before it replaces the current one, and the current one is kept so you can roll back. Want to continue? ")) {
     // User clicked OK
     console.log("Continuing...");
     // Continue with the rest of the function
@@ -145,6 +172,67 @@ function triggerUpload() {
 };
 
 
+function rollbackConfig() {
+  if (confirm('Go back to the config that was in use before the last upload?')) {
+    fetch('/rollback_config')
+      .then(response => response.text().then(text => {
+        alert(text);
+        if (response.ok) {
+          location.reload();
+        }
+      }));
+  }
+}
+
+
+// Sends only the fields that were changed, so anything not on the form (or
+// greyed out) is left as it is
+function saveSettings(event) {
+  event.preventDefault();
+  const relayFields = { label: 'relayLabels', ip: 'relayIPs', ping: 'pingEnabled', reset: 'resetEnabled' };
+  const scheduleFields = {
+    globalScheduleEnabled: 'enabled',
+    globalOnTime: 'powerOnTime',
+    globalOffTime: 'powerOffTime',
+    pollInterval: 'pollIntervalMinutes'
+  };
+  const patch = {};
+
+  for (const field of event.target.elements) {
+    const checkbox = field.type === 'checkbox';
+    if (!field.name || (checkbox ? field.checked === field.defaultChecked : field.value === field.defaultValue)) continue;
+    const value = checkbox ? field.checked : field.type === 'number' ? Number(field.value) : field.value;
+
+    const relay = field.name.match(/^(label|ip|ping|reset)(\d)$/);
+    if (relay) {
+      const key = relayFields[relay[1]];
+      patch[key] = patch[key] || {};
+      patch[key][relay[2]] = value;
+    } else if (scheduleFields[field.name]) {
+      patch.globalSchedule = patch.globalSchedule || {};
+      patch.globalSchedule[scheduleFields[field.name]] = value;
+    }
+  }
+
+  if (Object.keys(patch).length === 0) {
+    window.location.href = '/';
+    return false;
+  }
+  fetch('/api/config', {
+    method: 'PATCH',
+    headers: { 'Content-Type': 'application/json' },
+    body: JSON.stringify(patch)
+  }).then(response => {
+    if (response.ok) {
+      window.location.href = '/';
+    } else {
+      response.text().then(text => alert('Settings not saved: ' + text));
+    }
+  });
+  return false;
+}
+
+
 function togglePing(i) {
   const pingCheckbox = document.getElementById('ping' + i);
   const ipField = document.getElementById('ip' + i);
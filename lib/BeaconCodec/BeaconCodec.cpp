@@ -0,0 +1,79 @@
+#include "BeaconCodec.h"
+
+uint8_t beaconDiff(const BeaconState& a, const BeaconState& b) {
+  uint8_t fields = 0;
+  if (a.relayMask != b.relayMask) fields |= BF_RELAYS;
+  if (a.pulseMask != b.pulseMask) fields |= BF_PULSES;
+  if (a.flags != b.flags) fields |= BF_FLAGS;
+  if (a.battery != b.battery) fields |= BF_BATTERY;
+  if (a.probeBits != b.probeBits) fields |= BF_PROBES;
+  return fields;
+}
+
+
+size_t packBeaconDelta(uint8_t* buf, const BeaconState& state, const BeaconKey& key) {
+  int battDelta = (int)state.battery - key.state.battery;
+  uint32_t upDelta = state.uptimeMin - key.state.uptimeMin;
+  int battLimit = 1 << (BEACON_BITS_BATT_D - 1);
+  if (battDelta < -battLimit || battDelta >= battLimit || upDelta >= (1UL << BEACON_BITS_UP_D)) return 0;
+
+  uint8_t fields = beaconDiff(state, key.state);
+  BitWriter w = { buf, 0 };
+  w.put(0, 1);
+  w.put(key.seq, 8);
+  w.put(fields, 5);
+  if (fields & BF_RELAYS) w.put(state.relayMask, BEACON_BITS_MASK);
+  if (fields & BF_PULSES) w.put(state.pulseMask, BEACON_BITS_MASK);
+  if (fields & BF_FLAGS) w.put(state.flags, BEACON_BITS_FLAGS);
+  if (fields & BF_BATTERY) w.put(battDelta & ((1 << BEACON_BITS_BATT_D) - 1), BEACON_BITS_BATT_D);
+  if (fields & BF_PROBES) w.put(state.probeBits, BEACON_BITS_PROBES);
+  w.put(upDelta, BEACON_BITS_UP_D);
+  return w.bits;
+}
+
+
+size_t packBeaconFull(uint8_t* buf, const BeaconState& state) {
+  BitWriter w = { buf, 0 };
+  w.put(1, 1);
+  w.put(state.relayMask, BEACON_BITS_MASK);
+  w.put(state.pulseMask, BEACON_BITS_MASK);
+  w.put(state.flags, BEACON_BITS_FLAGS);
+  w.put(state.battery, BEACON_BITS_BATTERY);
+  w.put(state.probeBits, BEACON_BITS_PROBES);
+  w.put(state.uptimeMin, BEACON_BITS_UPTIME);
+  return w.bits;
+}
+
+
+bool unpackBeacon(const uint8_t* data, size_t len, uint8_t seq, BeaconKey& key, BeaconState& state) {
+  BitReader r = { data, len, 0, false };
+  if (r.get(1)) {
+    state.relayMask = r.get(BEACON_BITS_MASK);
+    state.pulseMask = r.get(BEACON_BITS_MASK);
+    state.flags = r.get(BEACON_BITS_FLAGS);
+    state.battery = r.get(BEACON_BITS_BATTERY);
+    state.probeBits = r.get(BEACON_BITS_PROBES);
+    state.uptimeMin = r.get(BEACON_BITS_UPTIME);
+    if (r.overrun) return false;
+    key.state = state;
+    key.seq = seq;
+    key.have = true;
+    return true;
+  }
+
+  uint8_t keySeq = r.get(8);
+  if (!key.have || keySeq != key.seq) return false;
+  state = key.state;
+  uint8_t fields = r.get(5);
+  if (fields & BF_RELAYS) state.relayMask = r.get(BEACON_BITS_MASK);
+  if (fields & BF_PULSES) state.pulseMask = r.get(BEACON_BITS_MASK);
+  if (fields & BF_FLAGS) state.flags = r.get(BEACON_BITS_FLAGS);
+  if (fields & BF_BATTERY) {
+    int delta = r.get(BEACON_BITS_BATT_D);
+    if (delta & (1 << (BEACON_BITS_BATT_D - 1))) delta -= 1 << BEACON_BITS_BATT_D;
+    state.battery += delta;
+  }
+  if (fields & BF_PROBES) state.probeBits = r.get(BEACON_BITS_PROBES);
+  state.uptimeMin += r.get(BEACON_BITS_UP_D);
+  return !r.overrun;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// What a beacon says, before packing. Battery goes in 20 mV steps, uptime in
+// minutes, and each relay's probe verdict in 2 bits (idle, ok, watch, reset/hold).
+struct BeaconState {
+  uint8_t relayMask;
+  uint8_t pulseMask;
+  uint8_t flags;
+  uint16_t battery;
+  uint16_t probeBits;
+  uint32_t uptimeMin;
+};
+
+// A full beacon, which the deltas after it are against
+struct BeaconKey {
+  BeaconState state;
+  uint8_t seq;
+  bool have;
+};
+
+// Bit widths on air. A full beacon is 58 bits plus the callsign; a delta is a
+// kind bit, the full beacon's seq and a mask, then only the fields that moved.
+#define BEACON_BITS_MASK    6
+#define BEACON_BITS_FLAGS   3
+#define BEACON_BITS_BATTERY 10
+#define BEACON_BITS_PROBES  12
+#define BEACON_BITS_UPTIME  20
+#define BEACON_BITS_BATT_D  7      // signed battery change against the full beacon
+#define BEACON_BITS_UP_D    10     // minutes since the full beacon
+#define BEACON_FULL_BITS    (1 + 2 * BEACON_BITS_MASK + BEACON_BITS_FLAGS + BEACON_BITS_BATTERY + \
+                             BEACON_BITS_PROBES + BEACON_BITS_UPTIME)
+enum BeaconField : uint8_t { BF_RELAYS = 1, BF_PULSES = 2, BF_FLAGS = 4, BF_BATTERY = 8, BF_PROBES = 16 };
+
+// LSB first bit packing
+struct BitWriter {
+  uint8_t* buf;
+  size_t bits;
+  void put(uint32_t value, int width) {
+    for (int i = 0; i < width; i++, bits++) {
+      if ((bits & 7) == 0) buf[bits >> 3] = 0;
+      if (value & (1UL << i)) buf[bits >> 3] |= 1 << (bits & 7);
+    }
+  }
+};
+
+struct BitReader {
+  const uint8_t* buf;
+  size_t len;
+  size_t bits;
+  bool overrun;
+  uint32_t get(int width) {
+    uint32_t value = 0;
+    for (int i = 0; i < width; i++, bits++) {
+      if ((bits >> 3) >= len) {
+        overrun = true;
+        return 0;
+      }
+      if (buf[bits >> 3] & (1 << (bits & 7))) value |= 1UL << i;
+    }
+    return value;
+  }
+};
+
+// BF_* mask of the fields that differ
+uint8_t beaconDiff(const BeaconState& a, const BeaconState& b);
+// Both return the bit count. The delta one returns 0 if the state has moved
+// too far from key for a delta to say it.
+size_t packBeaconFull(uint8_t* buf, const BeaconState& state);
+size_t packBeaconDelta(uint8_t* buf, const BeaconState& state, const BeaconKey& key);
+// Unpacks a beacon sent with seq into state, taking a full one as the
+// sender's new key. Returns false if it is a delta against a full beacon we
+// never heard, or does not parse.
+bool unpackBeacon(const uint8_t* data, size_t len, uint8_t seq, BeaconKey& key, BeaconState& state);
@@ -0,0 +1,186 @@
+#include "ConfigSchema.h"
+#include <stdio.h>
+#include <string.h>
+#include <ProbePolicy.h>
+
+const ConfigField configFields[] = {
+  { "relayLabels", nullptr, CT_STRING, true, 0, 32 },
+  { "relayIPs", nullptr, CT_IP, true },
+  { "pingEnabled", nullptr, CT_BOOL, true },
+  { "resetEnabled", nullptr, CT_BOOL, true },
+  { "cycleOffSeconds", nullptr, CT_INT, true, 1, 3600 },
+  { "globalSchedule", "enabled", CT_BOOL },
+  { "globalSchedule", "powerOnTime", CT_TIME },
+  { "globalSchedule", "powerOffTime", CT_TIME },
+  { "globalSchedule", "pollIntervalMinutes", CT_INT, false, 1, 1440 },
+  { "wifi", "ssid", CT_STRING, false, 0, 32 },
+  { "wifi", "password", CT_STRING, false, 0, 64 },
+  { "wifi", "staticIP", CT_IP },
+  { "wifi", "gateway", CT_IP },
+  { "wifi", "subnet", CT_IP },
+  { "wifi", "dns", CT_IP },
+  { "fallbackAp", "ssid", CT_STRING, false, 1, 32 },
+  { "fallbackAp", "password", CT_STRING, false, 8, 64 },
+  { "lora", "frequency", CT_FLOAT, false, 150, 960 },
+  { "lora", "bandwidth", CT_FLOAT, false, 7.8, 500 },
+  { "lora", "spreadingFactor", CT_INT, false, 5, 12 },
+  { "lora", "codingRate", CT_INT, false, 5, 8 },
+  { "lora", "outputPower", CT_INT, false, -9, 22 },
+  { "lora", "syncWord", CT_INT, false, 0, 255 },
+  { "lora", "nodeId", CT_INT, false, 1, 254 },
+  { "lora", "gateway", CT_BOOL },
+  { "lora", "dutyCyclePercent", CT_INT, false, 1, 100 },
+  { "lora", "mesh", CT_BOOL },
+  { "lora", "maxHops", CT_INT, false, 1, 7 },
+  { "battery", "divider", CT_FLOAT, false, 0.1, 100 },
+  { "battery", "sampleSeconds", CT_INT, false, 1, 3600 },
+  { "battery", "shedRules", CT_LIST },
+  { "buttons", nullptr, CT_LIST },
+  { "probe", "intervalSeconds", CT_INT, false, 10, 3600 },
+  { "probe", "window", CT_INT, false, 1, PROBE_WINDOW_MAX },
+  { "probe", "failThreshold", CT_INT, false, 1, PROBE_WINDOW_MAX },
+  { "probe", "rttCeilingMs", CT_INT, false, 1, 60000 },
+  { "probe", "cooldownMinutes", CT_INT, false, 0, 1440 },
+  { "probe", "maxResetsPerHour", CT_INT, false, 1, MAX_RESETS_PER_HOUR_CAP },
+  { "probe", "escalation", CT_LIST },
+  { "statusLedPin", nullptr, CT_PIN, false, 0, 48 },
+  { "webPort", nullptr, CT_INT, false, 1, 65535 },
+  { "debugFile", nullptr, CT_BOOL },
+  { "syslog", nullptr, CT_IP },
+  { "timezone", nullptr, CT_STRING, false, 1, 64 },
+};
+
+const size_t configFieldCount = sizeof(configFields) / sizeof(configFields[0]);
+
+
+bool configSectionStart(size_t i) {
+  return i == 0 || strcmp(configFields[i].section, configFields[i - 1].section) != 0;
+}
+
+
+const ConfigField* findConfigField(const char* section, const char* key) {
+  for (size_t i = 0; i < CONFIG_FIELDS; i++) {
+    const ConfigField& f = configFields[i];
+    if (strcmp(f.section, section) != 0) continue;
+    if (!key || (f.key && strcmp(f.key, key) == 0)) return &f;
+  }
+  return nullptr;
+}
+
+
+bool parseIPv4(const char* text, uint32_t* ip) {
+  uint32_t value = 0;
+  for (int part = 0; part < 4; part++) {
+    if (part && *text++ != '.') return false;
+    if (*text < '0' || *text > '9') return false;
+    int n = 0, digits = 0;
+    while (*text >= '0' && *text <= '9') {
+      n = n * 10 + (*text++ - '0');
+      if (++digits > 3 || n > 255) return false;
+    }
+    value |= (uint32_t)n << (part * 8);   // first octet lowest, as IPAddress has it
+  }
+  if (*text) return false;
+  *ip = value;
+  return true;
+}
+
+
+bool checkConfigValue(const ConfigField& f, JsonVariantConst v, PinInUse pinInUse, char* error, size_t size) {
+  const char* name = f.key ? f.key : f.section;
+  switch (f.type) {
+    case CT_STRING: {
+      size_t len = v.is<const char*>() ? strlen(v.as<const char*>()) : 0;
+      if (v.is<const char*>() && len >= f.lo && len <= f.hi) return true;
+      snprintf(error, size, "%s must be a string of %d to %d characters", name, (int)f.lo, (int)f.hi);
+      return false;
+    }
+    case CT_BOOL:
+      if (v.is<bool>()) return true;
+      snprintf(error, size, "%s must be true or false", name);
+      return false;
+    case CT_INT:
+    case CT_FLOAT:
+      if ((f.type == CT_INT ? v.is<long>() : v.is<float>()) && v.as<float>() >= f.lo && v.as<float>() <= f.hi) return true;
+      snprintf(error, size, "%s must be a%s number from %g to %g", name, f.type == CT_INT ? " whole" : "", f.lo, f.hi);
+      return false;
+    case CT_IP: {
+      uint32_t ip;
+      if (v.is<const char*>() && (!*v.as<const char*>() || parseIPv4(v.as<const char*>(), &ip))) return true;
+      snprintf(error, size, "%s must be an IPv4 address or empty", name);
+      return false;
+    }
+    case CT_TIME: {
+      int h, m;
+      char end;
+      if (v.is<const char*>() && sscanf(v.as<const char*>(), "%d:%d%c", &h, &m, &end) == 2 &&
+          h >= 0 && h < 24 && m >= 0 && m < 60) return true;
+      snprintf(error, size, "%s must be a time as HH:MM", name);
+      return false;
+    }
+    case CT_LIST:
+      if (v.is<JsonArrayConst>()) return true;
+      snprintf(error, size, "%s must be a list", name);
+      return false;
+    case CT_PIN: {
+      int pin = v.is<int>() ? v.as<int>() : -2;
+      if (pin == -1 || (pin >= f.lo && pin <= f.hi && !pinInUse(pin))) return true;
+      snprintf(error, size, "%s must be -1 or a free GPIO up to %d", name, (int)f.hi);
+      return false;
+    }
+  }
+  return false;
+}
+
+
+bool checkConfigPatch(JsonObjectConst patch, PinInUse pinInUse, char* error, size_t size) {
+  for (JsonPairConst kv : patch) {
+    const char* section = kv.key().c_str();
+    JsonVariantConst v = kv.value();
+    const ConfigField* f = findConfigField(section, nullptr);
+    if (!f) {
+      snprintf(error, size, "%s is not a config field", section);
+      return false;
+    }
+
+    if (f->perRelay) {
+      if (v.is<JsonArrayConst>()) {
+        if (v.size() != 6) {
+          snprintf(error, size, "%s must have 6 entries", section);
+          return false;
+        }
+        for (JsonVariantConst item : v.as<JsonArrayConst>()) {
+          if (!checkConfigValue(*f, item, pinInUse, error, size)) return false;
+        }
+      } else if (v.is<JsonObjectConst>()) {
+        for (JsonPairConst item : v.as<JsonObjectConst>()) {
+          const char* relay = item.key().c_str();
+          if (relay[0] < '0' || relay[0] > '5' || relay[1]) {
+            snprintf(error, size, "%s: %s is not a relay", section, relay);
+            return false;
+          }
+          if (!checkConfigValue(*f, item.value(), pinInUse, error, size)) return false;
+        }
+      } else {
+        snprintf(error, size, "%s must be a list of 6 or an object keyed by relay", section);
+        return false;
+      }
+    } else if (f->key) {
+      if (!v.is<JsonObjectConst>()) {
+        snprintf(error, size, "%s must be an object", section);
+        return false;
+      }
+      for (JsonPairConst item : v.as<JsonObjectConst>()) {
+        const ConfigField* field = findConfigField(section, item.key().c_str());
+        if (!field) {
+          snprintf(error, size, "%s.%s is not a config field", section, item.key().c_str());
+          return false;
+        }
+        if (!checkConfigValue(*field, item.value(), pinInUse, error, size)) return false;
+      }
+    } else if (!checkConfigValue(*f, v, pinInUse, error, size)) {
+      return false;
+    }
+  }
+  return true;
+}
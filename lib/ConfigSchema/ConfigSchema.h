@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <ArduinoJson.h>
+
+// What PATCH /api/config accepts. A field is a top level key, or a key inside
+// a section object. Per relay fields take a full array of six or an object of
+// {"<relay>": value}. Lists (rules, buttons) are replaced whole, their entries
+// are checked when applied just as for an upload. relayStates is not here,
+// /api/relays is the way to switch relays.
+enum ConfigType : uint8_t { CT_STRING, CT_BOOL, CT_INT, CT_FLOAT, CT_IP, CT_TIME, CT_LIST, CT_PIN };
+
+struct ConfigField {
+  const char* section;         // top level key
+  const char* key;             // nullptr for a top level value
+  ConfigType type;
+  bool perRelay;
+  float lo, hi;                // range, or length for strings
+};
+
+extern const ConfigField configFields[];
+extern const size_t configFieldCount;
+#define CONFIG_FIELDS configFieldCount
+
+// Fields of a section are next to each other, so a section starts wherever
+// the name changes
+bool configSectionStart(size_t i);
+// key is nullptr to find a top level value, or any field of a section
+const ConfigField* findConfigField(const char* section, const char* key);
+
+// Dotted quad, each part 0-255, nothing before or after
+bool parseIPv4(const char* text, uint32_t* ip);
+
+// Pins the board or the config already drive, for CT_PIN
+typedef bool (*PinInUse)(int gpio);
+
+bool checkConfigValue(const ConfigField& f, JsonVariantConst v, PinInUse pinInUse, char* error, size_t size);
+// Checks every field of a patch before any of it is applied, so a bad patch
+// changes nothing. error says which field and why.
+bool checkConfigPatch(JsonObjectConst patch, PinInUse pinInUse, char* error, size_t size);
@@ -0,0 +1,43 @@
+#include "Debounce.h"
+
+void debounceReset(Debouncer& d, bool pressed) {
+  d.edge = false;
+  d.pressed = pressed;
+  d.longFired = false;
+  d.pressedMs = 0;
+}
+
+
+DebounceEvent debounceService(Debouncer& d, bool pressed, bool hasLong, uint32_t now, uint32_t* sinceMs, uint32_t* waitMs) {
+  if (d.edge) {
+    uint32_t quietMs = now - d.edgeMs;
+    if (quietMs < DEBOUNCE_QUIET_MS) {
+      if (DEBOUNCE_QUIET_MS - quietMs < *waitMs) *waitMs = DEBOUNCE_QUIET_MS - quietMs;
+      return DEB_NONE;
+    }
+    uint32_t firstMs = d.firstEdgeMs;
+    d.edge = false;
+    if (pressed != d.pressed) {
+      d.pressed = pressed;
+      *sinceMs = firstMs;
+      if (pressed) {
+        d.pressedMs = firstMs;
+        d.longFired = false;
+        if (!hasLong) return DEB_SHORT;
+      } else if (hasLong && !d.longFired) {
+        return DEB_SHORT;
+      }
+    }
+  }
+
+  if (d.pressed && hasLong && !d.longFired) {
+    uint32_t heldMs = now - d.pressedMs;
+    if (heldMs >= DEBOUNCE_LONG_MS) {
+      d.longFired = true;
+      *sinceMs = d.pressedMs + DEBOUNCE_LONG_MS;
+      return DEB_LONG;
+    }
+    if (DEBOUNCE_LONG_MS - heldMs < *waitMs) *waitMs = DEBOUNCE_LONG_MS - heldMs;
+  }
+  return DEB_NONE;
+}
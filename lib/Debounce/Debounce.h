@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+
+// Debouncing for one push button. The interrupt handler records edges with
+// debounceEdge(); debounceService() then looks at the input once it has been
+// quiet for DEBOUNCE_QUIET_MS and says what, if anything, to fire.
+#define DEBOUNCE_QUIET_MS 8       // input has to be quiet this long after the last edge
+#define DEBOUNCE_LONG_MS  1000
+
+enum DebounceEvent : uint8_t { DEB_NONE, DEB_SHORT, DEB_LONG };
+
+struct Debouncer {
+  volatile bool edge;             // set by the ISR, cleared once the input has settled
+  volatile uint32_t firstEdgeMs;  // first edge of the bounce, where latency is counted from
+  volatile uint32_t edgeMs;       // last edge, where the quiet time is counted from
+  bool pressed;                   // debounced state
+  bool longFired;
+  uint32_t pressedMs;
+};
+
+// Safe to call from an ISR
+inline __attribute__((always_inline)) void debounceEdge(Debouncer& d, uint32_t now) {
+  if (!d.edge) d.firstEdgeMs = now;
+  d.edgeMs = now;
+  d.edge = true;
+}
+
+// pressed is the input as it is now, so one held through boot is not a press
+void debounceReset(Debouncer& d, bool pressed);
+
+// pressed is the input read now. A button with no long press action (hasLong
+// false) fires its short one on the press itself, otherwise the short action
+// waits for the release so the two can be told apart. On an event *sinceMs is
+// when the input changed, or when the press became long. *waitMs is lowered
+// to how long until it next needs a look.
+DebounceEvent debounceService(Debouncer& d, bool pressed, bool hasLong, uint32_t now, uint32_t* sinceMs, uint32_t* waitMs);
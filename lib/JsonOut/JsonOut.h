@@ -0,0 +1,155 @@
+#pragma once
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+// Streaming JSON writer for the hot paths (status and config save). Output
+// goes through a small fixed buffer straight to a sink, so nothing is built
+// on the heap. Keys are written as precomputed tokens, JK("name") expands to
+// "\"name\":" and its length at compile time. A null sink just counts, which
+// is how callers find a Content-Length up front.
+#define JK(name) "\"" name "\":", sizeof("\"" name "\":") - 1
+#define JSON_OUT_BUF   256
+
+typedef void (*JsonSink)(void* ctx, const char* data, size_t len);
+
+struct JsonOut {
+  JsonSink sink;
+  void* ctx;
+  char buf[JSON_OUT_BUF];
+  size_t used;
+  size_t total;
+  uint8_t depth;
+  uint8_t first;               // bit per depth, set until the first member is written, so 7 levels at most
+
+  void flush() {
+    if (used && sink) sink(ctx, buf, used);
+    used = 0;
+  }
+
+  void raw(const char* data, size_t len) {
+    total += len;
+    if (!sink) return;
+    while (len) {
+      size_t n = len < sizeof(buf) - used ? len : sizeof(buf) - used;
+      memcpy(buf + used, data, n);
+      used += n;
+      data += n;
+      len -= n;
+      if (used == sizeof(buf)) flush();
+    }
+  }
+
+  void put(char c) { raw(&c, 1); }
+
+  void separate() {
+    if (first & (1 << depth)) first &= ~(1 << depth);
+    else put(',');
+  }
+
+  void open(char c) {
+    separate();
+    put(c);
+    depth++;
+    first |= 1 << depth;
+  }
+
+  void close(char c) {
+    put(c);
+    depth--;
+  }
+
+  // Keys don't take a comma of their own, the value that follows does that
+  void key(const char* token, size_t len) {
+    separate();
+    raw(token, len);
+    first |= 1 << depth;
+  }
+
+  // A key only known at run time, e.g. a config section name
+  void key(const char* name) {
+    separate();
+    put('"');
+    raw(name, strlen(name));
+    raw("\":", 2);
+    first |= 1 << depth;
+  }
+
+  void beginObject() { open('{'); }
+  void endObject() { close('}'); }
+  void beginArray() { open('['); }
+  void endArray() { close(']'); }
+
+  void value(bool b) {
+    separate();
+    if (b) raw("true", 4);
+    else raw("false", 5);
+  }
+
+  void value(long n) {
+    char num[24];
+    separate();
+    raw(num, snprintf(num, sizeof(num), "%ld", n));
+  }
+  void value(int n) { value((long)n); }
+  void value(unsigned long n) {
+    char num[24];
+    separate();
+    raw(num, snprintf(num, sizeof(num), "%lu", n));
+  }
+  void value(unsigned int n) { value((unsigned long)n); }
+
+  void value(float f) {
+    char num[16];
+    separate();
+    if (isnan(f) || isinf(f)) raw("null", 4);
+    else raw(num, snprintf(num, sizeof(num), "%.7g", f));
+  }
+
+  void value(const char* text) {
+    separate();
+    put('"');
+    for (const char* p = text; *p; p++) {
+      char c = *p;
+      if (c == '"' || c == '\\') {
+        put('\\');
+        put(c);
+      } else if ((uint8_t)c < 0x20) {
+        char esc[7];
+        raw(esc, snprintf(esc, sizeof(esc), "\\u%04x", c));
+      } else {
+        put(c);
+      }
+    }
+    put('"');
+  }
+#ifdef ARDUINO
+  void value(const String& text) { value(text.c_str()); }
+#endif
+
+  // The relay arrays are always six long, so these take them by reference
+  // and the size comes from the type
+  template <size_t N, typename T> void array(const T (&items)[N]) {
+    beginArray();
+    for (size_t i = 0; i < N; i++) value(items[i]);
+    endArray();
+  }
+};
+
+
+// Zeroed so JsonOut needs no constructor, and a first member needs no comma
+inline JsonOut jsonOut(JsonSink sink, void* ctx) {
+  JsonOut out;
+  out.sink = sink;
+  out.ctx = ctx;
+  out.used = 0;
+  out.total = 0;
+  out.depth = 0;
+  out.first = 1;
+  return out;
+}
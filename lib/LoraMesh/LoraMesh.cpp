@@ -0,0 +1,77 @@
+#include "LoraMesh.h"
+#include <math.h>
+
+uint8_t loraLinkCost(float snr) {
+  int cost = LORA_HOP_COST + (snr < 10 ? (int)((10 - snr) * 2) : 0);
+  return cost < 255 ? cost : 255;
+}
+
+
+Route* findRoute(RouteTable& table, uint8_t dst, uint32_t nowMs) {
+  for (int i = 0; i < table.count; i++) {
+    if (table.routes[i].dst == dst && nowMs - table.routes[i].learnedMs < ROUTE_STALE_MS) return &table.routes[i];
+  }
+  return nullptr;
+}
+
+
+void learnRoute(RouteTable& table, uint8_t self, uint8_t dst, uint8_t nextHop, uint8_t hops, uint8_t cost, uint32_t nowMs) {
+  if (dst == self || dst == LORA_BROADCAST) return;
+  int slot = -1;
+  for (int i = 0; i < table.count; i++) {
+    if (table.routes[i].dst == dst) slot = i;
+  }
+  if (slot >= 0) {
+    Route& r = table.routes[slot];
+    bool stale = nowMs - r.learnedMs >= ROUTE_STALE_MS;
+    if (!stale && r.nextHop != nextHop && cost >= r.cost) return;
+  } else if (table.count < MAX_ROUTES) {
+    slot = table.count++;
+  } else {
+    slot = 0;   // full up, the route learned longest ago goes
+    for (int i = 1; i < MAX_ROUTES; i++) {
+      if (nowMs - table.routes[i].learnedMs > nowMs - table.routes[slot].learnedMs) slot = i;
+    }
+  }
+  table.routes[slot] = { dst, nextHop, hops, cost, nowMs };
+}
+
+
+void learnRoutesFrom(RouteTable& table, uint8_t self, const LoraHeader& header, uint8_t link, uint32_t nowMs) {
+  int cost = header.cost + link;
+  learnRoute(table, self, header.from, header.from, 1, link, nowMs);
+  learnRoute(table, self, header.src, header.from, header.hops + 1, cost < 255 ? cost : 255, nowMs);
+}
+
+
+bool dupSeen(DupCache& cache, const LoraHeader& header) {
+  uint64_t id = ((uint64_t)header.src << 32) | ((uint32_t)header.epoch << 16) | (header.type << 8) | header.seq;
+  for (int i = 0; i < LORA_DUP_CACHE; i++) {
+    if (cache.seen[i] == id) return true;
+  }
+  cache.seen[cache.pos++ % LORA_DUP_CACHE] = id;
+  return false;
+}
+
+
+bool meshForward(RouteTable& table, uint8_t self, int maxHops, uint8_t link, LoraHeader& header, uint32_t nowMs) {
+  bool ourTurn = header.via == self || header.via == LORA_BROADCAST;
+  if (header.dst == self || !ourTurn || header.hops + 1 >= maxHops) return false;
+  int cost = header.cost + link;
+  header.from = self;
+  header.hops++;
+  header.cost = cost < 255 ? cost : 255;
+  Route* route = header.dst == LORA_BROADCAST ? nullptr : findRoute(table, header.dst, nowMs);
+  header.via = route ? route->nextHop : LORA_BROADCAST;
+  return true;
+}
+
+
+uint32_t loraTimeOnAirUs(size_t len, int spreadingFactor, float bandwidthKHz, int codingRate, int preamble) {
+  double symbolUs = (double)(1UL << spreadingFactor) * 1000.0 / bandwidthKHz;
+  int lowRate = symbolUs > 16000 ? 1 : 0;   // low data rate optimisation, SF11/12 at 125 kHz
+  double bits = 8.0 * len - 4.0 * spreadingFactor + 28 + 16;
+  double blocks = ceil(bits / (4.0 * (spreadingFactor - 2 * lowRate)));
+  double payloadSymbols = 8 + (blocks > 0 ? blocks : 0) * codingRate;
+  return (uint32_t)((preamble + 4.25 + payloadSymbols) * symbolUs);
+}
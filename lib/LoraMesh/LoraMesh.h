@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Mesh side of the LoRa link: the frame header, the route table, the
+// duplicate cache and the decision whether to pass a frame on. radioTask
+// owns all of it, under loraLock; nothing here touches the radio.
+#define LORA_MAGIC           0xA6    // 0xA5 was the header without epoch
+#define LORA_BROADCAST       0xFF
+#define MAX_ROUTES           16
+#define LORA_DUP_CACHE       32
+#define ROUTE_STALE_MS       3600000
+#define LORA_HOP_COST        10      // every hop costs a frame's airtime, however good the link
+
+enum LoraFrameType : uint8_t { LORA_CMD = 1, LORA_STATUS = 2, LORA_BEACON = 3 };
+
+struct __attribute__((packed)) LoraHeader {
+  uint8_t magic;
+  uint8_t type;
+  uint8_t src;                 // node the frame started from
+  uint8_t dst;                 // node it is for in the end
+  uint8_t seq;                 // with src, epoch and type, identifies the frame on every hop
+  uint16_t epoch;              // picked at random each time src boots, as its seqs start over
+  uint8_t from;                // node that sent it on this hop
+  uint8_t via;                 // node that should pass it on, LORA_BROADCAST for anyone
+  uint8_t hops;                // hops so far
+  uint8_t cost;                // link cost summed over those hops
+};
+
+struct Route {
+  uint8_t dst;
+  uint8_t nextHop;
+  uint8_t hops;
+  uint8_t cost;
+  uint32_t learnedMs;
+};
+
+struct RouteTable {
+  Route routes[MAX_ROUTES];
+  int count;
+};
+
+struct DupCache {
+  uint64_t seen[LORA_DUP_CACHE];   // src/epoch/type/seq of recent frames, so each is handled once
+  uint8_t pos;
+};
+
+// Cost of one hop: the airtime it takes, plus more the weaker the link. SNR
+// at SF12 runs from about -20 dB (barely there) to +10 dB (solid).
+uint8_t loraLinkCost(float snr);
+
+Route* findRoute(RouteTable& table, uint8_t dst, uint32_t nowMs);
+// Keeps the cheapest way we have heard of to reach dst. The same next hop
+// always refreshes, so a route that gets worse is not kept on its old cost.
+void learnRoute(RouteTable& table, uint8_t self, uint8_t dst, uint8_t nextHop, uint8_t hops, uint8_t cost, uint32_t nowMs);
+// Learns the routes a received frame tells us about: to the node that sent
+// it on this hop, and back to where it started
+void learnRoutesFrom(RouteTable& table, uint8_t self, const LoraHeader& header, uint8_t link, uint32_t nowMs);
+
+// True if the frame has been seen already, otherwise remembers it
+bool dupSeen(DupCache& cache, const LoraHeader& header);
+
+// Whether a mesh node should pass a frame on. If so, the header has been
+// rewritten for the next hop: via is the next hop on the route to dst, or
+// LORA_BROADCAST to flood it when we have none.
+bool meshForward(RouteTable& table, uint8_t self, int maxHops, uint8_t link, LoraHeader& header, uint32_t nowMs);
+
+// Time on air of a frame in us, explicit header and CRC on (Semtech AN1200.13).
+// codingRate is the denominator, 5-8 for 4/5-4/8.
+uint32_t loraTimeOnAirUs(size_t len, int spreadingFactor, float bandwidthKHz, int codingRate, int preamble = 8);
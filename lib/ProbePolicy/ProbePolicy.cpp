@@ -0,0 +1,104 @@
+#include "ProbePolicy.h"
+#include <stdio.h>
+#include <string.h>
+
+const char* probeVerdictName(ProbeVerdict verdict) {
+  static const char* const names[] = { "idle", "ok", "watch", "reset", "hold" };
+  return names[verdict];
+}
+
+
+int probeFailures(const ProbePolicy& policy, const ProbeTarget& t) {
+  uint32_t mask = policy.window >= 32 ? 0xFFFFFFFF : (1UL << policy.window) - 1;
+  return __builtin_popcount(t.failBits & mask);
+}
+
+
+int probeResetsLastHour(const ProbeTarget& t, uint32_t nowSec) {
+  int count = 0;
+  for (int i = 0; i < MAX_RESETS_PER_HOUR_CAP; i++) {
+    if (t.resetAtSec[i] && nowSec - t.resetAtSec[i] < 3600) count++;
+  }
+  return count;
+}
+
+
+int probeRank(const ProbePolicy& policy, int relay) {
+  for (int i = 0; i < PROBE_RELAYS && policy.escalation[i] >= 0; i++) {
+    if (policy.escalation[i] == relay) return i;
+  }
+  return PROBE_RELAYS;
+}
+
+
+bool probeInCooldown(const ProbePolicy& policy, const ProbeTarget& t, uint32_t nowSec) {
+  return t.resetAtSec[0] && nowSec - t.resetAtSec[0] < policy.cooldownMinutes * 60UL;
+}
+
+
+void probeRecord(const ProbePolicy& policy, ProbeTarget& t, bool ok, uint16_t rttMs) {
+  bool failed = !ok || (policy.rttCeilingMs && rttMs > policy.rttCeilingMs);
+  t.failBits = (t.failBits << 1) | (failed ? 1 : 0);
+  if (t.samples < policy.window) t.samples++;
+  t.rttMs[t.rttPos] = ok ? (rttMs ? rttMs : 1) : 0;
+  t.rttPos = (t.rttPos + 1) % PROBE_WINDOW_MAX;
+}
+
+
+void probeNoteReset(ProbeTarget& t, uint32_t nowSec) {
+  memmove(&t.resetAtSec[1], &t.resetAtSec[0], (MAX_RESETS_PER_HOUR_CAP - 1) * sizeof(uint32_t));
+  t.resetAtSec[0] = nowSec ? nowSec : 1;   // 0 means no reset
+  // the old failures have been dealt with
+  t.failBits = 0;
+  t.samples = 0;
+}
+
+
+ProbeVerdict probeDecide(const ProbePolicy& policy, const ProbeTarget* targets, const ProbeRelay* relays,
+                         int relay, uint32_t nowSec, char* reason, size_t reasonLen) {
+  const ProbeTarget& t = targets[relay];
+  int failures = probeFailures(policy, t);
+
+  if (failures < policy.failThreshold) {
+    snprintf(reason, reasonLen, "%d of last %d probes failed", failures, t.samples);
+    return failures ? PROBE_WATCH : PROBE_OK;
+  }
+  if (!relays[relay].resetEnabled) {
+    snprintf(reason, reasonLen, "%d/%d failed, reset is disabled", failures, t.samples);
+    return PROBE_HOLD;
+  }
+  if (relays[relay].cycling) {
+    snprintf(reason, reasonLen, "%d/%d failed, already cycling", failures, t.samples);
+    return PROBE_HOLD;
+  }
+  if (probeInCooldown(policy, t, nowSec)) {
+    snprintf(reason, reasonLen, "%d/%d failed, cool-down for %lu more s", failures, t.samples,
+             (unsigned long)(policy.cooldownMinutes * 60UL - (nowSec - t.resetAtSec[0])));
+    return PROBE_HOLD;
+  }
+  if (probeResetsLastHour(t, nowSec) >= policy.maxResetsPerHour) {
+    snprintf(reason, reasonLen, "%d/%d failed, %d resets in the last hour already", failures, t.samples,
+             probeResetsLastHour(t, nowSec));
+    return PROBE_HOLD;
+  }
+
+  // Anything earlier in the escalation order that is failing, or has just been
+  // reset, goes first. Its reset may well fix us too. One that is failing but
+  // will not be reset (disabled, or out of resets for the hour) is passed over,
+  // or it would hold up everything after it.
+  int rank = probeRank(policy, relay);
+  for (int other = 0; other < PROBE_RELAYS; other++) {
+    if (other == relay || !relays[other].active || probeRank(policy, other) >= rank) continue;
+    const ProbeTarget& o = targets[other];
+    bool held = !relays[other].resetEnabled || probeResetsLastHour(o, nowSec) >= policy.maxResetsPerHour;
+    bool failing = !held && probeFailures(policy, o) >= policy.failThreshold;
+    if (failing || probeInCooldown(policy, o, nowSec)) {
+      snprintf(reason, reasonLen, "%d/%d failed, waiting on %s (%s)", failures, t.samples,
+               relays[other].label, failing ? "failing" : "recently reset");
+      return PROBE_HOLD;
+    }
+  }
+
+  snprintf(reason, reasonLen, "%d of last %d probes failed", failures, t.samples);
+  return PROBE_RESET;
+}
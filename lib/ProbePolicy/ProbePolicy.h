@@ -0,0 +1,59 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Probe policy. Each pinged relay keeps a window of recent results, and only
+// N failures out of the last M probes lead to a power cycle. Cool-down, an
+// hourly cap and an escalation order stop one flaky link from rebooting
+// everything behind it. Nothing here touches the hardware, main.cpp passes
+// in what it needs to know about the relays.
+#define PROBE_WINDOW_MAX        32
+#define MAX_RESETS_PER_HOUR_CAP 8
+#define PROBE_RELAYS            6
+
+struct ProbePolicy {
+  uint16_t intervalSeconds;   // each target is probed once per interval
+  uint8_t window;             // M
+  uint8_t failThreshold;      // N
+  uint16_t rttCeilingMs;      // slower replies count as failures, 0 for no ceiling
+  uint16_t cooldownMinutes;   // after a reset, before the same relay may be reset again
+  uint8_t maxResetsPerHour;
+  int8_t escalation[PROBE_RELAYS];   // relays in the order they get reset, -1 terminated
+};
+
+enum ProbeVerdict : uint8_t { PROBE_IDLE, PROBE_OK, PROBE_WATCH, PROBE_RESET, PROBE_HOLD };
+
+struct ProbeTarget {
+  uint32_t failBits;          // bit 0 is the newest probe, set = failed
+  uint8_t samples;
+  uint16_t rttMs[PROBE_WINDOW_MAX];   // 0 for a failed probe
+  uint8_t rttPos;
+  uint32_t resetAtSec[MAX_RESETS_PER_HOUR_CAP];   // uptime of recent resets, newest first
+  ProbeVerdict verdict;
+  char reason[64];
+};
+
+// What the policy needs to know about each relay right now
+struct ProbeRelay {
+  bool active;                // being probed
+  bool resetEnabled;
+  bool cycling;               // a pulse is already running on it
+  const char* label;
+};
+
+const char* probeVerdictName(ProbeVerdict verdict);
+int probeFailures(const ProbePolicy& policy, const ProbeTarget& t);
+int probeResetsLastHour(const ProbeTarget& t, uint32_t nowSec);
+// Position in the escalation order, relays not listed go after all those that are
+int probeRank(const ProbePolicy& policy, int relay);
+bool probeInCooldown(const ProbePolicy& policy, const ProbeTarget& t, uint32_t nowSec);
+
+// Adds one probe result to a target's window
+void probeRecord(const ProbePolicy& policy, ProbeTarget& t, bool ok, uint16_t rttMs);
+// A reset has been started on the target: counts it and starts the window afresh
+void probeNoteReset(ProbeTarget& t, uint32_t nowSec);
+
+// Works out what to do about one target and why. Only reads state, so the
+// same trace always gives the same answers.
+ProbeVerdict probeDecide(const ProbePolicy& policy, const ProbeTarget* targets, const ProbeRelay* relays,
+                         int relay, uint32_t nowSec, char* reason, size_t reasonLen);
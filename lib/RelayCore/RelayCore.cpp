@@ -0,0 +1,234 @@
+#include "RelayCore.h"
+#include <stdio.h>
+#include <string.h>
+
+static void lock(RelayCore& core) {
+  if (core.hooks.lock) core.hooks.lock();
+}
+
+static void unlock(RelayCore& core) {
+  if (core.hooks.unlock) core.hooks.unlock();
+}
+
+static void write(RelayCore& core, int relay) {
+  if (core.hooks.write) core.hooks.write(relay);
+}
+
+// states[relay] = where it settles, as a pulse ends
+static void settle(RelayCore& core, int relay) {
+  lock(core);
+  core.states[relay] = *core.settleMask & (1 << relay);
+  unlock(core);
+  write(core, relay);
+}
+
+
+void parseButtonAction(const char* text, ButtonAction& action, int8_t& relay) {
+  int r = -1;
+  relay = -1;
+  if (sscanf(text, "toggle:%d", &r) == 1 && r >= 0 && r < RELAY_COUNT) {
+    action = BTN_TOGGLE;
+    relay = r;
+  } else if (strcmp(text, "allOn") == 0) {
+    action = BTN_ALL_ON;
+  } else if (strcmp(text, "allOff") == 0) {
+    action = BTN_ALL_OFF;
+  } else if (strcmp(text, "wake") == 0) {
+    action = BTN_WAKE;
+  } else {
+    action = BTN_NONE;
+  }
+}
+
+
+const char* buttonActionName(ButtonAction action, int8_t relay, char* buf, size_t size) {
+  switch (action) {
+    case BTN_TOGGLE:  snprintf(buf, size, "toggle:%d", relay); return buf;
+    case BTN_ALL_ON:  return "allOn";
+    case BTN_ALL_OFF: return "allOff";
+    case BTN_WAKE:    return "wake";
+    default:          return "none";
+  }
+}
+
+
+bool parseRelayCommand(const char* text, RelayCommand& cmd) {
+  int relay = -1;
+  unsigned long ms = 0;
+  cmd.relay = -1;
+  cmd.ms = 0;
+
+  if (strcmp(text, "STATUS") == 0) {
+    cmd.op = CMD_STATUS;
+  } else if (strcmp(text, "BEACON") == 0) {
+    cmd.op = CMD_BEACON;
+  } else if (sscanf(text, "ON %d", &relay) == 1) {
+    cmd.op = CMD_ON;
+  } else if (sscanf(text, "OFF %d", &relay) == 1) {
+    cmd.op = CMD_OFF;
+  } else if (sscanf(text, "CYCLE %d", &relay) == 1) {
+    cmd.op = CMD_CYCLE;
+  } else if (sscanf(text, "PULSE %d %lu", &relay, &ms) == 2 && ms > 0) {
+    cmd.op = CMD_PULSE;
+    cmd.ms = ms;
+  } else if (sscanf(text, "CANCEL %d", &relay) == 1) {
+    cmd.op = CMD_CANCEL;
+  } else {
+    return false;
+  }
+  if (cmd.op != CMD_STATUS && cmd.op != CMD_BEACON && (relay < 0 || relay >= RELAY_COUNT)) return false;
+  cmd.relay = relay;
+  return true;
+}
+
+
+bool relaySettled(const RelayCore& core, int relay) {
+  return wheelArmed(*core.wheel, relay) ? *core.settleMask & (1 << relay) : core.states[relay];
+}
+
+
+void relaySetSettle(RelayCore& core, int relay, bool on) {
+  if (on) *core.settleMask |= (1 << relay);
+  else *core.settleMask &= ~(1 << relay);
+}
+
+
+void relayArmPulse(RelayCore& core, int relay, uint32_t ms, uint32_t nowTick) {
+  uint32_t ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+  wheelArm(*core.wheel, relay, nowTick + (ticks ? ticks : 1));
+  if (core.hooks.pulseArmed) core.hooks.pulseArmed(relay, ms);
+}
+
+
+bool relayCancelTimer(RelayCore& core, int relay) {
+  if (!wheelCancel(*core.wheel, relay)) return false;
+  if (core.hooks.pulseCleared) core.hooks.pulseCleared(relay);
+  return true;
+}
+
+
+void relaySet(RelayCore& core, int relay, bool on) {
+  relayCancelTimer(core, relay);
+  lock(core);
+  core.states[relay] = on;
+  unlock(core);
+  write(core, relay);
+}
+
+
+void relayToggle(RelayCore& core, int relay) {
+  relayCancelTimer(core, relay);
+  lock(core);   // so a button press on the other core isn't lost
+  core.states[relay] = !core.states[relay];
+  unlock(core);
+  write(core, relay);
+}
+
+
+void relayStartPulse(RelayCore& core, int relay, uint32_t ms, uint32_t nowTick) {
+  if (!wheelArmed(*core.wheel, relay)) {
+    lock(core);
+    relaySetSettle(core, relay, core.states[relay]);
+    core.states[relay] = !core.states[relay];
+    unlock(core);
+    write(core, relay);
+  }
+  relayArmPulse(core, relay, ms, nowTick);
+  if (core.hooks.pulseStarted) core.hooks.pulseStarted(relay, ms);
+}
+
+
+bool relayPowerCycle(RelayCore& core, int relay, uint32_t nowTick) {
+  if (!relaySettled(core, relay)) {
+    if (core.hooks.cycleRefused) core.hooks.cycleRefused(relay);
+    return false;
+  }
+  relayStartPulse(core, relay, core.cycleOffSeconds[relay] * 1000UL, nowTick);
+  return true;
+}
+
+
+void relayFinishPulse(RelayCore& core, int relay) {
+  if (core.hooks.pulseCleared) core.hooks.pulseCleared(relay);
+  settle(core, relay);
+}
+
+
+bool relayCancelPulse(RelayCore& core, int relay) {
+  if (!relayCancelTimer(core, relay)) return false;
+  settle(core, relay);
+  if (core.hooks.pulseCancelled) core.hooks.pulseCancelled(relay);
+  return true;
+}
+
+
+void buttonSwitch(RelayCore& core, ButtonAction action, int relay) {
+  if (action != BTN_TOGGLE && action != BTN_ALL_ON && action != BTN_ALL_OFF) return;
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    if (action == BTN_TOGGLE && i != relay) continue;
+    lock(core);
+    bool on = action == BTN_TOGGLE ? !core.states[i] : action == BTN_ALL_ON;
+    core.states[i] = on;
+    relaySetSettle(core, i, on);   // where a pulse in progress ends up, should it run out before loop() cancels it
+    if (core.hooks.pressWrite) core.hooks.pressWrite(i);
+    unlock(core);
+  }
+}
+
+
+void buttonSettle(RelayCore& core, ButtonAction action, int relay) {
+  if (action == BTN_NONE || action == BTN_WAKE) return;
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    if (action != BTN_TOGGLE || relay == i) relayCancelTimer(core, i);
+  }
+}
+
+
+void relayRunCommand(RelayCore& core, const RelayCommand& cmd, uint32_t nowTick) {
+  switch (cmd.op) {
+    case CMD_ON:
+    case CMD_OFF:
+      relaySet(core, cmd.relay, cmd.op == CMD_ON);
+      break;
+    case CMD_CYCLE:
+      if (!wheelArmed(*core.wheel, cmd.relay)) relayPowerCycle(core, cmd.relay, nowTick);
+      break;
+    case CMD_PULSE:
+      relayStartPulse(core, cmd.relay, cmd.ms, nowTick);
+      break;
+    case CMD_CANCEL:
+      relayCancelPulse(core, cmd.relay);
+      break;
+    default:
+      break;
+  }
+}
+
+
+void relayProbeEvaluate(RelayCore& core, const ProbePolicy& policy, ProbeTarget* targets, ProbeRelay* view,
+                        uint32_t nowSec, uint32_t nowTick) {
+  for (int i = 0; i < RELAY_COUNT; i++) view[i].cycling = wheelArmed(*core.wheel, i);
+
+  for (int relay = 0; relay < RELAY_COUNT; relay++) {
+    ProbeTarget& t = targets[relay];
+    ProbeVerdict was = t.verdict;
+    if (!view[relay].active) {
+      t.verdict = PROBE_IDLE;
+      if (was != PROBE_IDLE && core.hooks.probeVerdict) core.hooks.probeVerdict(relay, was, t);
+      continue;
+    }
+
+    char reason[sizeof(t.reason)];
+    t.verdict = probeDecide(policy, targets, view, relay, nowSec, reason, sizeof(reason));
+    strcpy(t.reason, reason);
+    if (t.verdict != was && core.hooks.probeVerdict) core.hooks.probeVerdict(relay, was, t);
+    if (t.verdict != PROBE_RESET) continue;
+
+    if (core.hooks.probeResetting) core.hooks.probeResetting(relay, t);
+    if (relayPowerCycle(core, relay, nowTick)) {
+      if (core.hooks.probeReset) core.hooks.probeReset(relay, t);
+      probeNoteReset(t, nowSec);
+      view[relay].cycling = true;
+    }
+  }
+}
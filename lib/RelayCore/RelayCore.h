@@ -0,0 +1,93 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <TimerWheel.h>
+#include <ProbePolicy.h>
+
+// What the relays do about a button press, a pulse, a probe verdict or a
+// text command. main.cpp hands in its relay state and hooks for the outputs,
+// the RTC copy and the log; test_replay hands in a virtual unit and replays
+// a trace through the same decisions the firmware made.
+#define RELAY_COUNT 6
+
+enum ButtonAction : uint8_t { BTN_NONE, BTN_TOGGLE, BTN_ALL_ON, BTN_ALL_OFF, BTN_WAKE };
+
+enum RelayCommandOp : uint8_t { CMD_STATUS, CMD_BEACON, CMD_ON, CMD_OFF, CMD_CYCLE, CMD_PULSE, CMD_CANCEL };
+
+struct RelayCommand {
+  RelayCommandOp op;
+  int relay;
+  uint32_t ms;                 // CMD_PULSE only
+};
+
+// Any of these can be left null
+struct RelayHooks {
+  void (*lock)();              // states[] and settleMask are shared with buttonTask
+  void (*unlock)();
+  void (*write)(int relay);    // drives an output from states[]
+  void (*pressWrite)(int relay);                // the same from buttonTask, with the lock held
+  void (*pulseArmed)(int relay, uint32_t ms);   // a pulse timer (re)started, ending ms from now
+  void (*pulseCleared)(int relay);              // and stopped, run out or cancelled
+
+  // For the log
+  void (*pulseStarted)(int relay, uint32_t ms);
+  void (*pulseCancelled)(int relay);
+  void (*cycleRefused)(int relay);              // a power cycle asked of a relay that is off
+  void (*probeVerdict)(int relay, ProbeVerdict was, const ProbeTarget& t);
+  void (*probeResetting)(int relay, const ProbeTarget& t);   // before the power cycle
+  void (*probeReset)(int relay, const ProbeTarget& t);       // it started, t still has the failures
+};
+
+struct RelayCore {
+  bool* states;                // what each output should be
+  uint8_t* settleMask;         // bit i set = relay i goes back to on when its pulse ends
+  TimerWheel* wheel;           // pulse timers, owner = relay
+  const int* cycleOffSeconds;  // per relay, for a power cycle
+  RelayHooks hooks;
+};
+
+// Button actions in config.json are "toggle:<relay>", "allOn", "allOff",
+// "wake" or "none"
+void parseButtonAction(const char* text, ButtonAction& action, int8_t& relay);
+// buf only gets used for toggle, which carries the relay number
+const char* buttonActionName(ButtonAction action, int8_t relay, char* buf, size_t size);
+
+// STATUS, BEACON, ON <relay>, OFF <relay>, CYCLE <relay>, PULSE <relay> <ms>,
+// CANCEL <relay>, relays numbered 0-5. False if it is none of those.
+bool parseRelayCommand(const char* text, RelayCommand& cmd);
+
+// Where a relay goes back to when its pulse ends, or what it is without one
+bool relaySettled(const RelayCore& core, int relay);
+// Call with the lock held
+void relaySetSettle(RelayCore& core, int relay, bool on);
+// (Re)arms the timer that puts a relay back to its settled state in ms
+void relayArmPulse(RelayCore& core, int relay, uint32_t ms, uint32_t nowTick);
+// Stops a pulse timer without touching the relay. False if none was running.
+bool relayCancelTimer(RelayCore& core, int relay);
+
+// A relay switched by hand takes over from any pulse on it
+void relaySet(RelayCore& core, int relay, bool on);
+void relayToggle(RelayCore& core, int relay);
+// Flips a relay away from its settled state for ms, then back. Pulsing a
+// relay that is already mid-pulse just restarts its timer.
+void relayStartPulse(RelayCore& core, int relay, uint32_t ms, uint32_t nowTick);
+// A pulse of the relay's cycleOffSeconds, only if it is on
+bool relayPowerCycle(RelayCore& core, int relay, uint32_t nowTick);
+// The pulse timer went off
+void relayFinishPulse(RelayCore& core, int relay);
+// Stops a pulse early and puts the relay straight back
+bool relayCancelPulse(RelayCore& core, int relay);
+
+// A button press, in two halves: buttonTask switches the relays straight
+// away, and loop() later drops any pulse on what the press switched, as the
+// press is the new settled state
+void buttonSwitch(RelayCore& core, ButtonAction action, int relay);
+void buttonSettle(RelayCore& core, ButtonAction action, int relay);
+
+// Carries out a command's relay ops; STATUS and BEACON are the caller's
+void relayRunCommand(RelayCore& core, const RelayCommand& cmd, uint32_t nowTick);
+
+// Runs the probe policy over every relay and power cycles the ones it says
+// to. view[].cycling is filled in here.
+void relayProbeEvaluate(RelayCore& core, const ProbePolicy& policy, ProbeTarget* targets, ProbeRelay* view,
+                        uint32_t nowSec, uint32_t nowTick);
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// The log is a run of numbered segment files. Each is appended to until it
+// reaches LOG_SEGMENT_SIZE and is then closed for good; once there are more
+// than LOG_SEGMENTS the oldest is deleted whole. Nothing is rewritten in place,
+// which on LittleFS (copy on write) is what keeps wear and write amplification
+// down. test/test_flash_bench has the numbers.
+#define LOG_SEGMENT_SIZE 16384
+#define LOG_SEGMENTS     8
+#define LOG_SYNC_MS      2000    // a logged line is on flash at most this long after
+
+// Whether a line of len bytes has to start a new segment
+inline bool segmentFull(size_t segmentBytes, size_t len) {
+  return segmentBytes + len > LOG_SEGMENT_SIZE;
+}
+
+// Whether the oldest segment has to go to make room for segment current
+inline bool segmentsOver(uint32_t first, uint32_t current) {
+  return current - first >= LOG_SEGMENTS;
+}
@@ -0,0 +1,76 @@
+#include "TimerWheel.h"
+
+void wheelInit(TimerWheel& w, uint32_t nowTick) {
+  for (int i = 0; i < WHEEL_SLOTS; i++) w.slots[i] = -1;
+  for (int i = 0; i < WHEEL_TIMERS; i++) {
+    w.timers[i].owner = -1;
+    w.byOwner[i] = -1;
+  }
+  w.tick = nowTick;
+}
+
+
+bool wheelArmed(const TimerWheel& w, int owner) {
+  return w.byOwner[owner] >= 0;
+}
+
+
+static void wheelUnlink(TimerWheel& w, int8_t t) {
+  int8_t* link = &w.slots[w.timers[t].expiresTick % WHEEL_SLOTS];
+  while (*link != -1 && *link != t) {
+    link = &w.timers[*link].next;
+  }
+  if (*link == t) *link = w.timers[t].next;
+  w.byOwner[w.timers[t].owner] = -1;
+  w.timers[t].owner = -1;
+}
+
+
+void wheelArm(TimerWheel& w, int owner, uint32_t expiresTick) {
+  int8_t t = w.byOwner[owner];
+  if (t >= 0) {
+    wheelUnlink(w, t);
+  } else {
+    for (t = 0; t < WHEEL_TIMERS && w.timers[t].owner != -1; t++);
+  }
+
+  // One already due goes off on the next tick, not a lap later
+  if ((int32_t)(expiresTick - w.tick) <= 0) expiresTick = w.tick + 1;
+
+  WheelTimer& timer = w.timers[t];
+  timer.owner = owner;
+  timer.expiresTick = expiresTick;
+  int8_t& head = w.slots[expiresTick % WHEEL_SLOTS];
+  timer.next = head;
+  head = t;
+  w.byOwner[owner] = t;
+}
+
+
+bool wheelCancel(TimerWheel& w, int owner) {
+  int8_t t = w.byOwner[owner];
+  if (t < 0) return false;
+  wheelUnlink(w, t);
+  return true;
+}
+
+
+int wheelAdvance(TimerWheel& w, uint32_t nowTick, void (*fire)(int owner, void* ctx), void* ctx) {
+  int fired = 0;
+  while ((int32_t)(nowTick - w.tick) > 0) {
+    w.tick++;
+    // fire() may cancel or re-arm any timer, so the chain is walked afresh
+    // from the slot after each one goes off
+    for (;;) {
+      int8_t t = w.slots[w.tick % WHEEL_SLOTS];
+      // Timers more than a lap out share the slot and wait for their own tick
+      while (t != -1 && (int32_t)(w.tick - w.timers[t].expiresTick) < 0) t = w.timers[t].next;
+      if (t == -1) break;
+      int owner = w.timers[t].owner;
+      wheelUnlink(w, t);
+      fired++;
+      fire(owner, ctx);
+    }
+  }
+  return fired;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+// Hashed timer wheel for the relay pulses. Each slot chains the timers whose
+// expiry tick hashes to it, so arming, cancelling and expiring are all O(1)
+// no matter how many relays are being cycled. One timer per owner (relay).
+#define WHEEL_SLOTS  64
+#define WHEEL_TIMERS 6
+#define WHEEL_TICK_MS 20     // the controller ticks it every 20 ms of esp_timer
+
+struct WheelTimer {
+  uint32_t expiresTick;
+  int8_t owner;         // -1 when the timer is free
+  int8_t next;          // next timer in the same slot, -1 ends the chain
+};
+
+struct TimerWheel {
+  WheelTimer timers[WHEEL_TIMERS];
+  int8_t slots[WHEEL_SLOTS];
+  int8_t byOwner[WHEEL_TIMERS];   // timer driving each owner, -1 when none
+  uint32_t tick;                  // last tick processed
+};
+
+void wheelInit(TimerWheel& w, uint32_t nowTick);
+bool wheelArmed(const TimerWheel& w, int owner);
+// (Re)arms the owner's timer to go off at expiresTick, or on the next tick
+// if that has already gone by
+void wheelArm(TimerWheel& w, int owner, uint32_t expiresTick);
+// Returns false if the owner had no timer
+bool wheelCancel(TimerWheel& w, int owner);
+// Moves the wheel on to nowTick, calling fire(owner) for every timer that
+// comes due, including on ticks missed in between. fire() may arm and cancel
+// timers, including ones due on the same tick. Returns how many fired.
+int wheelAdvance(TimerWheel& w, uint32_t nowTick, void (*fire)(int owner, void* ctx), void* ctx);
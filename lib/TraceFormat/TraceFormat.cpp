@@ -0,0 +1,60 @@
+#include "TraceFormat.h"
+#include <string.h>
+
+size_t traceVarint(uint8_t* out, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  out[n++] = v;
+  return n;
+}
+
+
+size_t traceHead(uint8_t* out, uint32_t deltaUs, TraceType type, size_t len) {
+  size_t n = traceVarint(out, deltaUs);
+  out[n++] = type;
+  n += traceVarint(out + n, len);
+  return n;
+}
+
+
+static bool readVarint(TraceReader& r, uint32_t& v) {
+  v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (r.pos >= r.len) return false;
+    uint8_t b = r.data[r.pos++];
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+
+bool traceOpen(TraceReader& r, const uint8_t* data, size_t len) {
+  r.data = data;
+  r.len = len;
+  r.pos = strlen(TRACE_MAGIC);
+  r.atUs = 0;
+  return len >= r.pos && !memcmp(data, TRACE_MAGIC, r.pos);
+}
+
+
+bool traceNext(TraceReader& r, TraceEvent& ev) {
+  uint32_t deltaUs, len;
+  size_t start = r.pos;
+  bool whole = readVarint(r, deltaUs) && r.pos < r.len;
+  uint8_t type = whole ? r.data[r.pos++] : 0;
+  if (!whole || !readVarint(r, len) || len > r.len - r.pos) {
+    r.pos = start;   // where the damage starts
+    return false;
+  }
+  r.atUs += deltaUs;
+  ev.atUs = r.atUs;
+  ev.type = (TraceType)type;
+  ev.payload = r.data + r.pos;
+  ev.len = len;
+  r.pos += len;
+  return true;
+}
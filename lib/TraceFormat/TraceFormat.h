@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Record mode's trace format. A trace is TRACE_MAGIC then, per event: varint
+// microseconds since the previous event, type byte, varint payload length,
+// payload. Over serial each event is one "TRACE <hex>" line in the same
+// encoding, without the magic.
+#define TRACE_MAGIC    "RCT1"
+#define TRACE_HEAD_MAX 11             // two varints and the type
+
+enum TraceType : uint8_t {
+  TRACE_HTTP = 1,              // method \0 uri \0 query \0 body
+  TRACE_LORA,                  // rssi int16, snr in quarter dB int8, the frame
+  TRACE_BUTTON,                // button, long press
+  TRACE_PROBE,                 // relay, ok, rtt ms uint16
+  TRACE_TIMER,                 // relay whose pulse or cycle ended
+  TRACE_CLOCK                  // epoch uint32, when recording starts and on each sync
+};
+
+size_t traceVarint(uint8_t* out, uint32_t v);
+// What goes before an event's payload. Returns its length.
+size_t traceHead(uint8_t* out, uint32_t deltaUs, TraceType type, size_t len);
+
+struct TraceEvent {
+  int64_t atUs;                // since the trace started
+  TraceType type;
+  const uint8_t* payload;
+  size_t len;
+};
+
+struct TraceReader {
+  const uint8_t* data;
+  size_t len;
+  size_t pos;
+  int64_t atUs;
+};
+
+// False if data is not a trace
+bool traceOpen(TraceReader& r, const uint8_t* data, size_t len);
+// The next event, pointing into the trace. False at the end, or at an event
+// that was cut short, with r.pos left at the start of it.
+bool traceNext(TraceReader& r, TraceEvent& ev);
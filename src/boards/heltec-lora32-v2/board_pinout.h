@@ -26,5 +26,7 @@
     #define INTERNAL_LED_PIN        25
     #define BATTERY_PIN             37
     #define ADC_CTRL                21
+    #define ADC_CTRL_ACTIVE         LOW      // level on ADC_CTRL that switches the battery divider on
+    #define BATTERY_DIVIDER         3.2      // battery volts per volt at BATTERY_PIN
     
 #endif
\ No newline at end of file
@@ -28,6 +28,8 @@
     #define BATTERY_PIN             1
     #define VEXT_CTRL               36
     #define ADC_CTRL                37
+    #define ADC_CTRL_ACTIVE         LOW      // level on ADC_CTRL that switches the battery divider on
+    #define BATTERY_DIVIDER         4.9      // battery volts per volt at BATTERY_PIN
     #define BOARD_I2C_SDA           41
     #define BOARD_I2C_SCL           42
 
@@ -1,16 +1,39 @@
 #include <WiFi.h>
 #include <WebServer.h>
-#include <SPIFFS.h>
+#include <detail/RequestHandler.h>
+#include <LittleFS.h>
+#include <SPIFFS.h>     // only to move old units over to LittleFS
 #include <ArduinoJson.h>
 #include <ESP32Ping.h>
 #include <time.h>
+#include <sys/time.h>
+#include <atomic>
 #include <WiFiUdp.h>
 #include "driver/rtc_io.h"
+#include "esp_rom_crc.h"
+#include "soc/gpio_reg.h"
+#include "esp_timer.h"
+#include "esp_task_wdt.h"
+#include "esp_sntp.h"
+#include "esp_partition.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 #include <SPI.h>
 #include <RadioLib.h>
 #include "boards/heltec_wifi_lora_32_V3/board_pinout.h"  // <-- Add this line
 #include <U8g2lib.h>
 #include <Wire.h>
+#include <TimerWheel.h>
+#include <BeaconCodec.h>
+#include <Debounce.h>
+#include <ProbePolicy.h>
+#include <JsonOut.h>
+#include <ConfigSchema.h>
+#include <LoraMesh.h>
+#include <SegmentLog.h>
+#include <TraceFormat.h>
+#include <RelayCore.h>
 
 #define LORA_BAND 433E6 // or 868E6 or 915E6 depending on your module
 
@@ -23,7 +46,30 @@ const char* buildTime = __TIME__;
 
 
 // For SSD1306 128x64 I2C (DollaTek/Heltec V3, ESP32-S3: SCL=18, SDA=17)
-U8G2_SSD1306_128X64_NONAME_F_HW_I2C u8g2(U8G2_R0, /* reset=*/ U8X8_PIN_NONE, /* clock=*/ 18, /* data=*/ 17);
+U8G2_SSD1306_128X64_NONAME_F_HW_I2C u8g2(U8G2_R0, /* reset=*/ OLED_RST, /* clock=*/ OLED_SCL, /* data=*/ OLED_SDA);
+
+// What the OLED shows. Built by a scheduler job in loop(), which owns all of
+// this state, and handed to the display task, which only ever draws from its copy.
+#define DISPLAY_MODEL_MS        250   // how often loop() looks for changes
+#define DISPLAY_MIN_INTERVAL_MS 100   // fastest the panel is redrawn
+
+struct DisplayModel {
+  uint8_t relayMask;
+  bool safeMode;
+  char clock[6];
+  char ip[16];
+  int8_t wifiRssi;            // 0 when not connected
+  int16_t loraRssi;           // 0 until something has been heard
+  char schedule[20];
+  uint16_t batteryDv;         // tenths of a volt, finer would redraw on every bit of noise
+};
+
+DisplayModel displayModel;    // latest from loop(), guarded by displayMux
+portMUX_TYPE displayMux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t displayTaskHandle = nullptr;
+volatile uint32_t displayFrames = 0;
+volatile uint32_t displayTilesSent = 0;
+int16_t lastLoraRssi = 0;
 
 
 struct Schedule {
@@ -33,16 +79,13 @@ struct Schedule {
   int pollIntervalMinutes;
 };
 
-Schedule globalSchedule;
+Schedule globalSchedule = { false, "06:00", "23:00", 10 };
 
 
 WiFiUDP syslogUdp;
 IPAddress syslogIP;
 
 
-bool rebootPending = false;
-unsigned long rebootStartTime = 0;
-
 const int ledPin = 2;  // GPIO pin for onboard blue LED
 
 // Original ESP32 pins
@@ -63,17 +106,504 @@ int globalPollIntervalMinutes = 10;
 String globalPowerOnTime = "06:00";
 String globalPowerOffTime = "23:00";
 
-unsigned long lastScheduleCheck = 0;
-unsigned long lastStatusFlashOn = 0;
-unsigned long lastStatusFlashOff = 0;
+// Status LED patterns. The LEDC peripheral does the fading in hardware and an
+// esp_timer moves on to the next step, so patterns keep playing however busy
+// loop() is. loop() only picks which pattern is wanted.
+#define LED_DUTY_MAX   8191    // 13 bit
+#define LED_PWM_HZ     5000
+
+struct LedStep {
+  uint16_t duty;
+  uint16_t fadeMs;     // hardware ramp to duty, 0 to jump straight there
+  uint16_t holdMs;     // then stay there this long
+};
+
+enum LedPatternId : uint8_t { LED_ALIVE, LED_PULSING, LED_WIFI_DOWN, LED_LOW_BATTERY, LED_SAFE_MODE, LED_FLASH };
+
+const LedStep ledAliveSteps[]      = { {LED_DUTY_MAX, 1500, 0}, {0, 1500, 500} };           // slow breathe
+const LedStep ledPulsingSteps[]    = { {LED_DUTY_MAX, 300, 0}, {0, 300, 0} };               // a relay is power cycling
+const LedStep ledWifiDownSteps[]   = { {LED_DUTY_MAX, 0, 100}, {0, 0, 400} };               // fast blink
+const LedStep ledLowBatterySteps[] = { {LED_DUTY_MAX, 0, 50}, {0, 0, 2950} };               // short blip every 3 s
+const LedStep ledSafeModeSteps[]   = { {LED_DUTY_MAX, 0, 100}, {0, 0, 150}, {LED_DUTY_MAX, 0, 100}, {0, 0, 900} };
+const LedStep ledFlashSteps[]      = { {0, 0, 50}, {LED_DUTY_MAX, 0, 80}, {0, 0, 50} };    // one off, e.g. LoRa RX
+
+struct LedPattern {
+  const char* name;
+  const LedStep* steps;
+  uint8_t count;
+};
+
+const LedPattern ledPatterns[] = {
+  { "alive", ledAliveSteps, 2 },
+  { "pulsing", ledPulsingSteps, 2 },
+  { "wifi-down", ledWifiDownSteps, 2 },
+  { "low-battery", ledLowBatterySteps, 2 },
+  { "safe-mode", ledSafeModeSteps, 4 },
+  { "flash", ledFlashSteps, 3 },
+};
+
+int statusLedPin = -1;                 // optional LED outside the box, mirrors ledPin
+int ledChannels = 0;
+volatile LedPatternId ledWanted = LED_ALIVE;
+volatile bool ledFlashWanted = false;
+LedPatternId ledPlaying = LED_ALIVE;
+LedPatternId ledResume = LED_ALIVE;    // what to go back to after a flash
+uint8_t ledStep = 0;
+esp_timer_handle_t ledTimer = nullptr;
 
 File uploadFile;
 size_t lastUploadSize = 0;
+bool uploadOk = false;
+String uploadError = "";
+
+// Config files. Uploads stream into CONFIG_TMP_PATH and are only swapped in once
+// they validate; the config they replace is kept as CONFIG_BAK_PATH for rollback.
+#define CONFIG_PATH     "/config.json"
+#define CONFIG_TMP_PATH "/config.tmp"
+#define CONFIG_BAK_PATH "/config.bak"
+
+// PATCH /api/config writes only the sections it changed, each to its own file
+// in CONFIG_OVERLAY_DIR, read over config.json at boot. The next full save of
+// config.json takes them in and deletes them.
+#define CONFIG_OVERLAY_DIR "/cfg"
+bool configOverlays = false;           // any overlay files on flash
+
+// The log is a run of segment files in LOG_DIR, rotated as lib/SegmentLog
+// says. Lines are synced to flash by a job every LOG_SYNC_MS, not one at a time.
+#define LOG_DIR          "/log"
+#define LOG_PAGE_SEGMENTS 2            // the log page shows the newest two, download has the lot
+
+File logFile;
+uint32_t logSegment = 0;               // segment being written
+uint32_t logFirstSegment = 0;          // oldest segment still on flash
+size_t logSegmentBytes = 0;
+bool logDirty = false;
+
+// Record mode. The inputs that drive the controller (HTTP requests, LoRa
+// frames, button presses, probe results, pulse timers, clock syncs) are
+// written as they arrive to a compact binary trace, in flash or as hex lines
+// on the serial port, so what happened in the field can be played back
+// against a unit with `relayfleet replay`, or through the lib/ code on the
+// build machine with test/test_replay. The format is in lib/TraceFormat.
+#define TRACE_PATH      "/trace.bin"
+#define TRACE_MAX_BYTES (256 * 1024)
+#define TRACE_EVENT_MAX 1536           // longer request bodies are cut short
+
+enum TraceSink : uint8_t { TRACE_OFF, TRACE_FLASH, TRACE_SERIAL };
+
+TraceSink traceSink = TRACE_OFF;
+File traceFile;
+int64_t traceLastUs = 0;
+uint32_t traceEvents = 0;
+uint32_t traceBytes = 0;
+bool traceHttpPending = false;         // a request was dispatched, loop() writes it out
+int64_t traceHttpUs = 0;
+uint8_t traceBuf[TRACE_EVENT_MAX];
+
+// Config sections, used to work out what needs restarting after a config change
+#define CFG_RELAYS   0x01
+#define CFG_SCHEDULE 0x02
+#define CFG_WIFI     0x04
+#define CFG_LORA     0x08
+#define CFG_WEB      0x10
+#define CFG_SYSLOG   0x20
+#define CFG_BUTTONS  0x40
+
+uint8_t pendingApplyMask = 0;
 
 String wifiSSID = "";
 String wifiPassword = "";
+
+// Optional static addressing, DHCP is used when wifiStaticIP is blank
+String wifiStaticIP = "";
+String wifiGateway = "";
+String wifiSubnet = "255.255.255.0";
+String wifiDNS = "";
+
+// Last good association, kept in RTC memory so a wake from deep sleep can go
+// straight to the known AP and channel without scanning or waiting on DHCP
+#define WIFI_CACHE_MAGIC 0x57494649
+
+struct WifiFastCache {
+  uint32_t magic;
+  char ssid[33];
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint32_t crc;
+};
+
+RTC_DATA_ATTR WifiFastCache wifiCache;
+RTC_DATA_ATTR uint16_t wifiAssocHistory[8];   // association time of recent boots, newest first
+RTC_DATA_ATTR uint8_t wifiAssocHistoryLen = 0;
+
+// Runtime state that has to survive deep sleep and soft resets. RTC_NOINIT
+// memory is garbage after power on, the CRC tells us whether to trust it.
+#define RTC_STATE_MAGIC 0x52454C59
+
+struct RtcState {
+  uint32_t magic;
+  uint8_t relayMask;          // bit i set = relay i on
+  uint8_t wakeReason;         // esp_sleep_wakeup_cause_t of the latest boot
+  uint8_t pulseMask;          // bit i set = relay i is part way through a pulse
+  uint8_t pulseSettleMask;    // bit i set = relay i goes back to on when its pulse ends
+  uint32_t sleepSeconds;      // poll interval used while sleeping
+  uint32_t nextWakeEpoch;     // schedule cursor, UTC time of the next power-on transition
+  uint32_t bootCount;
+  uint32_t sleepCount;
+  uint32_t quickSleepCount;   // timer wakes that went straight back to sleep
+  int64_t pulseEndMs[6];      // wall clock (gettimeofday) ms when each pulse ends
+  uint32_t pulseLenMs[6];
+  uint32_t clockSyncEpoch;    // last NTP sync, 0 if the clock has never been set since power on
+  uint32_t crc;
+};
+
+RTC_NOINIT_ATTR RtcState rtcState;
+
+// Wall clock. When SNTP sets the time we note the offset between the epoch
+// and esp_timer, and from then on every timestamp is esp_timer plus that
+// offset: sub-second, and nothing ever waits. Until the first sync clockSynced
+// is false and timestamps say so. The RTC keeps time through deep sleep and
+// soft resets, so rtcState.clockSyncEpoch lets a wake carry on as synced.
+#define CLOCK_VALID_EPOCH 1609459200   // anything after 2021 means the time has been set
+
+enum ClockSource : uint8_t { CLOCK_NONE, CLOCK_RTC, CLOCK_NTP };
+
+bool clockSynced = false;
+ClockSource clockSource = CLOCK_NONE;
+int64_t clockOffsetUs = 0;             // epoch microseconds minus esp_timer_get_time()
+volatile bool clockSyncPending = false;
+uint32_t clockSyncCount = 0;
+String clockTimezone = "UTC0";         // POSIX TZ string, "timezone" in config.json
+char clockText[24];                    // "YYYY-MM-DD HH:MM:SS" for clockTextSec
+int64_t clockTextSec = -1;
+
+// Crash accounting, kept apart from rtcState so that state written mid-crash
+// cannot cost us the relay mask. After SAFE_MODE_CRASHES crashes without a
+// stable run in between we boot into safe mode: relays and web server only.
+#define RTC_HEALTH_MAGIC     0x484C5448
+#define CRASH_HISTORY_LEN    8
+#define RESET_REASON_SLOTS   16
+#define SAFE_MODE_CRASHES    3
+#define STABLE_UPTIME_MS     120000   // a boot that lasts this long clears the crash streak
+#define SAFE_MODE_RETRY_MS   900000   // safe mode has another go at a normal boot after this
+#define TASK_WDT_TIMEOUT_S   15
+
+struct CrashRecord {
+  uint8_t reason;             // esp_reset_reason_t
+  uint32_t epoch;             // roughly when it happened, 0 if the clock was not set
+  uint32_t uptimeSec;         // how long that boot had been running
+};
+
+struct RtcHealth {
+  uint32_t magic;
+  uint16_t resetCounts[RESET_REASON_SLOTS];
+  uint32_t crashStreak;
+  uint32_t totalCrashes;
+  uint32_t totalBrownouts;    // kept apart from crashes, a sagging battery is not a bug
+  uint32_t lastBrownoutEpoch;
+  uint32_t lastUptimeSec;     // kept up to date while running
+  uint32_t lastEpoch;
+  uint8_t historyLen;
+  CrashRecord history[CRASH_HISTORY_LEN];   // newest first
+  uint32_t crc;
+};
+
+RTC_NOINIT_ATTR RtcHealth rtcHealth;
+bool safeMode = false;
+esp_reset_reason_t bootResetReason = ESP_RST_UNKNOWN;
+
+// Battery / supply voltage sampling ("battery" section of config.json)
+#define BATTERY_OVERSAMPLE   16
+#define BATTERY_MEDIAN_LEN   5
+#define BATTERY_HISTORY_LEN  60    // one median per minute, so the last hour
+#define MAX_SHED_RULES       6
+
+struct ShedRule {
+  int relay;
+  float offBelow;      // volts
+  float onAbove;       // volts, above offBelow for hysteresis
+  bool shed;           // relay is currently off because of this rule
+};
+
+float batteryDivider = BATTERY_DIVIDER;
+int batterySampleSeconds = 10;
+ShedRule shedRules[MAX_SHED_RULES];
+int shedRuleCount = 0;
+
+portMUX_TYPE batteryMux = portMUX_INITIALIZER_UNLOCKED;
+uint16_t batteryRaw[BATTERY_MEDIAN_LEN];        // recent oversampled readings, mV
+uint8_t batteryRawCount = 0;
+volatile uint16_t batteryMv = 0;                // filtered battery voltage, 0 until the first sample
+volatile uint32_t batterySampleCount = 0;
+uint16_t batteryHistory[BATTERY_HISTORY_LEN];   // oldest first
+uint8_t batteryHistoryLen = 0;
+uint32_t lastBatterySample = 0;                 // sample count the shed rules last looked at
+
+// Probe policy ("probe" section of config.json), see lib/ProbePolicy
+#define PROBE_PINGS        2       // echo requests per probe, any reply counts
+#define PROBE_RESET_LOG    16
+
+struct ProbeResetRecord {
+  uint32_t atSec;
+  int8_t relay;
+  uint8_t failures;
+  uint8_t window;
+};
+
+ProbePolicy probePolicy = { 60, 10, 4, 1500, 20, 2, { -1, -1, -1, -1, -1, -1 } };
+ProbeTarget probeTargets[6];
+ProbeResetRecord probeResets[PROBE_RESET_LOG];   // newest first
+int probeResetCount = 0;
+int probeNext = 0;                               // round robin cursor
+
+// Pings go out from probeTask, a dead target takes seconds to time out and
+// loop() must not wait for it. One probe is out at a time.
+struct ProbeResult {
+  int8_t relay;
+  uint32_t ip;
+  bool ok;
+  uint16_t rttMs;
+};
+
+QueueHandle_t probeRequests = nullptr;           // loop() to probeTask
+QueueHandle_t probeResults = nullptr;            // and back
+bool probeBusy = false;
+
+// Physical override buttons ("buttons" section of config.json). Edges come in
+// on GPIO interrupts and are debounced by buttonTask, which switches the
+// relays itself so a busy loop() never holds up a press. loop() catches up on
+// the logging and saving afterwards. The debouncing itself is in lib/Debounce.
+#define MAX_BUTTONS        4
+#define STAY_AWAKE_MS      1800000 // schedule sleep is held off this long after a wake press
+
+struct Button {
+  int pin;
+  bool activeLow;
+  ButtonAction shortAction;
+  ButtonAction longAction;
+  int8_t shortRelay;
+  int8_t longRelay;
+  // runtime
+  Debouncer deb;
+};
+
+struct ButtonEvent {
+  uint8_t button;
+  ButtonAction action;
+  int8_t relay;
+  bool longPress;
+  uint8_t before;              // relay mask either side of the press, for the audit journal
+  uint8_t after;
+  uint16_t latencyMs;          // input edge to relay output
+};
+
+Button buttons[MAX_BUTTONS];
+int buttonCount = 0;
+TaskHandle_t buttonTaskHandle = nullptr;
+QueueHandle_t buttonEvents = nullptr;
+SemaphoreHandle_t buttonLock = nullptr;   // buttons[] and buttonCount, held by buttonTask while it services them
+portMUX_TYPE relayMux = portMUX_INITIALIZER_UNLOCKED;   // relayStates[] and the relay mask, shared with buttonTask
+unsigned long stayAwakeUntil = 0;
+
+// Relay changes are persisted a little after the last one, so a burst of
+// changes costs one flash write
+#define CONFIG_SAVE_DELAY_MS 2000
+bool configDirty = false;
+
+// Pulses and power cycles run off a hashed timer wheel (lib/TimerWheel), one
+// timer per relay
+TimerWheel pulseWheel;
+
+// How long a power cycle holds each relay off ("cycleOffSeconds" in config.json)
+int relayCycleOffSeconds[6] = {5, 5, 5, 5, 5, 5};
+
+// What buttons, pulses, probes and LoRa commands do to the relays
+// (lib/RelayCore). Its hooks are set in setup().
+RelayCore relayCore = { relayStates, &rtcState.pulseSettleMask, &pulseWheel, relayCycleOffSeconds, {} };
+
+// Recent /api/relays request IDs and their responses, so a retried request
+// is answered without being applied twice
+#define RELAY_REQUEST_CACHE 8
+
+struct RelayRequest {
+  String id;
+  String response;
+};
+
+RelayRequest relayRequestCache[RELAY_REQUEST_CACHE];
+int relayRequestNext = 0;
+
+// LoRa link. Frames start with a small header so a command can be addressed
+// to one node and answered with that node's status. Anything without the
+// header is a plain text command from a handheld, as before. All sending goes
+// through a priority queue that knows about airtime, so nothing ever waits on
+// a transmit. The radio belongs to radioTask, which also does the mesh
+// forwarding (lib/LoraMesh); frames that are for us are handed to loop().
+#define LORA_FRAME_MAX       64
+#define LORA_TX_QUEUE        12
+#define LORA_MAX_ATTEMPTS    3
+#define LORA_REPLY_MARGIN_MS 1500    // on top of two frame times, for the other end to answer
+#define MAX_REMOTES          8
+
+// Status beacons. Sent quickly after something changes, backing off to the
+// idle interval while nothing does. Most are deltas against the last full
+// beacon; a full one goes out at least every LORA_BEACON_FULL_MS, which also
+// keeps the callsign on air.
+#define LORA_BEACON_FAST_MS   30000
+#define LORA_BEACON_IDLE_MS   300000
+#define LORA_BEACON_FULL_MS   900000
+#define LORA_BEACON_SETTLE_MS 2000     // let a burst of changes land in one beacon
+#define LORA_BEACON_BATT_STEP 100      // mV of battery movement that counts as a change
+
+enum LoraPriority : uint8_t { LORA_PRIO_REPLY, LORA_PRIO_HIGH, LORA_PRIO_NORMAL, LORA_PRIO_LOW };
+
+struct __attribute__((packed)) LoraStatusPayload {
+  uint8_t ackSeq;              // seq of the command this answers, 0 for a beacon
+  uint8_t relayMask;
+  uint8_t pulseMask;
+  uint8_t flags;               // bit 0 safe mode, 1 schedule enabled, 2 held awake past the schedule
+  uint16_t batteryMv;
+  uint32_t uptimeSec;
+};
+
+struct LoraOut {
+  bool used;
+  uint8_t priority;
+  uint8_t len;
+  uint8_t data[LORA_FRAME_MAX];
+  bool awaitReply;             // a command, kept until the node answers or we give up
+  uint8_t node;
+  uint8_t seq;
+  uint8_t attempts;
+  uint32_t queuedMs;
+  uint32_t notBeforeMs;
+};
+
+struct RemoteNode {
+  uint8_t id;
+  uint8_t relayMask;
+  uint8_t pulseMask;
+  uint8_t flags;
+  uint16_t batteryMv;
+  uint32_t uptimeSec;
+  uint32_t heardMs;
+  int16_t rssi;
+  float snr;
+  uint16_t probeBits;
+  BeaconKey key;               // the node's last full beacon, which its deltas are against
+  uint32_t askedFullMs;        // when we last asked for a full beacon, 0 never
+  uint32_t beacons;
+  uint32_t missedKeys;         // deltas we could not use
+};
+
+int loraNodeId = 1;
+bool loraGateway = false;
+int loraDutyPercent = 10;                  // share of each hour we allow ourselves on air
+
+LoraOut loraTx[LORA_TX_QUEUE];
+int loraAwaiting = -1;                     // queue slot whose reply we are waiting for
+uint32_t loraReplyDeadline = 0;
+bool loraTxBusy = false;
+bool loraTxAwaited = false;                // the frame on air is the one loraAwaiting waits on
+uint32_t loraTxToaMs = 0;
+uint8_t loraSeq = 0;
+uint16_t loraEpoch = 0;                   // goes out in every frame we start, new each boot
+uint16_t loraAirtimeMs[60];                // per minute, for the last hour
+uint32_t loraAirtimeMinute[60];
+uint32_t loraTxFrames = 0;
+uint32_t loraRxFrames = 0;
+uint32_t loraDropped = 0;
+
+struct LoraInbound {
+  uint8_t len;
+  uint8_t data[LORA_FRAME_MAX];
+  int16_t rssi;
+  float snr;
+  bool repeat;                             // a command we already ran, its answer must have been lost
+  int64_t rxUs;                            // esp_timer when it came off the air
+};
+
+bool loraMesh = false;
+int loraMaxHops = 3;
+RouteTable routeTable;
+DupCache loraSeen;
+uint32_t loraForwarded = 0;
+uint32_t loraDuplicates = 0;
+TaskHandle_t radioTaskHandle = nullptr;
+SemaphoreHandle_t loraLock = nullptr;      // the radio, the send queue and the route table
+QueueHandle_t loraInbox = nullptr;         // frames for us, radioTask to loop()
+volatile bool loraDio1 = false;
+
+RemoteNode remotes[MAX_REMOTES];
+int remoteCount = 0;
+
+BeaconState beaconSent;                    // what the last beacon said
+BeaconKey beaconKey;                       // our last full beacon
+bool beaconForceFull = false;
+uint32_t beaconIntervalMs = LORA_BEACON_FAST_MS;
+uint32_t beaconLastMs = 0;
+uint32_t beaconKeyMs = 0;
+uint32_t beaconChangedMs = 0;              // when we first saw state differ from beaconSent, 0 if it does not
+int beaconPendingSeq = -1;                 // beacon still waiting in the send queue
+uint32_t beaconFullCount = 0;
+uint32_t beaconDeltaCount = 0;
+uint32_t beaconBits = 0;                   // payload bits sent in beacons, callsigns included
+
+// LoRa radio settings ("lora" section of config.json)
+float loraFrequency = 439.9125;
+float loraBandwidth = 125.0;
+int loraSpreadingFactor = 12;
+int loraCodingRate = 5;
+int loraOutputPower = 14;
+int loraSyncWord = 0x12;
+
+int webServerPort = 80;
 WebServer server(80);
-unsigned long lastPingTime = 0;
+
+SX1262 lora = new Module(RADIO_CS_PIN, RADIO_DIO1_PIN, RADIO_RST_PIN, RADIO_BUSY_PIN);
+bool loraReady = false;
+
+// Boot timeline, readable through /api/boot
+#define MAX_BOOT_PHASES 8
+#define WIFI_CONNECT_TIMEOUT_MS 20000
+#define NTP_SYNC_TIMEOUT_MS     30000
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 3000
+#define WIFI_ATTEMPT_TIMEOUT_MS      15000
+#define WIFI_RETRY_MIN_MS            1000
+#define WIFI_RETRY_MAX_MS            120000
+
+struct BootPhase {
+  const char* name;
+  unsigned long startMs;
+  unsigned long endMs;
+  const char* result;   // nullptr while the phase is still running
+};
+
+BootPhase bootPhases[MAX_BOOT_PHASES];
+int bootPhaseCount = 0;
+int bootWifiPhase = -1;
+int bootNtpPhase = -1;
+int bootControllablePhase = -1;
+
+// Fallback access point, used when the configured WiFi cannot be joined
+String fallbackApSSID = "RelayController";
+String fallbackApPassword = "relaycontrol";
+bool fallbackApActive = false;
+
+unsigned long wifiAttemptStart = 0;   // 0 when no connection attempt is in progress
+bool wifiAttemptFast = false;
+bool wifiLinkUp = false;
+unsigned long wifiDownSince = 0;
+unsigned long wifiRetryDelay = WIFI_RETRY_MIN_MS;
+unsigned long wifiNextRetry = 0;
+unsigned long wifiAssocMs = 0;
+const char* wifiConnectMethod = "none";
+
+String networkMode = "connecting";   // connecting, station, fallback-ap, lora-only, offline
 String logText = "";
 
 
@@ -89,28 +619,420 @@ unsigned long measureElapsedMs() {
 }
 
 
+// Debug output. debugPrint() only copies the line into a ring in RAM, the
+// debug task writes it out to Serial, the debug file if "debugFile" is on,
+// and the tail kept for /api/debug/tail. So a verbose handler costs a few
+// microseconds a line, not the ~87 us a character Serial takes at 115200.
+// The ring is a bounded MPMC queue (Vyukov): any task can write to it
+// without a lock, and when it is full lines are dropped and counted, nobody
+// waits.
+#define DEBUG_SLOTS      64                // power of two
+#define DEBUG_LINE_MAX   160               // longer lines take several slots
+#define DEBUG_TAIL_SIZE  4096
+#define DEBUG_FILE_PATH  "/debug.log"
+#define DEBUG_FILE_OLD   "/debug.1.log"
+#define DEBUG_FILE_MAX   65536             // then it becomes DEBUG_FILE_OLD and a new one starts
+
+struct DebugSlot {
+  std::atomic<uint32_t> seq;
+  uint32_t ms;
+  uint16_t len;
+  char text[DEBUG_LINE_MAX];
+};
+
+struct DebugRing {
+  DebugSlot slots[DEBUG_SLOTS];
+  std::atomic<uint32_t> writePos;
+  std::atomic<uint32_t> readPos;
+
+  DebugRing() : writePos(0), readPos(0) {
+    for (uint32_t i = 0; i < DEBUG_SLOTS; i++) slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  bool push(uint32_t ms, const char* text, size_t len) {
+    uint32_t pos = writePos.load(std::memory_order_relaxed);
+    DebugSlot* slot;
+    for (;;) {
+      slot = &slots[pos & (DEBUG_SLOTS - 1)];
+      int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0 && writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      if (diff < 0) return false;   // full
+      if (diff > 0) pos = writePos.load(std::memory_order_relaxed);
+    }
+    slot->ms = ms;
+    slot->len = len;
+    memcpy(slot->text, text, len);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(uint32_t& ms, char* text, size_t& len) {
+    uint32_t pos = readPos.load(std::memory_order_relaxed);
+    DebugSlot* slot;
+    for (;;) {
+      slot = &slots[pos & (DEBUG_SLOTS - 1)];
+      int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - (pos + 1));
+      if (diff == 0 && readPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      if (diff < 0) return false;   // empty
+      if (diff > 0) pos = readPos.load(std::memory_order_relaxed);
+    }
+    ms = slot->ms;
+    len = slot->len;
+    memcpy(text, slot->text, len);
+    slot->seq.store(pos + DEBUG_SLOTS, std::memory_order_release);
+    return true;
+  }
+};
+
+DebugRing debugRing;
+std::atomic<uint32_t> debugLines(0);
+std::atomic<uint32_t> debugDropped(0);
+TaskHandle_t debugTaskHandle = nullptr;
+SemaphoreHandle_t serialLock = nullptr;   // one whole line to Serial at a time, shared with the serial trace
+bool debugToFile = false;                 // "debugFile" in config.json
+
+// Newest output, written only by the debug task
+char debugTail[DEBUG_TAIL_SIZE];
+uint32_t debugTailPos = 0;                // bytes ever written, the tail wraps
+SemaphoreHandle_t debugTailLock = nullptr;
+
+
+void debugQueue(const char* text, size_t len) {
+  uint32_t ms = millis();
+  while (len && text[len - 1] == '\n') len--;   // the line end is added on the way out
+  do {
+    size_t n = min(len, (size_t)DEBUG_LINE_MAX);
+    if (debugRing.push(ms, text, n)) debugLines++;
+    else debugDropped++;
+    text += n;
+    len -= n;
+  } while (len);
+  if (debugTaskHandle) xTaskNotifyGive(debugTaskHandle);
+}
+
+
 void debugPrint(const String& msg) {
-  Serial.print("[");
-  Serial.print(millis());
-  Serial.print(" ms] ");
-  Serial.println(msg);
+  debugQueue(msg.c_str(), msg.length());
 }
 
 
 void debugPrintf(const char* format, ...) {
-  Serial.print("[");
-  Serial.print(millis());
-  Serial.print(" ms] ");
-
   char buf[256];
   va_list args;
   va_start(args, format);
-  vsnprintf(buf, sizeof(buf), format, args);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
   va_end(args);
-  Serial.println(buf);
+  debugQueue(buf, min(max(len, 0), (int)sizeof(buf) - 1));
+}
+
+
+void debugTailWrite(const char* text, size_t len) {
+  xSemaphoreTake(debugTailLock, portMAX_DELAY);
+  for (size_t i = 0; i < len; i++) {
+    debugTail[debugTailPos++ % DEBUG_TAIL_SIZE] = text[i];
+  }
+  xSemaphoreGive(debugTailLock);
+}
+
+
+// Takes everything waiting in the ring out to Serial, the tail and the file.
+// The file is flushed at most once a second, and moved aside when it is full.
+void debugTask(void*) {
+  File file;
+  uint32_t flushedMs = 0, reportedDrops = 0;
+  bool unflushed = false;
+  char line[DEBUG_LINE_MAX + 32];
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+
+    if (debugToFile && !file && LittleFS.totalBytes()) file = LittleFS.open(DEBUG_FILE_PATH, "a");
+    if (!debugToFile && file) file.close();
+
+    uint32_t ms;
+    size_t len;
+    for (;;) {
+      uint32_t dropped = debugDropped.load();
+      if (dropped != reportedDrops) {
+        len = snprintf(line, sizeof(line), "[%lu ms] [DEBUG] %lu lines dropped, the ring was full\n",
+                       (unsigned long)millis(), (unsigned long)(dropped - reportedDrops));
+        reportedDrops = dropped;
+      } else {
+        char text[DEBUG_LINE_MAX];
+        if (!debugRing.pop(ms, text, len)) break;
+        int head = snprintf(line, sizeof(line), "[%lu ms] ", (unsigned long)ms);
+        memcpy(line + head, text, len);
+        len += head;
+        line[len++] = '\n';
+      }
+      // Only the line itself is held against traceEvent(), which waits on this from loop()
+      xSemaphoreTake(serialLock, portMAX_DELAY);
+      Serial.write((const uint8_t*)line, len);
+      xSemaphoreGive(serialLock);
+      debugTailWrite(line, len);
+      if (file) {
+        if (file.size() + len > DEBUG_FILE_MAX) {
+          file.close();
+          LittleFS.remove(DEBUG_FILE_OLD);
+          LittleFS.rename(DEBUG_FILE_PATH, DEBUG_FILE_OLD);
+          file = LittleFS.open(DEBUG_FILE_PATH, "a");
+        }
+        if (file) file.write((const uint8_t*)line, len);
+        unflushed = true;
+      }
+    }
+
+    if (file && unflushed && millis() - flushedMs >= 1000) {
+      file.flush();
+      flushedMs = millis();
+      unflushed = false;
+    }
+  }
+}
+
+
+// Lines queued before this wait in the ring and come out once the task runs
+void debugBegin() {
+  serialLock = xSemaphoreCreateMutex();
+  debugTailLock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(debugTask, "debug", 4096, nullptr, 1, &debugTaskHandle, 0);
+}
+
+
+// Gives the debug task up to `ms` to empty the ring, before a reboot or sleep
+void debugDrain(uint32_t ms) {
+  uint32_t start = millis();
+  while (debugTaskHandle && debugRing.readPos.load() != debugRing.writePos.load() && millis() - start < ms) {
+    xTaskNotifyGive(debugTaskHandle);
+    delay(5);
+  }
+}
+
+
+// The newest `lines` lines of debug output, oldest first
+String debugTailText(int lines) {
+  String out;
+  xSemaphoreTake(debugTailLock, portMAX_DELAY);
+  uint32_t oldest = debugTailPos > DEBUG_TAIL_SIZE ? debugTailPos - DEBUG_TAIL_SIZE : 0;
+  uint32_t from = debugTailPos ? debugTailPos - 1 : 0;   // past the newline ending the last line
+
+  // Back to the start of the line `lines` from the end. A line starts
+  // after a newline; the oldest one may have been partly overwritten.
+  int found = 0;
+  while (from > oldest && !(debugTail[(from - 1) % DEBUG_TAIL_SIZE] == '\n' && ++found == lines)) from--;
+  if (from == oldest && oldest) {
+    while (from < debugTailPos && debugTail[from % DEBUG_TAIL_SIZE] != '\n') from++;
+    from++;
+  }
+
+  out.reserve(debugTailPos > from ? debugTailPos - from : 0);
+  for (uint32_t i = from; i < debugTailPos; i++) out += debugTail[i % DEBUG_TAIL_SIZE];
+  xSemaphoreGive(debugTailLock);
+  return out;
+}
+
+
+
+// Deadline scheduler for everything loop() does on a timer. Jobs sit in a
+// min-heap ordered by due time, so loop() only ever looks at the earliest one
+// and can sleep until it is due. Periodic jobs are re-armed from their due
+// time rather than from when they ran, so they do not drift.
+#define MAX_JOBS     24
+#define LOOP_POLL_MS 10   // longest loop() waits, the web server still has to be polled
+
+typedef void (*JobFn)();
+
+struct Job {
+  const char* name;
+  JobFn fn;
+  uint32_t periodMs;     // 0 for one-shot jobs
+  int64_t dueUs;
+  int8_t heapPos;        // -1 when not armed
+  uint32_t runs;
+  uint32_t skipped;      // periods missed because the loop was held up
+  uint64_t totalLateUs;
+  uint32_t maxLateUs;
+  uint32_t maxRunUs;
+};
+
+Job jobs[MAX_JOBS];
+int jobCount = 0;
+int8_t jobHeap[MAX_JOBS];
+int jobHeapLen = 0;
+TaskHandle_t loopTaskHandle = nullptr;
+
+int rebootJob = -1;
+int configSaveJob = -1;
+int applyConfigJob = -1;
+int displayJob = -1;
+int probeJob = -1;
+int statusWaitJob = -1;
+int auditEraseJob = -1;
+
+// Who is behind the relay changes being made right now, for the audit journal.
+// Set wherever work comes in: loop() before the web server, each LoRa frame,
+// each scheduler job.
+enum AuditSource : uint8_t {
+  AUDIT_SYSTEM,                // boot, config, anything not listed
+  AUDIT_WEB,                   // id is the client's IPv4 address
+  AUDIT_LORA,                  // id is the node, 0 for a plain text handheld
+  AUDIT_BUTTON,                // id is the button
+  AUDIT_SCHEDULE,              // nothing yet, the schedule only sleeps
+  AUDIT_PROBE,                 // id is the relay whose target stopped answering
+  AUDIT_LOADSHED,              // id is the shed rule
+  AUDIT_TIMER                  // end of a pulse or power cycle
+};
+
+const char* const auditSourceNames[] = { "system", "web", "lora", "button", "schedule", "probe", "loadshed", "timer" };
+
+struct AuditContext {
+  AuditSource source;
+  uint32_t id;
+  int64_t startUs;             // when the request or event arrived
+};
+
+AuditContext auditCtx = { AUDIT_SYSTEM, 0, 0 };
+
+void auditFrom(AuditSource source, uint32_t id, int64_t startUs = 0) {
+  auditCtx.source = source;
+  auditCtx.id = id;
+  auditCtx.startUs = startUs ? startUs : esp_timer_get_time();
+}
+
+// /api/status is versioned. Anything it reports bumps stateVersion, which is
+// its ETag, and clients can long-poll for the next version instead of
+// polling on a timer.
+#define STATUS_WAITERS    4
+#define STATUS_WAIT_MAX_S 30
+#define STATUS_BATT_STEP  50       // mV the battery has to move before it counts as a change
+
+struct StatusWaiter {
+  bool used;
+  WiFiClient client;
+  uint32_t since;
+  uint32_t deadlineMs;
+};
+
+uint32_t stateVersion = 1;                 // starts somewhere random at boot, so old versions never match
+uint16_t statusBatteryMv = 0;              // battery as last reported, moves in STATUS_BATT_STEP steps
+StatusWaiter statusWaiters[STATUS_WAITERS];
+int statusWaiterCount = 0;
+
+
+void jobHeapSwap(int a, int b) {
+  int8_t t = jobHeap[a];
+  jobHeap[a] = jobHeap[b];
+  jobHeap[b] = t;
+  jobs[jobHeap[a]].heapPos = a;
+  jobs[jobHeap[b]].heapPos = b;
+}
+
+
+void jobHeapFix(int pos) {
+  while (pos > 0 && jobs[jobHeap[pos]].dueUs < jobs[jobHeap[(pos - 1) / 2]].dueUs) {
+    jobHeapSwap(pos, (pos - 1) / 2);
+    pos = (pos - 1) / 2;
+  }
+  for (;;) {
+    int smallest = pos;
+    int left = pos * 2 + 1;
+    int right = left + 1;
+    if (left < jobHeapLen && jobs[jobHeap[left]].dueUs < jobs[jobHeap[smallest]].dueUs) smallest = left;
+    if (right < jobHeapLen && jobs[jobHeap[right]].dueUs < jobs[jobHeap[smallest]].dueUs) smallest = right;
+    if (smallest == pos) break;
+    jobHeapSwap(pos, smallest);
+    pos = smallest;
+  }
+}
+
+
+void disarmJob(int id) {
+  if (id < 0 || jobs[id].heapPos < 0) return;
+  int pos = jobs[id].heapPos;
+  jobHeapLen--;
+  if (pos != jobHeapLen) {
+    jobHeapSwap(pos, jobHeapLen);
+    jobHeapFix(pos);
+  }
+  jobs[id].heapPos = -1;
+}
+
+
+// Arms (or re-arms) a job to run delayMs from now
+void armJob(int id, uint32_t delayMs) {
+  if (id < 0) return;
+  disarmJob(id);
+  jobs[id].dueUs = esp_timer_get_time() + (int64_t)delayMs * 1000;
+  jobs[id].heapPos = jobHeapLen;
+  jobHeap[jobHeapLen++] = id;
+  jobHeapFix(jobs[id].heapPos);
+}
+
+
+// Registers a job. Periodic jobs start armed, one-shot jobs wait for armJob().
+int addJob(const char* name, JobFn fn, uint32_t periodMs) {
+  if (jobCount >= MAX_JOBS) return -1;
+  int id = jobCount++;
+  memset(&jobs[id], 0, sizeof(Job));
+  jobs[id].name = name;
+  jobs[id].fn = fn;
+  jobs[id].periodMs = periodMs;
+  jobs[id].heapPos = -1;
+  if (periodMs) armJob(id, periodMs);
+  return id;
+}
+
+
+// Wakes loop() early, e.g. when a LoRa packet has arrived
+void wakeLoop() {
+  if (loopTaskHandle) xTaskNotifyGive(loopTaskHandle);
+}
+
+
+// loop() only. Something /api/status reports has changed.
+void bumpStateVersion() {
+  stateVersion++;
+  if (statusWaiterCount) armJob(statusWaitJob, 0);   // answer the long-polls now
 }
 
 
+// Runs every job that is due and returns the microseconds until the next one
+int64_t runScheduler() {
+  for (;;) {
+    int64_t now = esp_timer_get_time();
+    if (jobHeapLen == 0) return (int64_t)LOOP_POLL_MS * 1000;
+
+    Job& job = jobs[jobHeap[0]];
+    if (job.dueUs > now) return job.dueUs - now;
+
+    int id = jobHeap[0];
+    uint32_t lateUs = now - job.dueUs;
+    disarmJob(id);
+    if (job.periodMs) {
+      // Next run is one period after this one was due, unless we are so late
+      // that would bunch runs up, in which case skip ahead
+      int64_t next = job.dueUs + (int64_t)job.periodMs * 1000;
+      if (next <= now) {
+        job.skipped += (now - job.dueUs) / ((int64_t)job.periodMs * 1000);
+        next = now + (int64_t)job.periodMs * 1000;
+      }
+      job.dueUs = next;
+      job.heapPos = jobHeapLen;
+      jobHeap[jobHeapLen++] = id;
+      jobHeapFix(job.heapPos);
+    }
+
+    auditFrom(AUDIT_SYSTEM, 0);
+    job.fn();
+
+    uint32_t runUs = esp_timer_get_time() - now;
+    job.runs++;
+    job.totalLateUs += lateUs;
+    if (lateUs > job.maxLateUs) job.maxLateUs = lateUs;
+    if (runUs > job.maxRunUs) job.maxRunUs = runUs;
+  }
+}
+
 
 String htmlEscape(const String& input) {
   String output = input;
@@ -125,7 +1047,7 @@ String htmlEscape(const String& input) {
 
 
 String loadHTMLPart(const char* path) {
-  File file = SPIFFS.open(path, "r");
+  File file = LittleFS.open(path, "r");
   if (!file || file.isDirectory()) {
     debugPrint("Failed to open HTML part file");
     return "";
@@ -151,35 +1073,60 @@ int timeToMinutesX(String timeStr) {
 }
 
 
-// Used in the logging routine
-String getTimestamp() {
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
-    return "- No Network Time -";
-  }
-  char buf[20];
-  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &timeinfo);
-  return String(buf);
+void clockSetTimezone(const String& tz) {
+  clockTimezone = tz;
+  setenv("TZ", tz.c_str(), 1);
+  tzset();
+  clockTextSec = -1;
 }
 
-// Used in the sleep routines
-String getCurrentTimeStr() {
-  time_t now = time(nullptr);
-  struct tm* timeinfo = localtime(&now);
 
-  char buf[6]; // "HH:mm" + null terminator
-  snprintf(buf, sizeof(buf), "%02d:%02d", timeinfo->tm_hour, timeinfo->tm_min);
-  return String(buf);
+int64_t clockEpochUs() {
+  return esp_timer_get_time() + clockOffsetUs;
+}
+
+
+// Epoch seconds, 0 while unsynced
+time_t clockEpoch() {
+  return clockSynced ? clockEpochUs() / 1000000 : 0;
 }
 
 
+// Local time without waiting, false while unsynced
+bool clockLocal(struct tm* out) {
+  if (!clockSynced) return false;
+  time_t now = clockEpoch();
+  localtime_r(&now, out);
+  return true;
+}
+
+
+// Used in the logging routine. Only reformats when the second changes.
+String getTimestamp() {
+  char buf[40];
+  if (!clockSynced) {
+    int64_t up = esp_timer_get_time() / 1000;
+    snprintf(buf, sizeof(buf), "unsynced +%lu.%03lu", (unsigned long)(up / 1000), (unsigned long)(up % 1000));
+    return String(buf);
+  }
 
+  int64_t us = clockEpochUs();
+  time_t sec = us / 1000000;
+  if (sec != clockTextSec) {
+    struct tm timeinfo;
+    localtime_r(&sec, &timeinfo);
+    strftime(clockText, sizeof(clockText), "%Y-%m-%d %H:%M:%S", &timeinfo);
+    clockTextSec = sec;
+  }
+  snprintf(buf, sizeof(buf), "%s.%03lu", clockText, (unsigned long)((us / 1000) % 1000));
+  return String(buf);
+}
 
 bool shouldBeOnBySchedule() {
   if (!globalSchedule.enabled) return true;  // Always ON if schedule is disabled
 
   struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
+  if (!clockLocal(&timeinfo)) {
     debugPrint("[SCHEDULE] No local time available.");
     return true;  // Default to ON if no time info
   }
@@ -214,6 +1161,188 @@ bool shouldBeOnBySchedule() {
 }
 
 
+void logSegmentPath(uint32_t segment, char* path, size_t size) {
+  snprintf(path, size, LOG_DIR "/%08lu.log", (unsigned long)segment);
+}
+
+
+// Closes the segment being written and starts the next, dropping the oldest
+// if that takes us over LOG_SEGMENTS
+void logRotate() {
+  char path[32];
+  if (logFile) logFile.close();
+  logSegment++;
+  while (segmentsOver(logFirstSegment, logSegment)) {
+    logSegmentPath(logFirstSegment++, path, sizeof(path));
+    LittleFS.remove(path);
+  }
+  logSegmentPath(logSegment, path, sizeof(path));
+  logFile = LittleFS.open(path, FILE_WRITE);
+  logSegmentBytes = 0;
+  logDirty = false;
+}
+
+
+// Finds the segments already on flash and carries on appending to the newest
+void logStart() {
+  LittleFS.mkdir(LOG_DIR);
+  uint32_t lowest = 0, highest = 0;
+  File dir = LittleFS.open(LOG_DIR);
+  if (dir && dir.isDirectory()) {
+    File f;
+    while ((f = dir.openNextFile())) {
+      uint32_t n = strtoul(f.name(), nullptr, 10);
+      if (n && (!lowest || n < lowest)) lowest = n;
+      if (n > highest) highest = n;
+      f.close();
+    }
+  }
+
+  if (!highest) {
+    logFirstSegment = 1;
+    logSegment = 0;
+    logRotate();
+    return;
+  }
+  char path[32];
+  logFirstSegment = lowest;
+  logSegment = highest;
+  logSegmentPath(logSegment, path, sizeof(path));
+  logFile = LittleFS.open(path, FILE_APPEND);
+  logSegmentBytes = logFile ? logFile.size() : 0;
+  if (logSegmentBytes >= LOG_SEGMENT_SIZE) logRotate();
+}
+
+
+// Gets buffered log lines onto flash. Runs as a job, and before anything
+// that could lose them (reboot, deep sleep, reading the log back).
+void logSync() {
+  if (logDirty && logFile) {
+    logFile.flush();
+    logDirty = false;
+  }
+  if (traceFile) traceFile.flush();
+}
+
+
+// One-time move off SPIFFS. LittleFS uses the same partition, so every file
+// is first streamed into the audit partition (still empty at this point)
+// through a small buffer, then the partition is formatted and they are
+// streamed back. If any file cannot be staged nothing is formatted and SPIFFS
+// stays mounted, the unit runs on defaults until the files are dealt with.
+// The old log.txt keeps its newest LOG_SEGMENT_SIZE bytes and becomes the
+// first log segment.
+struct MigrateEntry {
+  uint32_t magic;
+  uint32_t len;
+  char path[32];
+};
+
+#define MIGRATE_MAGIC  0x4D494752      // "MIGR"
+#define MIGRATE_SECTOR 4096
+
+// Erases ahead of the write, a sector at a time
+bool migrateWrite(const esp_partition_t* part, size_t& at, size_t& erasedTo, const void* data, size_t len) {
+  if (at + len > part->size) return false;
+  while (erasedTo < at + len) {
+    if (esp_partition_erase_range(part, erasedTo, MIGRATE_SECTOR) != ESP_OK) return false;
+    erasedTo += MIGRATE_SECTOR;
+  }
+  if (esp_partition_write(part, at, data, len) != ESP_OK) return false;
+  at += (len + 3) & ~3;
+  return true;
+}
+
+
+bool migrateFromSpiffs() {
+  if (!SPIFFS.begin(false)) {
+    bool mounted = LittleFS.begin(true);   // nothing to keep, start afresh
+    if (mounted) LittleFS.mkdir(LOG_DIR);
+    return mounted;
+  }
+
+  const esp_partition_t* stage =
+    esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x40, "audit");
+  if (!stage) {
+    debugPrint("[FS] SPIFFS kept, no audit partition to stage the move to LittleFS through");
+    return false;
+  }
+
+  uint8_t buf[512];
+  size_t at = 0, erasedTo = 0;
+  int count = 0;
+  const char* failed = nullptr;
+  char current[32] = "";
+  File root = SPIFFS.open("/");
+  File f;
+  while (!failed && (f = root.openNextFile())) {
+    MigrateEntry entry = { MIGRATE_MAGIC, 0, "" };
+    const char* name = f.name();
+    snprintf(entry.path, sizeof(entry.path), "%s%s", name[0] == '/' ? "" : "/", name);
+    strlcpy(current, entry.path, sizeof(current));
+    size_t size = f.size();
+    if (strcmp(entry.path, "/log.txt") == 0) {
+      if (size > LOG_SEGMENT_SIZE) f.seek(size - LOG_SEGMENT_SIZE);
+      size = min(size, (size_t)LOG_SEGMENT_SIZE);
+      snprintf(entry.path, sizeof(entry.path), LOG_DIR "/%08lu.log", 1UL);
+    }
+    entry.len = size;
+
+    if (!migrateWrite(stage, at, erasedTo, &entry, sizeof(entry))) failed = "no room to stage";
+    for (size_t done = 0; !failed && done < size; ) {
+      size_t n = f.read(buf, min(sizeof(buf), size - done));
+      if (n == 0) failed = "read failed";
+      else if (!migrateWrite(stage, at, erasedTo, buf, n)) failed = "no room to stage";
+      done += n;
+    }
+    f.close();
+    count++;
+  }
+  root.close();
+
+  if (failed) {
+    esp_partition_erase_range(stage, 0, erasedTo);
+    debugPrint(String("[FS] SPIFFS kept, could not carry over ") + current + ": " + failed);
+    return false;
+  }
+  SPIFFS.end();
+  debugPrintf("[FS] Moving %d files (%u bytes staged) from SPIFFS to LittleFS\n", count, (unsigned)at);
+
+  bool mounted = LittleFS.begin(true);   // formats the partition
+  if (mounted) LittleFS.mkdir(LOG_DIR);
+  size_t from = 0;
+  for (int i = 0; i < count && mounted; i++) {
+    MigrateEntry entry;
+    esp_partition_read(stage, from, &entry, sizeof(entry));
+    from += sizeof(entry);
+    if (entry.magic != MIGRATE_MAGIC) break;
+    File out = LittleFS.open(entry.path, FILE_WRITE);
+    size_t written = 0;
+    for (size_t done = 0; out && done < entry.len; ) {
+      size_t n = min(sizeof(buf), entry.len - done);
+      esp_partition_read(stage, from + done, buf, n);
+      written += out.write(buf, n);
+      done += n;
+    }
+    if (!out || written != entry.len) {
+      debugPrintf("[FS] Could not write %s\n", entry.path);
+    }
+    out.close();
+    from += (entry.len + 3) & ~3;
+  }
+
+  // The journal starts out empty
+  esp_partition_erase_range(stage, 0, erasedTo);
+  return mounted;
+}
+
+
+bool mountStorage() {
+  if (LittleFS.begin(false)) return true;
+  return migrateFromSpiffs();
+}
+
+
 void appendLog(const String& message) {
   String timestamp = getTimestamp();
   String logEntry = timestamp + " " + message + "\n";
@@ -221,10 +1350,10 @@ void appendLog(const String& message) {
   logText += logEntry + "<br>";
   if (logText.length() > 5000) logText = logText.substring(logText.length() - 5000);
 
-  File file = SPIFFS.open("/log.txt", FILE_APPEND);
-  if (file) {
-    file.print(logEntry);
-    file.close();
+  if (logFile) {
+    if (segmentFull(logSegmentBytes, logEntry.length())) logRotate();
+    logSegmentBytes += logFile.print(logEntry);
+    logDirty = true;
   }
 
   // Send to syslog if valid
@@ -261,13 +1390,12 @@ void logHardwareInfo() {
   info += "Flash Size: " + String(ESP.getFlashChipSize() / (1024 * 1024)) + "MB, ";
   info += "Flash Speed: " + String(ESP.getFlashChipSpeed() / 1000000) + "MHz, ";
 
-  if (SPIFFS.begin(true)) {  // SPIFFS already mounted at this point
-    size_t totalBytes = SPIFFS.totalBytes();
-    size_t usedBytes = SPIFFS.usedBytes();
-    size_t freeBytes = totalBytes - usedBytes;
-    info += "SPIFFS: " + String(freeBytes / 1024) + "KB free of " + String(totalBytes / 1024) + "KB";
+  size_t totalBytes = LittleFS.totalBytes();
+  if (totalBytes) {  // mounted in setup()
+    size_t freeBytes = totalBytes - LittleFS.usedBytes();
+    info += "LittleFS: " + String(freeBytes / 1024) + "KB free of " + String(totalBytes / 1024) + "KB";
   } else {
-    info += "SPIFFS mount failed";
+    info += "LittleFS not mounted";
   }
 
   appendLog(info);
@@ -275,562 +1403,4219 @@ void logHardwareInfo() {
 }
 
 
-void loadConfig() {
-  measureElapsedMs();
-  debugPrint("Loading configuration from SPIFFS");
-  File file = SPIFFS.open("/config.json", "r");
-  if (!file) {
-    debugPrint("No config found");
-    for (int i = 0; i < 6; i++) {
-      relayLabels[i] = "Relay " + String(i + 1);
-      relayIPs[i] = "";
-      relayPingEnabled[i] = false;
-      relayResetEnabled[i] = false;
+void traceHex(const uint8_t* data, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  char line[65];
+  while (len) {
+    size_t n = min(len, sizeof(line) / 2);
+    for (size_t i = 0; i < n; i++) {
+      line[i * 2] = digits[data[i] >> 4];
+      line[i * 2 + 1] = digits[data[i] & 15];
     }
-    wifiSSID = "";
-    wifiPassword = "";
-    return;
+    Serial.write((const uint8_t*)line, n * 2);
+    data += n;
+    len -= n;
   }
+}
 
-  JsonDocument doc;
 
-  // Dump the entire config to see that what is there is what we expect
-  file.seek(0);  // Rewind to start in case anything was read
-  String rawConfig = file.readString();
-  debugPrint("[DEBUG] Raw config.json contents:");
-  debugPrint(rawConfig);
-  file.seek(0);  // Rewind again for actual parsing
+void traceStop(const char* why) {
+  if (traceSink == TRACE_OFF) return;
+  if (traceFile) traceFile.close();
+  traceSink = TRACE_OFF;
+  traceHttpPending = false;
+  appendLog("Trace stopped (" + String(why) + "), " + String(traceEvents) + " events, " + String(traceBytes) + " bytes");
+}
 
 
+// atUs is when the event happened, if not now
+void traceEvent(TraceType type, const uint8_t* payload, size_t len, int64_t atUs = 0) {
+  if (traceSink == TRACE_OFF) return;
+  if (!atUs) atUs = esp_timer_get_time();
+  uint8_t head[TRACE_HEAD_MAX];
+  size_t n = traceHead(head, (uint32_t)min(max(atUs - traceLastUs, (int64_t)0), (int64_t)UINT32_MAX), type, len);
+  traceLastUs = max(traceLastUs, atUs);
 
-  DeserializationError err = deserializeJson(doc, file);
-  file.close();
-  if (err) {
-    debugPrint("Failed to parse config");
-    return;
+  if (traceSink == TRACE_FLASH) {
+    if (traceBytes + n + len > TRACE_MAX_BYTES) {
+      traceStop("full");
+      return;
+    }
+    traceFile.write(head, n);
+    traceFile.write(payload, len);
+  } else {
+    xSemaphoreTake(serialLock, portMAX_DELAY);   // not split by debug output
+    Serial.print("TRACE ");
+    traceHex(head, n);
+    traceHex(payload, len);
+    Serial.println();
+    xSemaphoreGive(serialLock);
   }
+  traceEvents++;
+  traceBytes += n + len;
+}
 
-  
- // Syslog IP
- String syslogStr = doc["syslog"] | "";
- syslogStr.trim();
- debugPrint("[CONFIG] Raw syslog IP string: '" + syslogStr + "'");
- if (!syslogStr.isEmpty() && syslogIP.fromString(syslogStr)) {
-   debugPrint("[CONFIG] Syslog IP loaded: " + syslogIP.toString());
- } else {
-   debugPrint("[CONFIG] Invalid syslog IP or not set.");
- }
-
- // Relay config
-  for (int i = 0; i < 6; i++) {
-    relayLabels[i] = doc["relayLabels"][i].as<String>();
-    relayIPs[i] = doc["relayIPs"][i].as<String>();
-    relayStates[i] = doc["relayStates"][i] | true;
-    relayPingEnabled[i] = doc["pingEnabled"][i] | false;
-    relayResetEnabled[i] = doc["resetEnabled"][i] | false;
+
+// First in the web server's handler chain. Declines every request, but notes
+// that one came in; its arguments and body are only parsed after this, so
+// loop() writes the event once the request has been handled.
+class TraceTap : public RequestHandler {
+ public:
+  bool canHandle(HTTPMethod method, String uri) override {
+    if (traceSink != TRACE_OFF && !uri.startsWith("/api/trace")) {
+      traceHttpPending = true;
+      traceHttpUs = esp_timer_get_time();
+    }
+    return false;
   }
+};
 
-  // Declare sched here before you use it:
-  JsonObject sched = doc["globalSchedule"];
+TraceTap traceTap;
 
-  globalSchedule.enabled = sched["enabled"] | false;
-  globalSchedule.powerOnTime = sched["powerOnTime"] | "06:00";
-  globalSchedule.powerOffTime = sched["powerOffTime"] | "23:00";
-  globalSchedule.pollIntervalMinutes = sched["pollIntervalMinutes"] | 10;
-    
-  
-  debugPrintf("[CONFIG] Global Schedule: enabled=%s, on=%s, off=%s, poll=%dmin\n",
-                globalSchedule.enabled ? "true" : "false",
-                globalSchedule.powerOnTime.c_str(),
-                globalSchedule.powerOffTime.c_str(),
-                globalSchedule.pollIntervalMinutes);
 
-  wifiSSID = doc["wifi"]["ssid"].as<String>();
-  wifiPassword = doc["wifi"]["password"].as<String>();
-  debugPrint("loadConfig elapsed: " + String(measureElapsedMs()) + " ms");
+size_t traceAppend(size_t at, const char* text, size_t len) {
+  len = min(len, sizeof(traceBuf) - at);
+  memcpy(traceBuf + at, text, len);
+  return at + len;
 }
 
-void saveConfig() {
-
-  measureElapsedMs();
-  debugPrint("Preparing configuration for save...");
 
-  JsonDocument doc;
-  auto labels = doc["relayLabels"].to<JsonArray>();
-  auto ips = doc["relayIPs"].to<JsonArray>();
-  auto states = doc["relayStates"].to<JsonArray>();
-  auto pingEnabled = doc["pingEnabled"].to<JsonArray>();
-  auto resetEnabled = doc["resetEnabled"].to<JsonArray>();
-  
-  for (int i = 0; i < 6; i++) {
-    labels.add(relayLabels[i]);
-    ips.add(relayIPs[i]);
-    states.add(relayStates[i]);
-    pingEnabled.add(relayPingEnabled[i]);
-    resetEnabled.add(relayResetEnabled[i]);
+// URL encoded, as it would have come in
+size_t traceAppendEncoded(size_t at, const String& text) {
+  for (size_t i = 0; i < text.length(); i++) {
+    char c = text[i];
+    if (isalnum((uint8_t)c) || strchr("-_.~:", c)) {
+      at = traceAppend(at, &c, 1);
+    } else {
+      char hex[4];
+      at = traceAppend(at, hex, snprintf(hex, sizeof(hex), "%%%02X", (uint8_t)c));
+    }
   }
-
-  // Global schedule object
-  auto schedule = doc["globalSchedule"].to<JsonObject>();
-  schedule["enabled"] = globalSchedule.enabled;
-  schedule["powerOnTime"] = globalSchedule.powerOnTime;
-  schedule["powerOffTime"] = globalSchedule.powerOffTime;
-  schedule["pollIntervalMinutes"] = globalSchedule.pollIntervalMinutes;
+  return at;
+}
 
 
-  auto wifi = doc["wifi"].to<JsonObject>();
-  wifi["ssid"] = wifiSSID;
-  wifi["password"] = wifiPassword;
-
-   // Save syslog IP
-  doc["syslog"] = syslogIP.toString();
-  /*
-  debugPrintf("[CONFIG] Saved schedule: enabled=%d, on=%s, off=%s, pollInterval=%d\n",
-              globalSchedule.enabled,
-              globalSchedule.powerOnTime.c_str(),
-              globalSchedule.powerOffTime.c_str(),
-              globalSchedule.pollIntervalMinutes);  // no .c_str()
-  */
+const char* httpMethodName(HTTPMethod method) {
+  switch (method) {
+    case HTTP_POST: return "POST";
+    case HTTP_PUT: return "PUT";
+    case HTTP_PATCH: return "PATCH";
+    case HTTP_DELETE: return "DELETE";
+    case HTTP_HEAD: return "HEAD";
+    case HTTP_OPTIONS: return "OPTIONS";
+    default: return "GET";
+  }
+}
 
-  
-  debugPrint("Opening config file for writing...");
 
-  File file = SPIFFS.open("/config.json", "w");
-  if (!file) {
-    debugPrint("[ERROR] Failed to open /config.json for writing");
-    return;
+// The request the web server just handled. The query is put back together
+// from the parsed arguments.
+void traceHttp() {
+  traceHttpPending = false;
+  const char* method = httpMethodName(server.method());
+  size_t n = traceAppend(0, method, strlen(method) + 1);
+  String uri = server.uri();
+  n = traceAppend(n, uri.c_str(), uri.length() + 1);
+
+  bool first = true;
+  for (int i = 0; i < server.args(); i++) {
+    if (server.argName(i) == "plain") continue;
+    if (!first) n = traceAppend(n, "&", 1);
+    first = false;
+    n = traceAppendEncoded(n, server.argName(i));
+    n = traceAppend(n, "=", 1);
+    n = traceAppendEncoded(n, server.arg(i));
+  }
+  n = traceAppend(n, "", 1);
+  String body = server.arg("plain");
+  n = traceAppend(n, body.c_str(), body.length());
+  traceEvent(TRACE_HTTP, traceBuf, n, traceHttpUs);
+}
+
+
+bool isRelayPin(int gpio) {
+  for (int i = 0; i < 6; i++) {
+    if (relayPins[i] == gpio) return true;
+  }
+  return false;
+}
+
+
+void IRAM_ATTR buttonIsr(void* arg) {
+  Button* b = (Button*)arg;
+  debounceEdge(b->deb, millis());
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(buttonTaskHandle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+
+// Points the button pins at buttonIsr, each debouncer starting from the input
+// as it is now, so a button held through boot is not a press. Called with
+// buttonLock held.
+void armButtons() {
+  for (int i = 0; i < buttonCount; i++) {
+    Button& b = buttons[i];
+    detachInterrupt(b.pin);
+    pinMode(b.pin, b.activeLow ? INPUT_PULLUP : INPUT_PULLDOWN);
+    debounceReset(b.deb, digitalRead(b.pin) == (b.activeLow ? LOW : HIGH));
+    attachInterruptArg(b.pin, buttonIsr, &b, CHANGE);
+  }
+}
+
+
+// Takes on a new button config. buttonTask may be part way through buttons[]
+// on the other core, so it is kept out until the new pins are armed. Before
+// setupButtons() has started it, the config is only copied in.
+void setButtons(const Button* parsed, int count) {
+  if (buttonLock) xSemaphoreTake(buttonLock, portMAX_DELAY);
+  for (int i = 0; i < buttonCount; i++) {
+    detachInterrupt(buttons[i].pin);   // before the slot it points at is reused
+  }
+  memcpy(buttons, parsed, count * sizeof(Button));
+  buttonCount = count;
+  if (buttonLock) {
+    armButtons();
+    xSemaphoreGive(buttonLock);
+  }
+}
+
+
+bool isButtonPin(int gpio) {
+  for (int i = 0; i < buttonCount; i++) {
+    if (buttons[i].pin == gpio) return true;
+  }
+  return false;
+}
+
+
+// Pins the board or the config already drive, so nothing else may have them
+bool isPinInUse(int gpio) {
+  static const int boardPins[] = {
+    ledPin, RADIO_SCLK_PIN, RADIO_MISO_PIN, RADIO_MOSI_PIN, RADIO_CS_PIN, RADIO_RST_PIN, RADIO_DIO1_PIN,
+    RADIO_BUSY_PIN, OLED_SDA, OLED_SCL, OLED_RST, BATTERY_PIN, ADC_CTRL,
+#ifdef VEXT_CTRL
+    VEXT_CTRL,
+#endif
+  };
+  for (int pin : boardPins) {
+    if (pin == gpio) return true;
+  }
+  return isRelayPin(gpio) || isButtonPin(gpio);
+}
+
+
+// Targets are probed one at a time, the job runs six times per interval so
+// every target is probed at least once per interval
+uint32_t probePeriodMs() {
+  return probePolicy.intervalSeconds * 1000UL / 6;
+}
+
+
+void jsonToFile(void* ctx, const char* data, size_t len) {
+  ((File*)ctx)->write((const uint8_t*)data, len);
+}
+
+
+void jsonToClient(void* ctx, const char* data, size_t len) {
+  ((WiFiClient*)ctx)->write((const uint8_t*)data, len);
+}
+
+
+void jsonToServer(void* ctx, const char* data, size_t len) {
+  server.sendContent(data, len);
+}
+
+
+void buttonsToJson(JsonOut& out) {
+  char name[12];
+  out.beginArray();
+  for (int i = 0; i < buttonCount; i++) {
+    out.beginObject();
+    out.key(JK("pin")); out.value(buttons[i].pin);
+    out.key(JK("activeLow")); out.value(buttons[i].activeLow);
+    out.key(JK("short")); out.value(buttonActionName(buttons[i].shortAction, buttons[i].shortRelay, name, sizeof(name)));
+    out.key(JK("long")); out.value(buttonActionName(buttons[i].longAction, buttons[i].longRelay, name, sizeof(name)));
+    out.endObject();
+  }
+  out.endArray();
+}
+
+
+// Takes a value from a config section if it is there and of the right type.
+// Returns whether the running value changed.
+template <typename T> bool takeConfig(JsonVariantConst v, T& target) {
+  if (!v.is<T>()) return false;
+  T value = v.as<T>();
+  if (value == target) return false;
+  target = value;
+  return true;
+}
+
+
+// Per relay fields are a list of six, or in a patch {"<relay>": value}
+JsonVariantConst relayField(JsonVariantConst v, int relay) {
+  if (v.is<JsonArrayConst>()) return v[relay];
+  char key[2] = { (char)('0' + relay), 0 };
+  return v[key];
+}
+
+
+// Copies one section of the config into the running settings, from
+// config.json, an upload or a patch. Anything the section leaves out keeps
+// its running value, so a patch only carries what it changes. Returns the
+// CFG_* bits of whatever has to be restarted.
+uint8_t applyConfigSection(const char* section, JsonVariantConst v) {
+  uint8_t changed = 0;
+  if (v.isNull()) return 0;
+
+  if (strcmp(section, "syslog") == 0) {
+    // Empty, or not an address, turns syslog off
+    String text = v | "";
+    text.trim();
+    IPAddress ip;
+    if (!text.isEmpty() && !ip.fromString(text)) {
+      debugPrint("[CONFIG] Invalid syslog IP '" + text + "'");
+    }
+    if (ip != syslogIP) {
+      syslogIP = ip;
+      changed |= CFG_SYSLOG;
+    }
+
+  } else if (strcmp(section, "timezone") == 0) {
+    // POSIX TZ string, e.g. "GMT0BST,M3.5.0/1,M10.5.0". Takes effect straight away.
+    String tz = clockTimezone;
+    if (takeConfig(v, tz)) clockSetTimezone(tz);
+
+  } else if (strcmp(section, "relayLabels") == 0) {
+    for (int i = 0; i < 6; i++) {
+      if (takeConfig(relayField(v, i), relayLabels[i])) changed |= CFG_RELAYS;
+    }
+  } else if (strcmp(section, "relayIPs") == 0) {
+    for (int i = 0; i < 6; i++) {
+      if (takeConfig(relayField(v, i), relayIPs[i])) changed |= CFG_RELAYS;
+    }
+  } else if (strcmp(section, "pingEnabled") == 0) {
+    for (int i = 0; i < 6; i++) {
+      if (takeConfig(relayField(v, i), relayPingEnabled[i])) changed |= CFG_RELAYS;
+    }
+  } else if (strcmp(section, "resetEnabled") == 0) {
+    for (int i = 0; i < 6; i++) {
+      if (takeConfig(relayField(v, i), relayResetEnabled[i])) changed |= CFG_RELAYS;
+    }
+  } else if (strcmp(section, "cycleOffSeconds") == 0) {
+    for (int i = 0; i < 6; i++) {
+      if (takeConfig(relayField(v, i), relayCycleOffSeconds[i])) changed |= CFG_RELAYS;
+      relayCycleOffSeconds[i] = constrain(relayCycleOffSeconds[i], 1, 3600);
+    }
+
+  } else if (strcmp(section, "globalSchedule") == 0) {
+    if (takeConfig(v["enabled"], globalSchedule.enabled) |
+        takeConfig(v["powerOnTime"], globalSchedule.powerOnTime) |
+        takeConfig(v["powerOffTime"], globalSchedule.powerOffTime) |
+        takeConfig(v["pollIntervalMinutes"], globalSchedule.pollIntervalMinutes)) {
+      changed |= CFG_SCHEDULE;
+    }
+    debugPrintf("[CONFIG] Global Schedule: enabled=%s, on=%s, off=%s, poll=%dmin\n",
+                globalSchedule.enabled ? "true" : "false",
+                globalSchedule.powerOnTime.c_str(),
+                globalSchedule.powerOffTime.c_str(),
+                globalSchedule.pollIntervalMinutes);
+
+  } else if (strcmp(section, "wifi") == 0) {
+    if (takeConfig(v["ssid"], wifiSSID) | takeConfig(v["password"], wifiPassword) |
+        takeConfig(v["staticIP"], wifiStaticIP) | takeConfig(v["gateway"], wifiGateway) |
+        takeConfig(v["subnet"], wifiSubnet) | takeConfig(v["dns"], wifiDNS)) {
+      changed |= CFG_WIFI;
+    }
+
+  } else if (strcmp(section, "fallbackAp") == 0) {
+    if (takeConfig(v["ssid"], fallbackApSSID) | takeConfig(v["password"], fallbackApPassword)) {
+      changed |= CFG_WIFI;
+    }
+
+  } else if (strcmp(section, "lora") == 0) {
+    // The radio settings need the radio restarting, the rest are picked up as they are used
+    if (takeConfig(v["frequency"], loraFrequency) | takeConfig(v["bandwidth"], loraBandwidth) |
+        takeConfig(v["spreadingFactor"], loraSpreadingFactor) | takeConfig(v["codingRate"], loraCodingRate) |
+        takeConfig(v["outputPower"], loraOutputPower) | takeConfig(v["syncWord"], loraSyncWord)) {
+      changed |= CFG_LORA;
+    }
+    takeConfig(v["nodeId"], loraNodeId);
+    takeConfig(v["gateway"], loraGateway);
+    takeConfig(v["dutyCyclePercent"], loraDutyPercent);
+    takeConfig(v["mesh"], loraMesh);
+    takeConfig(v["maxHops"], loraMaxHops);
+    loraNodeId = constrain(loraNodeId, 1, 254);
+    loraDutyPercent = constrain(loraDutyPercent, 1, 100);
+    loraMaxHops = constrain(loraMaxHops, 1, 7);
+
+  } else if (strcmp(section, "battery") == 0) {
+    takeConfig(v["divider"], batteryDivider);
+    takeConfig(v["sampleSeconds"], batterySampleSeconds);
+    batterySampleSeconds = max(1, batterySampleSeconds);
+    if (v["shedRules"].is<JsonArrayConst>()) {
+      // A relay that is shed right now stays shed under its new rule, otherwise
+      // nothing would ever turn it back on
+      bool wasShed[6] = {};
+      for (int i = 0; i < shedRuleCount; i++) {
+        if (shedRules[i].shed) wasShed[shedRules[i].relay] = true;
+      }
+      shedRuleCount = 0;
+      for (JsonObjectConst rule : v["shedRules"].as<JsonArrayConst>()) {
+        if (shedRuleCount >= MAX_SHED_RULES) break;
+        int relay = rule["relay"] | -1;
+        if (relay < 0 || relay >= 6) continue;
+        ShedRule& r = shedRules[shedRuleCount++];
+        r.relay = relay;
+        r.offBelow = rule["offBelow"] | 0.0;
+        r.onAbove = max(r.offBelow, rule["onAbove"] | 0.0f);
+        r.shed = wasShed[relay];
+        wasShed[relay] = false;   // one rule per relay carries it
+      }
+    }
+
+  } else if (strcmp(section, "buttons") == 0) {
+    Button parsed[MAX_BUTTONS];
+    int parsedCount = 0;
+    for (JsonObjectConst b : v.as<JsonArrayConst>()) {
+      if (parsedCount >= MAX_BUTTONS) break;
+      int pin = b["pin"] | -1;
+      if (pin < 0 || isRelayPin(pin)) continue;
+      Button& button = parsed[parsedCount++];
+      memset(&button, 0, sizeof(Button));
+      button.pin = pin;
+      button.activeLow = b["activeLow"] | true;
+      parseButtonAction(b["short"] | "none", button.shortAction, button.shortRelay);
+      parseButtonAction(b["long"] | "none", button.longAction, button.longRelay);
+    }
+    bool buttonsChanged = parsedCount != buttonCount;
+    for (int i = 0; i < parsedCount && !buttonsChanged; i++) {
+      buttonsChanged = parsed[i].pin != buttons[i].pin || parsed[i].activeLow != buttons[i].activeLow ||
+                       parsed[i].shortAction != buttons[i].shortAction || parsed[i].shortRelay != buttons[i].shortRelay ||
+                       parsed[i].longAction != buttons[i].longAction || parsed[i].longRelay != buttons[i].longRelay;
+    }
+    if (buttonsChanged) {
+      setButtons(parsed, parsedCount);
+      changed |= CFG_BUTTONS;
+    }
+
+  } else if (strcmp(section, "probe") == 0) {
+    takeConfig(v["intervalSeconds"], probePolicy.intervalSeconds);
+    takeConfig(v["window"], probePolicy.window);
+    takeConfig(v["failThreshold"], probePolicy.failThreshold);
+    takeConfig(v["rttCeilingMs"], probePolicy.rttCeilingMs);
+    takeConfig(v["cooldownMinutes"], probePolicy.cooldownMinutes);
+    takeConfig(v["maxResetsPerHour"], probePolicy.maxResetsPerHour);
+    probePolicy.intervalSeconds = constrain(probePolicy.intervalSeconds, 10, 3600);
+    probePolicy.window = constrain(probePolicy.window, 1, PROBE_WINDOW_MAX);
+    probePolicy.failThreshold = constrain(probePolicy.failThreshold, 1, probePolicy.window);
+    probePolicy.maxResetsPerHour = constrain(probePolicy.maxResetsPerHour, 1, MAX_RESETS_PER_HOUR_CAP);
+    if (v["escalation"].is<JsonArrayConst>()) {
+      int escalationCount = 0;
+      for (int relay : v["escalation"].as<JsonArrayConst>()) {
+        if (escalationCount < 6 && relay >= 0 && relay < 6) probePolicy.escalation[escalationCount++] = relay;
+      }
+      for (int i = escalationCount; i < 6; i++) {
+        probePolicy.escalation[i] = -1;
+      }
+    }
+    if (probeJob >= 0) {
+      jobs[probeJob].periodMs = probePeriodMs();
+    }
+
+  } else if (strcmp(section, "statusLedPin") == 0) {
+    int pin = statusLedPin;
+    if (takeConfig(v, pin)) {
+      statusLedPin = pin >= 0 && isPinInUse(pin) ? -1 : pin;   // picked up at the next boot
+    }
+
+  } else if (strcmp(section, "debugFile") == 0) {
+    takeConfig(v, debugToFile);
+
+  } else if (strcmp(section, "webPort") == 0) {
+    if (takeConfig(v, webServerPort)) changed |= CFG_WEB;
+  }
+
+  return changed;
+}
+
+
+uint32_t rtcStateCrc() {
+  return esp_rom_crc32_le(0, (const uint8_t*)&rtcState, offsetof(RtcState, crc));
+}
+
+
+bool rtcStateValid() {
+  return rtcState.magic == RTC_STATE_MAGIC && rtcState.crc == rtcStateCrc();
+}
+
+
+void rtcStateSave() {
+  rtcState.magic = RTC_STATE_MAGIC;
+  rtcState.crc = rtcStateCrc();
+}
+
+
+// The state a relay settles in, i.e. what it returns to after any pulse in
+// progress. This is what gets saved, so a reboot mid-pulse does not latch it.
+bool persistedRelayState(int i) {
+  return relaySettled(relayCore, i);
+}
+
+
+// Stops the timer on a relay without touching the output. Returns false if it had none.
+bool cancelPulseTimer(int relay) {
+  return relayCancelTimer(relayCore, relay);
+}
+
+
+// Copies a whole config (config.json, an upload, the rollback copy) into the
+// running settings and returns the CFG_* sections whose values actually
+// changed, so callers can restart only the subsystems that are affected.
+uint8_t applyConfig(JsonDocument& doc) {
+  uint8_t changed = 0;
+  for (size_t i = 0; i < CONFIG_FIELDS; i++) {
+    if (!configSectionStart(i)) continue;
+    changed |= applyConfigSection(configFields[i].section, doc[configFields[i].section]);
+  }
+
+  // Relay states are not a config field, only a whole config carries them.
+  // They are settled states, so a pulse that ends in the same one carries on.
+  for (int i = 0; i < 6; i++) {
+    bool state = doc["relayStates"][i] | true;
+    if (state == persistedRelayState(i)) continue;
+    cancelPulseTimer(i);
+    relayStates[i] = state;
+    changed |= CFG_RELAYS;
+  }
+  if (changed & CFG_RELAYS) bumpStateVersion();
+
+  debugPrintf("[CONFIG] Changed sections: 0x%02X\n", changed);
+  return changed;
+}
+
+
+bool readConfigFile(const char* path, JsonDocument& doc) {
+  File file = LittleFS.open(path, "r");
+  if (!file) {
+    debugPrint(String("No config found at ") + path);
+    return false;
+  }
+
+  // Dump the entire config to see that what is there is what we expect
+  file.seek(0);  // Rewind to start in case anything was read
+  String rawConfig = file.readString();
+  debugPrint("[DEBUG] Raw " + String(path) + " contents:");
+  debugPrint(rawConfig);
+  file.seek(0);  // Rewind again for actual parsing
+
+  DeserializationError err = deserializeJson(doc, file);
+  file.close();
+  if (err) {
+    debugPrint(String("Failed to parse ") + path + ": " + err.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+void configOverlayPath(const char* section, char* path, size_t size) {
+  snprintf(path, size, CONFIG_OVERLAY_DIR "/%s.json", section);
+}
+
+
+// Reads any overlays over the config loaded from config.json
+void loadConfigOverlays(JsonDocument& doc) {
+  for (size_t i = 0; i < CONFIG_FIELDS; i++) {
+    if (!configSectionStart(i)) continue;
+    const char* section = configFields[i].section;
+    char path[48];
+    configOverlayPath(section, path, sizeof(path));
+    if (!LittleFS.exists(path)) continue;
+
+    JsonDocument overlay;
+    if (!readConfigFile(path, overlay)) continue;   // torn, config.json has the last full save
+    doc[section] = overlay;
+    configOverlays = true;
+    debugPrintf("[CONFIG] %s from %s\n", section, path);
+  }
+}
+
+
+void clearConfigOverlays() {
+  for (size_t i = 0; i < CONFIG_FIELDS; i++) {
+    if (!configSectionStart(i)) continue;
+    char path[48];
+    configOverlayPath(configFields[i].section, path, sizeof(path));
+    if (LittleFS.exists(path)) LittleFS.remove(path);
+  }
+  configOverlays = false;
+}
+
+
+void loadConfig() {
+  measureElapsedMs();
+  debugPrint("Loading configuration from LittleFS");
+
+  JsonDocument doc;
+
+  // A missing or unreadable config.json falls back to the copy kept from before
+  // the last upload, e.g. if power was lost half way through swapping them.
+  if (!readConfigFile(CONFIG_PATH, doc) && !readConfigFile(CONFIG_BAK_PATH, doc)) {
+    debugPrint("No usable config found");
+    for (int i = 0; i < 6; i++) {
+      relayLabels[i] = "Relay " + String(i + 1);
+      relayIPs[i] = "";
+      relayPingEnabled[i] = false;
+      relayResetEnabled[i] = false;
+    }
+    wifiSSID = "";
+    wifiPassword = "";
+    return;
+  }
+
+  loadConfigOverlays(doc);
+  applyConfig(doc);
+  debugPrint("loadConfig elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+// The value of one section as config.json holds it
+void writeConfigSection(JsonOut& out, const char* section) {
+  if (strcmp(section, "relayLabels") == 0) {
+    out.array(relayLabels);
+  } else if (strcmp(section, "relayIPs") == 0) {
+    out.array(relayIPs);
+  } else if (strcmp(section, "pingEnabled") == 0) {
+    out.array(relayPingEnabled);
+  } else if (strcmp(section, "resetEnabled") == 0) {
+    out.array(relayResetEnabled);
+  } else if (strcmp(section, "cycleOffSeconds") == 0) {
+    out.array(relayCycleOffSeconds);
+
+  } else if (strcmp(section, "globalSchedule") == 0) {
+    out.beginObject();
+    out.key(JK("enabled")); out.value(globalSchedule.enabled);
+    out.key(JK("powerOnTime")); out.value(globalSchedule.powerOnTime);
+    out.key(JK("powerOffTime")); out.value(globalSchedule.powerOffTime);
+    out.key(JK("pollIntervalMinutes")); out.value(globalSchedule.pollIntervalMinutes);
+    out.endObject();
+
+  } else if (strcmp(section, "wifi") == 0) {
+    out.beginObject();
+    out.key(JK("ssid")); out.value(wifiSSID);
+    out.key(JK("password")); out.value(wifiPassword);
+    out.key(JK("staticIP")); out.value(wifiStaticIP);
+    out.key(JK("gateway")); out.value(wifiGateway);
+    out.key(JK("subnet")); out.value(wifiSubnet);
+    out.key(JK("dns")); out.value(wifiDNS);
+    out.endObject();
+
+  } else if (strcmp(section, "fallbackAp") == 0) {
+    out.beginObject();
+    out.key(JK("ssid")); out.value(fallbackApSSID);
+    out.key(JK("password")); out.value(fallbackApPassword);
+    out.endObject();
+
+  } else if (strcmp(section, "lora") == 0) {
+    out.beginObject();
+    out.key(JK("frequency")); out.value(loraFrequency);
+    out.key(JK("bandwidth")); out.value(loraBandwidth);
+    out.key(JK("spreadingFactor")); out.value(loraSpreadingFactor);
+    out.key(JK("codingRate")); out.value(loraCodingRate);
+    out.key(JK("outputPower")); out.value(loraOutputPower);
+    out.key(JK("syncWord")); out.value(loraSyncWord);
+    out.key(JK("nodeId")); out.value(loraNodeId);
+    out.key(JK("gateway")); out.value(loraGateway);
+    out.key(JK("dutyCyclePercent")); out.value(loraDutyPercent);
+    out.key(JK("mesh")); out.value(loraMesh);
+    out.key(JK("maxHops")); out.value(loraMaxHops);
+    out.endObject();
+
+  } else if (strcmp(section, "battery") == 0) {
+    out.beginObject();
+    out.key(JK("divider")); out.value(batteryDivider);
+    out.key(JK("sampleSeconds")); out.value(batterySampleSeconds);
+    out.key(JK("shedRules"));
+    out.beginArray();
+    for (int i = 0; i < shedRuleCount; i++) {
+      out.beginObject();
+      out.key(JK("relay")); out.value(shedRules[i].relay);
+      out.key(JK("offBelow")); out.value(shedRules[i].offBelow);
+      out.key(JK("onAbove")); out.value(shedRules[i].onAbove);
+      out.endObject();
+    }
+    out.endArray();
+    out.endObject();
+
+  } else if (strcmp(section, "buttons") == 0) {
+    buttonsToJson(out);
+
+  } else if (strcmp(section, "probe") == 0) {
+    out.beginObject();
+    out.key(JK("intervalSeconds")); out.value(probePolicy.intervalSeconds);
+    out.key(JK("window")); out.value(probePolicy.window);
+    out.key(JK("failThreshold")); out.value(probePolicy.failThreshold);
+    out.key(JK("rttCeilingMs")); out.value(probePolicy.rttCeilingMs);
+    out.key(JK("cooldownMinutes")); out.value(probePolicy.cooldownMinutes);
+    out.key(JK("maxResetsPerHour")); out.value(probePolicy.maxResetsPerHour);
+    out.key(JK("escalation"));
+    out.beginArray();
+    for (int i = 0; i < 6 && probePolicy.escalation[i] >= 0; i++) {
+      out.value(probePolicy.escalation[i]);
+    }
+    out.endArray();
+    out.endObject();
+
+  } else if (strcmp(section, "statusLedPin") == 0) {
+    out.value(statusLedPin);
+  } else if (strcmp(section, "webPort") == 0) {
+    out.value(webServerPort);
+  } else if (strcmp(section, "debugFile") == 0) {
+    out.value(debugToFile);
+  } else if (strcmp(section, "syslog") == 0) {
+    char syslog[16];
+    snprintf(syslog, sizeof(syslog), "%u.%u.%u.%u", syslogIP[0], syslogIP[1], syslogIP[2], syslogIP[3]);
+    out.value(syslog);
+  } else if (strcmp(section, "timezone") == 0) {
+    out.value(clockTimezone);
+  }
+}
+
+
+// The whole config as config.json holds it
+void writeConfigJson(JsonOut& out) {
+  bool states[6];
+  for (int i = 0; i < 6; i++) {
+    states[i] = persistedRelayState(i);
+  }
+
+  out.beginObject();
+  out.key(JK("relayStates")); out.array(states);
+  for (size_t i = 0; i < CONFIG_FIELDS; i++) {
+    if (!configSectionStart(i)) continue;
+    out.key(configFields[i].section);
+    writeConfigSection(out, configFields[i].section);
+  }
+  out.endObject();
+}
+
+
+// Streams the config straight into the file, see JsonOut
+void saveConfig() {
+
+  measureElapsedMs();
+  debugPrint("Opening config file for writing...");
+
+  File file = LittleFS.open(CONFIG_PATH, "w");
+  if (!file) {
+    debugPrint("[ERROR] Failed to open " CONFIG_PATH " for writing");
+    return;
+  }
+
+  JsonOut out = jsonOut(jsonToFile, &file);
+  writeConfigJson(out);
+  out.flush();
+  file.close();
+
+  if (configOverlays) clearConfigOverlays();   // config.json has it all now
+
+  debugPrintf("[CONFIG] Configuration saved to " CONFIG_PATH ", %u bytes\n", (unsigned)out.total);
+  debugPrint("saveConfig elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+
+// Writes one section's overlay, swapped in with a rename so a power cut
+// leaves the old one or the new one
+bool saveConfigSection(const char* section) {
+  char path[48];
+  configOverlayPath(section, path, sizeof(path));
+  LittleFS.mkdir(CONFIG_OVERLAY_DIR);
+  File file = LittleFS.open(CONFIG_OVERLAY_DIR "/section.tmp", "w");
+  if (!file) return false;
+  JsonOut out = jsonOut(jsonToFile, &file);
+  writeConfigSection(out, section);
+  out.flush();
+  bool ok = file.size() == out.total;
+  file.close();
+  if (!ok || !LittleFS.rename(CONFIG_OVERLAY_DIR "/section.tmp", path)) return false;
+  configOverlays = true;
+  return true;
+}
+
+// SNTP callback, runs in the lwIP task so it only flags the sync for loop()
+void onClockSync(struct timeval* tv) {
+  clockSyncPending = true;
+  wakeLoop();
+}
+
+
+// Takes the epoch offset from the system clock, which SNTP (or the RTC,
+// across a deep sleep) has just set
+void clockTakeOffset(ClockSource source) {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  clockOffsetUs = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - esp_timer_get_time();
+  clockSynced = true;
+  clockSource = source;
+  clockTextSec = -1;
+  if (source == CLOCK_NTP) {
+    rtcState.clockSyncEpoch = tv.tv_sec;
+    rtcStateSave();
+  }
+}
+
+
+// Boot: a clock that was set before a deep sleep or soft reset is still good
+void clockBegin() {
+  setenv("TZ", clockTimezone.c_str(), 1);
+  tzset();
+  sntp_set_time_sync_notification_cb(onClockSync);
+  time_t now = time(nullptr);
+  if (rtcState.clockSyncEpoch && now > CLOCK_VALID_EPOCH && (uint32_t)now >= rtcState.clockSyncEpoch) {
+    clockTakeOffset(CLOCK_RTC);
+  }
+}
+
+
+// loop() side of an SNTP sync. Later syncs correct the drift.
+void clockService() {
+  if (!clockSyncPending) return;
+  clockSyncPending = false;
+  bool first = clockSource != CLOCK_NTP;
+  clockTakeOffset(CLOCK_NTP);
+  clockSyncCount++;
+  uint32_t epoch = clockEpoch();
+  traceEvent(TRACE_CLOCK, (const uint8_t*)&epoch, 4);
+  if (first) appendLog("Clock synced from NTP");
+}
+
+
+uint32_t rtcHealthCrc() {
+  return esp_rom_crc32_le(0, (const uint8_t*)&rtcHealth, offsetof(RtcHealth, crc));
+}
+
+
+void rtcHealthSave() {
+  rtcHealth.magic = RTC_HEALTH_MAGIC;
+  rtcHealth.crc = rtcHealthCrc();
+}
+
+
+// Brownouts are not crashes. Load shedding expects the battery to sag, and
+// safe mode would turn shedding and probes off just when they are needed.
+bool isCrashReset(esp_reset_reason_t reason) {
+  return reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT ||
+         reason == ESP_RST_WDT;
+}
+
+
+const char* resetReasonName(int reason) {
+  switch (reason) {
+    case ESP_RST_POWERON:   return "poweron";
+    case ESP_RST_EXT:       return "external";
+    case ESP_RST_SW:        return "software";
+    case ESP_RST_PANIC:     return "panic";
+    case ESP_RST_INT_WDT:   return "int-wdt";
+    case ESP_RST_TASK_WDT:  return "task-wdt";
+    case ESP_RST_WDT:       return "wdt";
+    case ESP_RST_DEEPSLEEP: return "deepsleep";
+    case ESP_RST_BROWNOUT:  return "brownout";
+    default:                return "other";
+  }
+}
+
+
+// Counts this boot's reset reason and decides whether we come up in safe mode
+void recordBoot() {
+  bootResetReason = esp_reset_reason();
+  if (rtcHealth.magic != RTC_HEALTH_MAGIC || rtcHealth.crc != rtcHealthCrc() || bootResetReason == ESP_RST_POWERON) {
+    memset(&rtcHealth, 0, sizeof(rtcHealth));
+  }
+
+  int slot = bootResetReason < RESET_REASON_SLOTS ? bootResetReason : RESET_REASON_SLOTS - 1;
+  rtcHealth.resetCounts[slot]++;
+
+  if (bootResetReason == ESP_RST_BROWNOUT) {
+    rtcHealth.totalBrownouts++;
+    rtcHealth.lastBrownoutEpoch = rtcHealth.lastEpoch;
+  }
+
+  if (isCrashReset(bootResetReason)) {
+    rtcHealth.crashStreak++;
+    rtcHealth.totalCrashes++;
+    memmove(&rtcHealth.history[1], &rtcHealth.history[0], (CRASH_HISTORY_LEN - 1) * sizeof(CrashRecord));
+    rtcHealth.history[0].reason = bootResetReason;
+    rtcHealth.history[0].epoch = rtcHealth.lastEpoch;
+    rtcHealth.history[0].uptimeSec = rtcHealth.lastUptimeSec;
+    if (rtcHealth.historyLen < CRASH_HISTORY_LEN) rtcHealth.historyLen++;
+  }
+
+  rtcHealth.lastUptimeSec = 0;
+  safeMode = rtcHealth.crashStreak >= SAFE_MODE_CRASHES;
+  rtcHealthSave();
+}
+
+
+// Audit journal. Every relay change is a 16-byte record in the "audit" flash
+// partition, used as a ring of 4 KB sectors. Records are only ever programmed
+// into erased flash, and the sector after the head is kept erased ahead of
+// time (by a job, not on the relay path). A small index in RAM holds each
+// sector's time span, so /api/audit only reads the sectors a query touches.
+#define AUDIT_SECTOR      4096
+#define AUDIT_MAX_SECTORS 64
+#define AUDIT_READ_BATCH  16           // records per flash read
+#define AUDIT_QUERY_MAX   500
+
+struct __attribute__((packed)) AuditRecord {
+  uint32_t seq;                // counts up from 1, 0xFFFFFFFF is erased flash
+  uint32_t epoch;              // 0 if the clock was not synced
+  uint32_t sourceId;           // see AuditSource
+  uint16_t latencyMs;          // trigger to relay output, saturates
+  uint8_t what;                // bits 0-2 relay, 3 old state, 4 new state, 5-7 source
+  uint8_t check;               // crc8 of the bytes before it, catches a torn write
+};
+
+#define AUDIT_PER_SECTOR (AUDIT_SECTOR / sizeof(AuditRecord))
+
+struct AuditSector {
+  uint32_t firstSeq;
+  uint32_t minEpoch;           // synced records only, 0 if none
+  uint32_t maxEpoch;
+  uint16_t used;               // slots written, including any torn ones
+};
+
+const esp_partition_t* auditPart = nullptr;
+AuditSector auditIndex[AUDIT_MAX_SECTORS];
+int auditSectors = 0;
+int auditHead = 0;                     // sector being written
+uint32_t auditNextSeq = 1;
+uint32_t auditDropped = 0;             // writes that failed, or found no erased sector
+
+
+bool auditValid(const AuditRecord& r) {
+  return r.seq != 0xFFFFFFFF && r.check == esp_rom_crc8_le(0, (const uint8_t*)&r, offsetof(AuditRecord, check));
+}
+
+
+void auditIndexAdd(AuditSector& sec, const AuditRecord& r) {
+  if (!sec.used) sec.firstSeq = r.seq;
+  sec.used++;
+  if (r.epoch) {
+    if (!sec.minEpoch || r.epoch < sec.minEpoch) sec.minEpoch = r.epoch;
+    if (r.epoch > sec.maxEpoch) sec.maxEpoch = r.epoch;
+  }
+}
+
+
+void auditErase(int sector) {
+  esp_partition_erase_range(auditPart, sector * AUDIT_SECTOR, AUDIT_SECTOR);
+  memset(&auditIndex[sector], 0, sizeof(AuditSector));
+}
+
+
+// Keeps the sector after the head erased, so the head can move on at once
+void jobAuditErase() {
+  int next = (auditHead + 1) % auditSectors;
+  if (auditPart && auditIndex[next].used) auditErase(next);
+}
+
+
+// Reads every sector once to rebuild the index and find the head
+void auditBegin() {
+  auditPart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x40, "audit");
+  if (!auditPart) {
+    debugPrint("[AUDIT] No audit partition, journal disabled");
+    return;
+  }
+  auditSectors = min((int)(auditPart->size / AUDIT_SECTOR), AUDIT_MAX_SECTORS);
+
+  uint32_t newest = 0;
+  AuditRecord batch[AUDIT_READ_BATCH];
+  for (int s = 0; s < auditSectors; s++) {
+    AuditSector& sec = auditIndex[s];
+    memset(&sec, 0, sizeof(sec));
+    for (size_t slot = 0; slot < AUDIT_PER_SECTOR; slot += AUDIT_READ_BATCH) {
+      esp_partition_read(auditPart, s * AUDIT_SECTOR + slot * sizeof(AuditRecord), batch, sizeof(batch));
+      bool erased = false;
+      for (int i = 0; i < AUDIT_READ_BATCH && !erased; i++) {
+        if (batch[i].seq == 0xFFFFFFFF) {
+          erased = true;
+        } else if (auditValid(batch[i])) {
+          auditIndexAdd(sec, batch[i]);
+          if (batch[i].seq >= newest) {
+            newest = batch[i].seq;
+            auditHead = s;
+          }
+        } else {
+          sec.used++;   // torn, the slot is spent all the same
+        }
+      }
+      if (erased) break;
+    }
+  }
+  auditNextSeq = newest + 1;
+  debugPrintf("[AUDIT] %d sectors, head %d, next record %lu\n", auditSectors, auditHead, (unsigned long)auditNextSeq);
+}
+
+
+void auditRecord(int relay, bool was, bool now, int32_t latencyMs = -1) {
+  if (!auditPart) return;
+
+  if (auditIndex[auditHead].used >= AUDIT_PER_SECTOR) {
+    int next = (auditHead + 1) % auditSectors;
+    armJob(auditEraseJob, 0);
+    if (auditIndex[next].used) {
+      // The erase job has not caught up. Erasing here would hold up the relay
+      // for tens of ms, so this record is lost instead.
+      auditDropped++;
+      return;
+    }
+    auditHead = next;
+  }
+
+  if (latencyMs < 0) latencyMs = (esp_timer_get_time() - auditCtx.startUs) / 1000;
+  uint32_t id = auditCtx.id;
+  if (auditCtx.source == AUDIT_WEB && !id) id = (uint32_t)server.client().remoteIP();
+
+  AuditRecord r;
+  r.seq = auditNextSeq++;
+  r.epoch = clockEpoch();
+  r.sourceId = id;
+  r.latencyMs = min(latencyMs, (int32_t)0xFFFF);
+  r.what = (relay & 7) | (was ? 8 : 0) | (now ? 16 : 0) | (auditCtx.source << 5);
+  r.check = esp_rom_crc8_le(0, (const uint8_t*)&r, offsetof(AuditRecord, check));
+
+  AuditSector& sec = auditIndex[auditHead];
+  if (esp_partition_write(auditPart, auditHead * AUDIT_SECTOR + sec.used * sizeof(AuditRecord), &r, sizeof(r)) != ESP_OK) {
+    auditDropped++;
+    sec.used++;
+    return;
+  }
+  auditIndexAdd(sec, r);
+}
+
+
+// Drives a relay output from relayStates[] and keeps the RTC copy in step
+void writeRelay(int i) {
+  bool was = rtcState.relayMask & (1 << i);
+  portENTER_CRITICAL(&relayMux);
+  digitalWrite(relayPins[i], relayStates[i] ? RELAY_OFF : RELAY_ON);
+  if (relayStates[i]) rtcState.relayMask |= (1 << i);
+  else rtcState.relayMask &= ~(1 << i);
+  rtcStateSave();
+  portEXIT_CRITICAL(&relayMux);
+  armJob(displayJob, 0);  // show it straight away
+  bumpStateVersion();
+  if (was != relayStates[i]) auditRecord(i, was, relayStates[i]);
+}
+
+
+// Writes all six relay outputs at once through the GPIO set/clear registers,
+// so every relay in a batch switches at the same instant.
+void writeAllRelays() {
+  uint8_t before = rtcState.relayMask;
+  uint32_t set0 = 0, clear0 = 0, set1 = 0, clear1 = 0;
+  portENTER_CRITICAL(&relayMux);
+  for (int i = 0; i < 6; i++) {
+    bool high = (relayStates[i] ? RELAY_OFF : RELAY_ON) == HIGH;
+    int pin = relayPins[i];
+    if (pin < 32) {
+      (high ? set0 : clear0) |= (1UL << pin);
+    } else {
+      (high ? set1 : clear1) |= (1UL << (pin - 32));
+    }
+    if (relayStates[i]) rtcState.relayMask |= (1 << i);
+    else rtcState.relayMask &= ~(1 << i);
+  }
+  REG_WRITE(GPIO_OUT_W1TS_REG, set0);
+  REG_WRITE(GPIO_OUT_W1TC_REG, clear0);
+  REG_WRITE(GPIO_OUT1_W1TS_REG, set1);
+  REG_WRITE(GPIO_OUT1_W1TC_REG, clear1);
+  rtcStateSave();
+  portEXIT_CRITICAL(&relayMux);
+  armJob(displayJob, 0);
+  bumpStateVersion();
+  for (int i = 0; i < 6; i++) {
+    bool was = before & (1 << i);
+    if (was != relayStates[i]) auditRecord(i, was, relayStates[i]);
+  }
+}
+
+
+// Switches a relay straight from buttonTask, relayMux held. Only the output
+// and the RTC copy change here, loop() does the rest when it picks up the
+// ButtonEvent.
+void buttonWriteRelay(int relay) {
+  digitalWrite(relayPins[relay], relayStates[relay] ? RELAY_OFF : RELAY_ON);
+  if (relayStates[relay]) rtcState.relayMask |= (1 << relay);
+  else rtcState.relayMask &= ~(1 << relay);
+  rtcStateSave();   // a reset before loop() catches up still finds it
+}
+
+
+// sinceMs is when the input changed, or the press became long
+void fireButton(int index, ButtonAction action, int8_t relay, bool longPress, uint32_t sinceMs) {
+  if (action == BTN_NONE) return;
+  uint8_t before = rtcState.relayMask;
+  buttonSwitch(relayCore, action, relay);
+
+  uint32_t latencyMs = millis() - sinceMs;
+  ButtonEvent event = { (uint8_t)index, action, relay, longPress, before, rtcState.relayMask,
+                        (uint16_t)min(latencyMs, (uint32_t)0xFFFF) };
+  xQueueSend(buttonEvents, &event, 0);
+  wakeLoop();
+}
+
+
+// Debounces every button and fires its actions. Returns how long until it
+// next needs to look, or portMAX_DELAY if it can wait for the next edge.
+TickType_t serviceButtons(uint32_t now) {
+  uint32_t waitMs = UINT32_MAX;
+
+  for (int i = 0; i < buttonCount; i++) {
+    Button& b = buttons[i];
+    bool pressed = digitalRead(b.pin) == (b.activeLow ? LOW : HIGH);
+    uint32_t sinceMs;
+    DebounceEvent event = debounceService(b.deb, pressed, b.longAction != BTN_NONE, now, &sinceMs, &waitMs);
+    if (event == DEB_SHORT) fireButton(i, b.shortAction, b.shortRelay, false, sinceMs);
+    else if (event == DEB_LONG) fireButton(i, b.longAction, b.longRelay, true, sinceMs);
+  }
+
+  return waitMs == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(max(waitMs, 1U));
+}
+
+
+// High priority so a press is handled within a few ms of the input settling,
+// whatever the web server or the radio are up to
+void buttonTask(void* param) {
+  TickType_t wait = portMAX_DELAY;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, wait);
+    xSemaphoreTake(buttonLock, portMAX_DELAY);
+    wait = serviceButtons(millis());
+    xSemaphoreGive(buttonLock);
+  }
+}
+
+
+void setupButtons() {
+  if (!buttonEvents) {
+    buttonLock = xSemaphoreCreateMutex();
+    buttonEvents = xQueueCreate(8, sizeof(ButtonEvent));
+    xTaskCreatePinnedToCore(buttonTask, "buttons", 3072, nullptr, configMAX_PRIORITIES - 3, &buttonTaskHandle, 0);
+  }
+
+  xSemaphoreTake(buttonLock, portMAX_DELAY);
+  armButtons();
+  xSemaphoreGive(buttonLock);
+}
+
+
+// Buttons as deep sleep wake sources. ext0 takes one active low button with the
+// RTC pull-up holding it high, ext1 takes any active high ones.
+void enableButtonWake() {
+  bool ext0Used = false;
+  uint64_t highMask = 0;
+  for (int i = 0; i < buttonCount; i++) {
+    gpio_num_t gpio = (gpio_num_t)buttons[i].pin;
+    if (!rtc_gpio_is_valid_gpio(gpio)) continue;
+    if (buttons[i].activeLow) {
+      if (ext0Used) continue;
+      rtc_gpio_pullup_en(gpio);
+      rtc_gpio_pulldown_dis(gpio);
+      esp_sleep_enable_ext0_wakeup(gpio, 0);
+      ext0Used = true;
+    } else {
+      rtc_gpio_pulldown_en(gpio);
+      rtc_gpio_pullup_dis(gpio);
+      highMask |= 1ULL << gpio;
+    }
+  }
+  if (highMask) {
+    esp_sleep_enable_ext1_wakeup(highMask, ESP_EXT1_WAKEUP_ANY_HIGH);
+  }
+}
+
+
+void markConfigDirty() {
+  configDirty = true;
+  armJob(configSaveJob, CONFIG_SAVE_DELAY_MS);
+}
+
+
+uint32_t wheelNowTick() {
+  return (uint32_t)(esp_timer_get_time() / 1000 / WHEEL_TICK_MS);
+}
+
+
+int64_t wallClockMs() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);   // keeps counting through soft resets and deep sleep
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+// RelayCore hooks for the pulses. The end time goes into RTC memory so a
+// pulse survives a reboot.
+void pulseArmed(int relay, uint32_t ms) {
+  rtcState.pulseMask |= (1 << relay);
+  rtcState.pulseEndMs[relay] = wallClockMs() + ms;
+  rtcState.pulseLenMs[relay] = ms;
+  rtcStateSave();
+}
+
+
+void pulseCleared(int relay) {
+  rtcState.pulseMask &= ~(1 << relay);
+  rtcStateSave();
+}
+
+
+// The log names whoever started it, as the audit journal does
+void pulseStarted(int relay, uint32_t ms) {
+  appendLog("Pulse " + relayLabels[relay] + (relayStates[relay] ? " on" : " off") + " for " + String(ms) + " ms (" +
+            auditSourceNames[auditCtx.source] + ")");
+}
+
+
+void pulseCancelled(int relay) {
+  appendLog("Pulse cancelled: " + relayLabels[relay] + (relayStates[relay] ? " on" : " off") + " (" +
+            auditSourceNames[auditCtx.source] + ")");
+}
+
+
+void cycleRefused(int relay) {
+  appendLog("Not power cycling " + relayLabels[relay] + ", it is switched off (" + auditSourceNames[auditCtx.source] + ")");
+}
+
+
+void armPulse(int relay, uint32_t ms) {
+  relayArmPulse(relayCore, relay, ms, wheelNowTick());
+}
+
+
+void firePulseTimer(int relay, void*) {
+  auditFrom(AUDIT_TIMER, 0);
+  uint8_t traced = relay;
+  traceEvent(TRACE_TIMER, &traced, 1);
+  relayFinishPulse(relayCore, relay);
+  appendLog("Pulse finished: " + relayLabels[relay] + (relayStates[relay] ? " on" : " off"));
+}
+
+
+// Catches up on any ticks missed while loop() was busy
+void serviceTimerWheel() {
+  wheelAdvance(pulseWheel, wheelNowTick(), firePulseTimer, nullptr);
+}
+
+
+// Re-arms pulses that were running when we rebooted, with whatever time they
+// had left. Only called when the relay states were restored from RTC memory.
+void restorePulses() {
+  int64_t now = wallClockMs();
+  for (int i = 0; i < 6; i++) {
+    if (!(rtcState.pulseMask & (1 << i))) continue;
+    int64_t remaining = rtcState.pulseEndMs[i] - now;
+    // A clock step (e.g. the first NTP sync) can make this nonsense, so clamp it
+    remaining = constrain(remaining, (int64_t)0, (int64_t)rtcState.pulseLenMs[i]);
+    uint32_t len = rtcState.pulseLenMs[i];
+    armPulse(i, remaining);
+    rtcState.pulseLenMs[i] = len;
+    rtcStateSave();
+    appendLog("Resumed pulse on " + relayLabels[i] + ", " + String((long)remaining) + " ms left");
+  }
+}
+
+
+void toggleRelay(int i) {
+  appendLog("Toggle Pin:" + String(relayPins[i]) + " - " + String(relayLabels[i]) + " " + String(relayStates[i]) + " >> " + String(!relayStates[i]));
+  relayToggle(relayCore, i);  // takes over from any pulse in progress
+}
+
+
+
+
+// Reads the battery through its divider. The divider is only switched on for
+// the burst of readings so it does not drain the battery between samples.
+uint16_t readBatteryMv() {
+  digitalWrite(ADC_CTRL, ADC_CTRL_ACTIVE);
+  delay(5);  // let the divider settle
+
+  uint32_t sum = 0;
+  for (int i = 0; i < BATTERY_OVERSAMPLE; i++) {
+    sum += analogReadMilliVolts(BATTERY_PIN);  // calibrated oneshot read
+  }
+  digitalWrite(ADC_CTRL, !ADC_CTRL_ACTIVE);
+
+  return (uint16_t)((sum / BATTERY_OVERSAMPLE) * batteryDivider);
+}
+
+
+uint16_t medianMv(const uint16_t* values, uint8_t count) {
+  uint16_t sorted[BATTERY_MEDIAN_LEN];
+  memcpy(sorted, values, count * sizeof(uint16_t));
+  for (int i = 1; i < count; i++) {
+    uint16_t v = sorted[i];
+    int j = i - 1;
+    while (j >= 0 && sorted[j] > v) {
+      sorted[j + 1] = sorted[j];
+      j--;
+    }
+    sorted[j + 1] = v;
+  }
+  return sorted[count / 2];
+}
+
+
+// Background sampler: oversampled average per reading, a median over the last
+// few readings to knock out spikes from relay switching, and a per-minute history.
+void batteryTask(void* param) {
+  unsigned long lastHistory = 0;
+
+  esp_task_wdt_add(nullptr);
+
+  pinMode(ADC_CTRL, OUTPUT);
+  digitalWrite(ADC_CTRL, !ADC_CTRL_ACTIVE);
+  analogSetPinAttenuation(BATTERY_PIN, ADC_11db);
+
+  for (;;) {
+    uint16_t reading = readBatteryMv();
+
+    portENTER_CRITICAL(&batteryMux);
+    if (batteryRawCount < BATTERY_MEDIAN_LEN) {
+      batteryRaw[batteryRawCount++] = reading;
+    } else {
+      memmove(&batteryRaw[0], &batteryRaw[1], (BATTERY_MEDIAN_LEN - 1) * sizeof(uint16_t));
+      batteryRaw[BATTERY_MEDIAN_LEN - 1] = reading;
+    }
+    batteryMv = medianMv(batteryRaw, batteryRawCount);
+
+    if (lastHistory == 0 || millis() - lastHistory >= 60000) {
+      lastHistory = millis();
+      if (batteryHistoryLen < BATTERY_HISTORY_LEN) {
+        batteryHistory[batteryHistoryLen++] = batteryMv;
+      } else {
+        memmove(&batteryHistory[0], &batteryHistory[1], (BATTERY_HISTORY_LEN - 1) * sizeof(uint16_t));
+        batteryHistory[BATTERY_HISTORY_LEN - 1] = batteryMv;
+      }
+    }
+    batterySampleCount++;
+    portEXIT_CRITICAL(&batteryMux);
+
+    // Wait in one second slices so the task watchdog keeps hearing from us
+    for (int waited = 0; waited < batterySampleSeconds; waited++) {
+      esp_task_wdt_reset();
+      vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+  }
+}
+
+
+// Drops low priority relays when the battery sags and brings them back once it
+// has recovered past the hysteresis point. Runs from loop() after each new sample.
+void checkLoadShedding() {
+  if (batterySampleCount == lastBatterySample) return;
+  lastBatterySample = batterySampleCount;
+
+  if (abs((int)batteryMv - (int)statusBatteryMv) >= STATUS_BATT_STEP) {
+    statusBatteryMv = batteryMv;
+    bumpStateVersion();
+  }
+
+  float volts = batteryMv / 1000.0;
+  if (volts < 1.0) return;  // no battery fitted, or nothing sensible read yet
+
+  for (int i = 0; i < shedRuleCount; i++) {
+    ShedRule& rule = shedRules[i];
+    int relay = rule.relay;
+    auditFrom(AUDIT_LOADSHED, i);
+
+    if (rule.shed && relayStates[relay]) {
+      rule.shed = false;  // someone switched it back on by hand, leave it alone
+      bumpStateVersion();
+    } else if (!rule.shed && relayStates[relay] && volts < rule.offBelow) {
+      rule.shed = true;
+      relaySet(relayCore, relay, false);
+      appendLog("Load shed: " + relayLabels[relay] + " off, battery " + String(volts, 2) + "V < " + String(rule.offBelow, 2) + "V");
+    } else if (rule.shed && volts > rule.onAbove) {
+      rule.shed = false;
+      relaySet(relayCore, relay, true);
+      appendLog("Load restored: " + relayLabels[relay] + " on, battery " + String(volts, 2) + "V > " + String(rule.onAbove, 2) + "V");
+    }
+  }
+}
+
+
+String loraStatusBeacon() {
+  String mask = "";
+  for (int i = 0; i < 6; i++) {
+    mask += relayStates[i] ? '1' : '0';
+  }
+  return "G7NRU ST R=" + mask + " B=" + String(batteryMv / 1000.0, 2) + "V U=" + String(millis() / 1000);
+}
+
+
+void ledApplyStep() {
+  const LedStep& step = ledPatterns[ledPlaying].steps[ledStep];
+  for (int ch = 0; ch < ledChannels; ch++) {
+    if (step.fadeMs) {
+      ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, (ledc_channel_t)ch, step.duty, step.fadeMs);
+      ledc_fade_start(LEDC_LOW_SPEED_MODE, (ledc_channel_t)ch, LEDC_FADE_NO_WAIT);
+    } else {
+      ledc_set_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)ch, step.duty);
+      ledc_update_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)ch);
+    }
+  }
+  esp_timer_start_once(ledTimer, (uint64_t)(step.fadeMs + step.holdMs) * 1000);
+}
+
+
+// Runs in the esp_timer task at the end of each step. Pattern changes are only
+// taken up here, at a step boundary, so a hardware fade is never cut short.
+void ledTimerCallback(void* arg) {
+  if (ledFlashWanted && ledPlaying != LED_FLASH) {
+    ledFlashWanted = false;
+    ledResume = ledPlaying;
+    ledPlaying = LED_FLASH;
+    ledStep = 0;
+  } else if (++ledStep >= ledPatterns[ledPlaying].count) {
+    ledStep = 0;
+    if (ledPlaying == LED_FLASH) ledPlaying = ledResume;
+  }
+
+  if (ledPlaying != LED_FLASH && ledPlaying != ledWanted) {
+    ledPlaying = ledWanted;
+    ledStep = 0;
+  }
+  ledApplyStep();
+}
+
+
+void setupLeds() {
+  ledc_timer_config_t timer = {};
+  timer.speed_mode = LEDC_LOW_SPEED_MODE;
+  timer.duty_resolution = LEDC_TIMER_13_BIT;
+  timer.timer_num = LEDC_TIMER_0;
+  timer.freq_hz = LED_PWM_HZ;
+  timer.clk_cfg = LEDC_AUTO_CLK;
+  ledc_timer_config(&timer);
+
+  int pins[2] = { ledPin, statusLedPin };
+  for (int i = 0; i < 2; i++) {
+    if (pins[i] < 0 || isRelayPin(pins[i]) || isButtonPin(pins[i])) continue;
+    ledc_channel_config_t channel = {};
+    channel.gpio_num = pins[i];
+    channel.speed_mode = LEDC_LOW_SPEED_MODE;
+    channel.channel = (ledc_channel_t)ledChannels++;
+    channel.timer_sel = LEDC_TIMER_0;
+    channel.duty = 0;
+    ledc_channel_config(&channel);
+  }
+  ledc_fade_func_install(0);
+
+  esp_timer_create_args_t args = {};
+  args.callback = ledTimerCallback;
+  args.name = "led";
+  esp_timer_create(&args, &ledTimer);
+  ledPlaying = ledWanted;
+  ledStep = 0;
+  ledApplyStep();
+}
+
+
+// Free to call from anywhere, the change shows at the next step boundary
+void ledSetPattern(LedPatternId pattern) {
+  ledWanted = pattern;
+}
+
+
+void ledFlash() {
+  ledFlashWanted = true;
+}
+
+
+void IRAM_ATTR onLoraDio1() {
+  loraDio1 = true;
+  BaseType_t woken = pdFALSE;
+  if (radioTaskHandle) vTaskNotifyGiveFromISR(radioTaskHandle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+
+uint32_t loraAirtimeLastHour() {
+  uint32_t minute = millis() / 60000, total = 0;
+  for (int i = 0; i < 60; i++) {
+    if (minute - loraAirtimeMinute[i] < 60) total += loraAirtimeMs[i];
+  }
+  return total;
+}
+
+
+void loraAddAirtime(uint32_t ms) {
+  uint32_t minute = millis() / 60000;
+  int slot = minute % 60;
+  if (loraAirtimeMinute[slot] != minute) {
+    loraAirtimeMinute[slot] = minute;
+    loraAirtimeMs[slot] = 0;
+  }
+  loraAirtimeMs[slot] += ms;
+}
+
+
+// Adds a frame to the send queue. Returns the slot, or -1 if the queue is full.
+int loraQueue(const uint8_t* data, size_t len, uint8_t priority, bool awaitReply, uint8_t node, uint8_t seq,
+              uint32_t delayMs = 0) {
+  if (!loraReady || len > LORA_FRAME_MAX) return -1;
+  int slot = -1;
+  xSemaphoreTakeRecursive(loraLock, portMAX_DELAY);
+  for (int i = 0; i < LORA_TX_QUEUE && slot < 0; i++) {
+    if (loraTx[i].used) continue;
+    LoraOut& out = loraTx[i];
+    memset(&out, 0, sizeof(out));
+    out.used = true;
+    out.priority = priority;
+    out.len = len;
+    memcpy(out.data, data, len);
+    out.awaitReply = awaitReply;
+    out.node = node;
+    out.seq = seq;
+    out.queuedMs = millis();
+    out.notBeforeMs = out.queuedMs + delayMs;
+    slot = i;
+  }
+  if (slot < 0) loraDropped++;
+  xSemaphoreGiveRecursive(loraLock);
+
+  if (slot < 0) {
+    debugPrint("[LoRa] Send queue full, frame dropped");
+  } else if (radioTaskHandle) {
+    xTaskNotifyGive(radioTaskHandle);
+  }
+  return slot;
+}
+
+
+// Starts a frame from this node. Returns its seq, or -1 if it could not be queued.
+int loraQueueFrame(uint8_t type, uint8_t dst, const void* payload, size_t payloadLen, uint8_t priority,
+                   bool awaitReply) {
+  uint8_t frame[LORA_FRAME_MAX];
+  if (!loraReady || sizeof(LoraHeader) + payloadLen > sizeof(frame)) return -1;
+
+  xSemaphoreTakeRecursive(loraLock, portMAX_DELAY);
+  uint8_t seq = ++loraSeq ? loraSeq : ++loraSeq;   // 0 means "not an answer" in status frames
+  LoraHeader header = { LORA_MAGIC, type, (uint8_t)loraNodeId, dst, seq, loraEpoch, (uint8_t)loraNodeId, dst, 0, 0 };
+  if (loraMesh && dst != LORA_BROADCAST) {
+    Route* route = findRoute(routeTable, dst, millis());
+    header.via = route ? route->nextHop : LORA_BROADCAST;   // no route yet, so flood it
+  }
+  memcpy(frame, &header, sizeof(header));
+  memcpy(frame + sizeof(header), payload, payloadLen);
+  int slot = loraQueue(frame, sizeof(header) + payloadLen, priority, awaitReply, dst, seq);
+  xSemaphoreGiveRecursive(loraLock);
+  return slot < 0 ? -1 : seq;
+}
+
+
+// Queues a command for a remote node. Returns its seq, or -1 if it was refused.
+int queueRemoteCommand(uint8_t node, const String& command, uint8_t priority) {
+  if (command.length() == 0 || command.length() > LORA_FRAME_MAX - sizeof(LoraHeader)) return -1;
+  return loraQueueFrame(LORA_CMD, node, command.c_str(), command.length(), priority, true);
+}
+
+
+uint8_t beaconFlags() {
+  uint8_t flags = safeMode ? 1 : 0;
+  if (globalSchedule.enabled) flags |= 2;
+  if (millis() < stayAwakeUntil) flags |= 4;
+  return flags;
+}
+
+
+// Our status, answering a command. The callsign goes on the end so every
+// transmission identifies the station.
+void loraQueueStatus(uint8_t dst, uint8_t ackSeq, uint8_t priority) {
+  uint8_t payload[sizeof(LoraStatusPayload) + 8];
+  LoraStatusPayload status;
+  status.ackSeq = ackSeq;
+  status.relayMask = rtcState.relayMask;
+  status.pulseMask = rtcState.pulseMask;
+  status.flags = beaconFlags();
+  status.batteryMv = batteryMv;
+  status.uptimeSec = millis() / 1000;
+  memcpy(payload, &status, sizeof(status));
+  memcpy(payload + sizeof(status), "G7NRU", 5);
+  loraQueueFrame(LORA_STATUS, dst, payload, sizeof(status) + 5, priority, false);
+}
+
+
+BeaconState currentBeaconState() {
+  BeaconState state;
+  state.relayMask = rtcState.relayMask;
+  state.pulseMask = rtcState.pulseMask;
+  state.flags = beaconFlags();
+  state.battery = min(batteryMv / 20, (1 << BEACON_BITS_BATTERY) - 1);
+  state.probeBits = 0;
+  for (int i = 0; i < 6; i++) {
+    uint8_t verdict = probeTargets[i].verdict;
+    state.probeBits |= min(verdict, (uint8_t)3) << (i * 2);   // reset and hold share a code
+  }
+  state.uptimeMin = min(millis() / 60000, (1UL << BEACON_BITS_UPTIME) - 1);
+  return state;
+}
+
+
+// Has state moved enough since the last beacon to be worth telling anyone?
+// Uptime never counts, and the battery only once it has really moved.
+bool beaconWorthSending(const BeaconState& state) {
+  uint8_t fields = beaconDiff(state, beaconSent);
+  if (fields & BF_BATTERY && abs((int)state.battery - beaconSent.battery) * 20 < LORA_BEACON_BATT_STEP) {
+    fields &= ~BF_BATTERY;
+  }
+  return fields != 0;
+}
+
+
+bool beaconStillQueued() {
+  if (!loraReady || beaconPendingSeq < 0) return false;
+  bool queued = false;
+  xSemaphoreTakeRecursive(loraLock, portMAX_DELAY);
+  for (int i = 0; i < LORA_TX_QUEUE; i++) {
+    const LoraOut& out = loraTx[i];
+    if (out.used && out.seq == beaconPendingSeq && out.data[1] == LORA_BEACON && out.data[2] == loraNodeId) {
+      queued = true;
+    }
+  }
+  xSemaphoreGiveRecursive(loraLock);
+  if (!queued) beaconPendingSeq = -1;
+  return queued;
+}
+
+
+void sendLoraBeacon() {
+  BeaconState state = currentBeaconState();
+  uint8_t payload[16];
+  uint32_t now = millis();
+
+  size_t bits = 0;
+  bool full = !beaconKey.have || beaconForceFull || now - beaconKeyMs >= LORA_BEACON_FULL_MS;
+  if (!full) {
+    bits = packBeaconDelta(payload, state, beaconKey);
+    full = bits == 0 || bits >= BEACON_FULL_BITS;   // no gain, so make it a new key
+  }
+  if (full) bits = packBeaconFull(payload, state);
+
+  size_t len = (bits + 7) / 8;
+  if (full) {
+    memcpy(payload + len, "G7NRU", 5);
+    len += 5;
+  }
+  int seq = loraQueueFrame(LORA_BEACON, LORA_BROADCAST, payload, len, LORA_PRIO_LOW, false);
+  if (seq < 0) return;
+
+  beaconPendingSeq = seq;
+  beaconSent = state;
+  beaconLastMs = now;
+  beaconChangedMs = 0;
+  beaconBits += len * 8;
+  if (full) {
+    beaconKey.state = state;
+    beaconKey.seq = seq;
+    beaconKey.have = true;
+    beaconForceFull = false;
+    beaconKeyMs = now;
+    beaconFullCount++;
+  } else {
+    beaconDeltaCount++;
+  }
+}
+
+
+// Runs a text command (see parseRelayCommand), relays numbered 0-5 as in the
+// web API. Returns false if it was not a command we know.
+bool runLoraCommand(const String& command) {
+  RelayCommand cmd;
+  if (!parseRelayCommand(command.c_str(), cmd)) return false;
+
+  if (cmd.op == CMD_BEACON) {
+    beaconForceFull = true;   // someone lost track of our deltas
+    beaconChangedMs = millis() - LORA_BEACON_SETTLE_MS;
+  }
+  relayRunCommand(relayCore, cmd, wheelNowTick());
+  if (cmd.op == CMD_ON || cmd.op == CMD_OFF) {
+    markConfigDirty();
+    appendLog("LoRa: " + relayLabels[cmd.relay] + (relayStates[cmd.relay] ? " on" : " off"));
+  }
+  return true;
+}
+
+
+// Plain text command from a handheld, answered with the text status line
+void handleLoraCommand(const String& command) {
+  if (runLoraCommand(command)) {
+    String reply = loraStatusBeacon();
+    loraQueue((const uint8_t*)reply.c_str(), reply.length(), LORA_PRIO_REPLY, false, LORA_BROADCAST, 0);
+  }
+}
+
+
+RemoteNode* findRemote(uint8_t id, bool create) {
+  for (int i = 0; i < remoteCount; i++) {
+    if (remotes[i].id == id) return &remotes[i];
+  }
+  if (!create) return nullptr;
+
+  // Full up, so the node heard from longest ago makes way
+  int slot = remoteCount;
+  if (remoteCount < MAX_REMOTES) {
+    remoteCount++;
+  } else {
+    slot = 0;
+    for (int i = 1; i < MAX_REMOTES; i++) {
+      if (millis() - remotes[i].heardMs > millis() - remotes[slot].heardMs) slot = i;
+    }
+  }
+  memset(&remotes[slot], 0, sizeof(RemoteNode));
+  remotes[slot].id = id;
+  return &remotes[slot];
+}
+
+
+// loop() side of a frame that is for us: run commands, note remote status.
+// Duplicates and retries have already been weeded out by radioTask.
+void handleLoraFrame(const uint8_t* data, size_t len, int16_t rssi, float snr, bool repeat) {
+  LoraHeader header;
+  memcpy(&header, data, sizeof(header));
+  const uint8_t* payload = data + sizeof(header);
+  size_t payloadLen = len - sizeof(header);
+
+  if (header.type == LORA_CMD && header.dst == loraNodeId) {
+    char text[LORA_FRAME_MAX + 1];
+    memcpy(text, payload, payloadLen);
+    text[payloadLen] = 0;
+    debugPrintf("[LoRa] Command from node %d (%d hops): %s\n", header.src, header.hops + 1, text);
+    if (!repeat && !runLoraCommand(text)) {
+      appendLog("LoRa: unknown command from node " + String(header.src) + ": " + text);
+    }
+    loraQueueStatus(header.src, header.seq, LORA_PRIO_REPLY);
+    return;
+  }
+
+  if (header.type == LORA_STATUS && payloadLen >= sizeof(LoraStatusPayload)) {
+    LoraStatusPayload status;
+    memcpy(&status, payload, sizeof(status));
+    RemoteNode* node = findRemote(header.src, true);
+    node->relayMask = status.relayMask;
+    node->pulseMask = status.pulseMask;
+    node->flags = status.flags;
+    node->batteryMv = status.batteryMv;
+    node->uptimeSec = status.uptimeSec;
+    node->heardMs = millis();
+    node->rssi = rssi;
+    node->snr = snr;
+    return;
+  }
+
+  if (header.type == LORA_BEACON) {
+    RemoteNode* node = findRemote(header.src, true);
+    node->heardMs = millis();
+    node->rssi = rssi;
+    node->snr = snr;
+    node->beacons++;
+
+    BeaconState state;
+    if (!unpackBeacon(payload, payloadLen, header.seq, node->key, state)) {
+      // A delta against a full beacon we missed. A gateway asks for a fresh
+      // one, now and then; anyone else waits for the next.
+      node->missedKeys++;
+      if (loraGateway && (node->askedFullMs == 0 || millis() - node->askedFullMs > LORA_BEACON_FULL_MS / 3)) {
+        node->askedFullMs = millis();
+        queueRemoteCommand(header.src, "BEACON", LORA_PRIO_LOW);
+      }
+      return;
+    }
+    node->relayMask = state.relayMask;
+    node->pulseMask = state.pulseMask;
+    node->flags = state.flags;
+    node->batteryMv = state.battery * 20;
+    node->probeBits = state.probeBits;
+    node->uptimeSec = state.uptimeMin * 60;
+  }
+}
+
+
+// Frames for us that radioTask has passed over
+// A frame for us, from the radio or replayed from a trace
+void handleLoraInbound(const uint8_t* data, size_t len, int16_t rssi, float snr, bool repeat, int64_t rxUs) {
+  if (len >= sizeof(LoraHeader) && data[0] == LORA_MAGIC) {
+    auditFrom(AUDIT_LORA, data[offsetof(LoraHeader, src)], rxUs);
+    handleLoraFrame(data, len, rssi, snr, repeat);
+  } else {
+    auditFrom(AUDIT_LORA, 0, rxUs);   // node 0, a handheld sending plain text
+    char text[LORA_FRAME_MAX + 1];
+    memcpy(text, data, len);
+    text[len] = 0;
+    debugPrintf("[LoRa RX] Received: %s\n", text);
+    handleLoraCommand(String(text));
+  }
+}
+
+
+void handleLoraInbox() {
+  LoraInbound in;
+  while (xQueueReceive(loraInbox, &in, 0)) {
+    if (traceSink) {
+      uint8_t event[3 + LORA_FRAME_MAX];
+      memcpy(event, &in.rssi, 2);
+      event[2] = (int8_t)lroundf(in.snr * 4);
+      memcpy(event + 3, in.data, in.len);
+      traceEvent(TRACE_LORA, event, 3 + in.len, in.rxUs);
+    }
+    handleLoraInbound(in.data, in.len, in.rssi, in.snr, in.repeat, in.rxUs);
+  }
+}
+
+
+// radioTask: hops we expect a frame to dst to take, for the reply timeout
+int loraHopsTo(uint8_t dst) {
+  Route* route = findRoute(routeTable, dst, millis());
+  if (route) return route->hops;
+  return loraMesh ? loraMaxHops : 1;
+}
+
+
+void onLoraTxDone() {
+  lora.finishTransmit();
+  loraTxBusy = false;
+  lora.startReceive();
+  if (loraAwaiting >= 0 && loraTxAwaited) {
+    int hops = loraHopsTo(loraTx[loraAwaiting].node);
+    loraReplyDeadline = millis() + hops * (2 * loraTxToaMs + LORA_REPLY_MARGIN_MS);
+  }
+}
+
+
+// radioTask: a frame off the air. Learns routes from it, drops repeats, hands
+// anything for us to loop() and passes the rest on if we are a mesh node.
+void radioReceive(uint8_t* data, size_t len, int16_t rssi, float snr) {
+  LoraInbound in;
+  in.len = min(len, sizeof(in.data));
+  memcpy(in.data, data, in.len);
+  in.rssi = rssi;
+  in.snr = snr;
+  in.repeat = false;
+  in.rxUs = esp_timer_get_time();
+
+  if (len < sizeof(LoraHeader) || data[0] != LORA_MAGIC) {
+    xQueueSend(loraInbox, &in, 0);   // plain text command
+    wakeLoop();
+    return;
+  }
+
+  LoraHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.src == loraNodeId) return;   // our own frame passed back to us
+
+  uint8_t link = loraLinkCost(snr);
+  learnRoutesFrom(routeTable, loraNodeId, header, link, millis());
+
+  if (dupSeen(loraSeen, header)) {
+    loraDuplicates++;
+    if (header.type == LORA_CMD && header.dst == loraNodeId) {
+      in.repeat = true;   // the sender is retrying, so answer again without running it twice
+      xQueueSend(loraInbox, &in, 0);
+      wakeLoop();
+    }
+    return;
+  }
+
+  bool forUs = header.dst == loraNodeId || header.dst == LORA_BROADCAST;
+  if (forUs) {
+    // An answer to the command we are waiting on lets the queue move on
+    if (header.type == LORA_STATUS && header.dst == loraNodeId && loraAwaiting >= 0 &&
+        len >= sizeof(LoraHeader) + sizeof(LoraStatusPayload)) {
+      LoraStatusPayload status;
+      memcpy(&status, data + sizeof(header), sizeof(status));
+      if (loraTx[loraAwaiting].node == header.src && status.ackSeq == loraTx[loraAwaiting].seq) {
+        loraTx[loraAwaiting].used = false;
+        loraAwaiting = -1;
+      }
+    }
+    xQueueSend(loraInbox, &in, 0);
+    wakeLoop();
+  }
+
+  if (loraMesh && meshForward(routeTable, loraNodeId, loraMaxHops, link, header, millis())) {
+    memcpy(data, &header, sizeof(header));
+
+    // A random wait before passing on a flooded frame, so that neighbours who
+    // all heard it do not transmit over each other
+    uint32_t toaMs = lora.getTimeOnAir(len) / 1000;
+    uint32_t jitter = header.via == LORA_BROADCAST ? random(20, 20 + toaMs) : 20;
+    if (loraQueue(data, len, LORA_PRIO_HIGH, false, header.dst, header.seq, jitter) >= 0) {
+      loraForwarded++;
+    }
+  }
+}
+
+
+// radioTask: DIO1 means either our transmit has finished or a packet is in
+void radioDio1() {
+  if (loraTxBusy) {
+    onLoraTxDone();
+    return;
+  }
+
+  uint8_t data[256];
+  size_t len = min(lora.getPacketLength(), sizeof(data));
+  int rxState = lora.readData(data, len);
+  if (rxState == RADIOLIB_ERR_NONE && len > 0) {
+    loraRxFrames++;
+    lastLoraRssi = lora.getRSSI();
+    ledFlash();
+    radioReceive(data, len, lastLoraRssi, lora.getSNR());
+  }
+  lora.startReceive();
+}
+
+
+// radioTask: sends the most urgent frame that is due, if the channel is ours
+// and the hour's airtime allows. Only one command is outstanding at a time,
+// since the answer needs the channel too.
+void serviceLoraTx() {
+  if (!loraReady || loraTxBusy) return;
+  uint32_t now = millis();
+
+  // While a reply is awaited no other command goes out, but replies, beacons
+  // and mesh forwards do
+  bool awaiting = loraAwaiting >= 0 && (int32_t)(now - loraReplyDeadline) < 0;
+  if (loraAwaiting >= 0 && !awaiting) {
+    LoraOut& out = loraTx[loraAwaiting];
+    if (out.attempts >= LORA_MAX_ATTEMPTS) {
+      debugPrintf("[LoRa] No answer from node %d after %d tries, giving up\n", out.node, out.attempts);
+      loraDropped++;
+      out.used = false;
+    } else {
+      out.notBeforeMs = now + out.attempts * 2000;   // back off a little more each time
+    }
+    loraAwaiting = -1;
+  }
+
+  int best = -1;
+  for (int i = 0; i < LORA_TX_QUEUE; i++) {
+    const LoraOut& out = loraTx[i];
+    if (!out.used || (int32_t)(now - out.notBeforeMs) < 0 || (awaiting && out.awaitReply)) continue;
+    if (best < 0 || out.priority < loraTx[best].priority ||
+        (out.priority == loraTx[best].priority && out.queuedMs < loraTx[best].queuedMs)) {
+      best = i;
+    }
+  }
+  if (best < 0) return;
+
+  LoraOut& out = loraTx[best];
+  uint32_t toaMs = (lora.getTimeOnAir(out.len) + 999) / 1000;
+  if (loraAirtimeLastHour() + toaMs > loraDutyPercent * 36000UL && out.priority != LORA_PRIO_REPLY) {
+    return;   // over budget, try again when older airtime has aged out
+  }
+
+  int state = lora.startTransmit(out.data, out.len);
+  if (state != RADIOLIB_ERR_NONE) {
+    debugPrintf("[LoRa TX] startTransmit failed (%d)\n", state);
+    lora.startReceive();
+    return;
+  }
+  loraTxBusy = true;
+  loraTxToaMs = toaMs;
+  loraTxAwaited = out.awaitReply;
+  loraAddAirtime(toaMs);
+  loraTxFrames++;
+
+  if (out.awaitReply) {
+    out.attempts++;
+    loraAwaiting = best;
+    loraReplyDeadline = now + 60000;   // set properly once the send completes
+  } else {
+    out.used = false;
+  }
+}
+
+
+// Owns the SX1262. Wakes on DIO1 or when something is queued, and every 50 ms
+// for retries and frames that were held back.
+void radioTask(void* param) {
+  esp_task_wdt_add(nullptr);
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(50));
+    esp_task_wdt_reset();
+
+    xSemaphoreTakeRecursive(loraLock, portMAX_DELAY);
+    if (loraDio1) {
+      loraDio1 = false;
+      radioDio1();
+    }
+    serviceLoraTx();
+    xSemaphoreGiveRecursive(loraLock);
+  }
+}
+
+
+void remoteJson(JsonObject obj, const RemoteNode& node) {
+  obj["node"] = node.id;
+  auto states = obj["states"].to<JsonArray>();
+  auto pulsing = obj["pulsing"].to<JsonArray>();
+  for (int i = 0; i < 6; i++) {
+    states.add((bool)(node.relayMask & (1 << i)));
+    pulsing.add((bool)(node.pulseMask & (1 << i)));
+  }
+  obj["safeMode"] = (bool)(node.flags & 1);
+  obj["scheduleEnabled"] = (bool)(node.flags & 2);
+  obj["heldAwake"] = (bool)(node.flags & 4);
+  auto probes = obj["probes"].to<JsonArray>();
+  for (int i = 0; i < 6; i++) {
+    probes.add(probeVerdictName((ProbeVerdict)((node.probeBits >> (i * 2)) & 3)));   // hold comes over as reset
+  }
+  obj["beacons"] = node.beacons;
+  obj["missedKeys"] = node.missedKeys;
+  obj["batteryMv"] = node.batteryMv;
+  obj["uptimeSec"] = node.uptimeSec;
+  obj["ageSec"] = (millis() - node.heardMs) / 1000;
+  obj["rssi"] = node.rssi;
+  obj["snr"] = node.snr;
+}
+
+
+// Gateway API. GET answers from the cache straight away:
+//   /api/remote            every node heard from, plus the send queue
+//   /api/remote?node=3     one node
+// POST queues a command and returns at once, the node's cached state is
+// updated when it answers:
+//   {"node":3,"cmd":"CYCLE 2","priority":"high"}
+void handleRemoteApi() {
+  if (!loraGateway) {
+    server.send(404, "text/plain", "Not a LoRa gateway, set lora.gateway in the config");
+    return;
+  }
+
+  if (server.method() == HTTP_POST) {
+    JsonDocument req;
+    if (deserializeJson(req, server.arg("plain"))) {
+      server.send(400, "text/plain", "Invalid JSON");
+      return;
+    }
+    int node = req["node"] | -1;
+    String command = req["cmd"] | "";
+    String prio = req["priority"] | "normal";
+    uint8_t priority = prio == "high" ? LORA_PRIO_HIGH : prio == "low" ? LORA_PRIO_LOW : LORA_PRIO_NORMAL;
+    if (node < 1 || node > 254 || node == loraNodeId) {
+      server.send(400, "text/plain", "Invalid node");
+      return;
+    }
+    int seq = queueRemoteCommand(node, command, priority);
+    if (seq < 0) {
+      server.send(503, "text/plain", loraReady ? "Send queue full or command too long" : "LoRa radio is not running");
+      return;
+    }
+    appendLog("Gateway: queued '" + command + "' for node " + String(node) + " (seq " + String(seq) + ")");
+    server.send(202, "application/json", "{\"queued\":true,\"seq\":" + String(seq) + "}");
+    return;
+  }
+
+  JsonDocument doc;
+  if (server.hasArg("node")) {
+    RemoteNode* node = findRemote(server.arg("node").toInt(), false);
+    if (!node) {
+      server.send(404, "text/plain", "Not heard from that node yet");
+      return;
+    }
+    remoteJson(doc.to<JsonObject>(), *node);
+  } else {
+    doc["nodeId"] = loraNodeId;
+    doc["airtimeLastHourMs"] = loraAirtimeLastHour();
+    doc["airtimeBudgetMs"] = loraDutyPercent * 36000UL;
+    doc["txFrames"] = loraTxFrames;
+    doc["rxFrames"] = loraRxFrames;
+    doc["dropped"] = loraDropped;
+    doc["mesh"] = loraMesh;
+    doc["forwarded"] = loraForwarded;
+    auto beacon = doc["beacon"].to<JsonObject>();
+    beacon["full"] = beaconFullCount;
+    beacon["delta"] = beaconDeltaCount;
+    beacon["bits"] = beaconBits;
+    beacon["intervalSec"] = beaconIntervalMs / 1000;
+    doc["duplicates"] = loraDuplicates;
+    auto nodes = doc["nodes"].to<JsonArray>();
+    for (int i = 0; i < remoteCount; i++) {
+      remoteJson(nodes.add<JsonObject>(), remotes[i]);
+    }
+    auto routeList = doc["routes"].to<JsonArray>();
+    auto queue = doc["queue"].to<JsonArray>();
+    if (loraReady) {   // no radio, nothing routed or queued
+      xSemaphoreTakeRecursive(loraLock, portMAX_DELAY);
+      for (int i = 0; i < routeTable.count; i++) {
+        const Route& r = routeTable.routes[i];
+        auto route = routeList.add<JsonObject>();
+        route["dst"] = r.dst;
+        route["via"] = r.nextHop;
+        route["hops"] = r.hops;
+        route["cost"] = r.cost;
+        route["ageSec"] = (millis() - r.learnedMs) / 1000;
+      }
+      for (int i = 0; i < LORA_TX_QUEUE; i++) {
+        if (!loraTx[i].used) continue;
+        auto entry = queue.add<JsonObject>();
+        entry["node"] = loraTx[i].node;
+        entry["seq"] = loraTx[i].seq;
+        entry["priority"] = loraTx[i].priority;
+        entry["attempts"] = loraTx[i].attempts;
+        entry["waitingMs"] = millis() - loraTx[i].queuedMs;
+        entry["inFlight"] = i == loraAwaiting;
+      }
+      xSemaphoreGiveRecursive(loraLock);
+    }
+  }
+
+  String json;
+  serializeJson(doc, json);
+  server.send(200, "application/json", json);
+}
+
+
+void handleBatteryApi() {
+  JsonDocument doc;
+  doc["mv"] = batteryMv;
+  doc["samples"] = batterySampleCount;
+  doc["divider"] = batteryDivider;
+
+  auto history = doc["historyMv"].to<JsonArray>();
+  portENTER_CRITICAL(&batteryMux);
+  uint16_t copy[BATTERY_HISTORY_LEN];
+  uint8_t len = batteryHistoryLen;
+  memcpy(copy, batteryHistory, len * sizeof(uint16_t));
+  portEXIT_CRITICAL(&batteryMux);
+  for (int i = 0; i < len; i++) {
+    history.add(copy[i]);
+  }
+
+  auto rules = doc["shedRules"].to<JsonArray>();
+  for (int i = 0; i < shedRuleCount; i++) {
+    auto rule = rules.add<JsonObject>();
+    rule["relay"] = shedRules[i].relay;
+    rule["offBelow"] = shedRules[i].offBelow;
+    rule["onAbove"] = shedRules[i].onAbove;
+    rule["shed"] = shedRules[i].shed;
+  }
+
+  String json;
+  serializeJson(doc, json);
+  server.send(200, "application/json", json);
+}
+
+
+void handleRoot() {
+  measureElapsedMs();
+
+  
+  IPAddress clientIP = server.client().remoteIP();
+  String logEntry = "Connection from IP: " + clientIP.toString();
+  debugPrint(logEntry);
+
+  // Optional: save to the log file
+  appendLog(logEntry);
+
+
+  String html = loadHTMLPart("/header.html");
+  html  += R"rawliteral(<div class="button-grid">)rawliteral";
+
+
+
+  for (int i = 0; i < 6; i++) {
+    String buttonClass = relayStates[i] ? "green active" : "red active";
+  
+    String dotStyle = "";
+    if (relayPingEnabled[i] && relayResetEnabled[i]) {
+      dotStyle = "style='--dot-color: yellow;'";
+      buttonClass += " has-dot";
+    } else if (relayPingEnabled[i]) {
+      dotStyle = "style='--dot-color: blue;'";
+      buttonClass += " has-dot";
+    }
+  
+    html += "<button id='relay" + String(i) + "' class='" + buttonClass + "' " + dotStyle + " onclick='toggleRelay(" + i + ")'>" + relayLabels[i] + "</button>";
+  }
+
+
+  html += R"rawliteral(
+  <button class="settings-button" onclick="location.href='/settings'">Settings</button>
+  <button class="settings-button" onclick="location.href='/log'">View Log</button>
+  <button class="reboot-button" onclick="location.href='/reboot'">Reboot</button>
+</div>
+
+)rawliteral";
+
+  html += loadHTMLPart("/footer.html");
+  server.send(200, "text/html", html);
+  debugPrint("handleRoot elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+void handleToggle() {
+  measureElapsedMs();
+
+  debugPrint("Handling toggle request");
+  if (server.hasArg("id")) {
+    int id = server.arg("id").toInt();
+    if (id >= 0 && id < 6) toggleRelay(id);
+  }
+  markConfigDirty();
+  server.send(200, "text/plain", "OK");
+  debugPrint("Toggle request handled successfully");
+  debugPrint("handleToggle elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+String relayStateJson() {
+  JsonDocument doc;
+  auto states = doc["states"].to<JsonArray>();
+  auto pulsing = doc["pulsing"].to<JsonArray>();
+  for (int i = 0; i < 6; i++) {
+    states.add(relayStates[i]);
+    pulsing.add(wheelArmed(pulseWheel, i));
+  }
+  String json;
+  serializeJson(doc, json);
+  return json;
+}
+
+
+// Batch relay control. Takes explicit on/off/pulse operations, so a retried
+// request cannot flip a relay back, e.g.
+//   {"requestId":"a1","ops":[{"relay":0,"op":"off"},{"relay":2,"op":"pulse","ms":5000}]}
+// Every op is checked before any is applied, the pins are written together and
+// the config is saved once, shortly afterwards.
+void handleRelaysApi() {
+  measureElapsedMs();
+
+  if (server.method() == HTTP_GET) {
+    server.send(200, "application/json", relayStateJson());
+    return;
+  }
+
+  JsonDocument doc;
+  DeserializationError err = deserializeJson(doc, server.arg("plain"));
+  if (err) {
+    server.send(400, "text/plain", String("Invalid JSON: ") + err.c_str());
+    return;
+  }
+
+  String requestId = doc["requestId"] | "";
+  if (!requestId.isEmpty()) {
+    for (int i = 0; i < RELAY_REQUEST_CACHE; i++) {
+      if (relayRequestCache[i].id == requestId) {
+        debugPrint("[RELAYS] Duplicate request " + requestId + ", returning cached result");
+        server.send(200, "application/json", relayRequestCache[i].response);
+        return;
+      }
+    }
+  }
+
+  bool newStates[6];
+  bool touched[6] = {false};
+  bool cancel[6] = {false};
+  uint32_t pulseMs[6] = {0};
+  for (int i = 0; i < 6; i++) newStates[i] = persistedRelayState(i);
+
+  JsonArray ops = doc["ops"];
+  if (ops.isNull() || ops.size() == 0) {
+    server.send(400, "text/plain", "No ops given");
+    return;
+  }
+  for (JsonObject op : ops) {
+    int relay = op["relay"] | -1;
+    String action = op["op"] | "";
+    if (relay < 0 || relay >= 6) {
+      server.send(400, "text/plain", "Invalid relay " + String(relay));
+      return;
+    }
+    touched[relay] = true;
+    if (action == "on" || action == "off") {
+      newStates[relay] = action == "on";
+      pulseMs[relay] = 0;
+    } else if (action == "pulse") {
+      uint32_t ms = op["ms"] | 1000;
+      if (ms == 0 || ms > 3600000) {
+        server.send(400, "text/plain", "Pulse length must be 1 ms to 1 hour");
+        return;
+      }
+      pulseMs[relay] = ms;
+    } else if (action == "cycle") {
+      if (!newStates[relay]) {
+        server.send(400, "text/plain", "Relay " + String(relay) + " is off, nothing to power cycle");
+        return;
+      }
+      pulseMs[relay] = relayCycleOffSeconds[relay] * 1000UL;
+    } else if (action == "cancel") {
+      cancel[relay] = true;
+      pulseMs[relay] = 0;
+    } else {
+      server.send(400, "text/plain", "Invalid op '" + action + "' for relay " + String(relay));
+      return;
+    }
+  }
+
+  // Apply. A pulse flips the relay away from its settled state for ms, then
+  // back. Relays not named in the batch carry on with any pulse they have.
+  for (int i = 0; i < 6; i++) {
+    if (touched[i] && !pulseMs[i]) cancelPulseTimer(i);
+  }
+  bool was[6];
+  portENTER_CRITICAL(&relayMux);   // buttonTask switches relays from the other core
+  for (int i = 0; i < 6; i++) {
+    was[i] = relayStates[i];
+    if (!touched[i]) continue;
+    if (pulseMs[i]) relaySetSettle(relayCore, i, newStates[i]);
+    relayStates[i] = pulseMs[i] ? !newStates[i] : newStates[i];
+  }
+  portEXIT_CRITICAL(&relayMux);
+  writeAllRelays();
+
+  String changes = "";
+  for (int i = 0; i < 6; i++) {
+    if (!touched[i]) continue;
+    if (relayStates[i] != was[i] || pulseMs[i] || cancel[i]) {
+      changes += " " + String(i) + (pulseMs[i] ? ":pulse" : cancel[i] ? ":cancel" : (relayStates[i] ? ":on" : ":off"));
+    }
+    if (pulseMs[i]) armPulse(i, pulseMs[i]);
+  }
+  markConfigDirty();
+  appendLog("Relay batch from " + server.client().remoteIP().toString() + ":" + (changes.isEmpty() ? String(" no change") : changes));
+
+  String response = relayStateJson();
+  if (!requestId.isEmpty()) {
+    relayRequestCache[relayRequestNext].id = requestId;
+    relayRequestCache[relayRequestNext].response = response;
+    relayRequestNext = (relayRequestNext + 1) % RELAY_REQUEST_CACHE;
+  }
+  server.send(200, "application/json", response);
+  debugPrint("handleRelaysApi elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+
+void handleSettings() {
+  measureElapsedMs();
+  debugPrintf("Schedule enabled: %d\n", globalSchedule.enabled);
+  debugPrintf("Power ON time: %s\n", globalSchedule.powerOnTime.c_str());
+  debugPrintf("Power OFF time: %s\n", globalSchedule.powerOffTime.c_str());
+
+  String html = loadHTMLPart("/header.html");
+
+  html += R"rawliteral(
+  <div class="container">
+    <form id='settingsForm' onsubmit='return saveSettings(event)'>
+      <table class='settings-table'>
+        <thead>
+          <tr>
+            <th>Label</th>
+            <th>Enable Ping</th>
+            <th>IP Address</th>
+            <th>Reset on Fail</th>
+          </tr>
+        </thead>
+        <tbody>
+  )rawliteral";
+
+  for (int i = 0; i < 6; i++) {
+    html += "<tr>";
+    html += "<td><input type='text' name='label" + String(i) + "' value='" + relayLabels[i] + "' maxlength='20'></td>";
+    html += "<td><input type='checkbox' id='ping" + String(i) + "' name='ping" + String(i) + "'" + (relayPingEnabled[i] ? " checked" : "") + " onchange='togglePing(" + String(i) + ")'></td>";
+    html += "<td><input type='text' id='ip" + String(i) + "' name='ip" + String(i) + "' value='" + relayIPs[i] + "' maxlength='20' pattern='^$|^(?:[0-9]{1,3}\\.){3}[0-9]{1,3}$' title='Enter a valid IPv4 address or leave blank'></td>";
+    html += "<td><input type='checkbox' id='reset" + String(i) + "' name='reset" + String(i) + "'" + (relayResetEnabled[i] ? " checked" : "") + "></td>";
+    html += "</tr>";
+  }
+
+  html += R"rawliteral(
+        </tbody>
+      </table>
+      <br>
+      <table class='settings-table'>
+        <tr>
+          <td><label for='globalSchedEnable'>Enable Deep Sleep Schedule</label></td>
+          <td><input type='checkbox' id='globalSchedEnable' name='globalScheduleEnabled')rawliteral";
+  html += globalSchedule.enabled ? " checked" : "";
+  html += R"rawliteral(></td>
+        </tr>
+        <tr>
+          <td><label for='globalOnTime'>Wake Time</label></td>
+          <td><input type='time' id='globalOnTime' name='globalOnTime' value=')rawliteral";
+  html += globalSchedule.powerOnTime;
+  html += R"rawliteral('></td>
+        </tr>
+        <tr>
+          <td><label for='globalOffTime'>Sleep Time</label></td>
+          <td><input type='time' id='globalOffTime' name='globalOffTime' value=')rawliteral";
+  html += globalSchedule.powerOffTime;
+  html += R"rawliteral('></td>
+        </tr>
+        <tr>
+          <td><label for='pollInterval'>Poll Interval (minutes)</label></td>
+          <td><input type='number' id='pollInterval' name='pollInterval' min='1' max='1440' value=')rawliteral";
+  html += String(globalSchedule.pollIntervalMinutes);
+  html += R"rawliteral('></td>
+        </tr>
+      </table>
+
+      <div class='form-buttons'>
+        <button class='settings-button' type='submit' form='settingsForm'>Save Settings</button>
+        <form action="/download_config" method="GET" style="display: inline;">
+          <button class="settings-button" type="submit">Download Settings</button>
+        </form>
+        <form id="uploadForm" method="POST" action="/upload_config" enctype="multipart/form-data" style="display: inline;">
+          <input type="file" id="uploadInput" name="upload" style="display: none;" required>
+          <button class="settings-button" type="button" onclick="triggerUpload()">Upload Settings</button>
+        </form>
+        <button class="settings-button" type="button" onclick="rollbackConfig()">Rollback Settings</button>
+        <a href="/" style="margin-left: 10px;">
+          <button class="settings-button" type="button">Back</button>
+        </a>
+      </div>
+    </form>
+  </div>
+  )rawliteral";
+
+  html += loadHTMLPart("/footer.html");
+  server.send(200, "text/html", html);
+  debugPrint("handleSettings elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+
+
+
+
+void handleLogPage() {
+  measureElapsedMs();
+
+  String html = loadHTMLPart("/header.html");
+  html += R"rawliteral(<div class="log-box">)rawliteral";
+  logSync();
+  uint32_t from = logSegment - logFirstSegment >= LOG_PAGE_SEGMENTS ? logSegment - LOG_PAGE_SEGMENTS + 1 : logFirstSegment;
+  for (uint32_t n = from; n && n <= logSegment; n++) {
+    char path[32];
+    logSegmentPath(n, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    if (file) {
+      while (file.available()) {
+        //html += file.readStringUntil('\n') + "<br>";
+        html += htmlEscape(file.readStringUntil('\n')) + "<br>";
+      }
+      file.close();
+    }
+  }
+  if (!logSegment) {
+    html += "<p>No log file found.</p>";
+  }
+
+  html += R"rawliteral(
+</div>
+<div class="controls">
+  <button class="settings-button" onclick="clearLog()">Clear Log</button>
+  <button class="settings-button" onclick="location.href='/'">Back to Control Panel</button>
+</div>
+)rawliteral";
+
+html += loadHTMLPart("/footer.html");
+  server.send(200, "text/html", html);
+  debugPrint("handleLogPage elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+String statusETag() {
+  return "\"" + String(stateVersion) + "\"";
+}
+
+
+// What the status body reports that buttonTask can change under us. Both
+// passes over the body use one copy, or a button press in between could make
+// the body a byte longer or shorter than the Content-Length sent.
+struct StatusSnapshot {
+  uint32_t version;
+  bool states[6];
+};
+
+StatusSnapshot statusSnapshot() {
+  StatusSnapshot snap;
+  portENTER_CRITICAL(&relayMux);
+  snap.version = stateVersion;
+  memcpy(snap.states, relayStates, sizeof(snap.states));
+  portEXIT_CRITICAL(&relayMux);
+  return snap;
+}
+
+
+// The status body, streamed. Called twice per response, once with a
+// counting JsonOut for the Content-Length and once for real.
+void writeStatusJson(JsonOut& out, const StatusSnapshot& snap) {
+  out.beginObject();
+  out.key(JK("version")); out.value(snap.version);
+  out.key(JK("states")); out.array(snap.states);
+  out.key(JK("labels")); out.array(relayLabels);
+  out.key(JK("reset")); out.array(relayResetEnabled);
+  out.key(JK("ips")); out.array(relayIPs);
+
+  out.key(JK("safeMode")); out.value(safeMode);
+  out.key(JK("led")); out.value(ledPatterns[ledWanted].name);
+  out.key(JK("batteryMv")); out.value(statusBatteryMv);
+  out.key(JK("shed"));
+  out.beginArray();
+  for (int i = 0; i < shedRuleCount; i++) {
+    if (shedRules[i].shed) out.value(shedRules[i].relay);
+  }
+  out.endArray();
+  out.key(JK("probes"));
+  out.beginArray();
+  for (int i = 0; i < 6; i++) {
+    out.value(probeVerdictName(probeTargets[i].verdict));
+  }
+  out.endArray();
+
+  // This will return log data but for now we wont use this so I will supress it
+  // out.key(JK("log")); out.value(logText);
+  out.endObject();
+  out.flush();
+}
+
+
+size_t statusJsonLength(const StatusSnapshot& snap) {
+  JsonOut counter = jsonOut(nullptr, nullptr);
+  writeStatusJson(counter, snap);
+  return counter.total;
+}
+
+
+// Answers a parked long-poll directly on its socket, the WebServer has long
+// since moved on to other clients
+void answerStatusWaiter(StatusWaiter& w, bool changed) {
+  StatusSnapshot snap = statusSnapshot();
+  char head[160];
+  int len;
+  if (changed) {
+    len = snprintf(head, sizeof(head),
+                   "HTTP/1.1 200 OK\r\nETag: \"%lu\"\r\nCache-Control: no-cache\r\nConnection: close\r\n"
+                   "Content-Type: application/json\r\nContent-Length: %u\r\n\r\n",
+                   (unsigned long)snap.version, (unsigned)statusJsonLength(snap));
+  } else {
+    len = snprintf(head, sizeof(head),
+                   "HTTP/1.1 304 Not Modified\r\nETag: \"%lu\"\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n",
+                   (unsigned long)snap.version);
+  }
+  w.client.write((const uint8_t*)head, len);
+  if (changed) {
+    JsonOut out = jsonOut(jsonToClient, &w.client);
+    writeStatusJson(out, snap);
+  }
+  w.client.stop();
+  w.client = WiFiClient();
+  w.used = false;
+  statusWaiterCount--;
+}
+
+
+// Runs twice a second while anyone is waiting, and straight away on a bump
+void jobStatusWaiters() {
+  uint32_t now = millis();
+  for (int i = 0; i < STATUS_WAITERS; i++) {
+    StatusWaiter& w = statusWaiters[i];
+    if (!w.used) continue;
+    if (w.since != stateVersion) {
+      answerStatusWaiter(w, true);
+    } else if ((int32_t)(now - w.deadlineMs) >= 0) {
+      answerStatusWaiter(w, false);
+    } else if (!w.client.connected()) {
+      w.client = WiFiClient();   // gave up on us
+      w.used = false;
+      statusWaiterCount--;
+    }
+  }
+}
+
+
+// GET /api/status. Carries an ETag, so If-None-Match gets a 304 when nothing
+// has changed. ?since=<version>&wait=<s> holds the request open for up to
+// STATUS_WAIT_MAX_S seconds until the version moves on; 304 if it never does.
+void handleStatusApi() {
+  measureElapsedMs();
+
+  String etag = statusETag();
+  if (server.header("If-None-Match") == etag) {
+    server.sendHeader("ETag", etag);
+    server.send(304);
+    return;
+  }
+
+  if (server.hasArg("since") && (uint32_t)server.arg("since").toInt() == stateVersion) {
+    int waitSec = constrain(server.arg("wait").toInt(), 0, STATUS_WAIT_MAX_S);
+    if (waitSec == 0) {
+      server.sendHeader("ETag", etag);
+      server.send(304);
+      return;
+    }
+    for (int i = 0; i < STATUS_WAITERS; i++) {
+      StatusWaiter& w = statusWaiters[i];
+      if (w.used) continue;
+      // Our copy of the client keeps the socket open. stop() on the server's
+      // copy only drops its reference, so handleClient() sees it as gone and
+      // moves on to the next request instead of sitting in HC_WAIT_CLOSE.
+      w.used = true;
+      w.client = server.client();
+      w.since = stateVersion;
+      w.deadlineMs = millis() + waitSec * 1000;
+      statusWaiterCount++;
+      server.client().stop();
+      return;
+    }
+    server.sendHeader("Retry-After", "1");
+    server.send(503, "text/plain", "Too many waiting");
+    return;
+  }
+
+  StatusSnapshot snap = statusSnapshot();
+  server.sendHeader("ETag", "\"" + String(snap.version) + "\"");
+  server.sendHeader("Cache-Control", "no-cache");
+  server.setContentLength(statusJsonLength(snap));
+  server.send(200, "application/json", "");
+  JsonOut out = jsonOut(jsonToServer, nullptr);
+  writeStatusJson(out, snap);
+  debugPrint("handleStatusApi elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+void handleDownloadLog() {
+  measureElapsedMs();
+
+  if (!logSegment) {
+    server.send(404, "text/plain", "Log file not found");
+    return;
+  }
+
+  // Every segment, oldest first, as one chunked response
+  logSync();
+  server.sendHeader("Content-Disposition", "attachment; filename=log.txt");
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain", "");
+  uint8_t buf[512];
+  for (uint32_t n = logFirstSegment; n <= logSegment; n++) {
+    char path[32];
+    logSegmentPath(n, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    size_t len;
+    while (file && (len = file.read(buf, sizeof(buf))) > 0) {
+      server.sendContent((const char*)buf, len);
+    }
+    file.close();
+  }
+  server.sendContent("");
+  appendLog("Log downloaded");
+  debugPrint("handleDownloadLog elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+void handleClearLog() {
+  measureElapsedMs();
+
+  debugPrint("Trying to clear the log..");
+  // Segment numbers keep counting up, so a fresh segment is never mistaken for an old one
+  uint32_t first = logFirstSegment, last = logSegment;
+  logFirstSegment = logSegment + 1;
+  logRotate();
+  for (uint32_t n = first; n && n <= last; n++) {
+    char path[32];
+    logSegmentPath(n, path, sizeof(path));
+    LittleFS.remove(path);
+  }
+  if (logFile) {
+    appendLog("Log cleared");
+    server.send(200, "text/plain", "Log cleared");
+  } else {
+    appendLog("Failed to clear the log");
+    server.send(500, "text/plain", "Failed to clear log");
+  }
+  debugPrint("handleClearLog elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+// PATCH /api/config with just the fields to change, e.g.
+//   {"relayLabels": {"2": "Pump"}, "globalSchedule": {"enabled": true}}
+// The patch is checked against configFields, laid over the running config and
+// applied like an upload. Only the sections it touches are written to flash.
+void handleConfigPatch() {
+  measureElapsedMs();
+
+  JsonDocument patch;
+  DeserializationError err = deserializeJson(patch, server.arg("plain"));
+  if (err || !patch.is<JsonObject>()) {
+    server.send(400, "text/plain", String("Invalid JSON: ") + (err ? err.c_str() : "not an object"));
+    return;
+  }
+  char error[96];
+  if (!checkConfigPatch(patch.as<JsonObjectConst>(), isPinInUse, error, sizeof(error))) {
+    server.send(400, "text/plain", error);
+    return;
+  }
+
+  // Each section goes straight into the running settings, and its overlay
+  // is written from them. Relay states are not part of a patch, so the live
+  // ones stay as they are, pulses in progress included.
+  uint8_t changed = 0;
+  String sections;
+  for (JsonPairConst kv : patch.as<JsonObjectConst>()) {
+    const char* section = kv.key().c_str();
+    changed |= applyConfigSection(section, kv.value());
+    if (!saveConfigSection(section)) {
+      markConfigDirty();   // the full save will have it
+    }
+    sections += (sections.isEmpty() ? "" : ", ") + String(section);
+  }
+  if (changed) {
+    pendingApplyMask |= changed;
+    armJob(applyConfigJob, 500);
+  }
+  bumpStateVersion();
+  appendLog("Config changed: " + sections);
+
+  JsonDocument reply;
+  reply["changed"] = changed;
+  reply["version"] = stateVersion;
+  String body;
+  serializeJson(reply, body);
+  server.send(200, "application/json", body);
+  debugPrint("handleConfigPatch elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+void handleReboot() {
+  measureElapsedMs();
+
+  String html = loadHTMLPart("/header.html");
+  html += "<h1>Rebooting...</h1><p>Check the log for confirmation</p><script>setPageTimeout();</script>";
+  html += loadHTMLPart("/footer.html");
+  server.send(200, "text/html", html);
+  debugPrint("handleReboot elapsed: " + String(measureElapsedMs()) + " ms");
+  
+  armJob(rebootJob, 1000); // reboot once the page has gone out
+
+}
+
+// Seconds from now until the schedule turns the station back on, 0 if unknown
+uint32_t secondsUntilPowerOn() {
+  struct tm timeinfo;
+  int onHour, onMin;
+  if (!clockLocal(&timeinfo) ||
+      sscanf(globalSchedule.powerOnTime.c_str(), "%d:%d", &onHour, &onMin) != 2) {
+    return 0;
+  }
+  int nowSeconds = timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec;
+  int onSeconds = onHour * 3600 + onMin * 60;
+  int wait = onSeconds - nowSeconds;
+  if (wait <= 0) wait += 24 * 3600;
+  return wait;
+}
+
+
+// Latch the relay outputs in the pads so they ride through deep sleep and the
+// following boot untouched. Released again by releaseRelayHold().
+void holdRelayOutputs() {
+  for (int i = 0; i < 6; i++) {
+    gpio_hold_en((gpio_num_t)relayPins[i]);
+  }
+  gpio_deep_sleep_hold_en();
+}
+
+
+void releaseRelayHold() {
+  for (int i = 0; i < 6; i++) {
+    gpio_hold_dis((gpio_num_t)relayPins[i]);
+  }
+  gpio_deep_sleep_hold_dis();
+}
+
+
+void goToDeepSleep(uint32_t sleepSeconds) {
+  debugPrintf("Going to sleep for %u seconds...\n", sleepSeconds);
+
+  // Wake up on the poll interval, or right on the power-on time if that comes first
+  uint32_t untilOn = secondsUntilPowerOn();
+  rtcState.sleepSeconds = sleepSeconds;
+  rtcState.nextWakeEpoch = untilOn ? clockEpoch() + untilOn : 0;
+  rtcState.sleepCount++;
+  rtcStateSave();
+  if (untilOn && untilOn < sleepSeconds) {
+    sleepSeconds = untilOn;
+  }
+  delay(100);  // Allow Serial flush
+
+  // Stop Wi-Fi to reduce power
+  WiFi.disconnect(true); // Disconnect and turn off Wi-Fi
+  WiFi.mode(WIFI_OFF);
+
+  // Set all RTC-capable GPIOs to input to reduce current, apart from the relays
+  for (gpio_num_t gpio = GPIO_NUM_0; gpio < GPIO_NUM_MAX; gpio = (gpio_num_t)(gpio + 1)) {
+    if (!rtc_gpio_is_valid_gpio(gpio)) continue;
+    if (isRelayPin(gpio) || isButtonPin(gpio)) continue;
+    rtc_gpio_deinit(gpio);           // Reset RTC GPIO function
+    gpio_reset_pin(gpio);            // Reset to default
+    gpio_set_direction(gpio, GPIO_MODE_INPUT); // Set as input
+    gpio_pullup_dis(gpio);           // Disable pull-up
+    gpio_pulldown_dis(gpio);         // Disable pull-down
+  }
+
+  holdRelayOutputs();
+  enableButtonWake();
+
+  // Enable wake-up timer
+  esp_sleep_enable_timer_wakeup((uint64_t)sleepSeconds * 1000000ULL);
+
+  // Start deep sleep
+  logSync();
+  debugDrain(200);
+  esp_deep_sleep_start();
+}
+
+
+// First thing on every boot. A timer wake that is still before the next
+// power-on time goes straight back to sleep, before Serial, the filesystem or
+// the radios are touched. The relay pads are still held, so powered equipment
+// never sees the wake at all.
+void quickSleepCheck() {
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+
+  if (!rtcStateValid() || esp_reset_reason() == ESP_RST_POWERON) {
+    memset(&rtcState, 0, sizeof(rtcState));
+  }
+  rtcState.bootCount++;
+  rtcState.wakeReason = cause;
+
+  time_t now = time(nullptr);   // the RTC keeps the clock running through deep sleep
+  if (cause == ESP_SLEEP_WAKEUP_TIMER && rtcState.nextWakeEpoch && now > CLOCK_VALID_EPOCH &&
+      (uint32_t)now + 5 < rtcState.nextWakeEpoch) {
+    uint32_t sleepFor = rtcState.nextWakeEpoch - now;
+    if (rtcState.sleepSeconds && rtcState.sleepSeconds < sleepFor) {
+      sleepFor = rtcState.sleepSeconds;
+    }
+    rtcState.quickSleepCount++;
+    rtcStateSave();
+    holdRelayOutputs();
+    esp_sleep_enable_timer_wakeup((uint64_t)sleepFor * 1000000ULL);
+    esp_deep_sleep_start();
+  }
+
+  rtcState.nextWakeEpoch = 0;
+  rtcStateSave();
+}
+
+
+void handleDeepSleep() {
+  measureElapsedMs();
+
+  server.send(200, "text/plain", "Good night :-)");
+  goToDeepSleep(30);
+  return;
+
+}
+
+
+
+// Incremental JSON syntax checker. Upload chunks are fed through it as they
+// arrive so a truncated or malformed config is caught before it ever replaces
+// the live one. The root must be an object, nesting is limited to 32 levels.
+struct JsonStreamValidator {
+  enum State { VALUE, ARRAY_START, OBJECT_START, KEY, COLON, AFTER_VALUE, STRING, STRING_ESC, STRING_HEX, LITERAL, DONE, FAIL };
+
+  State state;
+  bool stringIsKey;
+  uint8_t hexLeft;
+  uint8_t depth;
+  uint32_t stack;            // one bit per open container, 1 = object, 0 = array
+  const char* literal;       // "true"/"false"/"null" being matched, nullptr for numbers
+  uint8_t literalPos;
+  size_t offset;
+  const char* error;
+
+  void reset() {
+    state = VALUE;
+    stringIsKey = false;
+    hexLeft = 0;
+    depth = 0;
+    stack = 0;
+    literal = nullptr;
+    literalPos = 0;
+    offset = 0;
+    error = nullptr;
+  }
+
+  bool fail(const char* why) {
+    state = FAIL;
+    error = why;
+    return false;
+  }
+
+  bool inObject() const {
+    return depth > 0 && (stack >> (depth - 1)) & 1;
+  }
+
+  bool push(bool isObject) {
+    if (depth >= 32) return fail("nested too deep");
+    if (isObject) stack |= (1UL << depth);
+    else stack &= ~(1UL << depth);
+    depth++;
+    state = isObject ? OBJECT_START : ARRAY_START;
+    return true;
+  }
+
+  bool pop(bool isObject) {
+    if (depth == 0 || inObject() != isObject) return fail("mismatched bracket");
+    depth--;
+    state = depth == 0 ? DONE : AFTER_VALUE;
+    return true;
+  }
+
+  bool startValue(char c) {
+    if (depth == 0 && c != '{') return fail("config must be a JSON object");
+    if (c == '{') return push(true);
+    if (c == '[') return push(false);
+    if (c == '"') {
+      stringIsKey = false;
+      state = STRING;
+      return true;
+    }
+    if (c == 't') literal = "true";
+    else if (c == 'f') literal = "false";
+    else if (c == 'n') literal = "null";
+    else if (c == '-' || (c >= '0' && c <= '9')) literal = nullptr;
+    else return fail("unexpected character");
+    literalPos = 1;
+    state = LITERAL;
+    return true;
+  }
+
+  bool step(char c) {
+    bool ws = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+
+    switch (state) {
+      case STRING:
+        if (c == '"') state = stringIsKey ? COLON : AFTER_VALUE;
+        else if (c == '\\') state = STRING_ESC;
+        else if ((uint8_t)c < 0x20) return fail("control character in string");
+        return true;
+
+      case STRING_ESC:
+        if (c == 'u') {
+          hexLeft = 4;
+          state = STRING_HEX;
+        } else if (strchr("\"\\/bfnrt", c) && c != 0) {
+          state = STRING;
+        } else {
+          return fail("bad escape");
+        }
+        return true;
+
+      case STRING_HEX:
+        if (!isxdigit((unsigned char)c)) return fail("bad unicode escape");
+        if (--hexLeft == 0) state = STRING;
+        return true;
+
+      case LITERAL:
+        if (literal) {
+          if (literal[literalPos] != 0) {
+            if (c != literal[literalPos]) return fail("bad literal");
+            literalPos++;
+            return true;
+          }
+        } else if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+          return true;
+        }
+        // Literal finished, this character belongs to whatever follows it
+        state = AFTER_VALUE;
+        return step(c);
+
+      default:
+        break;
+    }
+
+    if (ws) return true;
+
+    switch (state) {
+      case VALUE:
+        return startValue(c);
+
+      case ARRAY_START:
+        if (c == ']') return pop(false);
+        return startValue(c);
+
+      case OBJECT_START:
+        if (c == '}') return pop(true);
+        // fall through
+      case KEY:
+        if (c != '"') return fail("expected a key");
+        stringIsKey = true;
+        state = STRING;
+        return true;
+
+      case COLON:
+        if (c != ':') return fail("expected ':'");
+        state = VALUE;
+        return true;
+
+      case AFTER_VALUE:
+        if (c == ',') {
+          state = inObject() ? KEY : VALUE;
+          return true;
+        }
+        if (c == '}') return pop(true);
+        if (c == ']') return pop(false);
+        return fail("expected ',' or closing bracket");
+
+      case DONE:
+        return fail("trailing data after config");
+
+      default:
+        return false;
+    }
+  }
+
+  bool feed(const uint8_t* buf, size_t len) {
+    for (size_t i = 0; i < len; i++, offset++) {
+      if (state == FAIL || !step((char)buf[i])) return false;
+    }
+    return true;
+  }
+
+  bool finish() {
+    if (state == FAIL) return false;
+    if (state != DONE) return fail("config is truncated");
+    return true;
+  }
+};
+
+JsonStreamValidator uploadValidator;
+
+
+int bootPhaseStart(const char* name) {
+  if (bootPhaseCount >= MAX_BOOT_PHASES) return -1;
+  BootPhase& phase = bootPhases[bootPhaseCount];
+  phase.name = name;
+  phase.startMs = millis();
+  phase.endMs = 0;
+  phase.result = nullptr;
+  return bootPhaseCount++;
+}
+
+
+void bootPhaseEnd(int index, const char* result) {
+  if (index < 0 || index >= bootPhaseCount || bootPhases[index].result) return;
+  bootPhases[index].endMs = millis();
+  bootPhases[index].result = result;
+  debugPrintf("[BOOT] %s: %s after %lu ms\n", bootPhases[index].name, result,
+              bootPhases[index].endMs - bootPhases[index].startMs);
+}
+
+
+uint32_t wifiCacheCrc() {
+  return esp_rom_crc32_le(0, (const uint8_t*)&wifiCache, offsetof(WifiFastCache, crc));
+}
+
+
+bool wifiCacheValid() {
+  return wifiCache.magic == WIFI_CACHE_MAGIC && wifiCache.crc == wifiCacheCrc() &&
+         wifiSSID == wifiCache.ssid && wifiCache.channel > 0;
+}
+
+
+void saveWifiCache() {
+  memset(&wifiCache, 0, sizeof(wifiCache));
+  wifiCache.magic = WIFI_CACHE_MAGIC;
+  strncpy(wifiCache.ssid, wifiSSID.c_str(), sizeof(wifiCache.ssid) - 1);
+  memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.ip = WiFi.localIP();
+  wifiCache.gateway = WiFi.gatewayIP();
+  wifiCache.subnet = WiFi.subnetMask();
+  wifiCache.dns = WiFi.dnsIP(0);
+  wifiCache.crc = wifiCacheCrc();
+}
+
+
+// Kicks off a connection to the configured network and returns straight away,
+// serviceWiFi() watches for the result. Uses the RTC cache for a directed
+// connect to the last known AP when it is valid, otherwise a full scan.
+void startWiFi() {
+  WiFi.setHostname("RelayController");  // Set this to something unique and descriptive
+  WiFi.mode(fallbackApActive ? WIFI_AP_STA : WIFI_STA);
+  WiFi.setAutoReconnect(false);         // serviceWiFi() reconnects with backoff
+  if (wifiSSID.isEmpty()) {
+    debugPrint("No WiFi SSID configured");
+    return;
+  }
+
+  bool fast = wifiCacheValid();
+  IPAddress ip, gateway, subnet, dns;
+  if (ip.fromString(wifiStaticIP) && gateway.fromString(wifiGateway) && subnet.fromString(wifiSubnet)) {
+    if (!dns.fromString(wifiDNS)) dns = gateway;
+    WiFi.config(ip, gateway, subnet, dns);
+    wifiConnectMethod = fast ? "fast-static" : "static";
+  } else if (fast) {
+    // Reuse the last DHCP lease to skip the DHCP exchange as well
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+    wifiConnectMethod = "fast";
+  } else {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    wifiConnectMethod = "full";
+  }
+
+  if (fast) {
+    WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str(), wifiCache.channel, wifiCache.bssid);
+    debugPrintf("Trying WiFi SSID: %s (fast reconnect, channel %d)\n", wifiSSID.c_str(), wifiCache.channel);
+  } else {
+    WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
+    debugPrint("Trying WiFi SSID: " + wifiSSID + " | Password: " + wifiPassword);
+  }
+  wifiAttemptFast = fast;
+  wifiAttemptStart = millis() | 1;  // never 0, that means idle
+}
+
+
+void onWiFiConnected() {
+  wifiLinkUp = true;
+  wifiRetryDelay = WIFI_RETRY_MIN_MS;
+  wifiAssocMs = millis() - wifiAttemptStart;
+  wifiAttemptStart = 0;
+  saveWifiCache();
+
+  // Record the association time of the first connection on each boot
+  if (bootWifiPhase >= 0 && !bootPhases[bootWifiPhase].result) {
+    memmove(&wifiAssocHistory[1], &wifiAssocHistory[0], sizeof(wifiAssocHistory) - sizeof(wifiAssocHistory[0]));
+    wifiAssocHistory[0] = min(wifiAssocMs, 65535UL);
+    if (wifiAssocHistoryLen < 8) wifiAssocHistoryLen++;
+  }
+  appendLog("WiFi associated in " + String(wifiAssocMs) + " ms (" + wifiConnectMethod + "), IP: " + WiFi.localIP().toString());
+}
+
+
+// Tracks the WiFi link. A dropped link is retried straight away using the
+// cache, then with exponential backoff so a missing AP is not hammered.
+void serviceWiFi() {
+  unsigned long now = millis();
+
+  if (WiFi.status() == WL_CONNECTED) {
+    if (!wifiLinkUp) onWiFiConnected();
+    return;
+  }
+
+  if (wifiLinkUp) {
+    wifiLinkUp = false;
+    wifiDownSince = now;
+    wifiAttemptStart = 0;
+    wifiRetryDelay = WIFI_RETRY_MIN_MS;
+    wifiNextRetry = now;
+    appendLog("WiFi link lost, reconnecting");
+  }
+
+  if (wifiAttemptStart) {
+    unsigned long elapsed = now - wifiAttemptStart;
+    if (wifiAttemptFast && elapsed > WIFI_FAST_CONNECT_TIMEOUT_MS) {
+      debugPrint("Fast reconnect failed, falling back to a full scan");
+      wifiCache.magic = 0;
+      WiFi.disconnect();
+      startWiFi();
+    } else if (elapsed > WIFI_ATTEMPT_TIMEOUT_MS) {
+      wifiAttemptStart = 0;
+      wifiNextRetry = now + wifiRetryDelay;
+      debugPrintf("WiFi attempt timed out, next try in %lu ms\n", wifiRetryDelay);
+      wifiRetryDelay = min(wifiRetryDelay * 2, (unsigned long)WIFI_RETRY_MAX_MS);
+    }
+  } else if (!wifiSSID.isEmpty() && (long)(now - wifiNextRetry) >= 0) {
+    startWiFi();
+  }
+}
+
+
+void startFallbackAP() {
+  WiFi.mode(WIFI_AP_STA);
+  // An AP password must be at least 8 characters, anything shorter gives an open AP
+  const char* password = fallbackApPassword.length() >= 8 ? fallbackApPassword.c_str() : nullptr;
+  if (WiFi.softAP(fallbackApSSID.c_str(), password)) {
+    fallbackApActive = true;
+    networkMode = "fallback-ap";
+    appendLog("WiFi unavailable, started fallback AP '" + fallbackApSSID + "' on " + WiFi.softAPIP().toString());
+    bootPhaseEnd(bootControllablePhase, "fallback-ap");
+  } else {
+    const char* mode = loraReady ? "lora-only" : "offline";
+    networkMode = mode;
+    appendLog("WiFi unavailable and fallback AP failed, running " + networkMode);
+    bootPhaseEnd(bootControllablePhase, mode);
+  }
+}
+
+
+// Finishes off the parts of the boot that run in the background: WiFi joins or
+// times out into the fallback AP, NTP syncs or is given up on. Called from loop().
+void serviceBoot() {
+  unsigned long now = millis();
+
+  serviceWiFi();
+
+  if (bootWifiPhase >= 0 && !bootPhases[bootWifiPhase].result) {
+    if (wifiLinkUp) {
+      bootPhaseEnd(bootWifiPhase, "ok");
+      bootPhaseEnd(bootControllablePhase, "station");
+      networkMode = "station";
+      debugPrint(" -> Connected to wifi. Local allocated IP: " + WiFi.localIP().toString());
+    } else if (wifiSSID.isEmpty() || now - bootPhases[bootWifiPhase].startMs > WIFI_CONNECT_TIMEOUT_MS) {
+      bootPhaseEnd(bootWifiPhase, wifiSSID.isEmpty() ? "skipped" : "timeout");
+      startFallbackAP();
+    }
+  } else if (networkMode == "station") {
+    // Same fallback if the network goes away for good later on
+    if (!wifiLinkUp && now - wifiDownSince > WIFI_CONNECT_TIMEOUT_MS) {
+      startFallbackAP();
+    }
+  } else if (wifiLinkUp) {
+    // Back on the real network, the fallback AP is no longer needed
+    if (fallbackApActive) {
+      WiFi.softAPdisconnect(true);
+      WiFi.mode(WIFI_STA);
+      fallbackApActive = false;
+    }
+    networkMode = "station";
+    appendLog("WiFi connected, leaving fallback mode. IP: " + WiFi.localIP().toString());
+  }
+
+  if (bootNtpPhase >= 0 && !bootPhases[bootNtpPhase].result) {
+    if (clockSynced) {
+      bootPhaseEnd(bootNtpPhase, "ok");
+      debugPrint(shouldBeOnBySchedule() ? "I should wake" : "I should be sleeping. Need to check for a LoRa message");
+    } else if (now - bootPhases[bootNtpPhase].startMs > NTP_SYNC_TIMEOUT_MS) {
+      bootPhaseEnd(bootNtpPhase, "timeout");
+    }
+  }
+}
+
+
+// GET /api/health shows the crash counters, /api/health?exit_safe=1 leaves safe mode
+void handleHealthApi() {
+  if (server.hasArg("exit_safe")) {
+    if (!safeMode) {
+      server.send(400, "text/plain", "Not in safe mode");
+      return;
+    }
+    rtcHealth.crashStreak = 0;
+    rtcHealthSave();
+    appendLog("Leaving safe mode on request");
+    server.send(200, "text/plain", "Leaving safe mode, rebooting");
+    armJob(rebootJob, 1000);
+    return;
   }
 
-  debugPrint("Writing configuration to file...");
+  JsonDocument doc;
+  doc["safeMode"] = safeMode;
+  doc["resetReason"] = resetReasonName(bootResetReason);
+  auto clock = doc["clock"].to<JsonObject>();
+  static const char* const sources[] = { "none", "rtc", "ntp" };
+  clock["synced"] = clockSynced;
+  clock["source"] = sources[clockSource];
+  clock["timezone"] = clockTimezone;
+  clock["ntpSyncs"] = clockSyncCount;
+  if (rtcState.clockSyncEpoch && clockSynced) {
+    clock["lastSyncAgeSec"] = (uint32_t)(clockEpoch() - rtcState.clockSyncEpoch);
+  }
+  doc["crashStreak"] = rtcHealth.crashStreak;
+  doc["safeModeAfter"] = SAFE_MODE_CRASHES;
+  doc["totalCrashes"] = rtcHealth.totalCrashes;
+  doc["brownouts"] = rtcHealth.totalBrownouts;
+  if (rtcHealth.lastBrownoutEpoch) doc["lastBrownoutEpoch"] = rtcHealth.lastBrownoutEpoch;
+  doc["wdtTimeoutS"] = TASK_WDT_TIMEOUT_S;
+  doc["uptimeMs"] = millis();
+  auto debug = doc["debug"].to<JsonObject>();
+  debug["lines"] = debugLines.load();
+  debug["dropped"] = debugDropped.load();
+  debug["toFile"] = debugToFile;
+
+  auto counts = doc["resetCounts"].to<JsonObject>();
+  for (int i = 0; i < RESET_REASON_SLOTS; i++) {
+    if (rtcHealth.resetCounts[i]) {
+      counts[resetReasonName(i)] = counts[resetReasonName(i)].as<uint32_t>() + rtcHealth.resetCounts[i];
+    }
+  }
 
-  serializeJson(doc, file);
+  auto history = doc["crashes"].to<JsonArray>();
+  for (int i = 0; i < rtcHealth.historyLen; i++) {
+    auto crash = history.add<JsonObject>();
+    crash["reason"] = resetReasonName(rtcHealth.history[i].reason);
+    crash["uptimeSec"] = rtcHealth.history[i].uptimeSec;
+    if (rtcHealth.history[i].epoch) {
+      crash["epoch"] = rtcHealth.history[i].epoch;
+    }
+  }
 
-  debugPrint("Finished writing configuration to file");
-  file.close();
+  String json;
+  serializeJson(doc, json);
+  server.send(200, "application/json", json);
+}
+
+
+void handleBootApi() {
+  JsonDocument doc;
+  doc["network"] = networkMode;
+  doc["lora"] = loraReady;
+  doc["uptimeMs"] = millis();
+  if (bootControllablePhase >= 0 && bootPhases[bootControllablePhase].result) {
+    doc["timeToControllableMs"] = bootPhases[bootControllablePhase].endMs;
+  }
 
+  auto wake = doc["wake"].to<JsonObject>();
+  wake["reason"] = rtcState.wakeReason;
+  wake["bootCount"] = rtcState.bootCount;
+  wake["sleepCount"] = rtcState.sleepCount;
+  wake["quickSleepCount"] = rtcState.quickSleepCount;
 
-  debugPrint("[CONFIG] Configuration saved to /config.json");
-debugPrint("saveConfig elapsed: " + String(measureElapsedMs()) + " ms");
+  auto wifi = doc["wifi"].to<JsonObject>();
+  wifi["method"] = wifiConnectMethod;
+  wifi["assocMs"] = wifiAssocMs;
+  wifi["rssi"] = WiFi.RSSI();
+  auto history = wifi["assocHistoryMs"].to<JsonArray>();
+  for (int i = 0; i < wifiAssocHistoryLen; i++) {
+    history.add(wifiAssocHistory[i]);
+  }
+
+  auto phases = doc["phases"].to<JsonArray>();
+  for (int i = 0; i < bootPhaseCount; i++) {
+    auto phase = phases.add<JsonObject>();
+    phase["name"] = bootPhases[i].name;
+    phase["startMs"] = bootPhases[i].startMs;
+    if (bootPhases[i].result) {
+      phase["endMs"] = bootPhases[i].endMs;
+      phase["result"] = bootPhases[i].result;
+    } else {
+      phase["result"] = "running";
+    }
+  }
 
+  String json;
+  serializeJson(doc, json);
+  server.send(200, "application/json", json);
 }
 
-void toggleRelay(int i) {
-  appendLog("Toggle Pin:" + String(relayPins[i]) + " - " + String(relayLabels[i]) + " " + String(relayStates[i]) + " >> " + String(!relayStates[i]));
-  relayStates[i] = !relayStates[i];
-  digitalWrite(relayPins[i], relayStates[i] ? RELAY_OFF : RELAY_ON);
+
+bool setupLoRa() {
+  // LoRa SX1262 setup. radioTask stays off the radio meanwhile.
+  xSemaphoreTakeRecursive(loraLock, portMAX_DELAY);
+  int state = lora.begin(loraFrequency);
+  if (state == RADIOLIB_ERR_NONE) {
+    lora.setBandwidth(loraBandwidth);
+    lora.setSpreadingFactor(loraSpreadingFactor);
+    lora.setCodingRate(loraCodingRate);
+    lora.setOutputPower(loraOutputPower);
+    lora.setSyncWord(loraSyncWord);
+    // Receive on interrupt rather than polling the radio
+    loraDio1 = false;
+    lora.setDio1Action(onLoraDio1);
+    loraTxBusy = false;
+    lora.startReceive();
+    xSemaphoreGiveRecursive(loraLock);
+    debugPrintf("LoRa SX1262 configured: %.4f MHz, BW %.1f kHz, SF%d, CR 4/%d, %d dBm\n",
+                loraFrequency, loraBandwidth, loraSpreadingFactor, loraCodingRate, loraOutputPower);
+    return true;
+  }
+
+  xSemaphoreGiveRecursive(loraLock);
+  debugPrintf("LoRa SX1262 init failed, code %d\n", state);
+  return false;
 }
 
 
+// Restart only the subsystems whose settings changed. Called from loop() a
+// moment after the change so the HTTP response has already gone out.
+void applyConfigChanges(uint8_t changed) {
+  String applied = "";
 
+  if (changed & CFG_RELAYS) {
+    for (int i = 0; i < 6; i++) {
+      writeRelay(i);
+    }
+    applied += " relays";
+  }
 
-void handleRoot() {
-  measureElapsedMs();
+  if (changed & CFG_WIFI) {
+    WiFi.disconnect();
+    startWiFi();
+    applied += " wifi-restarted";
+  }
 
-  
-  IPAddress clientIP = server.client().remoteIP();
-  String logEntry = "Connection from IP: " + clientIP.toString();
-  debugPrint(logEntry);
+  if (changed & CFG_LORA) {
+    if (safeMode) {
+      applied += " lora-skipped(safe-mode)";
+    } else {
+      loraReady = setupLoRa();
+      applied += loraReady ? " lora-restarted" : " lora-FAILED";
+    }
+  }
 
-  // Optional: save to SPIFFS log file
-  appendLog(logEntry);
+  if (changed & CFG_WEB) {
+    server.stop();
+    server.begin(webServerPort);
+    applied += " web-restarted:" + String(webServerPort);
+  }
 
+  if (changed & CFG_BUTTONS) {
+    applied += " buttons";   // setButtons() has armed them already
+  }
 
-  String html = loadHTMLPart("/header.html");
-  html  += R"rawliteral(<div class="button-grid">)rawliteral";
+  if (changed & (CFG_SCHEDULE | CFG_SYSLOG)) {
+    applied += " in-place";
+  }
 
+  appendLog("Config applied:" + (applied.isEmpty() ? String(" no changes") : applied));
+}
 
 
-  for (int i = 0; i < 6; i++) {
-    String buttonClass = relayStates[i] ? "green active" : "red active";
-  
-    String dotStyle = "";
-    if (relayPingEnabled[i] && relayResetEnabled[i]) {
-      dotStyle = "style='--dot-color: yellow;'";
-      buttonClass += " has-dot";
-    } else if (relayPingEnabled[i]) {
-      dotStyle = "style='--dot-color: blue;'";
-      buttonClass += " has-dot";
-    }
-  
-    html += "<button id='relay" + String(i) + "' class='" + buttonClass + "' " + dotStyle + " onclick='toggleRelay(" + i + ")'>" + relayLabels[i] + "</button>";
+// Loads a config file that has just been made live and queues whatever
+// restarts its changes need.
+void activateConfig() {
+  JsonDocument doc;
+  if (!readConfigFile(CONFIG_PATH, doc)) {
+    appendLog("Activating config failed, could not read " CONFIG_PATH);
+    return;
   }
+  pendingApplyMask |= applyConfig(doc);
+  armJob(applyConfigJob, 500);
+}
 
 
-  html += R"rawliteral(
-  <button class="settings-button" onclick="location.href='/settings'">Settings</button>
-  <button class="settings-button" onclick="location.href='/log'">View Log</button>
-  <button class="reboot-button" onclick="location.href='/reboot'">Reboot</button>
-</div>
+// Promote the validated upload to the live config. The config it replaces is
+// kept as the rollback copy.
+bool swapInUploadedConfig() {
+  if (configOverlays) saveConfig();   // so the rollback copy is complete
+  if (LittleFS.exists(CONFIG_BAK_PATH)) {
+    LittleFS.remove(CONFIG_BAK_PATH);
+  }
+  if (LittleFS.exists(CONFIG_PATH) && !LittleFS.rename(CONFIG_PATH, CONFIG_BAK_PATH)) {
+    return false;
+  }
+  if (!LittleFS.rename(CONFIG_TMP_PATH, CONFIG_PATH)) {
+    LittleFS.rename(CONFIG_BAK_PATH, CONFIG_PATH);  // put the old one back
+    return false;
+  }
+  return true;
+}
 
-)rawliteral";
 
-  html += loadHTMLPart("/footer.html");
-  server.send(200, "text/html", html);
-  debugPrint("handleRoot elapsed: " + String(measureElapsedMs()) + " ms");
+void rejectUpload(const String& reason) {
+  if (uploadFile) {
+    uploadFile.close();
+  }
+  if (uploadError.isEmpty()) {
+    uploadError = reason;
+  }
+  LittleFS.remove(CONFIG_TMP_PATH);
+  appendLog("Config upload rejected: " + uploadError);
 }
 
-void handleToggle() {
+
+void handleFileUpload() {
   measureElapsedMs();
 
-  debugPrint("Handling toggle request");
-  if (server.hasArg("id")) {
-    int id = server.arg("id").toInt();
-    if (id >= 0 && id < 6) toggleRelay(id);
+  HTTPUpload& upload = server.upload();
+
+  if (upload.status == UPLOAD_FILE_START) {
+    debugPrint("Upload Start");
+    uploadOk = false;
+    uploadError = "";
+    uploadValidator.reset();
+    lastUploadSize = 0;
+    uploadFile = LittleFS.open(CONFIG_TMP_PATH, FILE_WRITE);
+    if (!uploadFile) {
+      uploadError = "Failed to open " CONFIG_TMP_PATH " for writing";
+      debugPrint(uploadError);
+      return;
+    } else {
+      debugPrint("Streaming upload into " CONFIG_TMP_PATH);
+    }
+
+  } else if (upload.status == UPLOAD_FILE_WRITE) {
+    // currentSize is the size of this chunk, not the running total
+    if (uploadFile && uploadError.isEmpty()) {
+      if (!uploadValidator.feed(upload.buf, upload.currentSize)) {
+        uploadError = String("Invalid JSON at byte ") + uploadValidator.offset + ": " + uploadValidator.error;
+        debugPrint(uploadError);
+        return;
+      }
+      size_t written = uploadFile.write(upload.buf, upload.currentSize);
+      lastUploadSize += written;
+      if (written != upload.currentSize) {
+        uploadError = "Write to flash failed, filesystem full?";
+        debugPrint(uploadError);
+        return;
+      }
+      debugPrintf("Wrote %u bytes, total uploaded: %u\n", written, lastUploadSize);
+    }
+
+  } else if (upload.status == UPLOAD_FILE_END) {
+    debugPrint("Upload Complete");
+    if (!uploadFile || !uploadError.isEmpty()) {
+      rejectUpload("Upload failed");
+      return;
+    }
+    uploadFile.close();
+
+    if (!uploadValidator.finish()) {
+      rejectUpload(String("Invalid JSON: ") + uploadValidator.error);
+      return;
+    }
+
+    // The syntax is good, now make sure it actually looks like our config
+    JsonDocument doc;
+    if (!readConfigFile(CONFIG_TMP_PATH, doc)) {
+      rejectUpload("Config could not be parsed");
+      return;
+    }
+    if (!doc["relayLabels"].is<JsonArray>() || !doc["wifi"]["ssid"].is<const char*>()) {
+      rejectUpload("Config is missing relayLabels or wifi.ssid");
+      return;
+    }
+
+    if (!swapInUploadedConfig()) {
+      rejectUpload("Could not swap in the new config");
+      return;
+    }
+
+    uploadOk = true;
+    appendLog("New config uploaded (" + String(lastUploadSize) + " bytes), previous config kept for rollback");
+    pendingApplyMask |= applyConfig(doc);
+    armJob(applyConfigJob, 500);
+
+  } else if (upload.status == UPLOAD_FILE_ABORTED) {
+    rejectUpload("Upload aborted");
   }
-  saveConfig();
-  server.send(200, "text/plain", "OK");
-  debugPrint("Toggle request handled successfully");
-  debugPrint("handleToggle elapsed: " + String(measureElapsedMs()) + " ms");
+  debugPrint("handleFileUpload elapsed: " + String(measureElapsedMs()) + " ms");
 }
 
-void handleSettings() {
+
+void handleRollbackConfig() {
   measureElapsedMs();
-  debugPrintf("Schedule enabled: %d\n", globalSchedule.enabled);
-  debugPrintf("Power ON time: %s\n", globalSchedule.powerOnTime.c_str());
-  debugPrintf("Power OFF time: %s\n", globalSchedule.powerOffTime.c_str());
 
-  String html = loadHTMLPart("/header.html");
+  if (!LittleFS.exists(CONFIG_BAK_PATH)) {
+    server.send(404, "text/plain", "No previous config to roll back to");
+    return;
+  }
 
-  html += R"rawliteral(
-  <div class="container">
-    <form action='/save'>
-      <table class='settings-table'>
-        <thead>
-          <tr>
-            <th>Label</th>
-            <th>Enable Ping</th>
-            <th>IP Address</th>
-            <th>Reset on Fail</th>
-          </tr>
-        </thead>
-        <tbody>
-  )rawliteral";
+  // Swap the live and backup copies, so a rollback can itself be undone
+  if (configOverlays) saveConfig();
+  LittleFS.remove(CONFIG_TMP_PATH);
+  LittleFS.rename(CONFIG_PATH, CONFIG_TMP_PATH);
+  if (!LittleFS.rename(CONFIG_BAK_PATH, CONFIG_PATH)) {
+    LittleFS.rename(CONFIG_TMP_PATH, CONFIG_PATH);
+    server.send(500, "text/plain", "Rollback failed");
+    return;
+  }
+  LittleFS.rename(CONFIG_TMP_PATH, CONFIG_BAK_PATH);
+
+  appendLog("Config rolled back to previous version");
+  activateConfig();
+  server.send(200, "text/plain", "Rolled back to previous config");
+  debugPrint("handleRollbackConfig elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
+
+
+// Copies the 8x8 tiles that changed since the last frame to the panel, one
+// run of tiles per tile row, and remembers what the panel now shows
+void sendDirtyTiles(uint8_t* shadow) {
+  uint8_t* buf = u8g2.getBufferPtr();
+  int tileWidth = u8g2.getBufferTileWidth();
+  int tileHeight = u8g2.getBufferTileHeight();
+
+  for (int ty = 0; ty < tileHeight; ty++) {
+    int first = -1, last = -1;
+    for (int tx = 0; tx < tileWidth; tx++) {
+      int offset = (ty * tileWidth + tx) * 8;
+      if (memcmp(buf + offset, shadow + offset, 8) != 0) {
+        if (first < 0) first = tx;
+        last = tx;
+      }
+    }
+    if (first >= 0) {
+      u8g2.updateDisplayArea(first, ty, last - first + 1, 1);
+      int offset = (ty * tileWidth + first) * 8;
+      memcpy(shadow + offset, buf + offset, (last - first + 1) * 8);
+      displayTilesSent += last - first + 1;
+    }
+  }
+}
+
+
+// Text rows are one tile (8 px) high so a changed value only dirties its own row
+void drawDashboard(const DisplayModel& m) {
+  char line[32];
+  u8g2.clearBuffer();
+  u8g2.setFont(u8g2_font_5x8_tr);
 
+  snprintf(line, sizeof(line), "G7NRU %s", m.safeMode ? "SAFE MODE" : "");
+  u8g2.drawStr(0, 6, line);
+  u8g2.drawStr(128 - 5 * 5, 6, m.clock);
+
+  snprintf(line, sizeof(line), "IP %s", m.ip[0] ? m.ip : "--");
+  u8g2.drawStr(0, 14, line);
+
+  char wifi[8] = "--", lora[8] = "--";
+  if (m.wifiRssi) snprintf(wifi, sizeof(wifi), "%d", m.wifiRssi);
+  if (m.loraRssi) snprintf(lora, sizeof(lora), "%d", m.loraRssi);
+  snprintf(line, sizeof(line), "WiFi %s  LoRa %s dBm", wifi, lora);
+  u8g2.drawStr(0, 22, line);
+
+  // Relay numbers on one row, a box under each that is filled when it is on
   for (int i = 0; i < 6; i++) {
-    html += "<tr>";
-    html += "<td><input type='text' name='label" + String(i) + "' value='" + relayLabels[i] + "' maxlength='20'></td>";
-    html += "<td><input type='checkbox' id='ping" + String(i) + "' name='ping" + String(i) + "'" + (relayPingEnabled[i] ? " checked" : "") + " onchange='togglePing(" + String(i) + ")'></td>";
-    html += "<td><input type='text' id='ip" + String(i) + "' name='ip" + String(i) + "' value='" + relayIPs[i] + "' maxlength='20' pattern='^$|^(?:[0-9]{1,3}\\.){3}[0-9]{1,3}$' title='Enter a valid IPv4 address or leave blank'></td>";
-    html += "<td><input type='checkbox' id='reset" + String(i) + "' name='reset" + String(i) + "'" + (relayResetEnabled[i] ? " checked" : "") + "></td>";
-    html += "</tr>";
+    int x = 4 + i * 21;
+    char num[2] = { (char)('1' + i), 0 };
+    u8g2.drawStr(x + 5, 30, num);
+    if (m.relayMask & (1 << i)) {
+      u8g2.drawBox(x, 33, 15, 6);
+    } else {
+      u8g2.drawFrame(x, 33, 15, 6);
+    }
   }
 
-  html += R"rawliteral(
-        </tbody>
-      </table>
-      <br>
-      <table class='settings-table'>
-        <tr>
-          <td><label for='globalSchedEnable'>Enable Deep Sleep Schedule</label></td>
-          <td><input type='checkbox' id='globalSchedEnable' name='globalScheduleEnabled')rawliteral";
-  html += globalSchedule.enabled ? " checked" : "";
-  html += R"rawliteral(></td>
-        </tr>
-        <tr>
-          <td><label for='globalOnTime'>Wake Time</label></td>
-          <td><input type='time' id='globalOnTime' name='globalOnTime' value=')rawliteral";
-  html += globalSchedule.powerOnTime;
-  html += R"rawliteral('></td>
-        </tr>
-        <tr>
-          <td><label for='globalOffTime'>Sleep Time</label></td>
-          <td><input type='time' id='globalOffTime' name='globalOffTime' value=')rawliteral";
-  html += globalSchedule.powerOffTime;
-  html += R"rawliteral('></td>
-        </tr>
-        <tr>
-          <td><label for='pollInterval'>Poll Interval (minutes)</label></td>
-          <td><input type='number' id='pollInterval' name='pollInterval' min='1' max='1440' value=')rawliteral";
-  html += String(globalSchedule.pollIntervalMinutes);
-  html += R"rawliteral('></td>
-        </tr>
-      </table>
+  u8g2.drawStr(0, 54, m.schedule);
+
+  snprintf(line, sizeof(line), "Batt %u.%uV", m.batteryDv / 10, m.batteryDv % 10);
+  u8g2.drawStr(0, 62, line);
+}
+
+
+// Low priority, on the other core from loop(). The I2C traffic happens here so
+// relay control never waits on the panel.
+void displayTask(void* param) {
+#ifdef VEXT_CTRL
+  pinMode(VEXT_CTRL, OUTPUT);
+  digitalWrite(VEXT_CTRL, LOW);   // Vext powers the OLED
+  vTaskDelay(pdMS_TO_TICKS(50));
+#endif
+  u8g2.begin();
+  u8g2.setBusClock(400000);
+  u8g2.clearDisplay();
+
+  static uint8_t shadow[128 * 64 / 8];   // what is on the panel right now
+  memset(shadow, 0, sizeof(shadow));
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    DisplayModel m;
+    portENTER_CRITICAL(&displayMux);
+    m = displayModel;
+    portEXIT_CRITICAL(&displayMux);
+
+    drawDashboard(m);
+    sendDirtyTiles(shadow);
+    displayFrames++;
+
+    vTaskDelay(pdMS_TO_TICKS(DISPLAY_MIN_INTERVAL_MS));
+  }
+}
+
+
+// Scheduler job: gathers what the display shows and wakes the display task
+// only when some of it has changed
+void jobDisplayModel() {
+  static int lastScheduleMinute = -1;
+  static char schedule[20] = "";
+
+  DisplayModel m;
+  memset(&m, 0, sizeof(m));
+  m.relayMask = rtcState.relayMask;
+  m.safeMode = safeMode;
+
+  struct tm timeinfo;
+  if (clockLocal(&timeinfo)) {
+    snprintf(m.clock, sizeof(m.clock), "%02d:%02d", timeinfo.tm_hour, timeinfo.tm_min);
+
+    // The schedule only moves on once a minute
+    int minute = timeinfo.tm_hour * 60 + timeinfo.tm_min;
+    if (minute != lastScheduleMinute) {
+      lastScheduleMinute = minute;
+      if (!globalSchedule.enabled) {
+        snprintf(schedule, sizeof(schedule), "No schedule");
+      } else if (shouldBeOnBySchedule()) {
+        snprintf(schedule, sizeof(schedule), "Off at %s", globalSchedule.powerOffTime.c_str());
+      } else {
+        snprintf(schedule, sizeof(schedule), "On at %s", globalSchedule.powerOnTime.c_str());
+      }
+    }
+  } else {
+    strcpy(m.clock, "--:--");
+    snprintf(schedule, sizeof(schedule), "Waiting for time");
+    lastScheduleMinute = -1;
+  }
+  strcpy(m.schedule, schedule);
+
+  if (WiFi.status() == WL_CONNECTED) {
+    strlcpy(m.ip, WiFi.localIP().toString().c_str(), sizeof(m.ip));
+    m.wifiRssi = WiFi.RSSI();
+  } else if (fallbackApActive) {
+    strlcpy(m.ip, WiFi.softAPIP().toString().c_str(), sizeof(m.ip));
+  }
+  m.loraRssi = lastLoraRssi;
+  m.batteryDv = (batteryMv + 50) / 100;
+
+  bool changed;
+  portENTER_CRITICAL(&displayMux);
+  changed = memcmp(&m, &displayModel, sizeof(m)) != 0;
+  if (changed) memcpy(&displayModel, &m, sizeof(m));
+  portEXIT_CRITICAL(&displayMux);
+
+  if (changed && displayTaskHandle) {
+    xTaskNotifyGive(displayTaskHandle);
+  }
+}
+
+
+bool probeActive(int relay) {
+  return relayPingEnabled[relay] && relayIPs[relay].length() > 0;
+}
+
+
+// What probeDecide() needs to know about the relays right now
+void probeRelayView(ProbeRelay* view) {
+  for (int i = 0; i < 6; i++) {
+    view[i] = { probeActive(i), relayResetEnabled[i], wheelArmed(pulseWheel, i), relayLabels[i].c_str() };
+  }
+}
 
-      <div class='form-buttons'>
-        <button class='settings-button' type='submit' form='settingsForm'>Save Settings</button>
-        <form action="/download_config" method="GET" style="display: inline;">
-          <button class="settings-button" type="submit">Download Settings</button>
-        </form>
-        <form id="uploadForm" method="POST" action="/upload_config" enctype="multipart/form-data" style="display: inline;">
-          <input type="file" id="uploadInput" name="upload" style="display: none;" required>
-          <button class="settings-button" type="button" onclick="triggerUpload()">Upload Settings</button>
-        </form>
-        <a href="/" style="margin-left: 10px;">
-          <button class="settings-button" type="button">Back</button>
-        </a>
-      </div>
-    </form>
-  </div>
-  )rawliteral";
 
-  html += loadHTMLPart("/footer.html");
-  server.send(200, "text/html", html);
-  debugPrint("handleSettings elapsed: " + String(measureElapsedMs()) + " ms");
+// RelayCore hooks for the probes. Verdict changes go in the log so the
+// history of why something was (or was not) reset is there afterwards.
+void probeVerdictChanged(int relay, ProbeVerdict was, const ProbeTarget& t) {
+  if (t.verdict != PROBE_IDLE && (t.verdict == PROBE_HOLD || was == PROBE_HOLD)) {
+    appendLog("Probe " + relayLabels[relay] + ": " + t.reason);
+  }
+  bumpStateVersion();
 }
 
 
+void probeResetting(int relay, const ProbeTarget& t) {
+  appendLog("Resetting " + relayLabels[relay] + ", " + t.reason);
+  auditFrom(AUDIT_PROBE, relay);
+}
 
 
+void probeReset(int relay, const ProbeTarget& t) {
+  memmove(&probeResets[1], &probeResets[0], (PROBE_RESET_LOG - 1) * sizeof(ProbeResetRecord));
+  probeResets[0] = { max((uint32_t)(millis() / 1000), 1U), (int8_t)relay, (uint8_t)probeFailures(probePolicy, t), t.samples };
+  if (probeResetCount < PROBE_RESET_LOG) probeResetCount++;
+}
 
-void handleLogPage() {
-  measureElapsedMs();
 
-  String html = loadHTMLPart("/header.html");
-  html += R"rawliteral(<div class="log-box">)rawliteral";
-  if (SPIFFS.exists("/log.txt")) {
-    File file = SPIFFS.open("/log.txt", "r");
-    if (file) {
-      while (file.available()) {
-        //html += file.readStringUntil('\n') + "<br>";
-        html += htmlEscape(file.readStringUntil('\n')) + "<br>";
-      }
-      file.close();
+void probeEvaluate() {
+  ProbeRelay view[6];
+  probeRelayView(view);
+  relayProbeEvaluate(relayCore, probePolicy, probeTargets, view, millis() / 1000, wheelNowTick());
+}
+
+
+void probeTask(void* param) {
+  ProbeResult probe;
+  for (;;) {
+    xQueueReceive(probeRequests, &probe, portMAX_DELAY);
+    probe.ok = Ping.ping(IPAddress(probe.ip), PROBE_PINGS);
+    probe.rttMs = probe.ok ? (uint16_t)Ping.averageTime() : 0;
+    xQueueSend(probeResults, &probe, portMAX_DELAY);
+    wakeLoop();
+  }
+}
+
+
+// Hands the next target in turn to probeTask. One target per run keeps each
+// run short.
+void jobProbe() {
+  for (int tries = 0; tries < 6 && !probeBusy; tries++) {
+    int relay = probeNext;
+    probeNext = (probeNext + 1) % 6;
+    if (!probeActive(relay)) continue;
+
+    IPAddress ip;
+    if (!ip.fromString(relayIPs[relay])) {
+      appendLog("Invalid IP for " + relayLabels[relay]);
+      continue;
     }
-  } else {
-    html += "<p>No log file found.</p>";
+    ProbeResult probe = { (int8_t)relay, (uint32_t)ip, false, 0 };
+    probeBusy = xQueueSend(probeRequests, &probe, 0) == pdTRUE;
   }
+  probeEvaluate();
+}
 
-  html += R"rawliteral(
-</div>
-<div class="controls">
-  <button class="settings-button" onclick="clearLog()">Clear Log</button>
-  <button class="settings-button" onclick="location.href='/'">Back to Control Panel</button>
-</div>
-)rawliteral";
 
-html += loadHTMLPart("/footer.html");
-  server.send(200, "text/html", html);
-  debugPrint("handleLogPage elapsed: " + String(measureElapsedMs()) + " ms");
+// loop(): a probe has come back from probeTask
+void handleProbeResults() {
+  ProbeResult probe;
+  while (xQueueReceive(probeResults, &probe, 0)) {
+    probeBusy = false;
+    int relay = probe.relay;
+    probeRecord(probePolicy, probeTargets[relay], probe.ok, probe.rttMs);
+    uint8_t traced[4] = { (uint8_t)relay, probe.ok, (uint8_t)probe.rttMs, (uint8_t)(probe.rttMs >> 8) };
+    traceEvent(TRACE_PROBE, traced, sizeof(traced));
+    debugPrintf("[PROBE] %s %s %u ms\n", relayLabels[relay].c_str(), probe.ok ? "ok" : "failed", probe.rttMs);
+  }
+  probeEvaluate();
 }
 
-void handleStatusApi() {
-  measureElapsedMs();
 
-  debugPrint("Handling API status request");
-  JsonDocument doc;
-  auto states = doc["states"].to<JsonArray>();
-  auto labels = doc["labels"].to<JsonArray>();
-  auto resetFlags = doc["reset"].to<JsonArray>();
-  auto ips = doc["ips"].to<JsonArray>();
+void traceStart(TraceSink sink) {
+  traceStop("restarted");
+  if (sink == TRACE_FLASH) {
+    traceFile = LittleFS.open(TRACE_PATH, "w");
+    if (!traceFile) {
+      appendLog("Trace not started, could not open " TRACE_PATH);
+      return;
+    }
+    traceFile.print(TRACE_MAGIC);
+  }
+  traceSink = sink;
+  traceLastUs = esp_timer_get_time();
+  traceEvents = 0;
+  traceBytes = sizeof(TRACE_MAGIC) - 1;
+  appendLog(String("Trace started, to ") + (sink == TRACE_FLASH ? TRACE_PATH : "serial"));
+  uint32_t epoch = clockEpoch();
+  traceEvent(TRACE_CLOCK, (const uint8_t*)&epoch, 4);
+}
 
-  for (int i = 0; i < 6; i++) {
-    states.add(relayStates[i]);
-    labels.add(relayLabels[i]);
-    resetFlags.add(relayResetEnabled[i]);
-    ips.add(relayIPs[i]);
+
+// /api/trace?start=flash|serial starts recording, ?stop=1 stops it. Either
+// way the answer is where recording stands.
+void handleTraceApi() {
+  if (server.hasArg("start")) {
+    traceStart(server.arg("start") == "serial" ? TRACE_SERIAL : TRACE_FLASH);
+  } else if (server.hasArg("stop")) {
+    traceStop("asked to");
   }
 
-  // This will return log data but for now we wont use this so I will supress it
-  // doc["log"] = logText;
+  JsonDocument doc;
+  doc["recording"] = traceSink == TRACE_FLASH ? "flash" : traceSink == TRACE_SERIAL ? "serial" : "off";
+  doc["events"] = traceEvents;
+  doc["bytes"] = traceBytes;
+  doc["maxBytes"] = TRACE_MAX_BYTES;
+  doc["saved"] = LittleFS.exists(TRACE_PATH);
+  String body;
+  serializeJson(doc, body);
+  server.send(200, "application/json", body);
+}
 
-  String json;
-  serializeJson(doc, json);
-  server.send(200, "application/json", json);
-  debugPrint("API status response sent");
-  debugPrint("handleStatusApi elapsed: " + String(measureElapsedMs()) + " ms");
+
+// /api/debug/tail?lines=N, the newest debug output as plain text
+void handleDebugTail() {
+  int lines = server.hasArg("lines") ? constrain(server.arg("lines").toInt(), 1, 500) : 50;
+  server.sendHeader("X-Debug-Lines", String(debugLines.load()));
+  server.sendHeader("X-Debug-Dropped", String(debugDropped.load()));
+  server.send(200, "text/plain", debugTailText(lines));
 }
 
-void handleDownloadLog() {
-  measureElapsedMs();
 
-  if (SPIFFS.exists("/log.txt")) {
-    File file = SPIFFS.open("/log.txt", "r");
-    server.streamFile(file, "text/plain");
-    file.close();
-    appendLog("Log downloaded");
-  } else {
-    server.send(404, "text/plain", "Log file not found");
+void handleTraceDownload() {
+  if (traceFile) traceFile.flush();
+  File file = LittleFS.open(TRACE_PATH, "r");
+  if (!file) {
+    server.send(404, "text/plain", "No trace recorded");
+    return;
   }
-  debugPrint("handleDownloadLog elapsed: " + String(measureElapsedMs()) + " ms");
+  server.sendHeader("Content-Disposition", "attachment; filename=trace.bin");
+  server.streamFile(file, "application/octet-stream");
+  file.close();
 }
 
-void handleClearLog() {
-  measureElapsedMs();
 
-  if (SPIFFS.exists("/log.txt")) {
-    SPIFFS.remove("/log.txt");
+// POST /api/trace/inject with one traced event (type byte and payload) as hex.
+// Feeds it through the same code the real input goes through, so a replay
+// drives the firmware the way the field did. HTTP events are replayed as
+// real requests instead, timers and clock syncs happen on their own.
+void handleTraceInject() {
+  String hex = server.arg("plain");
+  hex.trim();
+  size_t len = hex.length() / 2;
+  if (len < 1 || len > sizeof(traceBuf) || hex.length() % 2) {
+    server.send(400, "text/plain", "Expected one event as hex");
+    return;
   }
-  File logFile = SPIFFS.open("/log.txt", FILE_WRITE);
-  debugPrint("Trying to clear the log..");
-  if (logFile) {
-    logFile.print(""); // Not strictly necessary, but keeps logic clear
-    logFile.close();
-    appendLog("Log cleared");
-    server.send(200, "text/plain", "Log cleared");
-  } else {
-    appendLog("Failed to clear the log");
-    server.send(500, "text/plain", "Failed to clear log");
+  uint8_t* event = traceBuf;
+  for (size_t i = 0; i < len; i++) {
+    char byte[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+    char* end;
+    event[i] = strtoul(byte, &end, 16);
+    if (*end) {
+      server.send(400, "text/plain", "Expected one event as hex");
+      return;
+    }
   }
-  debugPrint("handleClearLog elapsed: " + String(measureElapsedMs()) + " ms");
-}
 
-void handleSave() {
-  measureElapsedMs();
+  const uint8_t* payload = event + 1;
+  len--;
+  bool ok = false;
+  int64_t startUs = esp_timer_get_time();
+  if (event[0] == TRACE_LORA && len > 3 && len <= 3 + LORA_FRAME_MAX) {
+    int16_t rssi;
+    memcpy(&rssi, payload, 2);
+    handleLoraInbound(payload + 3, len - 3, rssi, (int8_t)payload[2] / 4.0f, false, startUs);
+    ok = true;
+  } else if (event[0] == TRACE_BUTTON && len == 2 && payload[0] < buttonCount) {
+    Button& b = buttons[payload[0]];
+    if (payload[1]) fireButton(payload[0], b.longAction, b.longRelay, true, millis());
+    else fireButton(payload[0], b.shortAction, b.shortRelay, false, millis());
+    ok = true;
+  } else if (event[0] == TRACE_PROBE && len == 4 && payload[0] < 6) {
+    probeRecord(probePolicy, probeTargets[payload[0]], payload[1], payload[2] | (payload[3] << 8));
+    probeEvaluate();
+    ok = true;
+  }
+  if (!ok) {
+    server.send(400, "text/plain", "Not an event that can be injected");
+    return;
+  }
 
-  debugPrint("[SAVE] Handling settings save...");
+  char body[64];
+  snprintf(body, sizeof(body), "{\"us\":%lu,\"version\":%lu}",
+           (unsigned long)(esp_timer_get_time() - startUs), (unsigned long)stateVersion);
+  server.send(200, "application/json", body);
+}
 
-  for (int i = 0; i < 6; i++) {
-    relayLabels[i] = server.arg("label" + String(i));
-    relayIPs[i] = server.arg("ip" + String(i));
-    relayPingEnabled[i] = server.hasArg("ping" + String(i));
-    relayResetEnabled[i] = server.hasArg("reset" + String(i));
 
-    debugPrintf("[SAVE] Relay %d - Label: %s, IP: %s, Ping: %s, Reset: %s\n",
-                  i,
-                  relayLabels[i].c_str(),
-                  relayIPs[i].c_str(),
-                  relayPingEnabled[i] ? "ENABLED" : "DISABLED",
-                  relayResetEnabled[i] ? "ENABLED" : "DISABLED");
+// /api/audit?from=&to=&relay=&limit= , newest first. from and to are epoch
+// seconds; sectors outside them are skipped using the index, so only the
+// ones the range touches are read. Records made before the clock synced have
+// no time and only turn up when there is no range.
+void handleAuditApi() {
+  if (!auditPart) {
+    server.send(503, "text/plain", "No audit partition");
+    return;
+  }
+  measureElapsedMs();
+
+  bool ranged = server.hasArg("from") || server.hasArg("to");
+  uint32_t from = server.hasArg("from") ? strtoul(server.arg("from").c_str(), nullptr, 10) : 0;
+  uint32_t to = server.hasArg("to") ? strtoul(server.arg("to").c_str(), nullptr, 10) : 0xFFFFFFFF;
+  int relay = server.hasArg("relay") ? server.arg("relay").toInt() : -1;
+  int limit = server.hasArg("limit") ? constrain(server.arg("limit").toInt(), 1, AUDIT_QUERY_MAX) : 100;
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  JsonOut out = jsonOut(jsonToServer, nullptr);
+  out.beginObject();
+  out.key(JK("records"));
+  out.beginArray();
+
+  int count = 0, sectorsRead = 0;
+  AuditRecord batch[AUDIT_READ_BATCH];
+  for (int n = 0; n < auditSectors && count < limit; n++) {
+    int s = (auditHead - n + auditSectors) % auditSectors;
+    const AuditSector& sec = auditIndex[s];
+    if (!sec.used) continue;
+    if (ranged && (!sec.minEpoch || sec.maxEpoch < from || sec.minEpoch > to)) continue;
+    sectorsRead++;
+
+    // Back from the last batch written in this sector
+    for (int slot = (sec.used - 1) / AUDIT_READ_BATCH * AUDIT_READ_BATCH; slot >= 0 && count < limit; slot -= AUDIT_READ_BATCH) {
+      esp_partition_read(auditPart, s * AUDIT_SECTOR + slot * sizeof(AuditRecord), batch, sizeof(batch));
+      for (int i = AUDIT_READ_BATCH - 1; i >= 0 && count < limit; i--) {
+        const AuditRecord& r = batch[i];
+        if (!auditValid(r)) continue;
+        if (ranged && (!r.epoch || r.epoch < from || r.epoch > to)) continue;
+        if (relay >= 0 && (r.what & 7) != relay) continue;
+
+        AuditSource source = (AuditSource)(r.what >> 5);
+        out.beginObject();
+        out.key(JK("seq")); out.value((unsigned long)r.seq);
+        out.key(JK("epoch")); out.value((unsigned long)r.epoch);
+        out.key(JK("relay")); out.value(r.what & 7);
+        out.key(JK("old")); out.value((bool)(r.what & 8));
+        out.key(JK("new")); out.value((bool)(r.what & 16));
+        out.key(JK("source")); out.value(auditSourceNames[source]);
+        out.key(JK("id"));
+        if (source == AUDIT_WEB) out.value(IPAddress(r.sourceId).toString());
+        else out.value((unsigned long)r.sourceId);
+        out.key(JK("latencyMs")); out.value((unsigned int)r.latencyMs);
+        out.endObject();
+        count++;
+      }
+    }
   }
 
-  // Save global deep sleep schedule
-  globalSchedule.enabled = server.hasArg("globalScheduleEnabled");
-  debugPrintf("[SAVE] Global schedule enabled: %s\n", globalSchedule.enabled ? "YES" : "NO");
+  out.endArray();
+  out.key(JK("count")); out.value(count);
+  out.key(JK("sectorsRead")); out.value(sectorsRead);
+  out.key(JK("sectors")); out.value(auditSectors);
+  out.key(JK("capacity")); out.value((unsigned long)((auditSectors - 1) * AUDIT_PER_SECTOR));
+  out.key(JK("nextSeq")); out.value((unsigned long)auditNextSeq);
+  out.key(JK("dropped")); out.value((unsigned long)auditDropped);
+  out.endObject();
+  out.flush();
+  server.sendContent("");
+  debugPrint("handleAuditApi elapsed: " + String(measureElapsedMs()) + " ms");
+}
+
 
-  if (server.hasArg("globalOnTime")) {
-    globalSchedule.powerOnTime = server.arg("globalOnTime");
-    debugPrintf("[SAVE] Global On Time set to: %s\n", globalSchedule.powerOnTime.c_str());
+void handleProbesApi() {
+  JsonDocument doc;
+  uint32_t nowSec = millis() / 1000;
+
+  auto policy = doc["policy"].to<JsonObject>();
+  policy["intervalSeconds"] = probePolicy.intervalSeconds;
+  policy["window"] = probePolicy.window;
+  policy["failThreshold"] = probePolicy.failThreshold;
+  policy["rttCeilingMs"] = probePolicy.rttCeilingMs;
+  policy["cooldownMinutes"] = probePolicy.cooldownMinutes;
+  policy["maxResetsPerHour"] = probePolicy.maxResetsPerHour;
+  auto escalation = policy["escalation"].to<JsonArray>();
+  for (int i = 0; i < 6 && probePolicy.escalation[i] >= 0; i++) {
+    escalation.add(probePolicy.escalation[i]);
   }
 
-  if (server.hasArg("globalOffTime")) {
-    globalSchedule.powerOffTime = server.arg("globalOffTime");
-    debugPrintf("[SAVE] Global Off Time set to: %s\n", globalSchedule.powerOffTime.c_str());
+  auto targets = doc["targets"].to<JsonArray>();
+  for (int relay = 0; relay < 6; relay++) {
+    if (!probeActive(relay)) continue;
+    const ProbeTarget& t = probeTargets[relay];
+    auto target = targets.add<JsonObject>();
+    target["relay"] = relay;
+    target["label"] = relayLabels[relay];
+    target["ip"] = relayIPs[relay];
+    target["samples"] = t.samples;
+    target["failures"] = probeFailures(probePolicy, t);
+
+    // Newest first, "x" failed and "." ok
+    char bits[PROBE_WINDOW_MAX + 1];
+    for (int i = 0; i < t.samples; i++) {
+      bits[i] = (t.failBits >> i) & 1 ? 'x' : '.';
+    }
+    bits[t.samples] = 0;
+    target["history"] = bits;
+
+    uint32_t rttSum = 0, rttCount = 0, rttMax = 0;
+    for (int i = 0; i < PROBE_WINDOW_MAX; i++) {
+      if (!t.rttMs[i]) continue;
+      rttSum += t.rttMs[i];
+      rttCount++;
+      rttMax = max(rttMax, (uint32_t)t.rttMs[i]);
+    }
+    if (rttCount) {
+      target["rttAvgMs"] = rttSum / rttCount;
+      target["rttMaxMs"] = rttMax;
+    }
+    target["resetsLastHour"] = probeResetsLastHour(t, nowSec);
+    if (t.resetAtSec[0]) {
+      target["lastResetAgoSec"] = nowSec - t.resetAtSec[0];
+    }
+    target["verdict"] = probeVerdictName(t.verdict);
+    target["reason"] = t.reason;
   }
 
-  if (server.hasArg("pollInterval")) {
-    globalSchedule.pollIntervalMinutes = server.arg("pollInterval").toInt();
-    if (globalSchedule.pollIntervalMinutes > 1440) {
-      globalSchedule.pollIntervalMinutes = 5;
-    } 
-    debugPrintf("[SAVE] Poll interval set to: %d minutes\n", globalSchedule.pollIntervalMinutes);
+  auto resets = doc["resets"].to<JsonArray>();
+  for (int i = 0; i < probeResetCount; i++) {
+    auto reset = resets.add<JsonObject>();
+    reset["relay"] = probeResets[i].relay;
+    reset["agoSec"] = nowSec - probeResets[i].atSec;
+    reset["failures"] = probeResets[i].failures;
+    reset["of"] = probeResets[i].window;
   }
 
+  String json;
+  serializeJson(doc, json);
+  server.send(200, "application/json", json);
+}
+
 
-  saveConfig();
-  debugPrint("[SAVE] Configuration saved. Redirecting to main page.");
+// loop() side of a button press: logging, saving and the display
+void handleButtonEvents() {
+  ButtonEvent event;
+  while (xQueueReceive(buttonEvents, &event, 0)) {
+    uint8_t traced[2] = { event.button, event.longPress };
+    traceEvent(TRACE_BUTTON, traced, sizeof(traced));
+    String what = "Button " + String(event.button) + (event.longPress ? " long" : "") + " press: ";
+    if (event.action == BTN_WAKE) {
+      stayAwakeUntil = millis() + STAY_AWAKE_MS;
+      appendLog(what + "staying awake for " + String(STAY_AWAKE_MS / 60000) + " minutes");
+      continue;
+    }
+
+    buttonSettle(relayCore, event.action, event.relay);   // the press is the new settled state
+    rtcStateSave();
+    markConfigDirty();
+    armJob(displayJob, 0);
+    bumpStateVersion();
+    auditFrom(AUDIT_BUTTON, event.button);
+    for (int i = 0; i < 6; i++) {
+      bool was = event.before & (1 << i), now = event.after & (1 << i);
+      if (was != now) auditRecord(i, was, now, event.latencyMs);
+    }
 
-  server.sendHeader("Location", "/");
-  server.send(303);
-  debugPrint("handleSave elapsed: " + String(measureElapsedMs()) + " ms");
+    if (event.action == BTN_TOGGLE) {
+      appendLog(what + relayLabels[event.relay] + (relayStates[event.relay] ? " on" : " off"));
+    } else {
+      appendLog(what + (event.action == BTN_ALL_ON ? "all on" : "all off"));
+    }
+  }
 }
 
-void handleReboot() {
-  measureElapsedMs();
 
-  String html = loadHTMLPart("/header.html");
-  html += "<h1>Rebooting...</h1><p>Check the log for confirmation</p><script>setPageTimeout();</script>";
-  html += loadHTMLPart("/footer.html");
-  server.send(200, "text/html", html);
-  debugPrint("handleReboot elapsed: " + String(measureElapsedMs()) + " ms");
-  
-  rebootPending = true; // set the reboot flag
-  rebootStartTime = millis(); // remember the time  
+// Scheduler jobs, registered in setup()
 
-}
+// Picks the LED pattern for the most important thing going on
+void jobLedStatus() {
+  bool lowBattery = false;
+  for (int i = 0; i < shedRuleCount; i++) {
+    lowBattery |= shedRules[i].shed;
+  }
 
-void goToDeepSleep(uint32_t sleepSeconds) {
-  debugPrintf("Going to sleep for %u seconds...\n", sleepSeconds);
-  delay(100);  // Allow Serial flush
+  LedPatternId was = ledWanted;
+  if (safeMode) {
+    ledSetPattern(LED_SAFE_MODE);
+  } else if (lowBattery) {
+    ledSetPattern(LED_LOW_BATTERY);
+  } else if (WiFi.status() != WL_CONNECTED) {
+    ledSetPattern(LED_WIFI_DOWN);
+  } else if (rtcState.pulseMask) {
+    ledSetPattern(LED_PULSING);
+  } else {
+    ledSetPattern(LED_ALIVE);
+  }
+  if (ledWanted != was) bumpStateVersion();   // /api/status reports it
+}
 
-  // Stop Wi-Fi to reduce power
-  WiFi.disconnect(true); // Disconnect and turn off Wi-Fi
-  WiFi.mode(WIFI_OFF);
 
-  // Set all RTC-capable GPIOs to input to reduce current
-  for (gpio_num_t gpio = GPIO_NUM_0; gpio < GPIO_NUM_MAX; gpio = (gpio_num_t)(gpio + 1)) {
-    if (!rtc_gpio_is_valid_gpio(gpio)) continue;
-    rtc_gpio_deinit(gpio);           // Reset RTC GPIO function
-    gpio_reset_pin(gpio);            // Reset to default
-    gpio_set_direction(gpio, GPIO_MODE_INPUT); // Set as input
-    gpio_pullup_dis(gpio);           // Disable pull-up
-    gpio_pulldown_dis(gpio);         // Disable pull-down
+void jobScheduleCheck() {
+  // Lets see if we should be sleeping and if so, sleepy time
+  if (!shouldBeOnBySchedule() && millis() >= stayAwakeUntil) {
+    debugPrint("I should be sleeping - Going to sleep now");
+    appendLog("Schedule says off, going to deep sleep");
+    goToDeepSleep(globalSchedule.pollIntervalMinutes * 60);
   }
+}
 
-  // Enable wake-up timer
-  esp_sleep_enable_timer_wakeup((uint64_t)sleepSeconds * 1000000ULL);
 
-  // Start deep sleep
-  esp_deep_sleep_start();
+// Runs every second. Sends a beacon soon after our state changes, or when the
+// interval is up; each quiet beacon doubles the interval up to the idle one.
+void jobLoraBeacon() {
+  if (!loraReady || beaconStillQueued()) return;
+  uint32_t now = millis();
+
+  if (beaconWorthSending(currentBeaconState())) {
+    if (beaconChangedMs == 0) beaconChangedMs = now;
+    if (now - beaconChangedMs >= LORA_BEACON_SETTLE_MS) {
+      beaconIntervalMs = LORA_BEACON_FAST_MS;
+      sendLoraBeacon();
+    }
+    return;
+  }
+  beaconChangedMs = 0;
+
+  if (beaconLastMs == 0 || now - beaconLastMs >= beaconIntervalMs) {
+    sendLoraBeacon();
+    beaconIntervalMs = min(beaconIntervalMs * 2, (uint32_t)LORA_BEACON_IDLE_MS);
+  }
 }
 
-void handleDeepSleep() {
-  measureElapsedMs();
 
-  server.send(200, "text/plain", "Good night :-)");
-  goToDeepSleep(30);
-  return;
+void jobSaveConfig() {
+  if (configDirty) {
+    configDirty = false;
+    saveConfig();
+  }
+}
+
 
+// Apply config changes once the response that triggered them has gone out
+void jobApplyConfig() {
+  uint8_t changed = pendingApplyMask;
+  pendingApplyMask = 0;
+  if (changed) {
+    applyConfigChanges(changed);
+  }
 }
 
 
+// Keeps the crash records honest and works out when a boot counts as stable
+void jobHealth() {
+  rtcHealth.lastUptimeSec = millis() / 1000;
+  rtcHealth.lastEpoch = clockEpoch();
 
-void handleFileUpload() {
-  measureElapsedMs();
+  if (!safeMode && rtcHealth.crashStreak && millis() > STABLE_UPTIME_MS) {
+    appendLog("Running stable, crash streak of " + String(rtcHealth.crashStreak) + " cleared");
+    rtcHealth.crashStreak = 0;
+  }
 
-  HTTPUpload& upload = server.upload();
+  // Try a normal boot again. One more crash puts us straight back in safe mode.
+  if (safeMode && millis() > SAFE_MODE_RETRY_MS) {
+    appendLog("Safe mode retry, rebooting normally");
+    rtcHealth.crashStreak = SAFE_MODE_CRASHES - 1;
+    rtcHealthSave();
+    armJob(rebootJob, 0);
+  }
+  rtcHealthSave();
+}
 
-  if (upload.status == UPLOAD_FILE_START) {
-    debugPrint("Upload Start");
-    if (SPIFFS.exists("/config.json")) {
-      SPIFFS.remove("/config.json");
-      debugPrint("Old config.json removed");
-    }
-    uploadFile = SPIFFS.open("/config.json", FILE_WRITE);
-    lastUploadSize = 0;
-    if (!uploadFile) {
-      debugPrint("Failed to open file for writing");
-      return;
-    } else {
-      debugPrint("Opened config.json for writing");
-    }
 
-  } else if (upload.status == UPLOAD_FILE_WRITE) {
-    if (uploadFile) {
-      size_t chunkSize = upload.currentSize - lastUploadSize;
-      size_t written = uploadFile.write(upload.buf, chunkSize);
-      lastUploadSize = upload.currentSize;
-      debugPrintf("Wrote %u bytes, total uploaded: %u\n", written, lastUploadSize);
-    }
+void jobReboot() {
+  appendLog("Rebooting ESP32");
+  if (configDirty) {
+    saveConfig();
+  }
+  logSync();
+  debugDrain(200);
+  ESP.restart();
+}
 
-  } else if (upload.status == UPLOAD_FILE_END) {
-    debugPrint("Upload Complete");
-    if (uploadFile) {
-      uploadFile.close();
-      debugPrint("File closed");
+
+void handleSchedulerApi() {
+  JsonDocument doc;
+  int64_t now = esp_timer_get_time();
+  auto list = doc["jobs"].to<JsonArray>();
+  for (int i = 0; i < jobCount; i++) {
+    auto job = list.add<JsonObject>();
+    job["name"] = jobs[i].name;
+    job["periodMs"] = jobs[i].periodMs;
+    job["armed"] = jobs[i].heapPos >= 0;
+    if (jobs[i].heapPos >= 0) {
+      job["dueInMs"] = (jobs[i].dueUs - now) / 1000;
     }
+    job["runs"] = jobs[i].runs;
+    job["skipped"] = jobs[i].skipped;
+    job["avgLateUs"] = jobs[i].runs ? (uint32_t)(jobs[i].totalLateUs / jobs[i].runs) : 0;
+    job["maxLateUs"] = jobs[i].maxLateUs;
+    job["maxRunUs"] = jobs[i].maxRunUs;
+  }
+
+  auto display = doc["display"].to<JsonObject>();
+  display["frames"] = displayFrames;
+  display["tilesSent"] = displayTilesSent;
 
-    // Optional: Verify uploaded file
-    File f = SPIFFS.open("/config.json", FILE_READ);
-    if (f) {
-      debugPrintf("Final file size: %u bytes\n", f.size());
+  String json;
+  serializeJson(doc, json);
+  server.send(200, "application/json", json);
+}
 
-      // Print preview of contents
-      char preview[101] = {0};
-      size_t len = f.readBytes(preview, 100);
-      debugPrintf("First %u bytes: %s\n", len, preview);
 
-      f.close();
-    } else {
-      debugPrint("Failed to open uploaded file for verification");
-    }
+void relayLock() {
+  portENTER_CRITICAL(&relayMux);
+}
 
-    // SPIFFS does not support file modification timestamps directly,
-    // but you can log the time manually if you have a time source
-    appendLog("New config uploaded at " + String(millis()) + "ms uptime");
 
-    handleReboot();
-  }
-  debugPrint("handleFileUpload elapsed: " + String(measureElapsedMs()) + " ms");
+void relayUnlock() {
+  portEXIT_CRITICAL(&relayMux);
 }
 
 
+const RelayHooks relayHooks = {
+  relayLock, relayUnlock, writeRelay, buttonWriteRelay, pulseArmed, pulseCleared,
+  pulseStarted, pulseCancelled, cycleRefused, probeVerdictChanged, probeResetting, probeReset,
+};
 
-SX1262 lora = new Module(RADIO_CS_PIN, RADIO_DIO1_PIN, RADIO_RST_PIN, RADIO_BUSY_PIN);
 
 void setup() {
-  Serial.begin(115200);
+  quickSleepCheck();
+  recordBoot();
+
+  // From here on a hang anywhere in setup() or loop() resets us within TASK_WDT_TIMEOUT_S
+  esp_task_wdt_init(TASK_WDT_TIMEOUT_S, true);
+  esp_task_wdt_add(nullptr);
 
+  Serial.begin(115200);
+  debugBegin();
 
+  int relayPhase = bootPhaseStart("relays");
 
   debugPrint("============================================");
   debugPrint("Booting the G7NRU Remote Station Controller");
@@ -838,22 +5623,12 @@ void setup() {
   debugPrint("============================================");
 
 
-/*
-Display stuf for another day
-
-  Wire.begin(17, 18);  // SDA=17, SCL=18 for your board
-  u8g2.begin();
-  u8g2.clearBuffer();
-  u8g2.setFont(u8g2_font_ncenB08_tr);
-  u8g2.drawStr(0, 24, "G7NRU Remote Lora Station Controller");
-  u8g2.sendBuffer();
-  delay(1000); // Give time for the display to show the message
-  debugPrint("Starting setup...");
-*/
-
-  if (!SPIFFS.begin(true)) {
-    debugPrint("SPIFFS mount failed");
-    return;
+  // Without a filesystem we still restore relays (from defaults) and bring up
+  // the network so the unit can be reached and fixed remotely.
+  if (!mountStorage()) {
+    debugPrint("LittleFS mount failed, continuing with default config");
+  } else {
+    logStart();
   }
 
   debugPrint("Logging Hardware Info");
@@ -861,30 +5636,19 @@ Display stuf for another day
   // logHardwareInfo();
 
   debugPrint("Loading Config");
+  relayCore.hooks = relayHooks;
+  wheelInit(pulseWheel, wheelNowTick());   // applyConfig looks at it
   loadConfig();
 
-
-  if (!shouldBeOnBySchedule())
-    {
-      debugPrint("I should be sleeping. Need to check for a LoRa message");
-        
-      // Pole for Lora  message. 
-
-      // if (!validWakeMessage) {...
-      
-      // goToDeepSleep(globalSchedule.pollIntervalMinutes * 60);
-
-      // ...}
-    }
-    else
-    {
-      debugPrint("I should wake");
+  // The RTC copy of the relay states is newer than config.json after a
+  // deep sleep or a soft reset, so it wins when it is valid
+  bool restoreFromRtc = rtcState.bootCount > 1;
+  if (restoreFromRtc) {
+    debugPrintf("Restoring relays from RTC memory: 0x%02X (wake reason %d)\n", rtcState.relayMask, rtcState.wakeReason);
+    for (int i = 0; i < 6; i++) {
+      relayStates[i] = rtcState.relayMask & (1 << i);
     }
-
-
-  // if !wake = true
-  // Call deepsleep again..
-      
+  }
 
 
   // Here we are looking at setting the relays according to the saved config. And setting up the onboard LED as an output
@@ -892,56 +5656,109 @@ Display stuf for another day
   debugPrint("Setting relays");
   for (int i = 0; i < 6; i++) {
        
+    // Set the level before releasing any hold left over from deep sleep, so the output never glitches
     pinMode(relayPins[i], OUTPUT);
     debugPrint(String("Init GPIO Pin ") + relayPins[i] + " for Relay " + i);
-    digitalWrite(relayPins[i], relayStates[i] ? RELAY_OFF : RELAY_ON);
+    writeRelay(i);
     //delay(500);
   }
+  releaseRelayHold();
+  if (restoreFromRtc) {
+    restorePulses();
+  } else {
+    rtcState.pulseMask = 0;
+    rtcStateSave();
+  }
 
-  pinMode(ledPin, OUTPUT);
-  digitalWrite(ledPin, LOW);
- 
-  
-  debugPrint("Setting up LoRa radio");
+  setupButtons();
+  setupLeds();
+  if (rtcState.wakeReason == ESP_SLEEP_WAKEUP_EXT0 || rtcState.wakeReason == ESP_SLEEP_WAKEUP_EXT1) {
+    stayAwakeUntil = millis() + STAY_AWAKE_MS;
+    appendLog("Woken by a button, staying awake for " + String(STAY_AWAKE_MS / 60000) + " minutes");
+  }
+  bootPhaseEnd(relayPhase, "ok");
 
-  // LoRa SX1262 setup
-  SPI.begin(RADIO_SCLK_PIN, RADIO_MISO_PIN, RADIO_MOSI_PIN, RADIO_CS_PIN);
-  int state = lora.begin(439.9125); // Set frequency to 433 MHz
-  if (state == RADIOLIB_ERR_NONE) {
-    lora.setBandwidth(125.0);        // 125 kHz bandwidth
-    lora.setSpreadingFactor(12);      // SF12
-    lora.setCodingRate(5);            // 4/5 coding rate
-    lora.setOutputPower(14);         // Set output power to 14 dBm
-    lora.setSyncWord(0x12);          // LoRaWAN public sync word
-    Serial.println("LoRa SX1262 configured!");
+  xTaskCreatePinnedToCore(displayTask, "display", 4096, nullptr, 1, &displayTaskHandle, 0);
+
+  if (bootResetReason == ESP_RST_BROWNOUT) {
+    appendLog("Back from a brownout, " + String(rtcHealth.totalBrownouts) + " since power on");
+  }
+  if (safeMode) {
+    appendLog("Safe mode after " + String(rtcHealth.crashStreak) + " crashes (last: " +
+              resetReasonName(bootResetReason) + "), LoRa and probes are off");
   } else {
-    Serial.print("LoRa SX1262 init failed, code ");
-    Serial.println(state);
-    while (1);
+    xTaskCreatePinnedToCore(batteryTask, "battery", 3072, nullptr, 1, nullptr, 0);
   }
-  
-  
-  
-  
-  
-  // Setting up wifi and connecting to the network
 
-  WiFi.setHostname("RelayController");  // Set this to something unique and descriptive
-  WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
-  debugPrint("Trying WiFi SSID: " + wifiSSID + " | Password: " + wifiPassword);
-  delay(500);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    debugPrint(".");
-  }
-  debugPrint(" -> Connected to wifi. Local allocated IP: " + WiFi.localIP().toString());
 
-  // Setup NTP and sync
-  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+  // WiFi, LoRa and NTP come up side by side. WiFi association and NTP run in
+  // the background and are finished off (or timed out) by serviceBoot() from loop().
 
-  
+  bootWifiPhase = bootPhaseStart("wifi");
+  bootControllablePhase = bootPhaseStart("controllable");
+  startWiFi();
+
+  debugPrint("Setting up LoRa radio");
+  int loraPhase = bootPhaseStart("lora");
+  // Remotes remember recent seqs to drop repeats. The epoch keeps this boot's
+  // from being taken for repeats of the last one's.
+  loraEpoch = esp_random();
+  // The lock and inbox exist even in safe mode, so the API can take them safely
+  loraLock = xSemaphoreCreateRecursiveMutex();
+  loraInbox = xQueueCreate(4, sizeof(LoraInbound));
+  if (safeMode) {
+    bootPhaseEnd(loraPhase, "skipped");
+  } else {
+    SPI.begin(RADIO_SCLK_PIN, RADIO_MISO_PIN, RADIO_MOSI_PIN, RADIO_CS_PIN);
+    loraReady = setupLoRa();
+    xTaskCreatePinnedToCore(radioTask, "radio", 4096, nullptr, 3, &radioTaskHandle, 1);
+    bootPhaseEnd(loraPhase, loraReady ? "ok" : "failed");
+  }
+  if (!loraReady && !safeMode) {
+    appendLog("LoRa radio failed to start, continuing without LoRa");
+  }
+
+  // Setup NTP, it syncs on its own once the network is up
+  bootNtpPhase = bootPhaseStart("ntp");
+  clockBegin();
+  auditBegin();
+  configTzTime(clockTimezone.c_str(), "pool.ntp.org", "time.nist.gov");
+
+  // Everything loop() does on a timer
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  addJob("timer-wheel", serviceTimerWheel, WHEEL_TICK_MS);
+  addJob("boot-network", serviceBoot, 100);
+  addJob("led-status", jobLedStatus, 500);
+  addJob("health", jobHealth, 10000);
+  displayJob = addJob("display", jobDisplayModel, DISPLAY_MODEL_MS);
+  stateVersion = (esp_random() & 0xFFFFFF) + 1;
+  statusWaitJob = addJob("status-wait", jobStatusWaiters, 500);
+  auditEraseJob = addJob("audit-erase", jobAuditErase, 0);
+  armJob(auditEraseJob, 0);
+  addJob("log-sync", logSync, LOG_SYNC_MS);
+  if (!safeMode) {
+    addJob("load-shed", checkLoadShedding, 1000);
+    addJob("schedule", jobScheduleCheck, 300000);
+    probeRequests = xQueueCreate(1, sizeof(ProbeResult));
+    probeResults = xQueueCreate(1, sizeof(ProbeResult));
+    xTaskCreatePinnedToCore(probeTask, "probe", 4096, nullptr, 1, nullptr, 0);
+    probeJob = addJob("probe", jobProbe, probePeriodMs());
+    addJob("lora-beacon", jobLoraBeacon, 1000);
+  }
+  configSaveJob = addJob("config-save", jobSaveConfig, 0);
+  applyConfigJob = addJob("config-apply", jobApplyConfig, 0);
+  rebootJob = addJob("reboot", jobReboot, 0);
+
+#if CONFIG_PM_ENABLE
+  // With power management built in, let the idle task light sleep while loop() waits
+  esp_pm_config_esp32s3_t pmConfig = { .max_freq_mhz = 240, .min_freq_mhz = 80, .light_sleep_enable = true };
+  esp_pm_configure(&pmConfig);
+#endif
+
+  int webPhase = bootPhaseStart("web");
+  server.addHandler(&traceTap);   // sees every request first, see TraceTap
     server.on("/style.css", HTTP_GET, []() {
-    File file = SPIFFS.open("/style.css", "r");
+    File file = LittleFS.open("/style.css", "r");
     if (!file) {
       server.send(404, "text/css", "");
       return;
@@ -952,7 +5769,7 @@ Display stuf for another day
   });
   
   server.on("/script.js", HTTP_GET, []() {
-    File file = SPIFFS.open("/script.js", "r");
+    File file = LittleFS.open("/script.js", "r");
     if (!file) {
       server.send(404, "application/javascript", "");
       return;
@@ -965,7 +5782,7 @@ Display stuf for another day
   
 
   server.on("/logo.png", HTTP_GET, []() {
-  File file = SPIFFS.open("/logo.png", "r");
+  File file = LittleFS.open("/logo.png", "r");
   if (!file) {
     server.send(404, "image/png", "");
     return;
@@ -974,7 +5791,7 @@ Display stuf for another day
   server.streamFile(file, "image/png");
   file.close();
 });
-  //server.serveStatic("/logo.png", SPIFFS, "/logo.png");
+  //server.serveStatic("/logo.png", LittleFS, "/logo.png");
   
   
   server.on("/", handleRoot);
@@ -982,13 +5799,18 @@ Display stuf for another day
   server.on("/settings", handleSettings);
   server.on("/log", handleLogPage);
   server.on("/api/status", handleStatusApi);
+  const char* statusHeaders[] = { "If-None-Match" };
+  server.collectHeaders(statusHeaders, 1);
+  server.on("/api/relays", handleRelaysApi);
   server.on("/download_log", handleDownloadLog);
   server.on("/clearlog", HTTP_GET, handleClearLog);
-  server.on("/save", handleSave);
+  server.on("/api/config", HTTP_PATCH, handleConfigPatch);
   server.on("/reboot", handleReboot);
   server.on("/deepsleep", handleDeepSleep);
+  server.on("/rollback_config", handleRollbackConfig);
   server.on("/download_config", HTTP_GET, []() {
-    File configFile = SPIFFS.open("/config.json", "r");
+    if (configOverlays) saveConfig();
+    File configFile = LittleFS.open(CONFIG_PATH, "r");
     if (!configFile) {
       server.send(404, "text/plain", "File not found");
       return;
@@ -1005,91 +5827,64 @@ Display stuf for another day
   });
   server.on("/upload_config", HTTP_POST, []() 
     {
-    // server.send(200, "text/plain", "Upload handled");
+    if (!uploadOk) {
+      server.send(400, "text/plain", "Config upload rejected, the current config was left in place: " + uploadError);
+      return;
+    }
     server.sendHeader("Location", "/settings");  // or "/"
     server.send(303);  // HTTP 303 See Other, redirect after POST
 
     debugPrint("Procesing uploaded file");
     }, handleFileUpload);
+  server.on("/api/boot", handleBootApi);
+  server.on("/api/battery", handleBatteryApi);
+  server.on("/api/scheduler", handleSchedulerApi);
+  server.on("/api/health", handleHealthApi);
+  server.on("/api/probes", handleProbesApi);
+  server.on("/api/remote", handleRemoteApi);
+  server.on("/api/audit", HTTP_GET, handleAuditApi);
+  server.on("/api/trace", HTTP_GET, handleTraceApi);
+  server.on("/api/trace/download", HTTP_GET, handleTraceDownload);
+  server.on("/api/debug/tail", HTTP_GET, handleDebugTail);
+  server.on("/api/trace/inject", HTTP_POST, handleTraceInject);
   
-  server.begin();
+  server.begin(webServerPort);
+  bootPhaseEnd(webPhase, "ok");
 }
 
 void loop() {
+  esp_task_wdt_reset();
+
   //debugPrint(">>");
+  auditFrom(AUDIT_WEB, 0);   // the client's address is looked up if a relay changes
   server.handleClient();
+  if (traceHttpPending) traceHttp();
   //debugPrint("<<");
-  
-  String currentTime = getCurrentTimeStr();
-  
 
-
-  if (rebootPending && millis() - rebootStartTime > 1000) {  // 10 seconds
-    appendLog("Rebooting ESP32");
-    ESP.restart();
+  if (loraInbox && uxQueueMessagesWaiting(loraInbox)) {
+    handleLoraInbox();
   }
 
-
-  // Light pulses from the LED so that we know the ESP32 is stull processing this loop
-
-  if (millis() - lastStatusFlashOn > 3000) {
-    lastStatusFlashOn = millis();
-    // debugPrint("LED ON");
-    digitalWrite(ledPin, HIGH);  // Turn LED on
-  }
-  else if (millis() - lastStatusFlashOff > 1500) {
-    lastStatusFlashOff = millis();
-    // debugPrint("LED OFF");
-    digitalWrite(ledPin, LOW);   // Turn LED off
+  if (buttonEvents && uxQueueMessagesWaiting(buttonEvents)) {
+    handleButtonEvents();
   }
 
+  if (probeResults && uxQueueMessagesWaiting(probeResults)) {
+    handleProbeResults();
+  }
 
-  // --- Ping test logic ---
-  if (millis() - lastPingTime > 300000) {
-    // Before we do the pings, lets see if we should be sleeping and if so, sleepy time
-    if (!shouldBeOnBySchedule())
-        {
-          debugPrint("I should be sleeping - Going to sleep now");
-          //goToDeepSleep(globalSchedule.pollIntervalMinutes * 60);
-        }
-
-    lastPingTime = millis();
-    for (int i = 0; i < 6; i++) {
-        if (relayPingEnabled[i] && relayIPs[i].length() > 0) {
-        IPAddress ip;
-        if (ip.fromString(relayIPs[i])) {
-          int failed = 0;
-          /*
-          if (!Ping.ping(ip, 5))  {
-            appendLog("Ping failed for " + relayLabels[i]);
-            if (relayResetEnabled[i]) {
-              appendLog("Resetting " + relayLabels[i]);
-              appendLog("-- Toggle over ...  " + relayLabels[i]);
-              toggleRelay(i);
-              delay(1000);
-              toggleRelay(i);
-              appendLog("-- Toggle back ...  " + relayLabels[i]);
-            }
-          } else {
-            appendLog("Ping OK for " + relayLabels[i] + " (" + ip.toString() + ")");
-          }
-            */
-        } else {
-          appendLog("Invalid IP for " + relayLabels[i]);
-        }
-      }
-    
-    }
+  if (clockSyncPending) {
+    clockService();
   }
-  
-  // LoRa receive
-    String incoming;
-    int rxState = lora.receive(incoming, 0); // 0 = non-blocking
-    if (rxState == RADIOLIB_ERR_NONE) {
-        Serial.print("[LoRa RX] Received: ");
-        Serial.println(incoming);
-    }
 
+  // Sleep until the next deadline or until something wakes us (a LoRa packet,
+  // a relay change), but come back often enough to keep the web server polled.
+  // The idle task gets the CPU meanwhile, which lets it drop into light sleep.
+  int64_t untilNextUs = runScheduler();
+  uint32_t waitMs = constrain(untilNextUs / 1000, (int64_t)0, (int64_t)LOOP_POLL_MS);
+  if (waitMs) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+  }
 }
 
 
@@ -0,0 +1,168 @@
+#include <unity.h>
+#include <string.h>
+#include <BeaconCodec.h>
+
+BeaconState base;
+BeaconKey senderKey;
+BeaconKey receiverKey;
+uint8_t buf[16];
+
+void setUp(void) {
+  base = { 0x15, 0x00, 0x02, 620, 0x0555, 12345 };   // 12.4 V, relays 0, 2, 4 on
+  memset(&senderKey, 0, sizeof(senderKey));
+  memset(&receiverKey, 0, sizeof(receiverKey));
+}
+
+void tearDown(void) {}
+
+bool sameState(const BeaconState& a, const BeaconState& b) {
+  return beaconDiff(a, b) == 0 && a.uptimeMin == b.uptimeMin;
+}
+
+// Sends a full beacon from base as seq and has the receiver take it
+void sendFull(uint8_t seq) {
+  size_t bits = packBeaconFull(buf, base);
+  senderKey = { base, seq, true };
+  BeaconState got;
+  TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, seq, receiverKey, got));
+}
+
+
+void test_full_round_trip(void) {
+  size_t bits = packBeaconFull(buf, base);
+  TEST_ASSERT_EQUAL(BEACON_FULL_BITS, bits);
+  TEST_ASSERT_EQUAL(58, bits);
+  BeaconState got;
+  TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, 9, receiverKey, got));
+  TEST_ASSERT_TRUE(sameState(base, got));
+  TEST_ASSERT_TRUE(receiverKey.have);
+  TEST_ASSERT_EQUAL(9, receiverKey.seq);
+}
+
+
+void test_full_at_field_limits(void) {
+  base = { 0x3F, 0x3F, 0x07, (1 << BEACON_BITS_BATTERY) - 1, 0x0FFF, (1UL << BEACON_BITS_UPTIME) - 1 };
+  size_t bits = packBeaconFull(buf, base);
+  BeaconState got;
+  TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, 1, receiverKey, got));
+  TEST_ASSERT_TRUE(sameState(base, got));
+}
+
+
+// Nothing changed but the clock: kind, seq, mask and uptime, 24 bits
+void test_idle_delta_is_three_bytes(void) {
+  sendFull(40);
+  BeaconState now = base;
+  now.uptimeMin += 15;
+  size_t bits = packBeaconDelta(buf, now, senderKey);
+  TEST_ASSERT_EQUAL(1 + 8 + 5 + BEACON_BITS_UP_D, bits);
+  BeaconState got;
+  TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, 41, receiverKey, got));
+  TEST_ASSERT_TRUE(sameState(now, got));
+}
+
+
+void test_delta_carries_only_moved_fields(void) {
+  sendFull(7);
+  BeaconState now = base;
+  now.relayMask = 0x14;
+  now.battery = base.battery - 12;   // falling battery, negative delta
+  now.uptimeMin += 3;
+  size_t bits = packBeaconDelta(buf, now, senderKey);
+  TEST_ASSERT_EQUAL(1 + 8 + 5 + BEACON_BITS_MASK + BEACON_BITS_BATT_D + BEACON_BITS_UP_D, bits);
+  BeaconState got;
+  TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, 8, receiverKey, got));
+  TEST_ASSERT_TRUE(sameState(now, got));
+}
+
+
+void test_every_field_round_trips(void) {
+  sendFull(200);
+  BeaconState now = { 0x2A, 0x01, 0x05, (uint16_t)(base.battery + 63), 0x0F0F, base.uptimeMin + 1023 };
+  size_t bits = packBeaconDelta(buf, now, senderKey);
+  TEST_ASSERT_GREATER_THAN(0, bits);
+  BeaconState got;
+  TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, 201, receiverKey, got));
+  TEST_ASSERT_TRUE(sameState(now, got));
+}
+
+
+// Out of the delta's range, so the sender has to make a new key
+void test_delta_out_of_range(void) {
+  sendFull(1);
+  BeaconState now = base;
+  now.battery = base.battery + 64;
+  TEST_ASSERT_EQUAL(0, packBeaconDelta(buf, now, senderKey));
+  now.battery = base.battery - 65;
+  TEST_ASSERT_EQUAL(0, packBeaconDelta(buf, now, senderKey));
+  now = base;
+  now.uptimeMin += 1 << BEACON_BITS_UP_D;
+  TEST_ASSERT_EQUAL(0, packBeaconDelta(buf, now, senderKey));
+}
+
+
+// A receiver that missed the full beacon can't use the deltas after it
+void test_delta_against_missed_key(void) {
+  sendFull(5);
+  base.relayMask = 0;
+  senderKey = { base, 6, true };   // full beacon 6 never arrives
+
+  BeaconState now = base;
+  now.uptimeMin++;
+  size_t bits = packBeaconDelta(buf, now, senderKey);
+  BeaconState got;
+  TEST_ASSERT_FALSE(unpackBeacon(buf, (bits + 7) / 8, 7, receiverKey, got));
+
+  BeaconKey fresh = {};
+  TEST_ASSERT_FALSE(unpackBeacon(buf, (bits + 7) / 8, 7, fresh, got));
+}
+
+
+void test_truncated_frames(void) {
+  size_t bits = packBeaconFull(buf, base);
+  BeaconState got;
+  TEST_ASSERT_FALSE(unpackBeacon(buf, (bits + 7) / 8 - 1, 3, receiverKey, got));
+  TEST_ASSERT_FALSE(receiverKey.have);
+
+  sendFull(3);
+  BeaconState now = base;
+  now.probeBits = 0;
+  bits = packBeaconDelta(buf, now, senderKey);
+  TEST_ASSERT_FALSE(unpackBeacon(buf, 2, 4, receiverKey, got));
+}
+
+
+// An hour on a quiet station, one beacon a minute after a full one: the
+// deltas have to stay well under the full size or they are not worth it
+void test_hour_of_deltas_is_smaller(void) {
+  sendFull(0);
+  size_t fullBytes = (BEACON_FULL_BITS + 7) / 8;
+  size_t deltaBytes = 0;
+  BeaconState now = base;
+  for (int m = 1; m <= 15; m++) {
+    now.uptimeMin++;
+    if (m % 5 == 0) now.battery--;
+    size_t bits = packBeaconDelta(buf, now, senderKey);
+    TEST_ASSERT_GREATER_THAN(0, bits);
+    BeaconState got;
+    TEST_ASSERT_TRUE(unpackBeacon(buf, (bits + 7) / 8, m, receiverKey, got));
+    TEST_ASSERT_TRUE(sameState(now, got));
+    deltaBytes += (bits + 7) / 8;
+  }
+  TEST_ASSERT_LESS_THAN(fullBytes * 15 / 2, deltaBytes);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_full_round_trip);
+  RUN_TEST(test_full_at_field_limits);
+  RUN_TEST(test_idle_delta_is_three_bytes);
+  RUN_TEST(test_delta_carries_only_moved_fields);
+  RUN_TEST(test_every_field_round_trips);
+  RUN_TEST(test_delta_out_of_range);
+  RUN_TEST(test_delta_against_missed_key);
+  RUN_TEST(test_truncated_frames);
+  RUN_TEST(test_hour_of_deltas_is_smaller);
+  return UNITY_END();
+}
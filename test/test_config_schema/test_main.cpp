@@ -0,0 +1,128 @@
+#include <unity.h>
+#include <string.h>
+#include <ArduinoJson.h>
+#include <ConfigSchema.h>
+
+char error[96];
+
+// Stands in for the board: 35 drives the LED, 2-7 the relays
+bool pinInUse(int gpio) {
+  return gpio == 35 || (gpio >= 2 && gpio <= 7);
+}
+
+bool check(const char* json) {
+  JsonDocument doc;
+  error[0] = 0;
+  TEST_ASSERT_FALSE_MESSAGE(deserializeJson(doc, json), json);
+  return checkConfigPatch(doc.as<JsonObjectConst>(), pinInUse, error, sizeof(error));
+}
+
+void rejected(const char* json, const char* why) {
+  TEST_ASSERT_FALSE_MESSAGE(check(json), json);
+  TEST_ASSERT_EQUAL_STRING(why, error);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+
+void test_ipv4(void) {
+  uint32_t ip = 0;
+  TEST_ASSERT_TRUE(parseIPv4("192.168.3.1", &ip));
+  TEST_ASSERT_EQUAL_UINT32(0x0103A8C0, ip);
+  TEST_ASSERT_TRUE(parseIPv4("0.0.0.0", &ip));
+  TEST_ASSERT_TRUE(parseIPv4("255.255.255.255", &ip));
+  const char* bad[] = { "", "1.2.3", "1.2.3.4.5", "256.1.1.1", "1.2.3.4 ", " 1.2.3.4", "1..2.3", "a.b.c.d",
+                        "1.2.3.-4", "0001.2.3.4", "1.2.3.4x" };
+  for (const char* text : bad) TEST_ASSERT_FALSE_MESSAGE(parseIPv4(text, &ip), text);
+}
+
+
+// The apply and save code walk the table a section at a time, which only
+// works if every section's fields sit together
+void test_sections_are_contiguous(void) {
+  for (size_t i = 0; i < CONFIG_FIELDS; i++) {
+    if (!configSectionStart(i)) continue;
+    for (size_t j = 0; j < i; j++) {
+      TEST_ASSERT_FALSE_MESSAGE(strcmp(configFields[j].section, configFields[i].section) == 0, configFields[i].section);
+    }
+  }
+  TEST_ASSERT_EQUAL_PTR(&configFields[0], findConfigField("relayLabels", nullptr));
+  TEST_ASSERT_NOT_NULL(findConfigField("lora", "maxHops"));
+  TEST_ASSERT_NULL(findConfigField("lora", "colour"));
+  TEST_ASSERT_NULL(findConfigField("relayLabels", "x"));
+}
+
+
+void test_good_patches(void) {
+  TEST_ASSERT_TRUE(check("{}"));
+  TEST_ASSERT_TRUE(check("{\"relayLabels\":[\"a\",\"b\",\"c\",\"d\",\"e\",\"\"]}"));
+  TEST_ASSERT_TRUE(check("{\"relayIPs\":{\"0\":\"10.0.0.1\",\"5\":\"\"}}"));
+  TEST_ASSERT_TRUE(check("{\"globalSchedule\":{\"enabled\":true,\"powerOnTime\":\"06:30\",\"pollIntervalMinutes\":5}}"));
+  TEST_ASSERT_TRUE(check("{\"lora\":{\"frequency\":439.9125,\"bandwidth\":125,\"outputPower\":-9,\"mesh\":false}}"));
+  TEST_ASSERT_TRUE(check("{\"wifi\":{\"staticIP\":\"\",\"dns\":\"1.1.1.1\"},\"webPort\":8080,\"timezone\":\"UTC0\"}"));
+  TEST_ASSERT_TRUE(check("{\"buttons\":[],\"probe\":{\"escalation\":[0,2]}}"));
+  TEST_ASSERT_TRUE(check("{\"statusLedPin\":-1}"));
+  TEST_ASSERT_TRUE(check("{\"statusLedPin\":48}"));
+}
+
+
+void test_unknown_fields(void) {
+  rejected("{\"colour\":1}", "colour is not a config field");
+  rejected("{\"lora\":{\"colour\":1}}", "lora.colour is not a config field");
+  rejected("{\"relayStates\":[true,true,true,true,true,true]}", "relayStates is not a config field");
+}
+
+
+void test_per_relay_shapes(void) {
+  rejected("{\"pingEnabled\":[true,false]}", "pingEnabled must have 6 entries");
+  rejected("{\"pingEnabled\":{\"6\":true}}", "pingEnabled: 6 is not a relay");
+  rejected("{\"pingEnabled\":{\"01\":true}}", "pingEnabled: 01 is not a relay");
+  rejected("{\"pingEnabled\":true}", "pingEnabled must be a list of 6 or an object keyed by relay");
+  rejected("{\"cycleOffSeconds\":{\"2\":0}}", "cycleOffSeconds must be a whole number from 1 to 3600");
+  rejected("{\"relayIPs\":{\"1\":\"10.0.0\"}}", "relayIPs must be an IPv4 address or empty");
+}
+
+
+void test_value_types_and_ranges(void) {
+  rejected("{\"wifi\":\"x\"}", "wifi must be an object");
+  rejected("{\"wifi\":{\"ssid\":\"0123456789012345678901234567890123\"}}", "ssid must be a string of 0 to 32 characters");
+  rejected("{\"fallbackAp\":{\"password\":\"short\"}}", "password must be a string of 8 to 64 characters");
+  rejected("{\"globalSchedule\":{\"enabled\":1}}", "enabled must be true or false");
+  rejected("{\"globalSchedule\":{\"powerOffTime\":\"24:00\"}}", "powerOffTime must be a time as HH:MM");
+  rejected("{\"globalSchedule\":{\"powerOffTime\":\"7:00pm\"}}", "powerOffTime must be a time as HH:MM");
+  rejected("{\"lora\":{\"spreadingFactor\":7.5}}", "spreadingFactor must be a whole number from 5 to 12");
+  rejected("{\"lora\":{\"frequency\":2400}}", "frequency must be a number from 150 to 960");
+  rejected("{\"lora\":{\"nodeId\":\"3\"}}", "nodeId must be a whole number from 1 to 254");
+  rejected("{\"battery\":{\"shedRules\":{}}}", "shedRules must be a list");
+  rejected("{\"webPort\":0}", "webPort must be a whole number from 1 to 65535");
+}
+
+
+void test_status_led_pin(void) {
+  rejected("{\"statusLedPin\":35}", "statusLedPin must be -1 or a free GPIO up to 48");
+  rejected("{\"statusLedPin\":4}", "statusLedPin must be -1 or a free GPIO up to 48");
+  rejected("{\"statusLedPin\":49}", "statusLedPin must be -1 or a free GPIO up to 48");
+  rejected("{\"statusLedPin\":-2}", "statusLedPin must be -1 or a free GPIO up to 48");
+  rejected("{\"statusLedPin\":\"21\"}", "statusLedPin must be -1 or a free GPIO up to 48");
+}
+
+
+// One bad field anywhere fails the whole patch
+void test_all_or_nothing(void) {
+  rejected("{\"webPort\":80,\"lora\":{\"maxHops\":3,\"syncWord\":256}}", "syncWord must be a whole number from 0 to 255");
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_ipv4);
+  RUN_TEST(test_sections_are_contiguous);
+  RUN_TEST(test_good_patches);
+  RUN_TEST(test_unknown_fields);
+  RUN_TEST(test_per_relay_shapes);
+  RUN_TEST(test_value_types_and_ranges);
+  RUN_TEST(test_status_led_pin);
+  RUN_TEST(test_all_or_nothing);
+  return UNITY_END();
+}
@@ -0,0 +1,167 @@
+#include <unity.h>
+#include <stdio.h>
+#include <Debounce.h>
+
+// Bounce harness. A button is a list of input changes on a 0.1 ms virtual
+// clock; each change runs the ISR side and wakes the "task", which otherwise
+// sleeps for whatever wait debounceService() asked for, as buttonTask does.
+#define MAX_LATENCY_MS 20
+
+struct Change {
+  uint32_t atUs;
+  bool level;
+};
+
+struct Fired {
+  DebounceEvent event;
+  uint32_t atMs;
+  uint32_t sinceMs;
+};
+
+Fired fired[16];
+int firedCount;
+
+void run(const Change* changes, int count, bool hasLong, uint32_t endMs) {
+  Debouncer d;
+  debounceReset(d, false);
+  firedCount = 0;
+  bool level = false;
+  int next = 0;
+  bool awake = false;
+  uint32_t wakeAtMs = UINT32_MAX;
+
+  for (uint32_t us = 0; us <= endMs * 1000; us += 100) {
+    uint32_t nowMs = us / 1000;
+    while (next < count && changes[next].atUs <= us) {
+      if (changes[next].level != level) {
+        level = changes[next].level;
+        debounceEdge(d, nowMs);
+        awake = true;
+      }
+      next++;
+    }
+    if (!awake && (wakeAtMs == UINT32_MAX || nowMs < wakeAtMs)) continue;
+
+    // The task runs on the ms tick it woke in, like ulTaskNotifyTake() with pdMS_TO_TICKS
+    awake = false;
+    uint32_t waitMs = UINT32_MAX, sinceMs = 0;
+    DebounceEvent event = debounceService(d, level, hasLong, nowMs, &sinceMs, &waitMs);
+    if (event != DEB_NONE) fired[firedCount++] = { event, nowMs, sinceMs };
+    wakeAtMs = waitMs == UINT32_MAX ? UINT32_MAX : nowMs + (waitMs ? waitMs : 1);
+  }
+}
+
+// A contact that chatters for bounceUs either side of a press held for holdMs
+int bouncyPress(Change* out, uint32_t startUs, uint32_t holdMs, uint32_t bounceUs, uint32_t stepUs) {
+  int n = 0;
+  bool level = true;
+  for (uint32_t t = 0; t < bounceUs; t += stepUs, level = !level) out[n++] = { startUs + t, level };
+  out[n++] = { startUs + bounceUs, true };
+  uint32_t releaseUs = startUs + holdMs * 1000;
+  level = false;
+  for (uint32_t t = 0; t < bounceUs; t += stepUs, level = !level) out[n++] = { releaseUs + t, level };
+  out[n++] = { releaseUs + bounceUs, false };
+  return n;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+
+void test_clean_press(void) {
+  Change c[] = { { 10000, true }, { 200000, false } };
+  run(c, 2, false, 400);
+  TEST_ASSERT_EQUAL(1, firedCount);
+  TEST_ASSERT_EQUAL(DEB_SHORT, fired[0].event);
+  TEST_ASSERT_EQUAL(10, fired[0].sinceMs);
+  TEST_ASSERT_EQUAL(10 + DEBOUNCE_QUIET_MS, fired[0].atMs);
+}
+
+
+// Contact bounce from 0.3 ms to 5 ms long, at a few chatter rates: always one
+// event, and it lands within MAX_LATENCY_MS of the first edge
+void test_bounce_patterns(void) {
+  const uint32_t bounces[] = { 300, 1000, 2500, 5000 };
+  const uint32_t steps[] = { 100, 300, 700 };
+  for (uint32_t bounceUs : bounces) {
+    for (uint32_t stepUs : steps) {
+      Change c[256];
+      int n = bouncyPress(c, 50000, 150, bounceUs, stepUs);
+      run(c, n, false, 500);
+      char what[80];
+      snprintf(what, sizeof(what), "bounce %u us every %u us", (unsigned)bounceUs, (unsigned)stepUs);
+      TEST_ASSERT_EQUAL_MESSAGE(1, firedCount, what);
+      TEST_ASSERT_EQUAL_MESSAGE(50, fired[0].sinceMs, what);
+      TEST_ASSERT_TRUE_MESSAGE(fired[0].atMs - fired[0].sinceMs < MAX_LATENCY_MS, what);
+    }
+  }
+}
+
+
+// With a long action the short one waits for the release, latency counted from the release
+void test_short_with_long_action(void) {
+  Change c[256];
+  int n = bouncyPress(c, 20000, 300, 3000, 200);
+  run(c, n, true, 700);
+  TEST_ASSERT_EQUAL(1, firedCount);
+  TEST_ASSERT_EQUAL(DEB_SHORT, fired[0].event);
+  TEST_ASSERT_EQUAL(320, fired[0].sinceMs);
+  TEST_ASSERT_LESS_THAN(MAX_LATENCY_MS, fired[0].atMs - fired[0].sinceMs);
+}
+
+
+void test_long_press(void) {
+  Change c[256];
+  int n = bouncyPress(c, 20000, 1500, 4000, 300);
+  run(c, n, true, 2000);
+  TEST_ASSERT_EQUAL(1, firedCount);
+  TEST_ASSERT_EQUAL(DEB_LONG, fired[0].event);
+  TEST_ASSERT_EQUAL(20 + DEBOUNCE_LONG_MS, fired[0].sinceMs);
+  TEST_ASSERT_LESS_THAN(MAX_LATENCY_MS, fired[0].atMs - fired[0].sinceMs);
+}
+
+
+// Spikes shorter than the quiet time that end where they started are noise
+void test_glitches_are_ignored(void) {
+  Change c[] = { { 10000, true }, { 10200, false }, { 90000, true }, { 93000, false } };
+  run(c, 4, false, 300);
+  TEST_ASSERT_EQUAL(0, firedCount);
+}
+
+
+// Pressing again straight after a release is two presses
+void test_quick_double_press(void) {
+  Change c[256];
+  int n = bouncyPress(c, 10000, 60, 2000, 250);
+  n += bouncyPress(c + n, 100000, 60, 2000, 250);
+  run(c, n, false, 400);
+  TEST_ASSERT_EQUAL(2, firedCount);
+  TEST_ASSERT_EQUAL(10, fired[0].sinceMs);
+  TEST_ASSERT_EQUAL(100, fired[1].sinceMs);
+}
+
+
+// The millis() counter wraps every 49.7 days
+void test_across_millis_wrap(void) {
+  Debouncer d;
+  debounceReset(d, false);
+  uint32_t t = 0xFFFFFFFCu, waitMs = UINT32_MAX, sinceMs = 0;
+  debounceEdge(d, t);
+  TEST_ASSERT_EQUAL(DEB_NONE, debounceService(d, true, false, t + 2, &sinceMs, &waitMs));
+  TEST_ASSERT_EQUAL(DEBOUNCE_QUIET_MS - 2, waitMs);
+  TEST_ASSERT_EQUAL(DEB_SHORT, debounceService(d, true, false, t + DEBOUNCE_QUIET_MS, &sinceMs, &waitMs));
+  TEST_ASSERT_EQUAL(t, sinceMs);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_clean_press);
+  RUN_TEST(test_bounce_patterns);
+  RUN_TEST(test_short_with_long_action);
+  RUN_TEST(test_long_press);
+  RUN_TEST(test_glitches_are_ignored);
+  RUN_TEST(test_quick_double_press);
+  RUN_TEST(test_across_millis_wrap);
+  return UNITY_END();
+}
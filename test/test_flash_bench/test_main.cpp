@@ -0,0 +1,318 @@
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <SegmentLog.h>
+
+// Flash I/O benchmark for the log, on a model of LittleFS on the S3's NOR
+// flash. The numbers that matter for wear are bytes programmed and blocks
+// erased per byte logged, and those follow from how LittleFS lays files out:
+//  - a file is a list of whole blocks, and a block is erased when allocated
+//  - writing to a file after a sync or close starts a new block and copies
+//    the partly filled tail block into it (lfs_ctz_extend)
+//  - writing anywhere but the end rewrites the file from that block on
+//  - each sync, close, create or delete is a commit to the directory's
+//    metadata block, which is compacted into its pair once full
+// Reads and the VFS buffer in front of LittleFS are left out. Times are the
+// flash's typical page program and sector erase.
+#define BLOCK          4096
+#define PROG           256
+#define PROG_US        700
+#define ERASE_US       45000
+
+struct Flash {
+  uint64_t programmed;
+  uint32_t erases;
+  uint32_t commits;
+  uint32_t metaUsed;
+  uint64_t busyUs;
+};
+
+Flash flash;
+
+void program(uint32_t bytes) {
+  bytes = (bytes + PROG - 1) / PROG * PROG;
+  flash.programmed += bytes;
+  flash.busyUs += (uint64_t)bytes / PROG * PROG_US;
+}
+
+void erase(uint32_t blocks) {
+  flash.erases += blocks;
+  flash.busyUs += (uint64_t)blocks * ERASE_US;
+}
+
+void commit() {
+  flash.commits++;
+  if (flash.metaUsed + PROG > BLOCK) {
+    erase(1);
+    flash.metaUsed = 0;
+  }
+  program(PROG);
+  flash.metaUsed += PROG;
+}
+
+struct LfsFile {
+  uint32_t size;
+  uint32_t pos;
+  bool writing;        // written to since the last sync
+  uint32_t blockStart; // file offset of the block being written
+  uint32_t programmed; // how much of the file up to there is on flash
+};
+
+void fileOpen(LfsFile& f, uint32_t size, uint32_t pos) {
+  memset(&f, 0, sizeof(f));
+  f.size = size;
+  f.pos = pos;
+}
+
+void extend(LfsFile& f, uint32_t len) {
+  if (!f.writing) {
+    // A new block, with whatever of the old one came before pos copied in
+    f.writing = true;
+    f.blockStart = f.programmed = f.pos - f.pos % BLOCK;
+    erase(1);
+  }
+  while (len) {
+    if (f.pos == f.blockStart + BLOCK) {
+      program(f.pos - f.programmed);
+      f.blockStart = f.programmed = f.pos;
+      erase(1);
+    }
+    uint32_t take = f.blockStart + BLOCK - f.pos;
+    if (take > len) take = len;
+    f.pos += take;
+    len -= take;
+    uint32_t full = f.pos / PROG * PROG;
+    if (full > f.programmed) {
+      program(full - f.programmed);
+      f.programmed = full;
+    }
+  }
+}
+
+void fileWrite(LfsFile& f, uint32_t len) {
+  uint32_t size = f.size > f.pos + len ? f.size : f.pos + len;
+  extend(f, len);
+  f.size = size;
+}
+
+void fileSync(LfsFile& f) {
+  if (!f.writing) return;
+  // A write that stopped short of the end has the rest of the file copied after it
+  uint32_t pos = f.pos;
+  if (f.pos < f.size) extend(f, f.size - f.pos);
+  program(f.pos - f.programmed);
+  f.pos = pos;
+  f.writing = false;
+  commit();
+}
+
+
+// The three ways of keeping the log
+enum Strategy { PER_LINE, SEGMENTS, PREALLOCATED };
+const char* strategyName[] = { "open/append/close", "segments, synced", "preallocated ring" };
+
+struct Log {
+  Strategy strategy;
+  LfsFile file;
+  uint32_t first, current;     // segments on flash, as in logRotate()
+  uint32_t segmentBytes;
+  uint32_t maxSegments;
+};
+
+void logBegin(Log& log, Strategy strategy) {
+  memset(&log, 0, sizeof(log));
+  log.strategy = strategy;
+  log.first = log.current = 1;
+  // The preallocated files are made before the log starts and not counted
+  fileOpen(log.file, strategy == PREALLOCATED ? LOG_SEGMENT_SIZE : 0, 0);
+}
+
+void logLine(Log& log, uint32_t len) {
+  switch (log.strategy) {
+    case PER_LINE:
+      fileOpen(log.file, log.file.size, log.file.size);
+      fileWrite(log.file, len);
+      fileSync(log.file);
+      break;
+
+    case SEGMENTS:
+      if (segmentFull(log.segmentBytes, len)) {
+        fileSync(log.file);
+        log.current++;
+        while (segmentsOver(log.first, log.current)) {
+          log.first++;
+          commit();
+        }
+        commit();
+        fileOpen(log.file, 0, 0);
+        log.segmentBytes = 0;
+      }
+      fileWrite(log.file, len);
+      log.segmentBytes += len;
+      break;
+
+    case PREALLOCATED:
+      if (log.file.pos + len > LOG_SEGMENT_SIZE) {
+        fileSync(log.file);
+        log.current++;
+        fileOpen(log.file, LOG_SEGMENT_SIZE, 0);
+      }
+      fileWrite(log.file, len);
+      break;
+  }
+  if (log.current - log.first + 1 > log.maxSegments) log.maxSegments = log.current - log.first + 1;
+}
+
+// The logSync job
+void logTick(Log& log) {
+  if (log.strategy != PER_LINE) fileSync(log.file);
+}
+
+
+struct Result {
+  uint32_t lines;
+  uint64_t logged;
+  uint64_t programmed;
+  uint32_t erases;
+  uint64_t lineUs;             // flash time spent inside appendLog
+  uint32_t worstLineUs;
+  uint64_t syncUs;             // and in the sync job
+  double hours;
+};
+
+uint32_t seed;
+
+// Lines of 40 to 119 bytes, timestamp included, every periodMs for durationMs
+Result run(Strategy strategy, uint32_t periodMs, uint32_t durationMs) {
+  Log log;
+  Result r = {};
+  memset(&flash, 0, sizeof(flash));
+  logBegin(log, strategy);
+  seed = 12345;
+  uint32_t nextSync = LOG_SYNC_MS;
+  for (uint32_t now = 0; now < durationMs; now += periodMs) {
+    while (nextSync <= now) {
+      uint64_t before = flash.busyUs;
+      logTick(log);
+      r.syncUs += flash.busyUs - before;
+      nextSync += LOG_SYNC_MS;
+    }
+    seed = seed * 1103515245 + 12345;
+    uint32_t len = 40 + (seed >> 16) % 80;
+    uint64_t before = flash.busyUs;
+    logLine(log, len);
+    uint32_t us = flash.busyUs - before;
+    r.lineUs += us;
+    if (us > r.worstLineUs) r.worstLineUs = us;
+    r.lines++;
+    r.logged += len;
+  }
+  uint64_t before = flash.busyUs;
+  logTick(log);
+  r.syncUs += flash.busyUs - before;
+  r.programmed = flash.programmed;
+  r.erases = flash.erases;
+  r.hours = durationMs / 3600000.0;
+  if (strategy == SEGMENTS) TEST_ASSERT_LESS_OR_EQUAL(LOG_SEGMENTS, log.maxSegments);
+  return r;
+}
+
+double amplification(const Result& r) {
+  return (double)r.programmed / r.logged;
+}
+
+double erasesPerMB(const Result& r) {
+  return r.erases * 1048576.0 / r.logged;
+}
+
+void report(const char* workload, Strategy strategy, const Result& r) {
+  char line[200];
+  snprintf(line, sizeof(line), "%-7s %-18s  %6u lines  WA %5.1f  %6.0f erases/MB  line %6.2f ms mean %5.1f ms worst  sync %5.1f s/h",
+           workload, strategyName[strategy], (unsigned)r.lines, amplification(r), erasesPerMB(r),
+           r.lineUs / 1000.0 / r.lines, r.worstLineUs / 1000.0, r.syncUs / 1e6 / r.hours);
+  TEST_MESSAGE(line);
+}
+
+
+void setUp(void) {
+  memset(&flash, 0, sizeof(flash));
+}
+
+void tearDown(void) {}
+
+
+// Appending in one go costs the data and one commit
+void test_model_one_session(void) {
+  LfsFile f;
+  fileOpen(f, 0, 0);
+  fileWrite(f, 2 * BLOCK);
+  fileSync(f);
+  TEST_ASSERT_EQUAL(2 * BLOCK + PROG, flash.programmed);
+  TEST_ASSERT_EQUAL(2, flash.erases);
+}
+
+
+// Appending after a sync copies the tail block
+void test_model_copies_the_tail(void) {
+  LfsFile f;
+  fileOpen(f, 0, 0);
+  fileWrite(f, 1000);
+  fileSync(f);
+  memset(&flash, 0, sizeof(flash));
+  fileWrite(f, 100);
+  fileSync(f);
+  TEST_ASSERT_EQUAL(1, flash.erases);
+  TEST_ASSERT_EQUAL(1280 + PROG, flash.programmed);
+}
+
+
+// Writing at the start of a file rewrites all of it
+void test_model_rewrites_from_a_middle_write(void) {
+  LfsFile f;
+  fileOpen(f, LOG_SEGMENT_SIZE, 0);
+  fileWrite(f, 100);
+  fileSync(f);
+  TEST_ASSERT_EQUAL(LOG_SEGMENT_SIZE / BLOCK, flash.erases);
+  TEST_ASSERT_EQUAL(LOG_SEGMENT_SIZE + PROG, flash.programmed);
+  TEST_ASSERT_EQUAL(LOG_SEGMENT_SIZE, f.size);
+}
+
+
+// A quiet unit: a line every 10 s for a day. Each line gets a sync of its
+// own either way, so segments only match per line appends here, but a
+// preallocated file pays for rewriting the rest of itself every time.
+void test_steady(void) {
+  Result r[3];
+  for (int s = 0; s < 3; s++) {
+    r[s] = run((Strategy)s, 10000, 24 * 3600000u);
+    report("steady", (Strategy)s, r[s]);
+  }
+  TEST_ASSERT_TRUE(amplification(r[SEGMENTS]) <= amplification(r[PER_LINE]) * 1.05);
+  TEST_ASSERT_TRUE(amplification(r[PREALLOCATED]) > 3 * amplification(r[SEGMENTS]));
+}
+
+
+// A busy one: 20 lines a second for 10 minutes, where syncing every
+// LOG_SYNC_MS instead of every line pays off
+void test_burst(void) {
+  Result r[3];
+  for (int s = 0; s < 3; s++) {
+    r[s] = run((Strategy)s, 50, 600000);
+    report("burst", (Strategy)s, r[s]);
+  }
+  TEST_ASSERT_TRUE(amplification(r[SEGMENTS]) * 5 < amplification(r[PER_LINE]));
+  TEST_ASSERT_TRUE(erasesPerMB(r[SEGMENTS]) * 5 < erasesPerMB(r[PER_LINE]));
+  TEST_ASSERT_TRUE(amplification(r[SEGMENTS]) < amplification(r[PREALLOCATED]));
+  TEST_ASSERT_TRUE(r[SEGMENTS].lineUs < r[PER_LINE].lineUs);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_model_one_session);
+  RUN_TEST(test_model_copies_the_tail);
+  RUN_TEST(test_model_rewrites_from_a_middle_write);
+  RUN_TEST(test_steady);
+  RUN_TEST(test_burst);
+  return UNITY_END();
+}
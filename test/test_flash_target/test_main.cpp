@@ -0,0 +1,170 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <unity.h>
+#include <SegmentLog.h>
+
+// The flash benchmark on a real unit: pio test -e esp32s3dev. Mount time
+// and how long appending a line takes, per line appends against a segment
+// held open and synced every LOG_SYNC_MS. Write amplification can't be seen
+// from here; test_flash_bench models it. Works in BENCH_DIR and removes it
+// after, the rest of the filesystem is left alone.
+#define BENCH_DIR   "/bench"
+#define BENCH_LINES 600
+#define BENCH_GAP_MS 50           // 20 lines a second, as test_flash_bench's burst
+
+char line[128];
+
+const char* benchLine(int n) {
+  snprintf(line, sizeof(line), "2026-01-01 12:00:%02d Relay %d pulsed, line %d of the flash benchmark\n",
+           n % 60, n % 6 + 1, n);
+  return line;
+}
+
+void removeBench() {
+  File dir = LittleFS.open(BENCH_DIR);
+  if (dir && dir.isDirectory()) {
+    char path[48];
+    File f;
+    while ((f = dir.openNextFile())) {
+      snprintf(path, sizeof(path), BENCH_DIR "/%s", f.name());
+      f.close();
+      LittleFS.remove(path);
+    }
+  }
+  dir.close();
+  LittleFS.rmdir(BENCH_DIR);
+}
+
+void report(const char* what, uint32_t totalUs, uint32_t worstUs, uint32_t lines) {
+  char text[120];
+  snprintf(text, sizeof(text), "%-20s %4lu lines  %7.2f ms mean  %7.2f ms worst", what,
+           (unsigned long)lines, totalUs / 1000.0 / lines, worstUs / 1000.0);
+  TEST_MESSAGE(text);
+}
+
+
+// Clears out anything a run that was cut short left behind
+void setUp(void) {
+  removeBench();
+  LittleFS.mkdir(BENCH_DIR);
+}
+
+void tearDown(void) {
+  removeBench();
+}
+
+
+void test_mount_time(void) {
+  LittleFS.end();
+  uint32_t start = micros();
+  bool mounted = LittleFS.begin(false);
+  uint32_t us = micros() - start;
+  TEST_ASSERT_TRUE(mounted);
+  char text[64];
+  snprintf(text, sizeof(text), "mount %.1f ms, %u KB used", us / 1000.0, (unsigned)(LittleFS.usedBytes() / 1024));
+  TEST_MESSAGE(text);
+}
+
+
+// What appendLog did before: open, append and close for every line
+void test_append_per_line(void) {
+  uint32_t total = 0, worst = 0;
+  for (int n = 0; n < BENCH_LINES; n++) {
+    uint32_t start = micros();
+    File f = LittleFS.open(BENCH_DIR "/log.txt", FILE_APPEND);
+    f.print(benchLine(n));
+    f.close();
+    uint32_t us = micros() - start;
+    total += us;
+    if (us > worst) worst = us;
+    delay(BENCH_GAP_MS);
+  }
+  report("open/append/close", total, worst, BENCH_LINES);
+}
+
+
+// What it does now: the segment stays open and logSync flushes it
+void test_append_segment(void) {
+  uint32_t total = 0, worst = 0, syncUs = 0, bytes = 0, segment = 1;
+  char path[32];
+  snprintf(path, sizeof(path), BENCH_DIR "/%08lu.log", (unsigned long)segment);
+  File f = LittleFS.open(path, FILE_WRITE);
+  uint32_t lastSync = millis();
+  for (int n = 0; n < BENCH_LINES; n++) {
+    const char* text = benchLine(n);
+    uint32_t start = micros();
+    if (segmentFull(bytes, strlen(text))) {
+      f.close();
+      snprintf(path, sizeof(path), BENCH_DIR "/%08lu.log", (unsigned long)++segment);
+      f = LittleFS.open(path, FILE_WRITE);
+      bytes = 0;
+    }
+    bytes += f.print(text);
+    uint32_t us = micros() - start;
+    total += us;
+    if (us > worst) worst = us;
+    if (millis() - lastSync >= LOG_SYNC_MS) {
+      start = micros();
+      f.flush();
+      syncUs += micros() - start;
+      lastSync = millis();
+    }
+    delay(BENCH_GAP_MS);
+  }
+  f.close();
+  report("segment, synced", total, worst, BENCH_LINES);
+  char text[64];
+  snprintf(text, sizeof(text), "  and %.1f ms in syncs", syncUs / 1000.0);
+  TEST_MESSAGE(text);
+}
+
+
+// Overwriting a preallocated file, which LittleFS turns into a copy of the rest of it
+void test_append_preallocated(void) {
+  File f = LittleFS.open(BENCH_DIR "/ring.log", FILE_WRITE);
+  memset(line, ' ', sizeof(line));
+  for (int n = 0; n < LOG_SEGMENT_SIZE / (int)sizeof(line); n++) f.write((const uint8_t*)line, sizeof(line));
+  f.close();
+
+  uint32_t total = 0, worst = 0, syncUs = 0, pos = 0;
+  f = LittleFS.open(BENCH_DIR "/ring.log", "r+");
+  TEST_ASSERT_TRUE((bool)f);
+  uint32_t lastSync = millis();
+  for (int n = 0; n < BENCH_LINES; n++) {
+    const char* text = benchLine(n);
+    uint32_t start = micros();
+    if (pos + strlen(text) > LOG_SEGMENT_SIZE) {
+      f.seek(0);
+      pos = 0;
+    }
+    pos += f.print(text);
+    uint32_t us = micros() - start;
+    total += us;
+    if (us > worst) worst = us;
+    if (millis() - lastSync >= LOG_SYNC_MS) {
+      start = micros();
+      f.flush();
+      syncUs += micros() - start;
+      lastSync = millis();
+    }
+    delay(BENCH_GAP_MS);
+  }
+  f.close();
+  report("preallocated ring", total, worst, BENCH_LINES);
+  char text[64];
+  snprintf(text, sizeof(text), "  and %.1f ms in syncs", syncUs / 1000.0);
+  TEST_MESSAGE(text);
+}
+
+
+void setup() {
+  delay(2000);                    // lets the monitor attach
+  UNITY_BEGIN();
+  RUN_TEST(test_mount_time);      // first, it does the mounting
+  RUN_TEST(test_append_per_line);
+  RUN_TEST(test_append_segment);
+  RUN_TEST(test_append_preallocated);
+  UNITY_END();
+}
+
+void loop() {}
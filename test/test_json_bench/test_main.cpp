@@ -0,0 +1,165 @@
+#include <unity.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ArduinoJson.h>
+#include <JsonOut.h>
+
+// Builds a status body like /api/status both ways, checks they agree, and
+// compares time and heap traffic. JsonOut must not touch the heap at all;
+// ArduinoJson's allocations are counted through its Allocator hook.
+#define RUNS 2000
+
+struct Status {
+  unsigned long version;
+  bool states[6];
+  const char* labels[6];
+  bool reset[6];
+  const char* ips[6];
+  bool safeMode;
+  const char* led;
+  int batteryMv;
+  const char* probes[6];
+};
+
+const Status status = {
+  4711,
+  { true, true, false, true, false, false },
+  { "Router", "Switch", "Radio \"HF\"", "Camera", "Aux 1", "Aux 2" },
+  { true, true, true, false, false, false },
+  { "192.168.3.1", "192.168.3.2", "192.168.3.20", "192.168.3.30", "", "" },
+  false,
+  "ok",
+  12480,
+  { "ok", "ok", "watch", "idle", "idle", "idle" },
+};
+
+struct CountingAllocator : ArduinoJson::Allocator {
+  size_t allocations = 0;
+  size_t bytes = 0;
+  void* allocate(size_t size) override {
+    allocations++;
+    bytes += size;
+    return malloc(size);
+  }
+  void deallocate(void* ptr) override { free(ptr); }
+  void* reallocate(void* ptr, size_t size) override {
+    allocations++;
+    return realloc(ptr, size);
+  }
+};
+
+// Counts every operator new while JsonOut runs
+size_t heapCalls = 0;
+void* operator new(size_t size) {
+  heapCalls++;
+  void* p = malloc(size);
+  if (!p) abort();
+  return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+char sinkBuf[2048];
+size_t sinkUsed;
+
+void toBuffer(void* ctx, const char* data, size_t len) {
+  memcpy(sinkBuf + sinkUsed, data, len);
+  sinkUsed += len;
+}
+
+void writeWithJsonOut(JsonOut& out) {
+  out.beginObject();
+  out.key(JK("version")); out.value(status.version);
+  out.key(JK("states")); out.array(status.states);
+  out.key(JK("labels")); out.array(status.labels);
+  out.key(JK("reset")); out.array(status.reset);
+  out.key(JK("ips")); out.array(status.ips);
+  out.key(JK("safeMode")); out.value(status.safeMode);
+  out.key(JK("led")); out.value(status.led);
+  out.key(JK("batteryMv")); out.value(status.batteryMv);
+  out.key(JK("probes")); out.array(status.probes);
+  out.endObject();
+  out.flush();
+}
+
+size_t writeWithArduinoJson(ArduinoJson::Allocator* allocator, char* buf, size_t size) {
+  JsonDocument doc(allocator);
+  doc["version"] = status.version;
+  JsonArray states = doc["states"].to<JsonArray>();
+  for (bool s : status.states) states.add(s);
+  JsonArray labels = doc["labels"].to<JsonArray>();
+  for (const char* l : status.labels) labels.add(l);
+  JsonArray reset = doc["reset"].to<JsonArray>();
+  for (bool r : status.reset) reset.add(r);
+  JsonArray ips = doc["ips"].to<JsonArray>();
+  for (const char* ip : status.ips) ips.add(ip);
+  doc["safeMode"] = status.safeMode;
+  doc["led"] = status.led;
+  doc["batteryMv"] = status.batteryMv;
+  JsonArray probes = doc["probes"].to<JsonArray>();
+  for (const char* p : status.probes) probes.add(p);
+  return serializeJson(doc, buf, size);
+}
+
+void setUp(void) {
+  sinkUsed = 0;
+}
+
+void tearDown(void) {}
+
+
+void test_same_output_as_arduinojson(void) {
+  CountingAllocator allocator;
+  char expected[2048];
+  size_t len = writeWithArduinoJson(&allocator, expected, sizeof(expected));
+  JsonOut out = jsonOut(toBuffer, nullptr);
+  writeWithJsonOut(out);
+  TEST_ASSERT_EQUAL(len, sinkUsed);
+  TEST_ASSERT_EQUAL(len, out.total);
+  TEST_ASSERT_EQUAL_MEMORY(expected, sinkBuf, len);
+}
+
+
+void test_json_out_never_allocates(void) {
+  size_t before = heapCalls;
+  for (int i = 0; i < RUNS; i++) {
+    sinkUsed = 0;
+    JsonOut out = jsonOut(toBuffer, nullptr);
+    writeWithJsonOut(out);
+  }
+  TEST_ASSERT_EQUAL(0, heapCalls - before);
+}
+
+
+void test_benchmark(void) {
+  CountingAllocator allocator;
+  char buf[2048];
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < RUNS; i++) writeWithArduinoJson(&allocator, buf, sizeof(buf));
+  auto mid = std::chrono::steady_clock::now();
+  for (int i = 0; i < RUNS; i++) {
+    sinkUsed = 0;
+    JsonOut out = jsonOut(toBuffer, nullptr);
+    writeWithJsonOut(out);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double ajUs = std::chrono::duration<double, std::micro>(mid - start).count() / RUNS;
+  double outUs = std::chrono::duration<double, std::micro>(end - mid).count() / RUNS;
+  char line[200];
+  snprintf(line, sizeof(line), "status body %u bytes: ArduinoJson %.2f us, %.1f allocations, %.0f heap bytes; JsonOut %.2f us, 0 allocations",
+           (unsigned)sinkUsed, ajUs, (double)allocator.allocations / RUNS, (double)allocator.bytes / RUNS, outUs);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_GREATER_THAN(0, allocator.allocations);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_same_output_as_arduinojson);
+  RUN_TEST(test_json_out_never_allocates);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,138 @@
+#include <unity.h>
+#include <string>
+#include <JsonOut.h>
+
+std::string sunk;
+int sinkCalls;
+
+void toString(void* ctx, const char* data, size_t len) {
+  ((std::string*)ctx)->append(data, len);
+  sinkCalls++;
+}
+
+JsonOut out;
+
+void setUp(void) {
+  sunk.clear();
+  sinkCalls = 0;
+  out = jsonOut(toString, &sunk);
+}
+
+void tearDown(void) {}
+
+const char* finish() {
+  out.flush();
+  TEST_ASSERT_EQUAL(sunk.size(), out.total);
+  return sunk.c_str();
+}
+
+
+void test_empty_containers(void) {
+  out.beginObject();
+  out.key(JK("a")); out.beginArray(); out.endArray();
+  out.key(JK("b")); out.beginObject(); out.endObject();
+  out.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"a\":[],\"b\":{}}", finish());
+}
+
+
+void test_values(void) {
+  out.beginArray();
+  out.value(true);
+  out.value(false);
+  out.value(0);
+  out.value(-42);
+  out.value(4294967295UL);
+  out.value(-2147483647L - 1);
+  out.value(3.5f);
+  out.value(439.9125f);
+  out.value(NAN);
+  out.value(INFINITY);
+  out.value("");
+  out.endArray();
+  TEST_ASSERT_EQUAL_STRING("[true,false,0,-42,4294967295,-2147483648,3.5,439.9125,null,null,\"\"]", finish());
+}
+
+
+void test_escaping(void) {
+  out.value("say \"hi\"\\ \n\t\x01 ok");
+  TEST_ASSERT_EQUAL_STRING("\"say \\\"hi\\\"\\\\ \\u000a\\u0009\\u0001 ok\"", finish());
+}
+
+
+// Commas go between members at every depth, never before the first one
+void test_nesting(void) {
+  out.beginObject();
+  out.key(JK("version")); out.value(7);
+  out.key(JK("relays"));
+  out.beginArray();
+  for (int i = 0; i < 3; i++) {
+    out.beginObject();
+    out.key(JK("on")); out.value(i == 1);
+    out.key(JK("ids")); out.beginArray(); out.value(i); out.value(i + 10); out.endArray();
+    out.endObject();
+  }
+  out.endArray();
+  out.key("runtime"); out.value("key");
+  out.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"version\":7,\"relays\":[{\"on\":false,\"ids\":[0,10]},{\"on\":true,\"ids\":[1,11]},"
+                           "{\"on\":false,\"ids\":[2,12]}],\"runtime\":\"key\"}", finish());
+}
+
+
+void test_fixed_arrays(void) {
+  bool states[6] = { true, false, true, false, false, true };
+  int pins[6] = { 2, 3, 4, 5, 6, 7 };
+  const char* labels[6] = { "a", "b", "c", "d", "e", "f" };
+  out.beginObject();
+  out.key(JK("states")); out.array(states);
+  out.key(JK("pins")); out.array(pins);
+  out.key(JK("labels")); out.array(labels);
+  out.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"states\":[true,false,true,false,false,true],\"pins\":[2,3,4,5,6,7],"
+                           "\"labels\":[\"a\",\"b\",\"c\",\"d\",\"e\",\"f\"]}", finish());
+}
+
+
+// A long string goes through the buffer in several pieces, each a full buffer
+void test_output_larger_than_buffer(void) {
+  std::string big(JSON_OUT_BUF * 3 + 17, 'x');
+  out.beginArray();
+  out.value(big.c_str());
+  out.endArray();
+  TEST_ASSERT_EQUAL(3, sinkCalls);
+  finish();
+  TEST_ASSERT_EQUAL(4, sinkCalls);
+  TEST_ASSERT_EQUAL_STRING(("[\"" + big + "\"]").c_str(), sunk.c_str());
+}
+
+
+// With no sink it only counts, which has to agree with what a real run writes
+void test_counting_matches_output(void) {
+  JsonOut counter = jsonOut(nullptr, nullptr);
+  for (JsonOut* o : { &counter, &out }) {
+    o->beginObject();
+    for (int i = 0; i < 40; i++) {
+      o->key(JK("label")); o->value("relay \"one\"");
+      o->key(JK("n")); o->value(i * 1234567);
+    }
+    o->endObject();
+  }
+  counter.flush();
+  finish();
+  TEST_ASSERT_EQUAL(sunk.size(), counter.total);
+  TEST_ASSERT_EQUAL(0, counter.used);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_containers);
+  RUN_TEST(test_values);
+  RUN_TEST(test_escaping);
+  RUN_TEST(test_nesting);
+  RUN_TEST(test_fixed_arrays);
+  RUN_TEST(test_output_larger_than_buffer);
+  RUN_TEST(test_counting_matches_output);
+  return UNITY_END();
+}
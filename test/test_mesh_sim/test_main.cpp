@@ -0,0 +1,399 @@
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <LoraMesh.h>
+
+// Multi-node channel simulator for the mesh. Each node runs the same
+// learn / duplicate / forward steps radioTask does, on a 1 ms virtual clock.
+// The channel is half duplex with no listen-before-talk, as on the units: a
+// frame is lost at a receiver that is sending itself, or that hears another
+// frame overlapping it that is not at least CAPTURE_DB weaker. Forward delays
+// are the firmware's: 20 ms for a routed frame, 20 ms to 20 ms plus a frame
+// time for a flooded one.
+#define SIM_NODES   10
+#define SF          12
+#define BW_KHZ      125.0f
+#define CR          5
+#define PAYLOAD     10
+#define CAPTURE_DB  6            // a frame this much stronger survives an overlapping one
+
+struct SimFrame {
+  LoraHeader header;
+  uint32_t sentMs;             // when the originator queued it
+  uint32_t airtimeMs;          // summed over every transmission of it so far
+};
+
+struct Pending {
+  SimFrame frame;
+  uint32_t dueMs;
+};
+
+struct Tx {
+  int node;
+  SimFrame frame;
+  uint32_t startMs, endMs;
+};
+
+struct Delivery {
+  int node;
+  SimFrame frame;
+  uint32_t atMs;
+};
+
+struct Node {
+  bool present;
+  RouteTable routes;
+  DupCache seen;
+  std::vector<Pending> queue;
+  uint32_t busyUntil;
+  uint8_t seq;
+  uint16_t epoch;
+  int transmissions;
+  uint32_t airtimeMs;
+};
+
+Node nodes[SIM_NODES];
+float snr[SIM_NODES][SIM_NODES];   // link quality, NAN where out of range
+std::vector<Tx> onAir;
+std::vector<Delivery> delivered;
+uint32_t nowMs;
+uint32_t rng;
+int maxHops;
+int lost;                          // receptions spoilt by a collision or by sending at the time
+
+uint32_t simRandom(uint32_t lo, uint32_t hi) {
+  rng = rng * 1103515245 + 12345;
+  return lo + (rng >> 8) % (hi - lo);
+}
+
+uint32_t frameMs() {
+  return (loraTimeOnAirUs(sizeof(LoraHeader) + PAYLOAD, SF, BW_KHZ, CR) + 999) / 1000;
+}
+
+void link(int a, int b, float s) {
+  snr[a][b] = snr[b][a] = s;
+}
+
+void reset(int count) {
+  for (int i = 0; i < SIM_NODES; i++) {
+    nodes[i] = Node();
+    memset(&nodes[i].routes, 0, sizeof(RouteTable));
+    memset(&nodes[i].seen, 0, sizeof(DupCache));
+    nodes[i].present = i >= 1 && i <= count;
+    for (int j = 0; j < SIM_NODES; j++) snr[i][j] = NAN;
+  }
+  onAir.clear();
+  delivered.clear();
+  nowMs = 0;
+  rng = 12345;
+  maxHops = 7;
+  lost = 0;
+}
+
+// A node starts a frame of its own, routed if it knows the way
+void send(int src, int dst, uint8_t type) {
+  Node& n = nodes[src];
+  uint8_t seq = ++n.seq;
+  LoraHeader h = { LORA_MAGIC, type, (uint8_t)src, (uint8_t)dst, seq, n.epoch, (uint8_t)src, (uint8_t)dst, 0, 0 };
+  if (dst != LORA_BROADCAST) {
+    Route* r = findRoute(n.routes, dst, nowMs);
+    h.via = r ? r->nextHop : LORA_BROADCAST;
+  }
+  n.queue.push_back({ { h, nowMs, 0 }, nowMs });
+}
+
+// The node starts again with nothing learned and its seq back at 0, as
+// after a power cut
+void reboot(int node, uint16_t epoch) {
+  Node& n = nodes[node];
+  n.queue.clear();
+  memset(&n.routes, 0, sizeof(RouteTable));
+  memset(&n.seen, 0, sizeof(DupCache));
+  n.seq = 0;
+  n.epoch = epoch;
+}
+
+int deliveries(int node, uint8_t src, uint8_t type) {
+  int count = 0;
+  for (const Delivery& d : delivered) {
+    if (d.node == node && d.frame.header.src == src && d.frame.header.type == type) count++;
+  }
+  return count;
+}
+
+// What radioReceive() does with a frame that came through
+void receive(int at, const SimFrame& f, float s) {
+  Node& n = nodes[at];
+  LoraHeader h = f.header;
+  if (h.src == at) return;
+  uint8_t cost = loraLinkCost(s);
+  learnRoutesFrom(n.routes, at, h, cost, nowMs);
+  if (dupSeen(n.seen, h)) return;
+  if (h.dst == at || h.dst == LORA_BROADCAST) delivered.push_back({ at, f, nowMs });
+  if (meshForward(n.routes, at, maxHops, cost, h, nowMs)) {
+    uint32_t jitter = h.via == LORA_BROADCAST ? simRandom(20, 20 + frameMs()) : 20;
+    n.queue.push_back({ { h, f.sentMs, f.airtimeMs }, nowMs + jitter });
+  }
+}
+
+void step() {
+  // Frames finishing now reach whoever heard them cleanly
+  for (size_t t = 0; t < onAir.size();) {
+    Tx& tx = onAir[t];
+    if (tx.endMs != nowMs) {
+      t++;
+      continue;
+    }
+    for (int r = 1; r < SIM_NODES; r++) {
+      if (!nodes[r].present || r == tx.node || isnan(snr[tx.node][r])) continue;
+      bool spoilt = false;
+      for (const Tx& other : onAir) {
+        if (&other == &tx || other.endMs <= tx.startMs || other.startMs >= tx.endMs) continue;
+        if (other.node == r || snr[other.node][r] > snr[tx.node][r] - CAPTURE_DB) spoilt = true;
+      }
+      if (spoilt) lost++;
+      else receive(r, tx.frame, snr[tx.node][r]);
+    }
+    onAir.erase(onAir.begin() + t);
+  }
+
+  // Anyone idle with something due sends the oldest of it
+  for (int i = 1; i < SIM_NODES; i++) {
+    Node& n = nodes[i];
+    if (!n.present || nowMs < n.busyUntil) continue;
+    for (size_t q = 0; q < n.queue.size(); q++) {
+      if (n.queue[q].dueMs > nowMs) continue;
+      SimFrame f = n.queue[q].frame;
+      n.queue.erase(n.queue.begin() + q);
+      uint32_t ms = frameMs();
+      f.airtimeMs += ms;
+      n.busyUntil = nowMs + ms;
+      n.transmissions++;
+      n.airtimeMs += ms;
+      onAir.push_back({ i, f, nowMs, nowMs + ms });
+      break;
+    }
+  }
+  nowMs++;
+}
+
+void runFor(uint32_t ms) {
+  uint32_t end = nowMs + ms;
+  while (nowMs < end) step();
+}
+
+int totalTransmissions() {
+  int total = 0;
+  for (const Node& n : nodes) total += n.transmissions;
+  return total;
+}
+
+const Delivery* deliveredTo(int node, uint8_t src, uint8_t type) {
+  for (const Delivery& d : delivered) {
+    if (d.node == node && d.frame.header.src == src && d.frame.header.type == type) return &d;
+  }
+  return nullptr;
+}
+
+void report(const char* what, const Delivery* d) {
+  int hops = d->frame.header.hops + 1;
+  uint32_t latency = d->atMs - d->frame.sentMs;
+  char line[160];
+  snprintf(line, sizeof(line), "%-22s %d hops, %5u ms (%4u ms/hop), airtime %5u ms (%4u ms/hop), %d tx in all",
+           what, hops, (unsigned)latency, (unsigned)(latency / hops), (unsigned)d->frame.airtimeMs,
+           (unsigned)(d->frame.airtimeMs / hops), totalTransmissions());
+  TEST_MESSAGE(line);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+
+// Against the Semtech calculator
+void test_time_on_air(void) {
+  TEST_ASSERT_INT_WITHIN(1000, 1318912, loraTimeOnAirUs(20, 12, 125, 5));
+  TEST_ASSERT_INT_WITHIN(1000, 41216, loraTimeOnAirUs(10, 7, 125, 5));
+  TEST_ASSERT_INT_WITHIN(1000, 2465792, loraTimeOnAirUs(51, 12, 125, 5));
+  TEST_ASSERT_INT_WITHIN(1000, 246784, loraTimeOnAirUs(20, 9, 125, 8));
+}
+
+
+// 1 - 2 - 3 - 4 - 5: a command floods out, the answer comes back routed on
+// what the flood taught each node, and the next command is routed too
+void test_chain_flood_then_routed(void) {
+  reset(5);
+  for (int i = 1; i < 5; i++) link(i, i + 1, 5);
+
+  send(1, 5, LORA_CMD);
+  runFor(20000);
+  const Delivery* cmd = deliveredTo(5, 1, LORA_CMD);
+  TEST_ASSERT_NOT_NULL(cmd);
+  TEST_ASSERT_EQUAL(3, cmd->frame.header.hops);
+  report("flooded command", cmd);
+
+  send(5, 1, LORA_STATUS);
+  runFor(20000);
+  const Delivery* reply = deliveredTo(1, 5, LORA_STATUS);
+  TEST_ASSERT_NOT_NULL(reply);
+  TEST_ASSERT_EQUAL(2, reply->frame.header.from);
+  report("routed reply", reply);
+
+  Route* r = findRoute(nodes[1].routes, 5, nowMs);
+  TEST_ASSERT_NOT_NULL(r);
+  TEST_ASSERT_EQUAL(2, r->nextHop);
+  TEST_ASSERT_EQUAL(4, r->hops);
+
+  int before = totalTransmissions();
+  delivered.clear();
+  send(1, 5, LORA_CMD);
+  runFor(20000);
+  cmd = deliveredTo(5, 1, LORA_CMD);
+  TEST_ASSERT_NOT_NULL(cmd);
+  TEST_ASSERT_EQUAL(4, totalTransmissions() - before);   // one per hop, nobody else joins in
+  report("routed command", cmd);
+  TEST_ASSERT_EQUAL(0, lost);
+}
+
+
+// Each extra hop costs about one frame time plus the forward delay
+void test_latency_per_hop(void) {
+  reset(5);
+  for (int i = 1; i < 5; i++) link(i, i + 1, 5);
+  send(5, 1, LORA_STATUS);   // teaches the chain the way to 5
+  runFor(20000);
+  delivered.clear();
+  send(1, 5, LORA_CMD);
+  runFor(20000);
+  const Delivery* d = deliveredTo(5, 1, LORA_CMD);
+  TEST_ASSERT_NOT_NULL(d);
+  uint32_t perHop = (d->atMs - d->frame.sentMs) / 4;
+  TEST_ASSERT_INT_WITHIN(25, frameMs() + 20, perHop);
+  TEST_ASSERT_EQUAL(4 * frameMs(), d->frame.airtimeMs);
+}
+
+
+// maxHops stops a flood however far the mesh goes
+void test_max_hops(void) {
+  reset(6);
+  for (int i = 1; i < 6; i++) link(i, i + 1, 5);
+  maxHops = 3;
+  send(1, LORA_BROADCAST, LORA_STATUS);
+  runFor(30000);
+  TEST_ASSERT_NOT_NULL(deliveredTo(4, 1, LORA_STATUS));
+  TEST_ASSERT_NULL(deliveredTo(5, 1, LORA_STATUS));
+  TEST_ASSERT_EQUAL(3, totalTransmissions());
+}
+
+
+// Two ways round a square, one with a weak link. The answer must come back
+// the strong way however the flood happened to reach the far corner.
+//   1 - 2 (strong) - 4
+//   1 - 3 (weak)   - 4
+void test_prefers_the_cheaper_path(void) {
+  reset(4);
+  link(1, 2, 8);
+  link(2, 4, 8);
+  link(1, 3, 8);
+  link(3, 4, -15);
+  send(1, 4, LORA_CMD);
+  runFor(20000);
+  TEST_ASSERT_NOT_NULL(deliveredTo(4, 1, LORA_CMD));
+  send(4, 1, LORA_STATUS);
+  runFor(20000);
+  Route* r = findRoute(nodes[4].routes, 1, nowMs);
+  TEST_ASSERT_NOT_NULL(r);
+  TEST_ASSERT_EQUAL(2, r->nextHop);
+  TEST_ASSERT_NOT_NULL(deliveredTo(1, 4, LORA_STATUS));
+}
+
+
+// A dense patch of 9 nodes that mostly hear each other. A flood makes every
+// node send once and no more, and the forward jitter keeps enough of them
+// apart that broadcasts still get everywhere.
+void test_dense_flood(void) {
+  reset(9);
+  for (int a = 1; a <= 9; a++) {
+    for (int b = a + 1; b <= 9; b++) {
+      int ax = (a - 1) % 3, ay = (a - 1) / 3, bx = (b - 1) % 3, by = (b - 1) / 3;
+      if (abs(ax - bx) <= 1 && abs(ay - by) <= 1) link(a, b, 0);
+    }
+  }
+  int reached = 0, floods = 20;
+  for (int i = 0; i < floods; i++) {
+    delivered.clear();
+    send(1 + i % 9, LORA_BROADCAST, LORA_STATUS);
+    runFor(30000);
+    for (int n = 1; n <= 9; n++) {
+      if (n != 1 + i % 9 && deliveredTo(n, 1 + i % 9, LORA_STATUS)) reached++;
+    }
+    for (int n = 1; n <= 9; n++) TEST_ASSERT_LESS_OR_EQUAL(i + 1, nodes[n].transmissions);
+  }
+  char line[120];
+  snprintf(line, sizeof(line), "dense flood: %d of %d nodes reached, %d receptions lost to collisions, %d tx",
+           reached, floods * 8, lost, totalTransmissions());
+  TEST_MESSAGE(line);
+  TEST_ASSERT_GREATER_OR_EQUAL(floods * 8 * 9 / 10, reached);
+}
+
+
+// A frame that goes round a loop is dropped, not passed on again
+void test_loop_is_cut(void) {
+  reset(4);
+  link(1, 2, 5);
+  link(2, 3, 5);
+  link(3, 4, 5);
+  link(4, 2, 5);
+  send(1, LORA_BROADCAST, LORA_STATUS);
+  runFor(30000);
+  for (int n = 1; n <= 4; n++) TEST_ASSERT_LESS_OR_EQUAL(1, nodes[n].transmissions);
+}
+
+
+// A gateway that reboots starts its seqs again. The remote still has the
+// old ones in its duplicate cache, and only the new epoch keeps the first
+// commands after the reboot from being taken for repeats.
+void test_reboot_is_not_a_repeat(void) {
+  reset(2);
+  link(1, 2, 5);
+  for (int i = 0; i < 3; i++) {
+    send(1, 2, LORA_CMD);
+    runFor(5000);
+  }
+  TEST_ASSERT_EQUAL(3, deliveries(2, 1, LORA_CMD));
+
+  // A retry of the last one is a repeat
+  LoraHeader last = delivered.back().frame.header;
+  nodes[1].queue.push_back({ { last, nowMs, 0 }, nowMs });
+  runFor(5000);
+  TEST_ASSERT_EQUAL(3, deliveries(2, 1, LORA_CMD));
+
+  // Same seqs, same epoch: lost, which is what a reboot did without one
+  reboot(1, 0);
+  send(1, 2, LORA_CMD);
+  runFor(5000);
+  TEST_ASSERT_EQUAL(3, deliveries(2, 1, LORA_CMD));
+
+  reboot(1, 0x5a17);
+  for (int i = 0; i < 3; i++) {
+    send(1, 2, LORA_CMD);
+    runFor(5000);
+  }
+  TEST_ASSERT_EQUAL(6, deliveries(2, 1, LORA_CMD));
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_time_on_air);
+  RUN_TEST(test_chain_flood_then_routed);
+  RUN_TEST(test_latency_per_hop);
+  RUN_TEST(test_max_hops);
+  RUN_TEST(test_prefers_the_cheaper_path);
+  RUN_TEST(test_dense_flood);
+  RUN_TEST(test_loop_is_cut);
+  RUN_TEST(test_reboot_is_not_a_repeat);
+  return UNITY_END();
+}
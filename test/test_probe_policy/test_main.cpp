@@ -0,0 +1,214 @@
+#include <unity.h>
+#include <string.h>
+#include <ProbePolicy.h>
+
+// Synthetic probe traces run through the policy the way probeEvaluate() does:
+// one result per target per interval, then a decision for each, and a reset
+// when it says so.
+ProbePolicy policy;
+ProbeTarget targets[PROBE_RELAYS];
+ProbeRelay relays[PROBE_RELAYS];
+int resets[PROBE_RELAYS];
+uint32_t firstResetSec[PROBE_RELAYS];
+char reason[64];
+
+// One result: ok, and the rtt when it is
+struct Sample {
+  bool ok;
+  uint16_t rttMs;
+};
+typedef Sample (*Trace)(int relay, int step);
+
+void setUp(void) {
+  policy = { 60, 10, 4, 1500, 20, 2, { -1, -1, -1, -1, -1, -1 } };
+  memset(targets, 0, sizeof(targets));
+  memset(resets, 0, sizeof(resets));
+  memset(firstResetSec, 0, sizeof(firstResetSec));
+  static const char* const labels[] = { "router", "switch", "radio", "cam", "aux1", "aux2" };
+  for (int i = 0; i < PROBE_RELAYS; i++) relays[i] = { false, true, false, labels[i] };
+}
+
+void tearDown(void) {}
+
+void run(Trace trace, int steps) {
+  for (int step = 0; step < steps; step++) {
+    uint32_t nowSec = 100 + step * policy.intervalSeconds;
+    for (int r = 0; r < PROBE_RELAYS; r++) {
+      relays[r].cycling = false;   // a power cycle is over well within an interval
+      if (!relays[r].active) continue;
+      Sample s = trace(r, step);
+      probeRecord(policy, targets[r], s.ok, s.rttMs);
+    }
+    for (int r = 0; r < PROBE_RELAYS; r++) {
+      if (!relays[r].active) continue;
+      ProbeVerdict v = probeDecide(policy, targets, relays, r, nowSec, reason, sizeof(reason));
+      targets[r].verdict = v;
+      if (v == PROBE_RESET) {
+        if (!resets[r]) firstResetSec[r] = nowSec;
+        resets[r]++;
+        probeNoteReset(targets[r], nowSec);
+        relays[r].cycling = true;
+      }
+    }
+  }
+}
+
+Sample allGood(int relay, int step) { return { true, 40 }; }
+
+// Drops one ping in seven, never two in a row
+Sample lossy(int relay, int step) { return { step % 7 != 3, 60 }; }
+
+// Down from step 5 until something resets it
+int downSince[PROBE_RELAYS];
+Sample outage(int relay, int step) {
+  if (resets[relay]) return { true, 30 };
+  return { step < downSince[relay], 30 };
+}
+
+// Never comes back
+Sample dead(int relay, int step) { return { step < 5, 30 }; }
+
+// Answers, but slowly
+Sample congested(int relay, int step) { return { true, (uint16_t)(step < 5 ? 100 : 2500) }; }
+
+
+void test_healthy_target_never_resets(void) {
+  relays[0].active = true;
+  run(allGood, 200);
+  TEST_ASSERT_EQUAL(0, resets[0]);
+  TEST_ASSERT_EQUAL(PROBE_OK, targets[0].verdict);
+}
+
+
+// Scattered loss stays under N of M and only ever gets watched
+void test_lossy_link_is_watched_not_reset(void) {
+  relays[0].active = true;
+  run(lossy, 300);
+  TEST_ASSERT_EQUAL(0, resets[0]);
+  TEST_ASSERT_EQUAL(2, probeFailures(policy, targets[0]));
+}
+
+
+// A hard outage resets on the Nth failure, and once is enough
+void test_outage_resets_after_threshold(void) {
+  relays[0].active = true;
+  downSince[0] = 5;
+  run(outage, 60);
+  TEST_ASSERT_EQUAL(1, resets[0]);
+  TEST_ASSERT_EQUAL(100 + (5 + policy.failThreshold - 1) * 60, firstResetSec[0]);
+  TEST_ASSERT_EQUAL(PROBE_OK, targets[0].verdict);
+}
+
+
+// Replies slower than the ceiling are failures
+void test_rtt_ceiling(void) {
+  relays[0].active = true;
+  run(congested, 20);
+  TEST_ASSERT_EQUAL(1, resets[0]);
+  setUp();
+  policy.rttCeilingMs = 0;
+  relays[0].active = true;
+  run(congested, 20);
+  TEST_ASSERT_EQUAL(0, resets[0]);
+}
+
+
+// Something that stays dead is reset at most once per cool-down and never
+// more than the hourly cap
+void test_dead_target_is_rate_limited(void) {
+  relays[0].active = true;
+  run(dead, 180);   // three hours
+  TEST_ASSERT_GREATER_THAN(1, resets[0]);
+  TEST_ASSERT_LESS_OR_EQUAL(3 * policy.maxResetsPerHour, resets[0]);
+  TEST_ASSERT_EQUAL(PROBE_HOLD, targets[0].verdict);
+
+  setUp();
+  policy.cooldownMinutes = 0;
+  policy.maxResetsPerHour = 8;
+  relays[0].active = true;
+  run(dead, 60);
+  TEST_ASSERT_LESS_OR_EQUAL(8, resets[0]);
+  TEST_ASSERT_GREATER_THAN(2, resets[0]);
+}
+
+
+void test_reset_disabled_holds(void) {
+  relays[0].active = true;
+  relays[0].resetEnabled = false;
+  run(dead, 30);
+  TEST_ASSERT_EQUAL(0, resets[0]);
+  TEST_ASSERT_EQUAL(PROBE_HOLD, targets[0].verdict);
+  TEST_ASSERT_TRUE(strstr(reason, "disabled") != nullptr);
+}
+
+
+// The router goes down and takes the radio behind it with it. The router is
+// first in the escalation order, so only it gets cycled.
+Sample routerDown(int relay, int step) {
+  bool routerUp = step < 5 || resets[0] > 0;
+  return { routerUp, 20 };
+}
+
+void test_escalation_resets_upstream_first(void) {
+  policy.escalation[0] = 0;
+  policy.escalation[1] = 2;
+  relays[0].active = true;
+  relays[2].active = true;
+  run(routerDown, 40);
+  TEST_ASSERT_EQUAL(1, resets[0]);
+  TEST_ASSERT_EQUAL(0, resets[2]);
+}
+
+
+// Same again with the router's reset disabled: it must not hold up the radio
+void test_escalation_passes_over_held_upstream(void) {
+  policy.escalation[0] = 0;
+  policy.escalation[1] = 2;
+  relays[0].active = true;
+  relays[2].active = true;
+  relays[0].resetEnabled = false;
+  run(dead, 20);
+  TEST_ASSERT_EQUAL(0, resets[0]);
+  TEST_ASSERT_EQUAL(1, resets[2]);
+}
+
+
+void test_busy_relay_holds(void) {
+  relays[1].active = true;
+  for (int i = 0; i < 10; i++) probeRecord(policy, targets[1], false, 0);
+  relays[1].cycling = true;
+  TEST_ASSERT_EQUAL(PROBE_HOLD, probeDecide(policy, targets, relays, 1, 1000, reason, sizeof(reason)));
+  relays[1].cycling = false;
+  TEST_ASSERT_EQUAL(PROBE_RESET, probeDecide(policy, targets, relays, 1, 1000, reason, sizeof(reason)));
+}
+
+
+// Same trace, same answers
+void test_decisions_are_deterministic(void) {
+  relays[0].active = relays[2].active = relays[3].active = true;
+  policy.escalation[0] = 3;
+  run(dead, 150);
+  int first[PROBE_RELAYS];
+  memcpy(first, resets, sizeof(first));
+  setUp();
+  relays[0].active = relays[2].active = relays[3].active = true;
+  policy.escalation[0] = 3;
+  run(dead, 150);
+  TEST_ASSERT_EQUAL_MEMORY(first, resets, sizeof(first));
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_healthy_target_never_resets);
+  RUN_TEST(test_lossy_link_is_watched_not_reset);
+  RUN_TEST(test_outage_resets_after_threshold);
+  RUN_TEST(test_rtt_ceiling);
+  RUN_TEST(test_dead_target_is_rate_limited);
+  RUN_TEST(test_reset_disabled_holds);
+  RUN_TEST(test_escalation_resets_upstream_first);
+  RUN_TEST(test_escalation_passes_over_held_upstream);
+  RUN_TEST(test_busy_relay_holds);
+  RUN_TEST(test_decisions_are_deterministic);
+  return UNITY_END();
+}
@@ -0,0 +1,713 @@
+#include <unity.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <ArduinoJson.h>
+#include <TraceFormat.h>
+#include <TimerWheel.h>
+#include <ProbePolicy.h>
+#include <LoraMesh.h>
+#include <BeaconCodec.h>
+#include <ConfigSchema.h>
+#include <RelayCore.h>
+
+// Replay driver. Plays a trace recorded on a unit (/api/trace) through the
+// firmware's own lib/ code, RelayCore for what buttons, probes, pulses and
+// LoRa commands do to the relays, on a virtual clock that jumps from one
+// event to the next, then reports the state it all ended in. The unit's
+// config.json (/download_config) says what its buttons and probes are:
+//   REPLAY_TRACE=trace.bin REPLAY_CONFIG=config.json pio test -e native -f test_replay
+// otherwise a made-up trace and config are used. Requests other than /toggle
+// and config PATCHes need the web server and are only counted; `relayfleet
+// replay` sends those to a unit.
+#define NODES       16
+#define MAX_BUTTONS 4
+
+struct Node {
+  uint8_t id;
+  BeaconKey key;
+  BeaconState state;
+  uint32_t beacons;
+  uint32_t missedKeys;
+};
+
+struct ButtonConfig {
+  ButtonAction shortAction;
+  ButtonAction longAction;
+  int8_t shortRelay;
+  int8_t longRelay;
+};
+
+struct Unit {
+  int64_t nowUs;
+  bool relay[RELAY_COUNT];
+  uint8_t settleMask;
+  TimerWheel wheel;
+  RelayCore core;
+
+  // From config.json
+  int cycleOffSeconds[RELAY_COUNT];
+  bool pingEnabled[RELAY_COUNT];
+  bool hasIp[RELAY_COUNT];
+  bool resetEnabled[RELAY_COUNT];
+  ButtonConfig buttons[MAX_BUTTONS];
+  int buttonCount;
+  ProbePolicy policy;
+  uint8_t nodeId;
+  bool mesh;
+  int maxHops;
+
+  ProbeTarget targets[RELAY_COUNT];
+  uint32_t resets;
+  RouteTable routes;
+  DupCache seen;
+  Node nodes[NODES];
+  int nodeCount;
+  uint32_t epoch;
+  uint32_t forwarded, duplicates, loraText, commands, unknownCommands;
+  uint32_t configOk, configRejected, httpSkipped;
+};
+
+struct Fire {
+  int relay;
+  int64_t atUs;
+};
+
+// What the replay saw, beside the unit's own state
+struct Replay {
+  std::vector<Fire> recorded;    // TIMER events in the trace
+  std::vector<Fire> fired;       // timers the replay fired
+  uint32_t events;
+  int64_t lengthUs;
+};
+
+// The hooks have no context, and there is only ever the one unit
+Unit unit;
+Replay replay;
+
+
+uint32_t nowMs(const Unit& u) {
+  return (uint32_t)(u.nowUs / 1000);
+}
+
+// Probe times are uptime seconds, which never start at 0 on a unit
+uint32_t nowSec(const Unit& u) {
+  return (uint32_t)(u.nowUs / 1000000) + 1;
+}
+
+uint32_t nowTick(const Unit& u) {
+  return (uint32_t)(u.nowUs / 1000 / WHEEL_TICK_MS);
+}
+
+void countReset(int relay, const ProbeTarget& t) {
+  unit.resets++;
+}
+
+
+// A per relay section can be an array or, in a patch, an object keyed "0"-"5"
+JsonVariantConst relayField(JsonVariantConst v, int relay) {
+  if (v.is<JsonArrayConst>()) return v[relay];
+  char key[2] = { (char)('0' + relay), 0 };
+  return v[key];
+}
+
+// The sections of config.json the replay needs, from a whole config or a
+// patch, clamped as applyConfigSection does; whatever is not there is left
+// as it is
+void unitConfigure(Unit& u, JsonObjectConst config) {
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    JsonVariantConst ip = relayField(config["relayIPs"], i);
+    if (ip.is<const char*>()) u.hasIp[i] = *ip.as<const char*>();
+    u.pingEnabled[i] = relayField(config["pingEnabled"], i) | u.pingEnabled[i];
+    u.resetEnabled[i] = relayField(config["resetEnabled"], i) | u.resetEnabled[i];
+    int offSeconds = relayField(config["cycleOffSeconds"], i) | u.cycleOffSeconds[i];
+    u.cycleOffSeconds[i] = std::clamp(offSeconds, 1, 3600);
+  }
+
+  JsonObjectConst probe = config["probe"];
+  if (!probe.isNull()) {
+    ProbePolicy& p = u.policy;
+    p.intervalSeconds = std::clamp(probe["intervalSeconds"] | (int)p.intervalSeconds, 10, 3600);
+    p.window = std::clamp(probe["window"] | (int)p.window, 1, PROBE_WINDOW_MAX);
+    p.failThreshold = std::clamp(probe["failThreshold"] | (int)p.failThreshold, 1, (int)p.window);
+    p.rttCeilingMs = probe["rttCeilingMs"] | (int)p.rttCeilingMs;
+    p.cooldownMinutes = probe["cooldownMinutes"] | (int)p.cooldownMinutes;
+    p.maxResetsPerHour = std::clamp(probe["maxResetsPerHour"] | (int)p.maxResetsPerHour, 1, MAX_RESETS_PER_HOUR_CAP);
+    if (probe["escalation"].is<JsonArrayConst>()) {
+      int n = 0;
+      for (int relay : probe["escalation"].as<JsonArrayConst>()) {
+        if (n < RELAY_COUNT && relay >= 0 && relay < RELAY_COUNT) p.escalation[n++] = relay;
+      }
+      while (n < RELAY_COUNT) p.escalation[n++] = -1;
+    }
+  }
+
+  if (config["buttons"].is<JsonArrayConst>()) {
+    u.buttonCount = 0;
+    for (JsonObjectConst b : config["buttons"].as<JsonArrayConst>()) {
+      if (u.buttonCount == MAX_BUTTONS) break;
+      if ((b["pin"] | -1) < 0) continue;
+      ButtonConfig& button = u.buttons[u.buttonCount++];
+      parseButtonAction(b["short"] | "none", button.shortAction, button.shortRelay);
+      parseButtonAction(b["long"] | "none", button.longAction, button.longRelay);
+    }
+  }
+
+  JsonObjectConst lora = config["lora"];
+  if (!lora.isNull()) {
+    u.nodeId = std::clamp(lora["nodeId"] | (int)u.nodeId, 1, 254);
+    u.mesh = lora["mesh"] | u.mesh;
+    u.maxHops = std::clamp(lora["maxHops"] | u.maxHops, 1, 7);
+  }
+}
+
+// Starts the unit as the firmware does with the config, before any event
+bool unitInit(Unit& u, const char* config) {
+  memset(&u, 0, sizeof(u));
+  wheelInit(u.wheel, 0);
+  u.policy = { 60, 10, 4, 1500, 20, 2, { -1, -1, -1, -1, -1, -1 } };
+  for (int i = 0; i < RELAY_COUNT; i++) u.cycleOffSeconds[i] = 5;
+  u.nodeId = 1;
+  u.maxHops = 3;
+  u.core = { u.relay, &u.settleMask, &u.wheel, u.cycleOffSeconds, {} };
+  u.core.hooks.probeReset = countReset;
+
+  JsonDocument doc;
+  if (deserializeJson(doc, config) || !doc.is<JsonObjectConst>()) return false;
+  unitConfigure(u, doc.as<JsonObjectConst>());
+  // Only a whole config carries these, as the settled states
+  for (int i = 0; i < RELAY_COUNT; i++) u.relay[i] = doc["relayStates"][i] | true;
+  return true;
+}
+
+// firePulseTimer
+void fireTimer(int relay, void* ctx) {
+  Unit& u = *(Unit*)ctx;
+  replay.fired.push_back({ relay, (int64_t)u.wheel.tick * WHEEL_TICK_MS * 1000 });
+  relayFinishPulse(u.core, relay);
+}
+
+// The virtual clock moves on to the next event, and any timers due on the way go off
+void advanceTo(Unit& u, int64_t atUs) {
+  u.nowUs = atUs;
+  wheelAdvance(u.wheel, nowTick(u), fireTimer, &u);
+}
+
+// probeEvaluate
+void probeEvaluate(Unit& u) {
+  ProbeRelay view[RELAY_COUNT];
+  for (int i = 0; i < RELAY_COUNT; i++) view[i] = { u.pingEnabled[i] && u.hasIp[i], u.resetEnabled[i], false, "" };
+  relayProbeEvaluate(u.core, u.policy, u.targets, view, nowSec(u), nowTick(u));
+}
+
+// fireButton and handleButtonEvents
+void pressButton(Unit& u, int index, bool longPress) {
+  const ButtonConfig& b = u.buttons[index];
+  ButtonAction action = longPress ? b.longAction : b.shortAction;
+  int relay = longPress ? b.longRelay : b.shortRelay;
+  buttonSwitch(u.core, action, relay);
+  buttonSettle(u.core, action, relay);
+}
+
+// runLoraCommand
+void runCommand(Unit& u, const char* text) {
+  RelayCommand cmd;
+  if (!parseRelayCommand(text, cmd)) {
+    u.unknownCommands++;
+    return;
+  }
+  u.commands++;
+  relayRunCommand(u.core, cmd, nowTick(u));
+}
+
+Node* findNode(Unit& u, uint8_t id) {
+  for (int i = 0; i < u.nodeCount; i++) {
+    if (u.nodes[i].id == id) return &u.nodes[i];
+  }
+  if (u.nodeCount == NODES) return nullptr;
+  Node* node = &u.nodes[u.nodeCount++];
+  node->id = id;
+  return node;
+}
+
+// radioReceive and handleLoraFrame, for the parts in lib/. The trace has
+// what radioTask passed to loop(), retries included.
+void handleLora(Unit& u, const uint8_t* data, size_t len, float snr) {
+  if (len < sizeof(LoraHeader) || data[0] != LORA_MAGIC) {
+    u.loraText++;   // from a handheld
+    std::string text((const char*)data, len);
+    runCommand(u, text.c_str());
+    return;
+  }
+  LoraHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.src == u.nodeId) return;
+
+  uint8_t link = loraLinkCost(snr);
+  learnRoutesFrom(u.routes, u.nodeId, header, link, nowMs(u));
+  if (dupSeen(u.seen, header)) {
+    u.duplicates++;   // answered again, not run again
+    return;
+  }
+  if (u.mesh && meshForward(u.routes, u.nodeId, u.maxHops, link, header, nowMs(u))) u.forwarded++;
+
+  const uint8_t* payload = data + sizeof(header);
+  size_t payloadLen = len - sizeof(header);
+  if (header.type == LORA_CMD && header.dst == u.nodeId) {
+    std::string text((const char*)payload, payloadLen);
+    runCommand(u, text.c_str());
+  } else if (header.type == LORA_BEACON) {
+    Node* node = findNode(u, header.src);
+    if (!node) return;
+    node->beacons++;
+    BeaconState state;
+    if (unpackBeacon(payload, payloadLen, header.seq, node->key, state)) node->state = state;
+    else node->missedKeys++;
+  }
+}
+
+// The query value of name, or "" if it is not there
+std::string queryArg(const char* query, const char* name) {
+  size_t nameLen = strlen(name);
+  for (const char* p = query; *p;) {
+    const char* end = strchr(p, '&');
+    if (!end) end = p + strlen(p);
+    if ((size_t)(end - p) > nameLen && !strncmp(p, name, nameLen) && p[nameLen] == '=') {
+      return std::string(p + nameLen + 1, end);
+    }
+    p = *end ? end + 1 : end;
+  }
+  return "";
+}
+
+void handleHttp(Unit& u, const uint8_t* payload, size_t len) {
+  // method \0 uri \0 query \0 body, as traceHttp writes it
+  const char* parts[3];
+  size_t at = 0;
+  for (int i = 0; i < 3; i++) {
+    parts[i] = (const char*)payload + at;
+    const void* zero = memchr(payload + at, 0, len - at);
+    if (!zero) {
+      u.httpSkipped++;
+      return;
+    }
+    at = (const uint8_t*)zero - payload + 1;
+  }
+  std::string body((const char*)payload + at, len - at);
+
+  if (!strcmp(parts[1], "/toggle")) {
+    int id = atoi(queryArg(parts[2], "id").c_str());
+    if (id >= 0 && id < RELAY_COUNT) relayToggle(u.core, id);
+  } else if (!strcmp(parts[0], "PATCH") && !strcmp(parts[1], "/api/config")) {
+    JsonDocument doc;
+    char error[96];
+    bool ok = !deserializeJson(doc, body.c_str()) && doc.is<JsonObjectConst>() &&
+              checkConfigPatch(doc.as<JsonObjectConst>(), [](int gpio) { return false; }, error, sizeof(error));
+    if (ok) {
+      unitConfigure(u, doc.as<JsonObjectConst>());
+      u.configOk++;
+    } else {
+      u.configRejected++;
+    }
+  } else {
+    u.httpSkipped++;
+  }
+}
+
+void handleEvent(Unit& u, const TraceEvent& ev) {
+  const uint8_t* p = ev.payload;
+  switch (ev.type) {
+    case TRACE_HTTP:
+      handleHttp(u, p, ev.len);
+      break;
+    case TRACE_LORA:
+      if (ev.len > 3) handleLora(u, p + 3, ev.len - 3, (int8_t)p[2] / 4.0f);
+      break;
+    case TRACE_BUTTON:
+      if (ev.len == 2 && p[0] < u.buttonCount) pressButton(u, p[0], p[1]);
+      break;
+    case TRACE_PROBE:
+      if (ev.len != 4 || p[0] >= RELAY_COUNT) break;
+      probeRecord(u.policy, u.targets[p[0]], p[1], p[2] | (p[3] << 8));
+      probeEvaluate(u);
+      break;
+    case TRACE_TIMER:
+      // Happens on its own in the replay; kept to check the replay against
+      if (ev.len == 1) replay.recorded.push_back({ p[0], ev.atUs });
+      break;
+    case TRACE_CLOCK:
+      if (ev.len == 4) memcpy(&u.epoch, p, 4);
+      break;
+  }
+}
+
+bool runReplay(Unit& u, const std::vector<uint8_t>& trace, const char* config) {
+  TraceReader reader;
+  if (!traceOpen(reader, trace.data(), trace.size()) || !unitInit(u, config)) return false;
+  replay = Replay();
+  TraceEvent ev;
+  while (traceNext(reader, ev)) {
+    advanceTo(u, ev.atUs);
+    handleEvent(u, ev);
+    replay.events++;
+    replay.lengthUs = ev.atUs;
+  }
+  return true;
+}
+
+// The recorded timers the replay fired too, each within two ticks
+int matchedTimers(int64_t* worstUs) {
+  std::vector<bool> used(replay.fired.size());
+  int matched = 0;
+  *worstUs = 0;
+  for (const Fire& r : replay.recorded) {
+    for (size_t i = 0; i < replay.fired.size(); i++) {
+      int64_t drift = llabs(replay.fired[i].atUs - r.atUs);
+      if (used[i] || replay.fired[i].relay != r.relay || drift > 2 * WHEEL_TICK_MS * 1000) continue;
+      used[i] = true;
+      matched++;
+      *worstUs = std::max(*worstUs, drift);
+      break;
+    }
+  }
+  return matched;
+}
+
+// Final state, in a form two replays can be compared by
+std::string unitState(const Unit& u) {
+  char text[160];
+  std::string out;
+  int mask = 0, pulsing = 0;
+  for (int i = 0; i < 6; i++) {
+    mask |= u.relay[i] << i;
+    pulsing |= wheelArmed(u.wheel, i) << i;
+  }
+  snprintf(text, sizeof(text), "relays %02x pulsing %02x resets %u epoch %u\n", mask, pulsing, (unsigned)u.resets,
+           (unsigned)u.epoch);
+  out += text;
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    if (u.targets[i].verdict == PROBE_IDLE) continue;
+    snprintf(text, sizeof(text), "probe %d: %s, %s\n", i, probeVerdictName(u.targets[i].verdict), u.targets[i].reason);
+    out += text;
+  }
+  for (int i = 0; i < u.routes.count; i++) {
+    const Route& r = u.routes.routes[i];
+    snprintf(text, sizeof(text), "route %u via %u, %u hops, cost %u\n", r.dst, r.nextHop, r.hops, r.cost);
+    out += text;
+  }
+  for (int i = 0; i < u.nodeCount; i++) {
+    const Node& n = u.nodes[i];
+    snprintf(text, sizeof(text), "node %u: %u beacons, %u missed, relays %02x battery %u\n", n.id, (unsigned)n.beacons,
+             (unsigned)n.missedKeys, n.state.relayMask, n.state.battery * 20);
+    out += text;
+  }
+  snprintf(text, sizeof(text), "lora: %u forwarded, %u duplicates, %u text, %u commands, %u unknown", (unsigned)u.forwarded,
+           (unsigned)u.duplicates, (unsigned)u.loraText, (unsigned)u.commands, (unsigned)u.unknownCommands);
+  out += text;
+  snprintf(text, sizeof(text), "\nconfig: %u ok, %u rejected; %u requests not replayed", (unsigned)u.configOk,
+           (unsigned)u.configRejected, (unsigned)u.httpSkipped);
+  out += text;
+  return out;
+}
+
+void report(const Unit& u) {
+  char text[160];
+  snprintf(text, sizeof(text), "%u events over %.1f s of trace", (unsigned)replay.events, replay.lengthUs / 1e6);
+  TEST_MESSAGE(text);
+  int64_t worstUs;
+  int matched = matchedTimers(&worstUs);
+  snprintf(text, sizeof(text), "timers: %zu recorded, %zu fired in the replay, %d matched, worst %.1f ms apart",
+           replay.recorded.size(), replay.fired.size(), matched, worstUs / 1e3);
+  TEST_MESSAGE(text);
+
+  std::string state = unitState(u);
+  for (size_t start = 0; start < state.size();) {
+    size_t end = state.find('\n', start);
+    if (end == std::string::npos) end = state.size();
+    TEST_MESSAGE(state.substr(start, end - start).c_str());
+    start = end + 1;
+  }
+}
+
+
+// A made-up trace. Events can be added in any order, bytes() puts them in
+// time order and writes them the way traceEvent does.
+struct TraceBuilder {
+  struct Event {
+    int64_t atUs;
+    TraceType type;
+    std::string payload;
+  };
+  std::vector<Event> events;
+
+  void event(int64_t atUs, TraceType type, const void* payload, size_t len) {
+    events.push_back({ atUs, type, std::string((const char*)payload, len) });
+  }
+
+  std::vector<uint8_t> bytes() {
+    std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.atUs < b.atUs; });
+    std::vector<uint8_t> data(TRACE_MAGIC, TRACE_MAGIC + strlen(TRACE_MAGIC));
+    int64_t lastUs = 0;
+    for (const Event& ev : events) {
+      uint8_t head[TRACE_HEAD_MAX];
+      size_t n = traceHead(head, (uint32_t)(ev.atUs - lastUs), ev.type, ev.payload.size());
+      lastUs = ev.atUs;
+      data.insert(data.end(), head, head + n);
+      data.insert(data.end(), ev.payload.begin(), ev.payload.end());
+    }
+    return data;
+  }
+
+  void probe(int64_t atUs, int relay, bool ok, uint16_t rttMs) {
+    uint8_t p[4] = { (uint8_t)relay, ok, (uint8_t)rttMs, (uint8_t)(rttMs >> 8) };
+    event(atUs, TRACE_PROBE, p, sizeof(p));
+  }
+
+  void button(int64_t atUs, int button, bool longPress) {
+    uint8_t p[2] = { (uint8_t)button, longPress };
+    event(atUs, TRACE_BUTTON, p, sizeof(p));
+  }
+
+  void http(int64_t atUs, const char* method, const char* uri, const char* query, const char* body) {
+    std::string p = std::string(method) + '\0' + uri + '\0' + query + '\0' + body;
+    event(atUs, TRACE_HTTP, p.data(), p.size());
+  }
+
+  void lora(int64_t atUs, const LoraHeader& header, const uint8_t* payload, size_t len, float snr) {
+    uint8_t p[3 + sizeof(LoraHeader) + 32];
+    int16_t rssi = -90;
+    memcpy(p, &rssi, 2);
+    p[2] = (int8_t)(snr * 4);
+    memcpy(p + 3, &header, sizeof(header));
+    memcpy(p + 3 + sizeof(header), payload, len);
+    event(atUs, TRACE_LORA, p, 3 + sizeof(header) + len);
+  }
+
+  void command(int64_t atUs, uint8_t seq, const char* text) {
+    LoraHeader header = { LORA_MAGIC, LORA_CMD, 3, 1, seq, 1, 2, 1, 1, 20 };
+    lora(atUs, header, (const uint8_t*)text, strlen(text), 2);
+  }
+
+  void text(int64_t atUs, const char* text) {
+    uint8_t p[3 + 32] = { 0xA6, 0xFF, 20 };   // rssi -90, snr 5
+    memcpy(p + 3, text, strlen(text));
+    event(atUs, TRACE_LORA, p, 3 + strlen(text));
+  }
+
+  void beacon(int64_t atUs, uint8_t src, uint8_t seq, const BeaconState& state, const BeaconKey* key) {
+    uint8_t payload[16];
+    size_t bits = key ? packBeaconDelta(payload, state, *key) : packBeaconFull(payload, state);
+    LoraHeader header = { LORA_MAGIC, LORA_BEACON, src, LORA_BROADCAST, seq, 1, src, LORA_BROADCAST, 0, 0 };
+    lora(atUs, header, payload, (bits + 7) / 8, 5);
+  }
+};
+
+#define S(sec) ((int64_t)(sec) * 1000000)
+
+// The unit the made-up trace came from: hosts on relays 0-2 pinged and
+// reset, a button toggling relay 0 and one toggling relay 1 or, held, turning
+// everything off
+const char* madeUpConfig =
+  "{\"relayStates\":[true,true,true,false,true,true],"
+  "\"relayIPs\":[\"10.0.0.10\",\"10.0.0.11\",\"10.0.0.12\",\"\",\"\",\"\"],"
+  "\"pingEnabled\":[true,true,true,false,false,false],"
+  "\"resetEnabled\":[true,true,true,false,false,false],"
+  "\"cycleOffSeconds\":[5,5,5,5,5,5],"
+  "\"buttons\":[{\"pin\":4,\"short\":\"toggle:0\",\"long\":\"none\"},"
+  "{\"pin\":5,\"short\":\"toggle:1\",\"long\":\"allOff\"}],"
+  "\"lora\":{\"nodeId\":1,\"mesh\":true,\"maxHops\":3}}";
+
+// Ten minutes on a unit: relay 2's host stops answering for four minutes and
+// gets power cycled, two nodes beacon, one status frame is heard twice, relay 4
+// is pulsed over LoRa (the command heard twice) and relay 1 too until a button
+// press takes over, the web page is used and a config change is tried twice
+std::vector<uint8_t> madeUpTrace() {
+  TraceBuilder t;
+  uint32_t epoch = 1767225600;
+  t.event(0, TRACE_CLOCK, &epoch, 4);
+
+  // One target every 20 s; relay 2's probes at 160, 220, 280 and 340 s fail,
+  // the fourth of them trips the reset and the cycle ends 5 s later
+  for (int n = 1; n * 20 < 600; n++) {
+    int relay = n % 3;
+    bool down = relay == 2 && n * 20 >= 120 && n * 20 < 360;
+    t.probe(S(n * 20) + 1500, relay, !down, down ? 0 : 12 + n % 7);
+    if (relay == 2 && n * 20 == 340) {
+      uint8_t traced = 2;
+      t.event(S(345) + 1500 + 7000, TRACE_TIMER, &traced, 1);
+    }
+  }
+
+  BeaconState state = { 0x3F, 0, 0, 3700 / 20, 0, 100 };
+  BeaconKey key = { state, 1, true };
+  t.beacon(S(10), 2, 1, state, nullptr);
+  for (int n = 1; n <= 9; n++) {
+    state.battery -= 1;
+    state.uptimeMin++;
+    if (n == 5) state.relayMask = 0x1F;
+    t.beacon(S(10 + n * 60), 2, 1 + n, state, &key);
+  }
+  t.beacon(S(75), 4, 9, state, &key);   // a delta from a node whose full beacon we missed
+
+  uint8_t status[8] = {};
+  LoraHeader header = { LORA_MAGIC, LORA_STATUS, 3, 1, 40, 1, 2, 1, 1, 20 };
+  t.lora(S(130), header, status, sizeof(status), 2);
+  t.lora(S(133), header, status, sizeof(status), 2);
+
+  t.text(S(300), "OFF 5");
+  t.command(S(400), 41, "PULSE 4 30000");
+  t.command(S(401), 41, "PULSE 4 30000");
+  uint8_t traced = 4;
+  t.event(S(430), TRACE_TIMER, &traced, 1);
+  t.command(S(500), 42, "PULSE 1 60000");
+  t.button(S(510), 1, false);
+  t.command(S(520), 43, "JUMP 1");
+
+  t.button(S(30), 0, false);
+  t.button(S(90), 0, false);
+  t.http(S(200), "PATCH", "/api/config", "", "{\"lora\":{\"maxHops\":4}}");
+  t.http(S(210), "PATCH", "/api/config", "", "{\"lora\":{\"maxHops\":9}}");
+  t.http(S(250), "GET", "/api/status", "", "");
+  t.button(S(550), 1, true);
+  t.http(S(580), "GET", "/toggle", "id=3", "");
+  return t.bytes();
+}
+
+
+void setUp(void) {}
+void tearDown(void) {}
+
+
+void test_trace_format(void) {
+  uint8_t head[TRACE_HEAD_MAX];
+  TEST_ASSERT_EQUAL(3, traceHead(head, 0, TRACE_PROBE, 4));
+  TEST_ASSERT_EQUAL(TRACE_HEAD_MAX, traceHead(head, UINT32_MAX, TRACE_HTTP, UINT32_MAX));
+
+  TraceBuilder t;
+  t.probe(S(3), 1, true, 300);
+  t.probe(S(3) + 200, 2, false, 0);
+  std::vector<uint8_t> data = t.bytes();
+  TraceReader reader;
+  TraceEvent ev;
+  TEST_ASSERT_TRUE(traceOpen(reader, data.data(), data.size()));
+  TEST_ASSERT_TRUE(traceNext(reader, ev));
+  TEST_ASSERT_EQUAL(S(3), ev.atUs);
+  TEST_ASSERT_EQUAL(TRACE_PROBE, ev.type);
+  TEST_ASSERT_EQUAL(4, ev.len);
+  TEST_ASSERT_EQUAL(300, ev.payload[2] | ev.payload[3] << 8);
+  TEST_ASSERT_TRUE(traceNext(reader, ev));
+  TEST_ASSERT_EQUAL(S(3) + 200, ev.atUs);
+  TEST_ASSERT_FALSE(traceNext(reader, ev));
+
+  // Cut short, as a trace that filled the flash can be
+  TEST_ASSERT_TRUE(traceOpen(reader, data.data(), data.size() - 1));
+  TEST_ASSERT_TRUE(traceNext(reader, ev));
+  TEST_ASSERT_FALSE(traceNext(reader, ev));
+  TEST_ASSERT_FALSE(traceOpen(reader, (const uint8_t*)"RCT0", 4));
+}
+
+
+void test_replay_made_up_trace(void) {
+  TEST_ASSERT_TRUE(runReplay(unit, madeUpTrace(), madeUpConfig));
+  report(unit);
+
+  // Relay 2 was power cycled once, at its fourth failure, and the replay's
+  // timers went off where the unit's did: that one and relay 4's pulse.
+  // Relay 1's pulse was dropped by the button press.
+  TEST_ASSERT_EQUAL(1, unit.resets);
+  int64_t worstUs;
+  TEST_ASSERT_EQUAL(2, matchedTimers(&worstUs));
+  TEST_ASSERT_EQUAL(replay.recorded.size(), replay.fired.size());
+  TEST_ASSERT_EQUAL(PROBE_OK, unit.targets[2].verdict);
+  TEST_ASSERT_EQUAL(PROBE_IDLE, unit.targets[3].verdict);
+  TEST_ASSERT_EQUAL(1, unit.loraText);
+  TEST_ASSERT_EQUAL(3, unit.commands);
+  TEST_ASSERT_EQUAL(1, unit.unknownCommands);
+
+  // Everything off by the long press, then relay 3 on from the web page
+  for (int i = 0; i < RELAY_COUNT; i++) TEST_ASSERT_EQUAL(i == 3, unit.relay[i]);
+  TEST_ASSERT_EQUAL(0, unit.settleMask & ~(1 << 3));
+
+  Node* node = findNode(unit, 2);
+  TEST_ASSERT_EQUAL(10, node->beacons);
+  TEST_ASSERT_EQUAL(0x1F, node->state.relayMask);
+  TEST_ASSERT_EQUAL(1, findNode(unit, 4)->missedKeys);
+  Route* route = findRoute(unit.routes, 3, nowMs(unit));
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_EQUAL(2, route->nextHop);
+  TEST_ASSERT_EQUAL(2, unit.duplicates);
+  TEST_ASSERT_EQUAL(4, unit.maxHops);
+  TEST_ASSERT_EQUAL(1, unit.configOk);
+  TEST_ASSERT_EQUAL(1, unit.configRejected);
+  TEST_ASSERT_EQUAL(1, unit.httpSkipped);
+}
+
+
+// The point of it: the same trace always ends in the same state
+void test_replay_is_deterministic(void) {
+  std::vector<uint8_t> trace = madeUpTrace();
+  TEST_ASSERT_TRUE(runReplay(unit, trace, madeUpConfig));
+  std::string first = unitState(unit);
+  std::vector<Fire> fired = replay.fired;
+  TEST_ASSERT_TRUE(runReplay(unit, trace, madeUpConfig));
+  TEST_ASSERT_EQUAL_STRING(first.c_str(), unitState(unit).c_str());
+  TEST_ASSERT_EQUAL(fired.size(), replay.fired.size());
+  for (size_t i = 0; i < fired.size(); i++) TEST_ASSERT_EQUAL(fired[i].atUs, replay.fired[i].atUs);
+}
+
+
+std::string readFile(const char* path) {
+  std::string data;
+  FILE* f = fopen(path, "rb");
+  if (!f) return data;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+  fclose(f);
+  return data;
+}
+
+// A trace file as downloaded, or a serial capture with one "TRACE <hex>" line per event
+bool loadTrace(const char* path, std::vector<uint8_t>& trace) {
+  std::string data = readFile(path);
+
+  if (!data.compare(0, strlen(TRACE_MAGIC), TRACE_MAGIC)) {
+    trace.assign(data.begin(), data.end());
+    return true;
+  }
+  trace.assign(TRACE_MAGIC, TRACE_MAGIC + strlen(TRACE_MAGIC));
+  for (size_t at = 0; (at = data.find("TRACE ", at)) != std::string::npos;) {
+    at += 6;
+    while (at + 1 < data.size() && isxdigit((unsigned char)data[at]) && isxdigit((unsigned char)data[at + 1])) {
+      trace.push_back((uint8_t)strtoul(data.substr(at, 2).c_str(), nullptr, 16));
+      at += 2;
+    }
+  }
+  return trace.size() > strlen(TRACE_MAGIC);
+}
+
+void test_replay_field_trace(void) {
+  const char* path = getenv("REPLAY_TRACE");
+  const char* configPath = getenv("REPLAY_CONFIG");
+  if (!path) TEST_IGNORE_MESSAGE("REPLAY_TRACE=file replays a trace from a unit");
+  TEST_ASSERT_NOT_NULL_MESSAGE(configPath, "REPLAY_CONFIG=config.json from the unit's /download_config is needed too");
+  std::vector<uint8_t> trace;
+  TEST_ASSERT_TRUE_MESSAGE(loadTrace(path, trace), path);
+  std::string config = readFile(configPath);
+  TEST_ASSERT_TRUE_MESSAGE(runReplay(unit, trace, config.c_str()), configPath);
+  report(unit);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_trace_format);
+  RUN_TEST(test_replay_made_up_trace);
+  RUN_TEST(test_replay_is_deterministic);
+  RUN_TEST(test_replay_field_trace);
+  return UNITY_END();
+}
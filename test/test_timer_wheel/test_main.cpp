@@ -0,0 +1,177 @@
+#include <unity.h>
+#include <TimerWheel.h>
+
+TimerWheel wheel;
+int firedOwners[32];
+int firedCount;
+uint32_t firedTick[32];
+
+void recordFire(int owner, void* ctx) {
+  firedTick[firedCount] = ((TimerWheel*)ctx)->tick;
+  firedOwners[firedCount++] = owner;
+}
+
+int advance(uint32_t tick) {
+  return wheelAdvance(wheel, tick, recordFire, &wheel);
+}
+
+void setUp(void) {
+  wheelInit(wheel, 1000);
+  firedCount = 0;
+}
+
+void tearDown(void) {}
+
+
+void test_fires_on_its_tick(void) {
+  wheelArm(wheel, 2, 1005);
+  TEST_ASSERT_TRUE(wheelArmed(wheel, 2));
+  TEST_ASSERT_EQUAL(0, advance(1004));
+  TEST_ASSERT_EQUAL(1, advance(1005));
+  TEST_ASSERT_EQUAL(2, firedOwners[0]);
+  TEST_ASSERT_FALSE(wheelArmed(wheel, 2));
+  TEST_ASSERT_EQUAL(0, advance(1200));
+}
+
+
+void test_cancel(void) {
+  wheelArm(wheel, 0, 1003);
+  TEST_ASSERT_TRUE(wheelCancel(wheel, 0));
+  TEST_ASSERT_FALSE(wheelCancel(wheel, 0));
+  TEST_ASSERT_EQUAL(0, advance(1100));
+}
+
+
+void test_rearm_replaces(void) {
+  wheelArm(wheel, 1, 1003);
+  wheelArm(wheel, 1, 1010);
+  TEST_ASSERT_EQUAL(0, advance(1009));
+  TEST_ASSERT_EQUAL(1, advance(1010));
+  TEST_ASSERT_EQUAL(0, advance(1100));
+}
+
+
+// A timer more than a lap out shares its slot with nearer ones and must not
+// go off when the wheel passes it the first time
+void test_more_than_a_lap_out(void) {
+  wheelArm(wheel, 0, 1000 + WHEEL_SLOTS * 3 + 7);
+  wheelArm(wheel, 1, 1007);
+  TEST_ASSERT_EQUAL(1, advance(1000 + WHEEL_SLOTS * 3));
+  TEST_ASSERT_EQUAL(1, firedOwners[0]);
+  TEST_ASSERT_TRUE(wheelArmed(wheel, 0));
+  TEST_ASSERT_EQUAL(1, advance(1000 + WHEEL_SLOTS * 3 + 7));
+  TEST_ASSERT_EQUAL(0, firedOwners[1]);
+}
+
+
+// loop() stalled: everything that came due in the gap fires, in tick order
+void test_catches_up_missed_ticks(void) {
+  for (int i = 0; i < WHEEL_TIMERS; i++) wheelArm(wheel, i, 1050 - i * 5);
+  TEST_ASSERT_EQUAL(WHEEL_TIMERS, advance(1500));
+  for (int i = 0; i < WHEEL_TIMERS; i++) {
+    TEST_ASSERT_EQUAL(WHEEL_TIMERS - 1 - i, firedOwners[i]);
+    TEST_ASSERT_EQUAL(1050 - (WHEEL_TIMERS - 1 - i) * 5, firedTick[i]);
+  }
+}
+
+
+// Two timers in the same slot and tick, then one cancelled out of the middle of a chain
+void test_shared_slot(void) {
+  wheelArm(wheel, 0, 1020);
+  wheelArm(wheel, 1, 1020);
+  wheelArm(wheel, 2, 1020 + WHEEL_SLOTS);
+  TEST_ASSERT_TRUE(wheelCancel(wheel, 1));
+  TEST_ASSERT_EQUAL(1, advance(1020));
+  TEST_ASSERT_EQUAL(0, firedOwners[0]);
+  TEST_ASSERT_EQUAL(1, advance(1020 + WHEEL_SLOTS));
+  TEST_ASSERT_EQUAL(2, firedOwners[1]);
+}
+
+
+// The tick counter wraps after ~2.7 years of 20 ms ticks
+void test_tick_wraparound(void) {
+  wheelInit(wheel, 0xFFFFFFF0u);
+  wheelArm(wheel, 3, 0xFFFFFFF0u + 40);
+  TEST_ASSERT_EQUAL(0, advance(0xFFFFFFF0u + 39));
+  TEST_ASSERT_EQUAL(1, advance(0xFFFFFFF0u + 40));
+  TEST_ASSERT_EQUAL(3, firedOwners[0]);
+}
+
+
+// Re-arming from inside the fire callback, like a pulse restarted by whatever it triggered
+void rearmOnFire(int owner, void* ctx) {
+  firedOwners[firedCount++] = owner;
+  if (firedCount < 3) wheelArm(wheel, owner, wheel.tick + 10);
+}
+
+void test_rearm_from_callback(void) {
+  wheelArm(wheel, 4, 1010);
+  TEST_ASSERT_EQUAL(3, wheelAdvance(wheel, 1100, rearmOnFire, nullptr));
+  TEST_ASSERT_FALSE(wheelArmed(wheel, 4));
+}
+
+
+// A timer that is already due goes off on the next tick, not a lap later
+void test_past_expiry(void) {
+  advance(1010);
+  wheelArm(wheel, 1, 1005);
+  wheelArm(wheel, 2, 1010);
+  TEST_ASSERT_EQUAL(2, advance(1011));
+  TEST_ASSERT_EQUAL(1011, firedTick[0]);
+  TEST_ASSERT_EQUAL(1011, firedTick[1]);
+}
+
+
+// The callback cancels or moves the timer next in the same chain
+int victim;
+uint32_t victimTick;
+
+void disturbOnFire(int owner, void* ctx) {
+  firedOwners[firedCount++] = owner;
+  if (owner == victim) return;
+  if (victimTick) wheelArm(wheel, victim, victimTick);
+  else wheelCancel(wheel, victim);
+}
+
+void test_cancel_next_from_callback(void) {
+  victim = 0;
+  victimTick = 0;
+  wheelArm(wheel, 0, 1020);
+  wheelArm(wheel, 1, 1020);   // heads the chain, so fires first
+  TEST_ASSERT_EQUAL(1, wheelAdvance(wheel, 1100, disturbOnFire, nullptr));
+  TEST_ASSERT_EQUAL(1, firedOwners[0]);
+  TEST_ASSERT_FALSE(wheelArmed(wheel, 0));
+  for (int i = 0; i < WHEEL_TIMERS; i++) TEST_ASSERT_EQUAL(-1, wheel.byOwner[i]);
+}
+
+void test_move_next_from_callback(void) {
+  victim = 0;
+  victimTick = 1030;
+  wheelArm(wheel, 0, 1020);
+  wheelArm(wheel, 2, 1020 + WHEEL_SLOTS);   // in the same slot, a lap out
+  wheelArm(wheel, 1, 1020);
+  TEST_ASSERT_EQUAL(1, wheelAdvance(wheel, 1029, disturbOnFire, nullptr));
+  TEST_ASSERT_TRUE(wheelArmed(wheel, 0));
+  TEST_ASSERT_TRUE(wheelArmed(wheel, 2));
+  TEST_ASSERT_EQUAL(1, wheelAdvance(wheel, 1030, disturbOnFire, nullptr));
+  TEST_ASSERT_EQUAL(0, firedOwners[1]);
+  TEST_ASSERT_EQUAL(1, wheelAdvance(wheel, 1020 + WHEEL_SLOTS, disturbOnFire, nullptr));
+  TEST_ASSERT_EQUAL(2, firedOwners[2]);
+}
+
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fires_on_its_tick);
+  RUN_TEST(test_cancel);
+  RUN_TEST(test_rearm_replaces);
+  RUN_TEST(test_more_than_a_lap_out);
+  RUN_TEST(test_catches_up_missed_ticks);
+  RUN_TEST(test_shared_slot);
+  RUN_TEST(test_tick_wraparound);
+  RUN_TEST(test_rearm_from_callback);
+  RUN_TEST(test_past_expiry);
+  RUN_TEST(test_cancel_next_from_callback);
+  RUN_TEST(test_move_next_from_callback);
+  return UNITY_END();
+}
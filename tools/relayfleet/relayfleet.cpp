@@ -0,0 +1,1141 @@
+// relayfleet - look after a fleet of RelayControllers from a Linux box
+//
+// Build:  g++ -std=c++17 -O2 -Wall -I../../lib/TraceFormat -o relayfleet relayfleet.cpp ../../lib/TraceFormat/TraceFormat.cpp
+//
+//   relayfleet discover 192.168.3.0/24           find units on a subnet
+//   relayfleet status [--watch S] HOST...        poll /api/status on every unit at once
+//   relayfleet push JSON HOST...                 send one relay batch to every unit
+//   relayfleet bench [options] HOST              latency of each endpoint, p50/p99/max
+//   relayfleet trace FILE                        list the events in a recorded trace
+//   relayfleet replay [--speed X] FILE HOST      play a recorded trace back at a unit
+//   relayfleet serve [--port P]                  stand-in controller for testing the above
+//
+// HOST is an address with an optional :port. --fleet FILE reads hosts from a
+// file, one per line, # for comments. Everything runs on one epoll loop, so
+// a slow or dead unit never holds up the others.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <TraceFormat.h>
+
+static int64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// ---------------------------------------------------------------------------
+// Just enough JSON for what the controller sends and takes
+
+struct Json {
+  enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+  bool boolean = false;
+  double number = 0;
+  std::string str;
+  std::vector<Json> items;
+  std::vector<std::pair<std::string, Json>> fields;
+
+  const Json& operator[](const std::string& key) const {
+    static const Json none;
+    for (auto& f : fields) {
+      if (f.first == key) return f.second;
+    }
+    return none;
+  }
+  bool isNull() const { return type == Null; }
+};
+
+class JsonParser {
+ public:
+  explicit JsonParser(const std::string& text) : s(text) {}
+
+  bool parse(Json& out) {
+    bool ok = value(out);
+    skipSpace();
+    return ok && pos == s.size();
+  }
+
+ private:
+  const std::string& s;
+  size_t pos = 0;
+
+  void skipSpace() {
+    while (pos < s.size() && isspace((unsigned char)s[pos])) pos++;
+  }
+
+  bool literal(const char* word) {
+    size_t len = strlen(word);
+    if (s.compare(pos, len, word) != 0) return false;
+    pos += len;
+    return true;
+  }
+
+  bool string(std::string& out) {
+    if (s[pos] != '"') return false;
+    pos++;
+    while (pos < s.size() && s[pos] != '"') {
+      if (s[pos] == '\\' && pos + 1 < s.size()) {
+        pos++;
+        switch (s[pos]) {
+          case 'n': out += '\n'; break;
+          case 't': out += '\t'; break;
+          case 'u': out += '?'; pos += 4; break;   // not needed for anything we read
+          default: out += s[pos];
+        }
+        pos++;
+      } else {
+        out += s[pos++];
+      }
+    }
+    if (pos >= s.size()) return false;
+    pos++;
+    return true;
+  }
+
+  bool value(Json& out) {
+    skipSpace();
+    if (pos >= s.size()) return false;
+    char c = s[pos];
+    if (c == '{') {
+      out.type = Json::Object;
+      pos++;
+      skipSpace();
+      if (s[pos] == '}') { pos++; return true; }
+      for (;;) {
+        skipSpace();
+        std::string key;
+        if (!string(key)) return false;
+        skipSpace();
+        if (s[pos++] != ':') return false;
+        Json v;
+        if (!value(v)) return false;
+        out.fields.emplace_back(key, std::move(v));
+        skipSpace();
+        if (s[pos] == ',') { pos++; continue; }
+        if (s[pos] == '}') { pos++; return true; }
+        return false;
+      }
+    }
+    if (c == '[') {
+      out.type = Json::Array;
+      pos++;
+      skipSpace();
+      if (s[pos] == ']') { pos++; return true; }
+      for (;;) {
+        Json v;
+        if (!value(v)) return false;
+        out.items.push_back(std::move(v));
+        skipSpace();
+        if (s[pos] == ',') { pos++; continue; }
+        if (s[pos] == ']') { pos++; return true; }
+        return false;
+      }
+    }
+    if (c == '"') {
+      out.type = Json::String;
+      return string(out.str);
+    }
+    if (literal("true")) { out.type = Json::Bool; out.boolean = true; return true; }
+    if (literal("false")) { out.type = Json::Bool; return true; }
+    if (literal("null")) return true;
+
+    char* end = nullptr;
+    out.number = strtod(s.c_str() + pos, &end);
+    if (end == s.c_str() + pos) return false;
+    out.type = Json::Number;
+    pos = end - s.c_str();
+    return true;
+  }
+};
+
+
+// ---------------------------------------------------------------------------
+// Reactor: epoll plus one-shot timers
+
+class Reactor {
+ public:
+  using Handler = std::function<void(uint32_t events)>;
+
+  Reactor() : ep(epoll_create1(0)) {}
+  ~Reactor() { close(ep); }
+
+  void watch(int fd, uint32_t events, Handler handler) {
+    handlers[fd] = std::move(handler);
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  void modify(int fd, uint32_t events) {
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  void forget(int fd) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+  }
+
+  uint64_t after(int64_t delayUs, std::function<void()> fn) {
+    uint64_t id = ++lastTimerId;
+    int64_t when = nowUs() + delayUs;
+    timers.emplace(std::make_pair(when, id), std::move(fn));
+    timerDue[id] = when;
+    return id;
+  }
+
+  void cancel(uint64_t id) {
+    auto it = timerDue.find(id);
+    if (it == timerDue.end()) return;
+    timers.erase(std::make_pair(it->second, id));
+    timerDue.erase(it);
+  }
+
+  void stop() { running = false; }
+
+  // Runs until stop(), or until there is nothing left to wait for
+  void run() {
+    running = true;
+    epoll_event events[64];
+    while (running && (!handlers.empty() || !timers.empty())) {
+      int timeoutMs = -1;
+      if (!timers.empty()) {
+        int64_t wait = timers.begin()->first.first - nowUs();
+        timeoutMs = wait <= 0 ? 0 : (int)((wait + 999) / 1000);
+      }
+      int n = epoll_wait(ep, events, 64, timeoutMs);
+      for (int i = 0; i < n; i++) {
+        auto it = handlers.find(events[i].data.fd);
+        if (it != handlers.end()) {
+          Handler h = it->second;   // the handler may forget itself
+          h(events[i].events);
+        }
+      }
+      int64_t now = nowUs();
+      while (!timers.empty() && timers.begin()->first.first <= now) {
+        auto fn = std::move(timers.begin()->second);
+        timerDue.erase(timers.begin()->first.second);
+        timers.erase(timers.begin());
+        fn();
+      }
+    }
+  }
+
+ private:
+  int ep;
+  bool running = false;
+  std::map<int, Handler> handlers;
+  std::map<std::pair<int64_t, uint64_t>, std::function<void()>> timers;   // (due, id)
+  std::map<uint64_t, int64_t> timerDue;
+  uint64_t lastTimerId = 0;
+};
+
+
+// ---------------------------------------------------------------------------
+// HTTP client, one connection per request like a browser talking to the unit
+
+struct Host {
+  std::string name;     // as given, for printing
+  sockaddr_in addr = {};
+};
+
+struct HttpResult {
+  int status = 0;       // 0 when the request never completed
+  std::string error;
+  std::string body;
+  int64_t latencyUs = 0;
+};
+
+bool resolveHost(const std::string& spec, Host& host) {
+  std::string name = spec;
+  int port = 80;
+  size_t colon = spec.rfind(':');
+  if (colon != std::string::npos) {
+    name = spec.substr(0, colon);
+    port = atoi(spec.c_str() + colon + 1);
+  }
+
+  addrinfo hints = {}, *res = nullptr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name.c_str(), nullptr, &hints, &res) != 0 || !res) return false;
+  host.name = spec;
+  host.addr = *(sockaddr_in*)res->ai_addr;
+  host.addr.sin_port = htons(port);
+  freeaddrinfo(res);
+  return true;
+}
+
+class HttpClient {
+ public:
+  using Callback = std::function<void(const HttpResult&)>;
+
+  explicit HttpClient(Reactor& r) : reactor(r) {}
+
+  void request(const Host& host, const std::string& method, const std::string& path,
+               const std::string& body, int timeoutMs, Callback done) {
+    auto c = std::make_shared<Conn>();
+    c->start = nowUs();
+    c->done = std::move(done);
+    c->out = method + " " + path + " HTTP/1.1\r\nHost: " + host.name + "\r\nConnection: close\r\n";
+    if (!body.empty()) {
+      c->out += "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+    }
+    c->out += "\r\n" + body;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (const sockaddr*)&host.addr, sizeof(host.addr)) < 0 && errno != EINPROGRESS) {
+      finish(c, std::string("connect: ") + strerror(errno));
+      return;
+    }
+
+    reactor.watch(c->fd, EPOLLOUT | EPOLLIN | EPOLLRDHUP, [this, c](uint32_t events) { onEvent(c, events); });
+    c->timer = reactor.after((int64_t)timeoutMs * 1000, [this, c]() {
+      if (!c->finished) finish(c, "timeout");
+    });
+  }
+
+ private:
+  struct Conn {
+    int fd = -1;
+    int64_t start = 0;
+    std::string out;
+    size_t sent = 0;
+    std::string in;
+    bool finished = false;
+    uint64_t timer = 0;
+    Callback done;
+  };
+
+  Reactor& reactor;
+
+  void onEvent(const std::shared_ptr<Conn>& c, uint32_t events) {
+    if (c->finished) return;
+
+    if ((events & EPOLLOUT) && c->sent < c->out.size()) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err) {
+        finish(c, std::string("connect: ") + strerror(err));
+        return;
+      }
+      ssize_t n = send(c->fd, c->out.data() + c->sent, c->out.size() - c->sent, MSG_NOSIGNAL);
+      if (n > 0) c->sent += n;
+      if (c->sent == c->out.size()) reactor.modify(c->fd, EPOLLIN | EPOLLRDHUP);
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      char buf[4096];
+      for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+          c->in.append(buf, n);
+          if (complete(c->in)) {
+            finish(c, "");
+            return;
+          }
+        } else if (n == 0) {
+          finish(c, c->in.empty() ? "closed without a response" : "");
+          return;
+        } else {
+          if (errno != EAGAIN && errno != EWOULDBLOCK) finish(c, std::string("recv: ") + strerror(errno));
+          return;
+        }
+      }
+    }
+  }
+
+  // True once the headers and Content-Length worth of body are in
+  static bool complete(const std::string& in) {
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos) return false;
+    std::string headers = in.substr(0, end);
+    std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    size_t cl = headers.find("content-length:");
+    if (cl == std::string::npos) return false;   // read to EOF
+    return in.size() >= end + 4 + (size_t)atol(headers.c_str() + cl + 15);
+  }
+
+  void finish(const std::shared_ptr<Conn>& c, const std::string& error) {
+    if (c->finished) return;
+    c->finished = true;
+    reactor.cancel(c->timer);
+    if (c->fd >= 0) {
+      reactor.forget(c->fd);
+      close(c->fd);
+    }
+
+    HttpResult result;
+    result.latencyUs = nowUs() - c->start;
+    result.error = error;
+    if (error.empty()) {
+      if (sscanf(c->in.c_str(), "HTTP/%*s %d", &result.status) != 1) {
+        result.error = "bad response";
+      }
+      size_t end = c->in.find("\r\n\r\n");
+      if (end != std::string::npos) result.body = c->in.substr(end + 4);
+    }
+    c->done(result);
+  }
+};
+
+
+// ---------------------------------------------------------------------------
+// Fleet commands
+
+std::vector<std::string> readFleetFile(const std::string& path) {
+  std::vector<std::string> hosts;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    line.erase(0, line.find_first_not_of(" \t\r"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty()) hosts.push_back(line);
+  }
+  return hosts;
+}
+
+
+std::string relayString(const Json& states) {
+  std::string out;
+  for (auto& s : states.items) out += s.boolean ? '1' : '0';
+  return out.empty() ? "-" : out;
+}
+
+
+int cmdStatus(const std::vector<Host>& hosts, int watchSeconds) {
+  Reactor reactor;
+  HttpClient http(reactor);
+
+  std::function<void()> poll = [&]() {
+    auto results = std::make_shared<std::vector<HttpResult>>(hosts.size());
+    auto pending = std::make_shared<size_t>(hosts.size());
+
+    for (size_t i = 0; i < hosts.size(); i++) {
+      http.request(hosts[i], "GET", "/api/status", "", 3000, [&, results, pending, i](const HttpResult& r) {
+        (*results)[i] = r;
+        if (--*pending) return;
+
+        // Everyone has answered or timed out
+        int reachable = 0, relaysOn = 0, safe = 0;
+        double lowestBattery = 0;
+        printf("%-22s %8s  %-7s %7s  %s\n", "HOST", "LATENCY", "RELAYS", "BATT", "NOTES");
+        for (size_t h = 0; h < hosts.size(); h++) {
+          const HttpResult& res = (*results)[h];
+          Json doc;
+          if (!res.error.empty() || res.status != 200 || !JsonParser(res.body).parse(doc)) {
+            printf("%-22s %8s  %-7s %7s  %s\n", hosts[h].name.c_str(), "-", "-", "-",
+                   res.error.empty() ? ("HTTP " + std::to_string(res.status)).c_str() : res.error.c_str());
+            continue;
+          }
+          reachable++;
+          for (auto& s : doc["states"].items) relaysOn += s.boolean;
+          double volts = doc["batteryMv"].number / 1000.0;
+          if (volts > 1 && (lowestBattery == 0 || volts < lowestBattery)) lowestBattery = volts;
+
+          std::string notes;
+          if (doc["safeMode"].boolean) { notes += "SAFE-MODE "; safe++; }
+          if (!doc["shed"].items.empty()) notes += "shedding ";
+          if (doc["led"].type == Json::String && doc["led"].str != "alive") notes += doc["led"].str;
+          char batt[16] = "-";
+          if (volts > 1) snprintf(batt, sizeof(batt), "%.2fV", volts);
+          printf("%-22s %6lldms  %-7s %7s  %s\n", hosts[h].name.c_str(), (long long)(res.latencyUs / 1000),
+                 relayString(doc["states"]).c_str(), batt, notes.c_str());
+        }
+        printf("-- %d/%zu reachable, %d relays on, %d in safe mode", reachable, hosts.size(), relaysOn, safe);
+        if (lowestBattery > 0) printf(", lowest battery %.2fV", lowestBattery);
+        printf("\n");
+
+        if (watchSeconds > 0) {
+          printf("\n");
+          reactor.after((int64_t)watchSeconds * 1000000, poll);
+        }
+      });
+    }
+  };
+
+  poll();
+  reactor.run();
+  return 0;
+}
+
+
+int cmdPush(const std::vector<Host>& hosts, const std::string& opsJson, int retries) {
+  Json ops;
+  if (!JsonParser(opsJson).parse(ops) || ops.type != Json::Object) {
+    fprintf(stderr, "push: the batch has to be a JSON object, e.g. {\"ops\":[{\"relay\":0,\"op\":\"on\"}]}\n");
+    return 2;
+  }
+
+  Reactor reactor;
+  HttpClient http(reactor);
+  int failed = 0;
+
+  // Same requestId on every retry to a unit, so a retry after a lost response
+  // is answered from the unit's cache instead of being applied twice
+  long runId = (long)(nowUs() % 1000000000);
+  std::function<void(size_t, int)> send = [&](size_t i, int attempt) {
+    std::string body = opsJson;
+    if (ops["requestId"].isNull()) {
+      std::string id = "fleet-" + std::to_string(runId) + "-" + std::to_string(i);
+      body = "{\"requestId\":\"" + id + "\"," + opsJson.substr(opsJson.find('{') + 1);
+    }
+    http.request(hosts[i], "POST", "/api/relays", body, 5000, [&, i, attempt](const HttpResult& r) {
+      Json doc;
+      if (r.error.empty() && r.status == 200 && JsonParser(r.body).parse(doc)) {
+        printf("%-22s ok      %s\n", hosts[i].name.c_str(), relayString(doc["states"]).c_str());
+      } else if (!r.error.empty() && attempt < retries) {
+        reactor.after(500000, [&send, i, attempt]() { send(i, attempt + 1); });
+      } else {
+        failed++;
+        printf("%-22s FAILED  %s\n", hosts[i].name.c_str(),
+               r.error.empty() ? ("HTTP " + std::to_string(r.status) + " " + r.body).c_str() : r.error.c_str());
+      }
+    });
+  };
+
+  for (size_t i = 0; i < hosts.size(); i++) send(i, 0);
+  reactor.run();
+  return failed ? 1 : 0;
+}
+
+
+int cmdDiscover(const std::string& cidr, int port) {
+  unsigned a, b, c, d, bits = 24;
+  if (sscanf(cidr.c_str(), "%u.%u.%u.%u/%u", &a, &b, &c, &d, &bits) < 4 || bits < 16 || bits > 32) {
+    fprintf(stderr, "discover: expected a subnet such as 192.168.3.0/24 (/16 to /32)\n");
+    return 2;
+  }
+  uint32_t base = (a << 24) | (b << 16) | (c << 8) | d;
+  uint32_t mask = bits == 32 ? 0xFFFFFFFF : ~((1U << (32 - bits)) - 1);
+  uint32_t first = base & mask, count = ~mask + 1U;
+
+  Reactor reactor;
+  HttpClient http(reactor);
+  const uint32_t maxInFlight = 64;
+  uint32_t next = 0, inFlight = 0, found = 0;
+
+  std::function<void()> fill = [&]() {
+    while (inFlight < maxInFlight && next < count) {
+      uint32_t ip = first + next++;
+      if (count > 2 && ((ip & ~mask) == 0 || (ip & ~mask) == ~mask)) continue;   // network and broadcast
+      Host host;
+      host.addr.sin_family = AF_INET;
+      host.addr.sin_port = htons(port);
+      host.addr.sin_addr.s_addr = htonl(ip);
+      char name[32];
+      snprintf(name, sizeof(name), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+      host.name = port == 80 ? name : std::string(name) + ":" + std::to_string(port);
+      inFlight++;
+      http.request(host, "GET", "/api/status", "", 1500, [&, host](const HttpResult& r) {
+        inFlight--;
+        Json doc;
+        if (r.status == 200 && JsonParser(r.body).parse(doc) && doc["states"].type == Json::Array) {
+          found++;
+          std::string labels;
+          for (auto& l : doc["labels"].items) labels += (labels.empty() ? "" : ", ") + l.str;
+          printf("%-22s %s\n", host.name.c_str(), labels.c_str());
+          fflush(stdout);
+        }
+        fill();
+      });
+    }
+  };
+
+  fill();
+  reactor.run();
+  fprintf(stderr, "%u controller(s) found\n", found);
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// Load generator
+
+struct Endpoint {
+  std::string method = "GET";
+  std::string path;
+  std::string body;
+  std::vector<int64_t> latencies;
+  int errors = 0;
+};
+
+int64_t percentile(std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = (size_t)std::ceil(p / 100.0 * sorted.size());
+  return sorted[std::min(sorted.size() - 1, i ? i - 1 : 0)];
+}
+
+
+// Closed loop: `concurrency` requests in flight, endpoints taken in turn, until
+// `requests` have completed or `seconds` are up
+int cmdBench(const Host& host, std::vector<Endpoint>& endpoints, int concurrency, int requests, int seconds) {
+  Reactor reactor;
+  HttpClient http(reactor);
+  int started = 0, completed = 0;
+  size_t nextEndpoint = 0;
+  int64_t start = nowUs(), deadline = seconds ? start + (int64_t)seconds * 1000000 : 0;
+
+  std::function<void()> launch = [&]() {
+    if ((requests && started >= requests) || (deadline && nowUs() >= deadline)) return;
+    started++;
+    Endpoint& ep = endpoints[nextEndpoint++ % endpoints.size()];
+    http.request(host, ep.method, ep.path, ep.body, 10000, [&, &ep = ep](const HttpResult& r) {
+      completed++;
+      if (!r.error.empty() || r.status >= 400) ep.errors++;
+      else ep.latencies.push_back(r.latencyUs);
+      launch();
+    });
+  };
+
+  for (int i = 0; i < concurrency; i++) launch();
+  reactor.run();
+  double elapsed = (nowUs() - start) / 1e6;
+
+  printf("%d requests in %.1f s against %s, concurrency %d (%.1f req/s)\n",
+         completed, elapsed, host.name.c_str(), concurrency, completed / elapsed);
+  printf("%-6s %-28s %7s %6s %9s %9s %9s\n", "METHOD", "ENDPOINT", "OK", "ERR", "p50 ms", "p99 ms", "max ms");
+  for (auto& ep : endpoints) {
+    std::sort(ep.latencies.begin(), ep.latencies.end());
+    printf("%-6s %-28s %7zu %6d %9.1f %9.1f %9.1f\n", ep.method.c_str(), ep.path.c_str(), ep.latencies.size(),
+           ep.errors, percentile(ep.latencies, 50) / 1000.0, percentile(ep.latencies, 99) / 1000.0,
+           ep.latencies.empty() ? 0.0 : ep.latencies.back() / 1000.0);
+  }
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// Traces recorded by a controller (/api/trace), read with the firmware's own
+// lib/TraceFormat. A serial capture has one "TRACE <hex>" line per event,
+// mixed in with the rest of the debug output.
+
+struct TraceRecord {
+  int64_t atUs = 0;      // since the trace started
+  int type = 0;
+  std::string payload;
+};
+
+// The events of an encoded trace, magic included, from clockUs on. Returns
+// how many bytes of it were whole events.
+size_t decodeTrace(const std::string& data, int64_t clockUs, std::vector<TraceRecord>& events) {
+  TraceReader reader;
+  if (!traceOpen(reader, (const uint8_t*)data.data(), data.size())) return 0;
+  TraceEvent ev;
+  while (traceNext(reader, ev)) {
+    events.push_back({ clockUs + ev.atUs, ev.type, std::string((const char*)ev.payload, ev.len) });
+  }
+  return reader.pos;
+}
+
+std::string fromHex(const std::string& hex) {
+  std::string out;
+  for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+    if (!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1])) break;
+    out += (char)strtol(hex.substr(i, 2).c_str(), nullptr, 16);
+  }
+  return out;
+}
+
+std::string toHex(const std::string& data) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  for (unsigned char c : data) {
+    out += digits[c >> 4];
+    out += digits[c & 15];
+  }
+  return out;
+}
+
+bool loadTrace(const std::string& path, std::vector<TraceRecord>& events) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) return false;
+  std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  if (data.compare(0, strlen(TRACE_MAGIC), TRACE_MAGIC) == 0) {
+    size_t pos = decodeTrace(data, 0, events);
+    if (pos < data.size()) fprintf(stderr, "%s: stopped at a damaged event at byte %zu\n", path.c_str(), pos);
+    return true;
+  }
+
+  // A serial capture. Lines that got mixed up with other output are skipped.
+  int64_t clockUs = 0;
+  size_t start = 0;
+  while ((start = data.find("TRACE ", start)) != std::string::npos) {
+    size_t end = data.find('\n', start);
+    std::string line = TRACE_MAGIC + fromHex(data.substr(start + 6, end == std::string::npos ? std::string::npos : end - start - 6));
+    std::vector<TraceRecord> one;
+    if (decodeTrace(line, clockUs, one) == line.size() && one.size() == 1) {
+      clockUs = one[0].atUs;
+      events.push_back(one[0]);
+    }
+    if (end == std::string::npos) break;
+    start = end;
+  }
+  return !events.empty();
+}
+
+// An HTTP event is "METHOD\0uri\0query\0body"
+void splitHttpEvent(const TraceRecord& ev, std::string& method, std::string& path, std::string& body) {
+  std::vector<std::string> parts;
+  size_t start = 0;
+  for (int i = 0; i < 3; i++) {
+    size_t end = ev.payload.find('\0', start);
+    if (end == std::string::npos) end = ev.payload.size();
+    parts.push_back(ev.payload.substr(start, end - start));
+    start = std::min(end + 1, ev.payload.size());
+  }
+  method = parts[0];
+  path = parts[1] + (parts[2].empty() ? "" : "?" + parts[2]);
+  body = ev.payload.substr(start);
+}
+
+const char* traceTypeName(int type) {
+  static const char* names[] = {"?", "http", "lora", "button", "probe", "timer", "clock"};
+  return type > 0 && type <= TRACE_CLOCK ? names[type] : "?";
+}
+
+std::string describeTraceEvent(const TraceRecord& ev) {
+  const std::string& p = ev.payload;
+  char buf[160];
+  switch (ev.type) {
+    case TRACE_HTTP: {
+      std::string method, path, body;
+      splitHttpEvent(ev, method, path, body);
+      return method + " " + path + (body.empty() ? "" : " " + body);
+    }
+    case TRACE_LORA:
+      if (p.size() < 3) break;
+      snprintf(buf, sizeof(buf), "%zu bytes, rssi %d, snr %.2f: %s", p.size() - 3,
+               (int16_t)((uint8_t)p[0] | (uint8_t)p[1] << 8), (int8_t)p[2] / 4.0, toHex(p.substr(3)).c_str());
+      return buf;
+    case TRACE_BUTTON:
+      if (p.size() != 2) break;
+      snprintf(buf, sizeof(buf), "button %d%s", (uint8_t)p[0], p[1] ? " long" : "");
+      return buf;
+    case TRACE_PROBE:
+      if (p.size() != 4) break;
+      snprintf(buf, sizeof(buf), "relay %d %s, %d ms", (uint8_t)p[0], p[1] ? "ok" : "failed",
+               (uint8_t)p[2] | (uint8_t)p[3] << 8);
+      return buf;
+    case TRACE_TIMER:
+      if (p.size() != 1) break;
+      snprintf(buf, sizeof(buf), "relay %d pulse ended", (uint8_t)p[0]);
+      return buf;
+    case TRACE_CLOCK: {
+      if (p.size() != 4) break;
+      uint32_t epoch = (uint8_t)p[0] | (uint8_t)p[1] << 8 | (uint8_t)p[2] << 16 | (uint32_t)(uint8_t)p[3] << 24;
+      if (!epoch) return "not synced";
+      time_t t = epoch;
+      strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S UTC", gmtime(&t));
+      return buf;
+    }
+  }
+  return toHex(p);
+}
+
+
+int cmdTrace(const std::string& path) {
+  std::vector<TraceRecord> events;
+  if (!loadTrace(path, events)) {
+    fprintf(stderr, "%s: no trace found\n", path.c_str());
+    return 1;
+  }
+  for (auto& ev : events) {
+    printf("%12.3f  %-6s %s\n", ev.atUs / 1e6, traceTypeName(ev.type), describeTraceEvent(ev).c_str());
+  }
+  printf("-- %zu events over %.1f s\n", events.size(), events.empty() ? 0.0 : events.back().atUs / 1e6);
+  return 0;
+}
+
+
+// Plays a trace back at a unit. HTTP events are sent as the requests they
+// were; LoRa frames, button presses and probe results go to /api/trace/inject,
+// which runs them through the same firmware code the real input did. Timers
+// and clock syncs happen on the unit by themselves and are only listed.
+//
+// Event times are trace time divided by `speed`. At speed 0 each event goes as
+// soon as the one before has been answered, which makes a field trace into a
+// repeatable benchmark.
+int cmdReplay(const std::string& path, const Host& host, double speed) {
+  std::vector<TraceRecord> events;
+  if (!loadTrace(path, events)) {
+    fprintf(stderr, "%s: no trace found\n", path.c_str());
+    return 1;
+  }
+
+  Reactor reactor;
+  HttpClient http(reactor);
+  std::map<std::string, Endpoint> kinds;   // latency per kind of event
+  int skipped = 0, failed = 0;
+  size_t next = 0;
+  int64_t start = nowUs();
+
+  std::function<void()> sendNext = [&]() {
+    if (next >= events.size()) return;
+    const TraceRecord& ev = events[next++];
+    if (speed > 0 && next < events.size()) {
+      int64_t due = start + (int64_t)(events[next].atUs / speed);
+      reactor.after(due - nowUs(), sendNext);   // the next one keeps to its time whatever this one does
+    }
+
+    std::string method = "POST", target = "/api/trace/inject", body, kind;
+    if (ev.type == TRACE_HTTP) {
+      splitHttpEvent(ev, method, target, body);
+      kind = method + " " + target.substr(0, target.find('?'));
+    } else if (ev.type == TRACE_LORA || ev.type == TRACE_BUTTON || ev.type == TRACE_PROBE) {
+      body = toHex(std::string(1, (char)ev.type) + ev.payload);
+      kind = std::string("inject ") + traceTypeName(ev.type);
+    } else {
+      skipped++;
+      printf("%12.3f  %-6s %s (happens on the unit)\n", ev.atUs / 1e6, traceTypeName(ev.type), describeTraceEvent(ev).c_str());
+      if (speed <= 0) sendNext();
+      return;
+    }
+
+    double at = ev.atUs / 1e6;
+    const char* type = traceTypeName(ev.type);
+    std::string what = describeTraceEvent(ev);
+    http.request(host, method, target, body, 10000, [&, at, type, kind, what](const HttpResult& r) {
+      Endpoint& stats = kinds[kind];
+      Json doc;
+      bool ok = r.error.empty() && r.status < 400;
+      if (ok) {
+        stats.latencies.push_back(r.latencyUs);
+      } else {
+        stats.errors++;
+        failed++;
+      }
+
+      std::string result = r.error.empty() ? std::to_string(r.status) : r.error;
+      if (ok && kind.compare(0, 7, "inject ") == 0 && JsonParser(r.body).parse(doc)) {
+        result += " (" + std::to_string((long)doc["us"].number) + " us on the unit)";
+      }
+      printf("%12.3f  %-6s %-40.40s %6.1f ms  %s\n", at, type, what.c_str(),
+             r.latencyUs / 1000.0, result.c_str());
+      if (speed <= 0) sendNext();
+    });
+  };
+
+  if (speed > 0 && !events.empty()) reactor.after((int64_t)(events[0].atUs / speed), sendNext);
+  else sendNext();
+  reactor.run();
+  double elapsed = (nowUs() - start) / 1e6;
+
+  printf("\n%zu events in %.1f s (trace %.1f s), %d failed, %d not sent\n", events.size(), elapsed,
+         events.empty() ? 0.0 : events.back().atUs / 1e6, failed, skipped);
+  printf("%-28s %7s %6s %9s %9s %9s\n", "EVENT", "OK", "ERR", "p50 ms", "p99 ms", "max ms");
+  for (auto& k : kinds) {
+    auto& lat = k.second.latencies;
+    std::sort(lat.begin(), lat.end());
+    printf("%-28s %7zu %6d %9.1f %9.1f %9.1f\n", k.first.c_str(), lat.size(), k.second.errors,
+           percentile(lat, 50) / 1000.0, percentile(lat, 99) / 1000.0, lat.empty() ? 0.0 : lat.back() / 1000.0);
+  }
+
+  // Where the unit ended up, to compare between runs
+  int status = 1;
+  http.request(host, "GET", "/api/status", "", 5000, [&](const HttpResult& r) {
+    Json doc;
+    if (r.error.empty() && r.status == 200 && JsonParser(r.body).parse(doc)) {
+      printf("Final state: relays %s, version %.0f, led %s\n", relayString(doc["states"]).c_str(),
+             doc["version"].number, doc["led"].type == Json::String ? doc["led"].str.c_str() : "-");
+      status = failed ? 1 : 0;
+    } else {
+      printf("Final state: unavailable (%s)\n", r.error.empty() ? ("HTTP " + std::to_string(r.status)).c_str() : r.error.c_str());
+    }
+  });
+  reactor.run();
+  return status;
+}
+
+
+// ---------------------------------------------------------------------------
+// Stand-in controller. Answers /api/status and /api/relays the way the
+// firmware does, so the fleet commands and the benchmark can be tried out
+// without hardware.
+
+class StandIn {
+ public:
+  StandIn(Reactor& r, int port, int delayMs) : reactor(r), delayUs((int64_t)delayMs * 1000) {
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+      perror("serve");
+      exit(1);
+    }
+    reactor.watch(listener, EPOLLIN, [this](uint32_t) { accept(); });
+    printf("Stand-in controller listening on port %d\n", port);
+  }
+
+ private:
+  Reactor& reactor;
+  int listener;
+  int64_t delayUs;
+  bool states[6] = {true, true, true, true, true, false};
+  int64_t pulseEndUs[6] = {0};
+  std::map<std::string, std::string> requestCache;
+
+  void accept() {
+    for (;;) {
+      int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+      if (fd < 0) return;
+      auto in = std::make_shared<std::string>();
+      reactor.watch(fd, EPOLLIN | EPOLLRDHUP, [this, fd, in](uint32_t) { read(fd, *in); });
+    }
+  }
+
+  void read(int fd, std::string& in) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) in.append(buf, n);
+    if (n == 0 && in.empty()) {
+      reactor.forget(fd);
+      close(fd);
+      return;
+    }
+
+    size_t end = in.find("\r\n\r\n");
+    if (end == std::string::npos) return;
+    std::string lower = in.substr(0, end);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    size_t cl = lower.find("content-length:");
+    size_t bodyLen = cl == std::string::npos ? 0 : atol(lower.c_str() + cl + 15);
+    if (in.size() < end + 4 + bodyLen) return;
+
+    char method[8] = "", path[256] = "";
+    sscanf(in.c_str(), "%7s %255s", method, path);
+    std::string body = in.substr(end + 4, bodyLen);
+    reactor.forget(fd);
+
+    int status = 200;
+    std::string reply = handle(method, path, body, status);
+    std::string out = "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : " Error") +
+                      "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(reply.size()) +
+                      "\r\nConnection: close\r\n\r\n" + reply;
+
+    // Optional delay, roughly what the real unit takes to answer
+    reactor.after(delayUs, [fd, out]() {
+      send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+      close(fd);
+    });
+  }
+
+  void settlePulses() {
+    int64_t now = nowUs();
+    for (int i = 0; i < 6; i++) {
+      if (pulseEndUs[i] && now >= pulseEndUs[i]) {
+        states[i] = !states[i];
+        pulseEndUs[i] = 0;
+      }
+    }
+  }
+
+  std::string relayJson() {
+    std::string s = "{\"states\":[", p = "],\"pulsing\":[";
+    for (int i = 0; i < 6; i++) {
+      s += std::string(i ? "," : "") + (states[i] ? "true" : "false");
+      p += std::string(i ? "," : "") + (pulseEndUs[i] ? "true" : "false");
+    }
+    return s + p + "]}";
+  }
+
+  std::string handle(const std::string& method, const std::string& path, const std::string& body, int& status) {
+    settlePulses();
+
+    if (path == "/api/status") {
+      std::string s = relayJson();
+      s.pop_back();
+      return s + ",\"labels\":[\"Relay 1\",\"Relay 2\",\"Relay 3\",\"Relay 4\",\"Relay 5\",\"Relay 6\"],"
+                 "\"safeMode\":false,\"led\":\"alive\",\"batteryMv\":12600,\"shed\":[]}";
+    }
+
+    if (path == "/api/relays" && method == "GET") return relayJson();
+
+    if (path == "/api/trace/inject" && method == "POST") return "{\"us\":0,\"version\":1}";
+
+    if (path == "/api/relays" && method == "POST") {
+      Json doc;
+      if (!JsonParser(body).parse(doc) || doc["ops"].items.empty()) {
+        status = 400;
+        return "\"bad batch\"";
+      }
+      std::string id = doc["requestId"].str;
+      if (!id.empty() && requestCache.count(id)) return requestCache[id];
+
+      for (auto& op : doc["ops"].items) {
+        int relay = (int)op["relay"].number;
+        const std::string& what = op["op"].str;
+        if (relay < 0 || relay >= 6) {
+          status = 400;
+          return "\"invalid relay\"";
+        }
+        if (what == "on" || what == "off") {
+          if (pulseEndUs[relay]) states[relay] = !states[relay];
+          pulseEndUs[relay] = 0;
+          states[relay] = what == "on";
+        } else if (what == "pulse" || what == "cycle") {
+          int64_t ms = what == "cycle" ? 5000 : (op["ms"].isNull() ? 1000 : (int64_t)op["ms"].number);
+          if (!pulseEndUs[relay]) states[relay] = !states[relay];
+          pulseEndUs[relay] = nowUs() + ms * 1000;
+        } else if (what == "cancel") {
+          if (pulseEndUs[relay]) states[relay] = !states[relay];
+          pulseEndUs[relay] = 0;
+        } else {
+          status = 400;
+          return "\"invalid op\"";
+        }
+      }
+      std::string reply = relayJson();
+      if (!id.empty()) requestCache[id] = reply;
+      return reply;
+    }
+
+    status = 404;
+    return "\"not found\"";
+  }
+};
+
+
+// ---------------------------------------------------------------------------
+
+void usage() {
+  fprintf(stderr,
+          "usage: relayfleet discover SUBNET [--port P]\n"
+          "       relayfleet status [--watch SECONDS] [--fleet FILE] HOST...\n"
+          "       relayfleet push [--retries N] [--fleet FILE] JSON HOST...\n"
+          "       relayfleet bench [-e ENDPOINT]... [-c CONCURRENCY] [-n REQUESTS | -t SECONDS] HOST\n"
+          "                        ENDPOINT is a path, or \"POST /path {json}\"\n"
+          "       relayfleet trace FILE\n"
+          "       relayfleet replay [--speed X] FILE HOST    X is 1 for real time, 0 for back to back\n"
+          "       relayfleet serve [--port P] [--delay MS]\n");
+}
+
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  std::string cmd = argv[1];
+
+  int watch = 0, retries = 2, port = 0, concurrency = 4, requests = 0, seconds = 0, delayMs = 0;
+  double speed = 1;
+  std::vector<std::string> args, endpointSpecs;
+  for (int i = 2; i < argc; i++) {
+    std::string a = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (a == "--watch" && hasValue) watch = atoi(argv[++i]);
+    else if (a == "--retries" && hasValue) retries = atoi(argv[++i]);
+    else if (a == "--port" && hasValue) port = atoi(argv[++i]);
+    else if (a == "--delay" && hasValue) delayMs = atoi(argv[++i]);
+    else if (a == "-c" && hasValue) concurrency = std::max(1, atoi(argv[++i]));
+    else if (a == "-n" && hasValue) requests = atoi(argv[++i]);
+    else if (a == "-t" && hasValue) seconds = atoi(argv[++i]);
+    else if (a == "-e" && hasValue) endpointSpecs.push_back(argv[++i]);
+    else if (a == "--speed" && hasValue) speed = atof(argv[++i]);
+    else if (a == "--fleet" && hasValue) {
+      for (auto& h : readFleetFile(argv[++i])) args.push_back(h);
+    } else args.push_back(a);
+  }
+
+  if (cmd == "serve") {
+    Reactor reactor;
+    StandIn standIn(reactor, port ? port : 8080, delayMs);
+    reactor.run();
+    return 0;
+  }
+
+  if (cmd == "discover") {
+    if (args.size() != 1) { usage(); return 2; }
+    return cmdDiscover(args[0], port ? port : 80);
+  }
+
+  if (cmd == "trace") {
+    if (args.size() != 1) { usage(); return 2; }
+    return cmdTrace(args[0]);
+  }
+
+  std::string opsJson, tracePath;
+  if (cmd == "replay") {
+    if (args.size() != 2) { usage(); return 2; }
+    tracePath = args[0];
+    args.erase(args.begin());
+  }
+  if (cmd == "push") {
+    if (args.empty()) { usage(); return 2; }
+    opsJson = args[0];
+    args.erase(args.begin());
+  }
+
+  std::vector<Host> hosts;
+  for (auto& spec : args) {
+    Host host;
+    if (!resolveHost(spec, host)) {
+      fprintf(stderr, "Cannot resolve %s\n", spec.c_str());
+      return 2;
+    }
+    hosts.push_back(host);
+  }
+  if (hosts.empty()) {
+    usage();
+    return 2;
+  }
+
+  if (cmd == "status") return cmdStatus(hosts, watch);
+  if (cmd == "push") return cmdPush(hosts, opsJson, retries);
+  if (cmd == "replay") return cmdReplay(tracePath, hosts[0], speed);
+  if (cmd == "bench") {
+    if (endpointSpecs.empty()) endpointSpecs = {"/api/status", "/api/relays"};
+    std::vector<Endpoint> endpoints;
+    for (auto& spec : endpointSpecs) {
+      Endpoint ep;
+      if (spec.compare(0, 5, "POST ") == 0) {
+        ep.method = "POST";
+        size_t space = spec.find(' ', 5);
+        ep.path = spec.substr(5, space == std::string::npos ? std::string::npos : space - 5);
+        if (space != std::string::npos) ep.body = spec.substr(space + 1);
+      } else {
+        ep.path = spec;
+      }
+      endpoints.push_back(ep);
+    }
+    if (!requests && !seconds) requests = 200;
+    return cmdBench(hosts[0], endpoints, concurrency, requests, seconds);
+  }
+
+  usage();
+  return 2;
+}